@@ -30,19 +30,38 @@
  * des objets connectés et de réaliser le projet :
  * - \ref port
  * - \ref debug
+ * - \ref log
  * - \ref wifi
  * - \ref led
  * - \ref dht
  * - \ref tickers
+ * - \ref timerwheel
+ * - \ref boot
  * - \ref deepsleep
+ * - \ref energy
  * - \ref spiffs
  * - \ref ntp
  * - \ref webserver
  * - \ref ota
+ * - \ref remotelog
  * - \ref mqtt
  * - \ref adafruitio
  * - \ref mqtt
  * - \ref ble
+ * - \ref positivesync
+ * - \ref publisher
+ * - \ref tls
+ * - \ref blering
+ * - \ref scanscheduler
+ * - \ref rssi
+ * - \ref encounter
+ * - \ref bletrace
+ * - \ref blesync
+ * - \ref exposure
+ * - \ref events
+ * - \ref yct
+ * - \ref core0
+ * - \ref fleetsim
 */
 
 #define MYDEBUG         1 
@@ -60,19 +79,36 @@ int i=0;              // pour la loop
 // ------------------------------------------------------------------------------------------------
 // MODULES
 #include "MyDebug.h"        // Debug
+#include "MyTimerWheel.h"   // Roue de temporisation des travaux périodiques
+#include "MyLog.h"          // Journal en mémoire, mis en forme en tâche de fond
 #include "MyWiFi.h"         // WiFi
+#include "MyBoot.h"         // Démarrage des modules selon leurs dépendances
 #include "MyNTP.h"          // Network Time Protocol
+#include "MyEnergy.h"       // Bilan énergétique par état radio
 #include "MySPIFFS.h"       // Flash File System
+#include "MyEvents.h"       // File d'événements de l'application
+#include "MyPositiveSync.h" // Synchronisation de la liste des positifs
+#include "MyExposure.h"     // Graphe d'exposition (contacts de contacts)
+#include "MyBLERing.h"      // File des annonces BLE
+#include "MyScanScheduler.h" // Rythme du scan BLE
+#include "MyRSSI.h"         // Filtrage du RSSI et estimation de la distance
+#include "MyEncounter.h"    // Rencontres en cours avec les autres cartes
 #include "MyTicker.h"       // Tickers
+#include "MyPublisher.h"    // File de publication MQTT limitée
+#include "MyTLS.h"          // Connexion TLS avec reprise de session
 #include "MyAdafruitIO.h"   // Adafruit MQTT
+#include "MyYCT.h"          // Machine à états de l'état de santé
+#include "MyBLE.h"          // BLE
+#include "MyBLESync.h"      // Echange de la liste des positifs en BLE
+#include "MyBLETrace.h"     // Enregistrement et rejeu des annonces BLE
+#include "MyCore0.h"        // Capture BLE sur le core 0, enregistrement sur le core 1
+#include "MyDeepSleep.h"    // Deep Sleep et mode basse consommation
+#include "MyRemoteLog.h"    // Console telnet du journal
 #include "MyWebServer.h"    // Serveur Web
-#include "MyDeepSleep.h"    // Deep Sleep
 #include "MyOTA.h"          // Over the air
-#include "MyBLE.h"          // BLE
 //#include "MyLED.h"          // LED
 //#include "MyDHT.h"          // Capteur de température et humidité
-//#include "MyCore0.h"        // Utilisation du Core 0
-#include "MyYCT.h"
+//#include "MyFleetSim.h"     // Simulation d'une flotte de cartes virtuelles
 // ------------------------------------------------------------------------------------------------
 // ------------------------------------------------------------------------------------------------
 // SETUP
@@ -91,20 +127,52 @@ void setup() {
   // en appelant la fonction setupDebug();
    setupDebug();
    MYDEBUG_PRINTLN("------------------- SETUP");
+  setupLog();         // Journal en mémoire, vidé par un travail de priorité basse
+//  logBenchmark();     // Coût d'un message du journal, comparé au port série
+  setupTime();        // Horloge locale, reprise après un sommeil profond, cf. \ref ntp
+  setupEnergy();      // Temps passé dans chaque état radio, réveil court compris
+
+  if (setupLowPower() == LOWPOWER_WAKE_SCAN) { // Réveil court du mode basse consommation, cf. \ref deepsleep
+    rssiDistanceTableBuild(); // Table des distances BLE, d'après la configuration conservée en mémoire RTC
+    setupBLE();       // Ecoute et annonce BLE seulement, ni SPIFFS ni WiFi
+    return;
+  }
 
-  setupSPIFFS();      // Initialisation du système de fichiers
-  setupWiFi();        // Initialisation du WiFi
-  setupAdafruitIO();  // Initialisation Adafruit MQTT
-  setupWebServer();   // Initialisation du Serveur Web
+  // Etapes du démarrage et leurs dépendances, lancées par bootRun() dès que possible, cf. \ref boot
+  uint32_t spiffs = bootPhase("spiffs", []() {
+    setupSPIFFS();      // Initialisation du système de fichiers et lecture de la configuration
+  }, 0);
+  uint32_t bleinit = bootPhase("bleinit", []() {
+    bleBegin();         // Pile BLE, en parallèle du SPIFFS ; un échec est refait et journalisé par setupBLE()
+  }, 0, BOOT_CORE0);
+  uint32_t wifi = bootPhase("wifi", setupWiFi, spiffs | bleinit, BOOT_NET_START); // Après la pile BLE (radio partagée), sans attendre l'association
+  uint32_t data = bootPhase("data", []() {
+    setupPositiveSync();// Chargement de la liste versionnée des positifs
+    setupExposure();    // Graphe d'exposition, à partir des contacts enregistrés
+//    exposureBenchmark(); // Mises à jour incrémentales et recalcul complet sur 10 000 cartes, avant setupWiFi()
+    setupYCT();         // Etat de santé initial
+    rssiDistanceTableBuild(); // Table des distances BLE, d'après la configuration
+  }, spiffs);
+  bootPhase("ble", []() {
+    setupBLESync();     // Caractéristique de la liste des positifs, avant le démarrage du serveur BLE
+//    bleRingStress(500); // Test de charge de la file des annonces BLE, avant le démarrage du scan
+    setupBLE();         // Serveur pour publier un ID, client pour scanner les ID à proximité
+    setupBLETrace();    // Ecriture de l'enregistrement des annonces BLE en cours
+    setupMyCore0();     // Capture BLE sur le core 0, après setupBLESync() et setupBLE()
+//    bleFilterBenchmark(); // Coût du filtre des annonces BLE, en cycles CPU
+//    rssiBenchmark();    // Coût de l'estimation de distance par annonce, en cycles CPU
+//    bleSyncChunkBenchmark(); // Découpage de la liste des positifs selon le MTU BLE
+  }, data | bleinit);
+  bootPhase("web", setupWebServer, wifi);         // Initialisation du Serveur Web
+  bootPhase("mqtt", setupAdafruitIO, wifi | data); // Initialisation Adafruit MQTT
 //  setupTicker();      // Initialisation d'un ticker
-  setupNTP();         // Initialisation de la connexion avec le serveur NTP (heure)
-//  getNTP();           // Récupération de l'heure
-  setupBLEServer();   // Initialisation du serveur BLE pour publier un ID
-  setupBLEClient();   // Initialisation du client BLE pour scanner les ID à proximité
-  setupOTA();         // Initialisation du mode Over The Air
+  bootPhase("ntp", setupNTP, BOOT_NET);           // Initialisation de la connexion avec le serveur NTP (heure)
+  bootPhase("ota", setupOTA, BOOT_NET);           // Initialisation du mode Over The Air
+  bootPhase("remotelog", setupRemoteLog, BOOT_NET); // Console telnet du journal
 //  setupLED();         // Initialisation de la LED
 //  setupDhtSensor();   // Initialisation du capteur DHT
-//  setupMyCore0();     // Initialisation du Core 0
+//  runFleetSimulation(); // Simulation de la diffusion des positifs sur 10, 100 et 1000 cartes
+  bootRun();
 }
 
 // ------------------------------------------------------------------------------------------------
@@ -116,11 +184,8 @@ void setup() {
  * sans fin, permettant à votre programme de s'exécuter et de répondre.
 */
 void loop() {
-  loopWebServer();
-  loopAdafruitIO();
-  //loopBLEClient(); // A ACTIVER DANS ENVIRONNEMENT VIDE : CRASH INCONNU SI TROP D'APPAREILS
-  loopOTA();
+  timerRun();         // Travaux arrivés à échéance, enregistrés par les modules dans leur setup
 //  playWithLED();
 //  getDhtData();
-  delay(10);        // Délai pour que le CPU puisse passer à d'éventuelles autres tâches
+  timerIdle();        // Sommeil jusqu'à la prochaine échéance, le CPU peut passer à d'autres tâches
 }
@@ -50,7 +50,13 @@
 /************************* Configuration *************************************/
 // Connexion Adafruit
 #define IO_SERVER         "io.adafruit.com"
+// Connexion chiffrée (TLS, port 8883) avec reprise de session, cf. \ref tls
+//#define IO_USE_TLS
+#ifdef IO_USE_TLS
+#define IO_SERVERPORT     8883
+#else
 #define IO_SERVERPORT     1883
+#endif
 #define IO_USERNAME    "user123841294"
 #define IO_USERNAME2    "user21324"
 #define IO_KEY            "aio_Myzr43AsYOGv7TjiYhUh9gZxj43E"
@@ -61,39 +67,129 @@
 //#define FEED_ES_CONTACT   "/feeds/francois.etat-de-sante"
 #define FEED_POSITIVE_LIST "/feeds/data.positivelist"
 #define FEED_CONTACT_LIST "/feeds/data.contactlist"
-// Frequence d'envoi des données
+#define FEED_POSITIVE_SYNC "/feeds/data.positivesync"
+// Frequence d'envoi des données : une publication toutes les FEED_FREQ secondes par feed en moyenne, cf. \ref publisher
 #define FEED_FREQ         10
+// Intervalle entre deux PINGREQ pour maintenir la connexion, le ping attend sa réponse
+#define MQTT_PING_MS      60000
+// Délai entre deux tentatives de connexion au broker
+#define MQTT_RETRY_MS     10000
 
 
 /************************** Variables ****************************************/
-// Instanciation du client WiFi qui servira à se connecter au broker Adafruit
+// Instanciation du client WiFi (ou TLS) qui servira à se connecter au broker Adafruit
+#ifdef IO_USE_TLS
+TlsSessionClient client;
+#else
 WiFiClient client;
+#endif
+
+/**
+ * Hash FNV-1a calculé à la compilation (constexpr) : il sert de fonction de hachage parfaite
+ * pour router les messages reçus. Deux topics avec le même hash donneraient deux "case"
+ * identiques dans feedDispatch() et donc une erreur de compilation.
+ */
+constexpr uint32_t feedHash(const char *s, uint32_t h = 2166136261UL) {
+  return *s ? feedHash(s + 1, (h ^ (uint8_t)*s) * 16777619UL) : h;
+}
+
+/**
+ * Client MQTT qui gère lui-même les souscriptions et le routage des messages reçus.
+ * La bibliothèque limite le nombre de souscriptions (MAXSUBSCRIPTIONS) et parcourt toutes
+ * les souscriptions avec strcmp à chaque message reçu. Ici les SUBSCRIBE sont envoyés
+ * directement pour chaque feed de la table et chaque PUBLISH reçu est routé en O(1) par
+ * feedDispatch().
+ */
+class FeedMqttClient : public Adafruit_MQTT_Client {
+public:
+  FeedMqttClient(Client *client, const char *server, uint16_t port, const char *cid, const char *user, const char *pass)
+    : Adafruit_MQTT_Client(client, server, port, cid, user, pass) {}
+  bool subscribeTopic(const char *topic, uint8_t qos);
+  bool pingFeeds();
+  void processFeeds(int16_t timeout);
+  uint32_t dispatched = 0;                // Messages routés vers une callback
+  uint32_t unrouted = 0;                  // Messages reçus sur un topic inconnu
+protected:
+  // Octets échangés avec le broker, pour le temps d'antenne WiFi, cf. \ref energy
+  bool sendPacket(uint8_t *buffer, uint16_t len) {
+    energyWifiTx(len);
+    return Adafruit_MQTT_Client::sendPacket(buffer, len);
+  }
+  uint16_t readPacket(uint8_t *buffer, uint16_t maxlen, int16_t timeout) {
+    uint16_t len = Adafruit_MQTT_Client::readPacket(buffer, maxlen, timeout);
+    energyWifiTraffic(ENERGY_WIFI_RX, len, rxPacketEnd(buffer, len) ? 1 : 0);
+    return len;
+  }
+private:
+  /* readFullPacket() lit un paquet en trois temps : le type (1 octet), la longueur restante
+   * (1 octet à la fois), puis le contenu, même vide. Un paquet est compté à la fin de son contenu. */
+  bool rxPacketEnd(const uint8_t *buffer, uint16_t len) {
+    if (rxStage == 2) {
+      rxStage = 0;
+      return len > 0 || rxRemaining == 0;
+    }
+    if (len != 1) {
+      rxStage = 0;                        // Délai dépassé, readFullPacket() abandonne le paquet
+      return false;
+    }
+    if (rxStage == 0) {
+      rxStage = 1;
+      rxRemaining = 0;
+      rxShift = 0;
+      return false;
+    }
+    rxRemaining |= (uint32_t)(buffer[0] & 0x7F) << rxShift;
+    rxShift += 7;
+    if (!(buffer[0] & 0x80)) {
+      rxStage = 2;
+    }
+    return false;
+  }
+  uint8_t rxStage = 0;                    // 0 : type attendu, 1 : longueur restante, 2 : contenu
+  uint8_t rxShift = 0;
+  uint32_t rxRemaining = 0;
+  bool handlePublish(uint16_t len);
+  uint8_t feedBuffer[MAXBUFFERSIZE];
+  uint16_t feedPacketId = 0;
+};
+
 // Instanciation du client Adafruit avec les informations de connexion
 //Carte 1 - A changer en fonction de la carte
-//Adafruit_MQTT_Client MyAdafruitMqtt(&client, IO_SERVER, IO_SERVERPORT, IO_USERNAME, IO_USERNAME, IO_KEY);
+//FeedMqttClient MyAdafruitMqtt(&client, IO_SERVER, IO_SERVERPORT, IO_USERNAME, IO_USERNAME, IO_KEY);
 //Carte 2 - A changer en fonction de la carte
-Adafruit_MQTT_Client MyAdafruitMqtt(&client, IO_SERVER, IO_SERVERPORT, IO_USERNAME2, IO_USERNAME2, IO_KEY2);
+FeedMqttClient MyAdafruitMqtt(&client, IO_SERVER, IO_SERVERPORT, IO_USERNAME2, IO_USERNAME2, IO_KEY2);
 // Variable de stockage de la valeur du slider
 uint32_t uiSliderValue=0;
-Ticker MyAdafruitTicker;
 
 /****************************** Feeds ****************************************/
-// Création des Feed auxquels nous allons souscrire :
-// Un FEED 'time' pour récupérer l'heure
-Adafruit_MQTT_Subscribe timefeed = Adafruit_MQTT_Subscribe(&MyAdafruitMqtt, "time/seconds");
-// Un FEED 'slider' pour récupérer la valeur d'un slider présent sur le dashboard
-// Un FEED 'onoff' pour récupérer l'état d'un interrupteur présent sur le dashboard
-Adafruit_MQTT_Subscribe onoffbutton = Adafruit_MQTT_Subscribe(&MyAdafruitMqtt, IO_USERNAME FEED_ONOFF, MQTT_QOS_1);
-// Un FEED 'temperature' et 'humidity' pour publier des données de télémétrie
+// Table des feeds : ajouter un feed se fait en ajoutant une ligne. Les topics, les souscriptions,
+// les objets de publication et le routage des messages reçus en sont générés à la compilation.
+// X(NOM, chemin du feed, QoS, callback appelée à la réception d'un message)
+// - ONOFF : l'état d'un interrupteur présent sur le dashboard
+// - POSITIVE_LIST : la liste des personnes testées positives
+// - CONTACT_LIST : la liste des contacts
+// - POSITIVE_SYNC : les demandes de positifs manqués des autres cartes, cf. \ref positivesync
+#define FEED_TABLE(X) \
+  X(ONOFF,         FEED_ONOFF,         MQTT_QOS_1, onoffcallback)        \
+  X(POSITIVE_LIST, FEED_POSITIVE_LIST, MQTT_QOS_1, positiveListCallback) \
+  X(CONTACT_LIST,  FEED_CONTACT_LIST,  MQTT_QOS_1, contactListCallback)  \
+  X(POSITIVE_SYNC, FEED_POSITIVE_SYNC, MQTT_QOS_1, positiveSyncCallback)
+
+// Identifiants des feeds : FEED_ID_ONOFF, FEED_ID_POSITIVE_LIST ...
+#define FEED_ENUM(name, path, qos, cb) FEED_ID_##name,
+enum FeedId { FEED_TABLE(FEED_ENUM) FEED_COUNT };
+// Topics complets et QoS de chaque feed
+#define FEED_TOPIC(name, path, qos, cb) IO_USERNAME path,
+const char * const feedTopics[FEED_COUNT] = { FEED_TABLE(FEED_TOPIC) };
+#define FEED_QOS(name, path, qos, cb) qos,
+const uint8_t feedQos[FEED_COUNT] = { FEED_TABLE(FEED_QOS) };
+// Un objet de publication par feed, à l'index FEED_ID_xxx, utilisé par la file de publication
+#define FEED_PUBLISH(name, path, qos, cb) Adafruit_MQTT_Publish(&MyAdafruitMqtt, IO_USERNAME path),
+Adafruit_MQTT_Publish feedPublishers[FEED_COUNT] = { FEED_TABLE(FEED_PUBLISH) };
+static_assert(FEED_COUNT <= PUB_MAX_FEEDS, "Trop de feeds pour la file de publication (PUB_MAX_FEEDS)");
 //Adafruit_MQTT_Subscribe subEsMaxime = Adafruit_MQTT_Subscribe(&MyAdafruitMqtt, IO_USERNAME FEED_ES_MOI, MQTT_QOS_1);
 //Adafruit_MQTT_Subscribe subEsFrancois = Adafruit_MQTT_Subscribe(&MyAdafruitMqtt, IO_USERNAME FEED_ES_CONTACT, MQTT_QOS_1);
 //Adafruit_MQTT_Publish pubEsMaxime = Adafruit_MQTT_Publish(&MyAdafruitMqtt, IO_USERNAME FEED_ES_MOI);
-// Un FEED 'positive list' pour récupérer la liste des personnes testées positives
-Adafruit_MQTT_Subscribe positiveListFeed = Adafruit_MQTT_Subscribe(&MyAdafruitMqtt, IO_USERNAME FEED_POSITIVE_LIST, MQTT_QOS_1);
-Adafruit_MQTT_Publish pubPositiveList = Adafruit_MQTT_Publish(&MyAdafruitMqtt, IO_USERNAME FEED_POSITIVE_LIST);
-// Un FEED 'contact list' pour récupérer la liste des contacts
-Adafruit_MQTT_Subscribe contactListFeed = Adafruit_MQTT_Subscribe(&MyAdafruitMqtt, IO_USERNAME FEED_CONTACT_LIST, MQTT_QOS_1);
-Adafruit_MQTT_Publish pubContactList = Adafruit_MQTT_Publish(&MyAdafruitMqtt, IO_USERNAME FEED_CONTACT_LIST);
 /*************************** Sketch Code ************************************/
 
 /**
@@ -130,8 +226,31 @@ void onoffcallback(char *data, uint16_t len) {
 void positiveListCallback(char *data, uint16_t len) {
     MYDEBUG_PRINT("-AdafruitIO : Callback du feed de la liste des personnes testées positives avec la valeur : ");
     MYDEBUG_PRINTLN(data);
-    MYDEBUG_PRINTLN("-AdafruitIO : Test ajout à ma BDD locale");
-    CheckAddPositive(data);
+    char id[POSITIVE_SYNC_ID_LEN];
+    if (positiveSyncOnAnnounce(data, id)) {       // Uniquement si le positif est nouveau
+      eventPost(EVENT_POSITIVE, EVENT_SRC_MQTT, id);
+    }
+}
+
+/**
+ * Callback associée au feed de synchronisation de la liste des positifs :
+ * une autre carte demande les positifs qui lui manquent
+ */
+void positiveSyncCallback(char *data, uint16_t len) {
+    int n = positiveSyncOnRequest(data, DEVICE_NAME);
+    MYDEBUG_PRINT("-AdafruitIO : Requête de synchronisation, positifs à renvoyer : ");
+    MYDEBUG_PRINTLN(n);
+}
+
+/**
+ * Envoi d'une requête de synchronisation avec notre version et notre digest
+ */
+void requestPositiveSync() {
+    char request[SUBSCRIPTIONDATALEN];
+    positiveSyncFormatRequest(DEVICE_NAME, request, sizeof(request));
+    MYDEBUG_PRINT("-AdafruitIO : Requête de synchronisation : ");
+    MYDEBUG_PRINTLN(request);
+    publisherEnqueue(FEED_ID_POSITIVE_SYNC, request, PUB_CLASS_SYNC, positiveHash("Q"));
 }
 
 /**
@@ -140,6 +259,7 @@ void positiveListCallback(char *data, uint16_t len) {
 void contactListCallback(char *data, uint16_t len) {
     MYDEBUG_PRINT("-AdafruitIO : Callback du feed de la liste des contacts avec la valeur : ");
     MYDEBUG_PRINTLN(data);
+    eventPost(EVENT_CONTACT_LIST, EVENT_SRC_MQTT, data);  // "C:id1:id2", cf. \ref exposure
 }
 
 /**
@@ -148,10 +268,12 @@ void contactListCallback(char *data, uint16_t len) {
 void pubEtatSante(String etat, String nom) {
   if (etat == "Positif") {
     MYDEBUG_PRINTLN("-AdafruitIO : Publication de mon état de santé : Positif");
-    char data_publish[nom.length() + 1];
-    nom.toCharArray(data_publish, nom.length() + 1);
-    pubPositiveList.publish(data_publish);
-    MYDEBUG_PRINTLN("-AdafruitIO : Etat de santé publié");
+    char data_publish[SUBSCRIPTIONDATALEN];
+    uint32_t seq = positiveSyncDeclare(nom.c_str());
+    snprintf(data_publish, sizeof(data_publish), "P:%lu:%s", (unsigned long)seq, nom.c_str());
+    syncBytesOut += strlen(data_publish);
+    publisherEnqueue(FEED_ID_POSITIVE_LIST, data_publish, PUB_CLASS_STATE, positiveHash(nom.c_str()));
+    MYDEBUG_PRINTLN("-AdafruitIO : Etat de santé en attente de publication");
   }
 }
 
@@ -193,63 +315,273 @@ void EsFrancoisCallback(char *data, uint16_t len) {
 
 
 /**
- * Configuration de la connexion au borker Adafruit IO
- * - Connexion WiFi
- * - Configuration de l'actuateur
- * - Configuration des callbacks
+ * Routage d'un message reçu vers la callback de son feed.
+ * Le switch porte sur le hash du topic, calculé à la compilation pour chaque feed de la table :
+ * le compilateur en fait une table de saut ou une recherche dichotomique, sans parcourir les feeds.
+ * \return false si le topic ne correspond à aucun feed
  */
-void setupAdafruitIO() {
+#define FEED_CASE(name, path, qos, cb) \
+  case feedHash(IO_USERNAME path):    \
+    if (strcmp(topic, IO_USERNAME path) != 0) { return false; } \
+    cb(data, len);                    \
+    return true;
+bool feedDispatch(const char *topic, char *data, uint16_t len) {
+  switch (feedHash(topic)) {
+    FEED_TABLE(FEED_CASE)
+    default:
+      return false;
+  }
+}
 
-  if (WiFi.status() != WL_CONNECTED){setupWiFi();}     // Vérification de la connexion WiFi
+/**
+ * Envoi d'un paquet SUBSCRIBE pour un topic et attente de l'acquittement (SUBACK)
+ */
+bool FeedMqttClient::subscribeTopic(const char *topic, uint8_t qos) {
+  uint16_t tlen = strlen(topic);
+  uint16_t remaining = 2 + 2 + tlen + 1;          // identifiant + longueur du topic + topic + QoS
+  if (remaining + 3 > MAXBUFFERSIZE) {
+    return false;
+  }
+  uint8_t *p = feedBuffer;
+  *p++ = (MQTT_CTRL_SUBSCRIBE << 4) | (MQTT_QOS_1 << 1);
+  do {                                            // Longueur restante, encodée sur 7 bits par octet
+    uint8_t digit = remaining % 128;
+    remaining /= 128;
+    *p++ = remaining ? (digit | 0x80) : digit;
+  } while (remaining);
+  feedPacketId++;
+  *p++ = feedPacketId >> 8;
+  *p++ = feedPacketId & 0xFF;
+  *p++ = tlen >> 8;
+  *p++ = tlen & 0xFF;
+  memcpy(p, topic, tlen);
+  p += tlen;
+  *p++ = qos;
+  if (!sendPacket(feedBuffer, p - feedBuffer)) {
+    return false;
+  }
+  // Attente du SUBACK, les messages reçus entre temps sont traités
+  unsigned long start = millis();
+  while (millis() - start < CONNECT_TIMEOUT_MS) {
+    uint16_t len = readFullPacket(feedBuffer, MAXBUFFERSIZE, CONNECT_TIMEOUT_MS);
+    if (len == 0) {
+      return false;
+    }
+    if ((feedBuffer[0] >> 4) == MQTT_CTRL_SUBACK) {
+      return len >= 5 && feedBuffer[len - 1] != 0x80;   // 0x80 : souscription refusée
+    }
+    if ((feedBuffer[0] >> 4) == MQTT_CTRL_PUBLISH) {
+      handlePublish(len);
+    }
+  }
+  return false;
+}
 
-  // Configuration des callbacks pour les FEEDs auxquels on veut souscrire
-  //timefeed.setCallback(timecallback);
-  onoffbutton.setCallback(onoffcallback);
-  positiveListFeed.setCallback(positiveListCallback);
-  contactListFeed.setCallback(contactListCallback);
-  
-  // Souscription aux FEEDs
-  MyAdafruitMqtt.subscribe(&timefeed);
-  MyAdafruitMqtt.subscribe(&onoffbutton);
-  MyAdafruitMqtt.subscribe(&positiveListFeed);
-  MyAdafruitMqtt.subscribe(&contactListFeed);
+/**
+ * Envoi d'un PINGREQ et attente du PINGRESP.
+ * ping() de la bibliothèque ne connaît pas nos souscriptions : un PUBLISH reçu avant la réponse
+ * y serait perdu, sans PUBACK. Ici il est traité, comme dans subscribeTopic().
+ */
+bool FeedMqttClient::pingFeeds() {
+  uint8_t pingreq[2] = { MQTT_CTRL_PINGREQ << 4, 0 };
+  if (!sendPacket(pingreq, 2)) {
+    return false;
+  }
+  unsigned long start = millis();
+  while (millis() - start < PING_TIMEOUT_MS) {
+    uint16_t len = readFullPacket(feedBuffer, MAXBUFFERSIZE, PING_TIMEOUT_MS - (millis() - start));
+    if (len == 0) {
+      return false;
+    }
+    if ((feedBuffer[0] >> 4) == MQTT_CTRL_PINGRESP) {
+      return true;
+    }
+    if ((feedBuffer[0] >> 4) == MQTT_CTRL_PUBLISH) {
+      handlePublish(len);
+    }
+  }
+  return false;
+}
 
-  /*subEsMaxime.setCallback(EsMaximeCallback);
-  subEsFrancois.setCallback(EsFrancoisCallback);
-  MyAdafruitMqtt.subscribe(&subEsMaxime);
-  MyAdafruitMqtt.subscribe(&subEsFrancois);*/
+/**
+ * Décodage d'un paquet PUBLISH présent dans feedBuffer, acquittement si QoS 1 et routage
+ */
+bool FeedMqttClient::handlePublish(uint16_t len) {
+  scanSchedulerWifiActivity();                    // Le scan BLE laisse l'antenne au WiFi
+  uint8_t qos = (feedBuffer[0] >> 1) & 0x03;
+  uint16_t i = 1;
+  while (i < len && i < 5 && (feedBuffer[i] & 0x80)) {   // On saute la longueur restante
+    i++;
+  }
+  i++;
+  if (i + 2 > len) {
+    return false;
+  }
+  uint16_t tlen = (feedBuffer[i] << 8) | feedBuffer[i + 1];
+  i += 2;
+  if (i + tlen > len || tlen >= MAXBUFFERSIZE) {
+    return false;
+  }
+  char topic[MAXBUFFERSIZE];
+  memcpy(topic, feedBuffer + i, tlen);
+  topic[tlen] = '\0';
+  i += tlen;
+  uint16_t packetId = 0;
+  if (qos > 0) {
+    if (i + 2 > len) {
+      return false;
+    }
+    packetId = (feedBuffer[i] << 8) | feedBuffer[i + 1];
+    i += 2;
+  }
+  uint16_t dlen = (len > i) ? len - i : 0;
+  if (dlen > SUBSCRIPTIONDATALEN - 1) {
+    dlen = SUBSCRIPTIONDATALEN - 1;
+  }
+  char data[SUBSCRIPTIONDATALEN];
+  memcpy(data, feedBuffer + i, dlen);
+  data[dlen] = '\0';
+  if (qos == MQTT_QOS_1) {
+    uint8_t puback[4] = { MQTT_CTRL_PUBACK << 4, 2, (uint8_t)(packetId >> 8), (uint8_t)(packetId & 0xFF) };
+    sendPacket(puback, 4);
+  }
+  if (feedDispatch(topic, data, dlen)) {
+    dispatched++;
+    return true;
+  }
+  unrouted++;
+  return false;
 }
 
 /**
- * Connexion au broker Adafruit IO
+ * Traitement des messages reçus pendant au plus timeout millisecondes, comme processPackets(),
+ * mais sans attendre s'il n'y a rien à lire
  */
-void connectAdafruitIO() {
-  if (MyAdafruitMqtt.connected()) { return; }                      // Si déjà connecté, alors c'est tout bon
+void FeedMqttClient::processFeeds(int16_t timeout) {
+  unsigned long start = millis();
+  // Un message donne au plus un événement : sans place, il attend dans la connexion, cf. \ref events
+  while (millis() - start < (unsigned long)timeout && eventRoom() > EVENT_RESERVE && ::client.available() > 0) {
+    uint16_t len = readFullPacket(feedBuffer, MAXBUFFERSIZE, timeout - (millis() - start));
+    if (len == 0) {
+      break;
+    }
+    if ((feedBuffer[0] >> 4) == MQTT_CTRL_PUBLISH) {
+      handlePublish(len);
+    }
+  }
+}
+
+/**
+ * Connexion au broker Adafruit IO, une tentative au plus toutes les MQTT_RETRY_MS, sans bloquer
+ * \return true si la connexion est établie
+ */
+bool connectAdafruitIO() {
+  static unsigned long lastAttempt = 0;
+  if (MyAdafruitMqtt.connected()) { return true; }                 // Si déjà connecté, alors c'est tout bon
+  if (WiFi.status() != WL_CONNECTED) { return false; }             // Le WiFi se reconnecte en tâche de fond
+  if (lastAttempt && millis() - lastAttempt < MQTT_RETRY_MS) { return false; }
+  lastAttempt = millis();
   MYDEBUG_PRINT("-AdafruitIO : Utilisation du compte : ");
   MYDEBUG_PRINTLN(IO_USERNAME);
   MYDEBUG_PRINT("-AdafruitIO : Connexion au broker ... ");
   int8_t ret;
-  while ((ret = MyAdafruitMqtt.connect()) != 0) {                  // Retourne 0 si déjà connecté
+  // connect() ne lit que le CONNACK : la session est neuve (clean session) et aucune souscription
+  // n'est confiée à la bibliothèque, aucun PUBLISH ne peut donc arriver avant subscribeTopic()
+  if ((ret = MyAdafruitMqtt.connect()) != 0) {                     // Retourne 0 si déjà connecté
      MYDEBUG_PRINT("[ERREUR : ");
      MYDEBUG_PRINT(MyAdafruitMqtt.connectErrorString(ret));
-     MYDEBUG_PRINT("] nouvelle tentative dans 10 secondes ...");
+     MYDEBUG_PRINTLN("] nouvelle tentative dans 10 secondes ...");
      MyAdafruitMqtt.disconnect();                                  // Deconnexion pour être propre
-     delay(10000);                                                 // On attend 10 secondes avant de retenter le coup
+     return false;
   }
   MYDEBUG_PRINTLN("[OK]");
+  // Souscription aux FEEDs de la table
+  for (int f = 0; f < FEED_COUNT; f++) {
+    if (!MyAdafruitMqtt.subscribeTopic(feedTopics[f], feedQos[f])) {
+      MYDEBUG_PRINT("-AdafruitIO : Souscription impossible à ");
+      MYDEBUG_PRINTLN(feedTopics[f]);
+    }
+  }
+  requestPositiveSync();                                           // On rattrape les positifs publiés en notre absence
+  return true;
+}
+
+/**
+ * Mise en file de publication des réponses de synchronisation échues et de nos nouveaux contacts,
+ * tant que la file a de la place : le reste attend dans la table des positifs et dans la file des
+ * contacts, rien n'est retiré avant d'avoir été accepté
+ */
+void queueAdafruitIO() {
+  // Réponses différées aux requêtes de synchronisation des autres cartes
+  char resend[SUBSCRIPTIONDATALEN];
+  while (publisherPending() < PUB_QUEUE_SIZE && positiveSyncNextResend(resend, sizeof(resend))) {
+    // Clé de fusion sur l'identifiant seul, comme pubEtatSante() : "P:seq:id" change avec seq
+    uint32_t seq;
+    char id[POSITIVE_SYNC_ID_LEN];
+    positiveSyncParseAnnounce(resend, &seq, id);
+    publisherEnqueue(FEED_ID_POSITIVE_LIST, resend, PUB_CLASS_SYNC, positiveHash(id));
+  }
+  // Publication de nos nouveaux contacts, pour le graphe d'exposition des autres cartes
+  const char *peer;
+  while (publisherPending() < PUB_QUEUE_SIZE && (peer = exposurePeekOutbox()) != NULL) {
+    char contact[SUBSCRIPTIONDATALEN];
+    snprintf(contact, sizeof(contact), "C:%s:%s", DEVICE_NAME, peer);
+    if (!publisherEnqueue(FEED_ID_CONTACT_LIST, contact, PUB_CLASS_CONTACT, positiveHash(contact))) {
+      break;
+    }
+    exposurePopOutbox();
+  }
 }
 
 /**
- * Boucle Adafruit IO
+ * Boucle Adafruit IO, toutes les 100 ms dans la limite de budgetMs
  * - Vérification de l'état de la connexion
- * - Traitement des messages reçus
- * - Maintien de la connexion en vie avec un Ping si on aucun publish télémétrie n'est fait
+ * - Traitement des messages reçus, pendant au plus budgetMs
+ * - Maintien de la connexion en vie avec un Ping toutes les MQTT_PING_MS
  */
-void loopAdafruitIO() {
-  connectAdafruitIO();
-  MyAdafruitMqtt.processPackets(10000);
-  if(! MyAdafruitMqtt.ping()) {
-    MyAdafruitMqtt.disconnect();
+void pollAdafruitIO(uint32_t budgetMs) {
+  static unsigned long lastPing = 0;
+  if (!connectAdafruitIO()) {
+    return;
   }
-  
+  MyAdafruitMqtt.processFeeds(budgetMs);
+  // Les messages reçus avant le PINGRESP sont traités : le ping attend que la file se vide
+  if (millis() - lastPing > MQTT_PING_MS && eventRoom() > EVENT_RESERVE) {
+    lastPing = millis();
+    if(! MyAdafruitMqtt.pingFeeds()) {
+      MyAdafruitMqtt.disconnect();
+    }
+  }
+  queueAdafruitIO();
+  loopPositiveSync();
+  // Publication des messages en attente, dans la limite des quotas
+  if (MyAdafruitMqtt.connected()) {
+    loopPublisher();
+  }
+
+}
+
+/**
+ * Configuration de la connexion au borker Adafruit IO
+ * - Connexion WiFi
+ * - Configuration de l'actuateur
+ * - Configuration des callbacks
+ */
+void setupAdafruitIO() {
+
+  // Pas d'attente du WiFi : pollAdafruitIO() se connecte au broker quand le réseau est là
+
+  // Enregistrement de tous les feeds de la table dans la file de publication, l'index est FEED_ID_xxx
+  for (int f = 0; f < FEED_COUNT; f++) {
+    publisherAddFeed(&feedPublishers[f], FEED_FREQ * 1000UL);
+  }
+  timerPoll("mqtt", 100, 20, TIMER_PRIO_LOW, pollAdafruitIO);
+
+  // Les callbacks et les souscriptions sont générées à partir de FEED_TABLE,
+  // les souscriptions sont envoyées à chaque connexion par connectAdafruitIO()
+
+  /*subEsMaxime.setCallback(EsMaximeCallback);
+  subEsFrancois.setCallback(EsFrancoisCallback);
+  MyAdafruitMqtt.subscribe(&subEsMaxime);
+  MyAdafruitMqtt.subscribe(&subEsFrancois);*/
 }
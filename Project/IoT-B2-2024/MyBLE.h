@@ -23,6 +23,15 @@
    - Le service nous permet d'identifier les objets à proximité qui utilisent ce service,
    - Leur identifiant permet de connaître leur nom et de pouvoir les reconnaître individuellement.
 
+   Les deux rôles, serveur (advertising) et client (scan), partagent une seule instance de la pile Bluetooth,
+   initialisée une seule fois par bleBegin() selon la configuration commune bleConfig :
+   - la mémoire réservée au Bluetooth classique, inutile ici, est rendue au tas avant l'initialisation du contrôleur,
+     qui est alors démarré en mode BLE seul : BLEDevice::init() le démarrerait sinon en mode double
+     (BTDM), qui a besoin de cette mémoire,
+   - le contrôleur partage la radio entre advertising et fenêtres de scan : l'advertising est espacé
+     (bleConfig.advIntervalMin/Max) pour laisser la place au scan, dont le rythme est choisi par \ref scanscheduler,
+   - la mémoire prise par la pile et la durée de l'initialisation sont visibles sur /stats.
+
    Au regard de la taille des composants logiciels, vous aurez besoin de changer le partionnement de la carte en
    mode "Minimal SPIFFS (1.9 MB App with OTA/190 KB SPIFFS)" sinon vous ne pourrez pas charger le binaire sur la
    carte, par manque de place.
@@ -32,12 +41,64 @@
 #include <BLEDevice.h>
 #include <BLEUtils.h>
 #include <BLEServer.h>
+#include <esp_bt.h>
 
 #define SERVICE_UUID        "436f6e74-6163-7420-5472-61636b657273" // "Contact Trackers" d'ascii en hexa, ça ne sert à rien mais bon                             
 
+// Ajout de caractéristiques au service avant son démarrage, NULL si aucune, cf. \ref blesync
+void (*bleServiceHook)(BLEServer *pServer, BLEService *pService) = NULL;
+
+
+/* Configuration commune des deux rôles BLE */
+struct BleConfig {
+  const char *name;           // Nom publié, le même que celui utilisé en MQTT
+  bool advertise;             // Rôle serveur : publication du nom et du service
+  bool scan;                  // Rôle client : détection des autres cartes
+  uint16_t advIntervalMin;    // Intervalle d'advertising, en unités de 0,625 ms
+  uint16_t advIntervalMax;
+};
 
-int scanTime = 2; //In seconds
-BLEScan* pBLEScan;
+BleConfig bleConfig = { DEVICE_NAME, true, true, 400, 480 };   // Advertising toutes les 250 à 300 ms
+
+bool bleStarted = false;              // Pile Bluetooth initialisée
+uint32_t bleHeapReleased = 0;         // Mémoire du Bluetooth classique rendue au tas
+uint32_t bleHeapUsed = 0;             // Mémoire prise par la pile (contrôleur et Bluedroid)
+uint32_t bleInitMs = 0;               // Durée de l'initialisation de la pile
+
+/**
+   Initialisation unique de la pile Bluetooth, pour les deux rôles
+   \return false si le contrôleur n'a pas pu démarrer
+*/
+bool bleBegin() {
+  if (bleStarted) {
+    return true;
+  }
+  uint32_t heap = ESP.getFreeHeap();
+  unsigned long start = millis();
+  // Uniquement possible tant que le contrôleur n'est pas initialisé
+  if (esp_bt_controller_get_status() == ESP_BT_CONTROLLER_STATUS_IDLE &&
+      esp_bt_controller_mem_release(ESP_BT_MODE_CLASSIC_BT) == ESP_OK) {
+    bleHeapReleased = ESP.getFreeHeap() - heap;
+    heap = ESP.getFreeHeap();
+  }
+  // Contrôleur démarré ici en BLE seul, BLEDevice::init() le trouve déjà démarré (btStart())
+  if (!btStartMode(BT_MODE_BLE)) {
+    MYDEBUG_PRINTLN("-BLE : Démarrage du contrôleur impossible");
+    return false;
+  }
+  BLEDevice::init(bleConfig.name);
+  bleHeapUsed = heap - ESP.getFreeHeap();
+  bleInitMs = millis() - start;
+  bleStarted = true;
+  MYDEBUG_PRINT("-BLE : Pile initialisée en ");
+  MYDEBUG_PRINT(bleInitMs);
+  MYDEBUG_PRINT(" ms, tas utilisé ");
+  MYDEBUG_PRINT(bleHeapUsed);
+  MYDEBUG_PRINT(" octets, rendu ");
+  MYDEBUG_PRINT(bleHeapReleased);
+  MYDEBUG_PRINTLN(" octets");
+  return true;
+}
 
 /**
    Configuration du serveur BLE
@@ -47,80 +108,338 @@ BLEScan* pBLEScan;
 */
 void setupBLEServer() {
   MYDEBUG_PRINT("-BLE : Démarrage du serveur sous le nom : ");
-  MYDEBUG_PRINTLN(DEVICE_NAME);
+  MYDEBUG_PRINTLN(bleConfig.name);
 
-  BLEDevice::init(DEVICE_NAME);
+  if (!bleBegin()) {
+    return;
+  }
   BLEServer *pServer = BLEDevice::createServer();
   BLEService *pService = pServer->createService(SERVICE_UUID);
+  if (bleServiceHook) {
+    bleServiceHook(pServer, pService);
+  }
 
   pService->start();
   BLEAdvertising *pAdvertising = BLEDevice::getAdvertising();
   pAdvertising->addServiceUUID(SERVICE_UUID);
+  pAdvertising->setMinInterval(bleConfig.advIntervalMin);
+  pAdvertising->setMaxInterval(bleConfig.advIntervalMax);
   BLEDevice::startAdvertising();
   MYDEBUG_PRINTLN("-BLE : Serveur démarré");
 }
 
+uint8_t trackerUUIDRaw[16];            // UUID du service tel qu'il apparaît dans les annonces (octets inversés)
+volatile bool bleScanning = false;    // Scan continu en cours
+int8_t bleJobPoll = TIMER_NONE;         // Travaux de loop(), remplacés par la capture sur le core 0, cf. \ref core0
+int8_t bleJobExpire = TIMER_NONE;
+volatile bool bleReplaying = false;   // Rejeu d'une trace en cours, les annonces réelles sont ignorées
+volatile bool blePaused = false;      // Scan suspendu pendant une connexion à une autre carte, cf. \ref blesync
+// Première annonce d'une nouvelle rencontre, NULL si rien à faire, cf. \ref blesync
+void (*bleNewPeerHook)(const uint8_t *addr, uint32_t peer) = NULL;
+// Enregistrement des annonces brutes reçues, NULL si aucun enregistrement n'est en cours, cf. \ref bletrace
+void (*bleTraceHook)(const uint8_t *bda, int8_t rssi, const uint8_t *data, uint8_t len) = NULL;
+
+// Statistiques du filtre des annonces
+uint32_t bleFilterAccepted = 0;       // Annonces de CONTACT TRACKER
+uint32_t bleFilterRejected = 0;       // Autres annonces
+uint64_t bleFilterRejectCycles = 0;   // Cycles CPU cumulés pour rejeter les autres annonces
+uint32_t bleFilterRejectMax = 0;      // Cycles CPU maximum pour rejeter une annonce
+
+/**
+   Conversion d'un UUID texte "xxxxxxxx-xxxx-..." en 16 octets, dans l'ordre des annonces (poids faible en premier)
+*/
+void bleParseUUID(const char *uuid, uint8_t *out) {
+  int n = 15;
+  for (const char *p = uuid; *p && n >= 0; p++) {
+    if (*p == '-') continue;
+    char hex[3] = { p[0], p[1], '\0' };
+    out[n--] = strtoul(hex, NULL, 16);
+    p++;
+  }
+}
+
 /**
-   Callback quand un device BLE est détecté.
-   Dans notre cas, on vérifie si son service UUID est celui que nous recherchons.
-   Si c'est le cas, on récupère son nom et le niveau de puissance (RSSI)
-   qui nous permet de calculer une distance approximative
-*/
-class MyAdvertisedDeviceCallbacks: public BLEAdvertisedDeviceCallbacks {
-    void onResult(BLEAdvertisedDevice advertisedDevice) {
-      String myId = DEVICE_NAME;
-      if (SERVICE_UUID == advertisedDevice.getServiceUUID().toString()) {
-        MYDEBUG_PRINT("-BLE client / CONTACT TRACKER trouvé : ");
-        MYDEBUG_PRINTLN(advertisedDevice.getServiceUUID().toString().c_str());
-        MYDEBUG_PRINT("    -- Device Name : ");
-        MYDEBUG_PRINTLN(advertisedDevice.getName().c_str());
-        if (!advertisedDevice.getName().empty())
-        {
-          saveContact(advertisedDevice.getName().c_str(), advertisedDevice.getName().c_str(), "toto");
+   Recherche de l'UUID du service dans les données brutes d'une annonce, sans allocation.
+   Une annonce est une suite de champs [longueur][type][données] : on ne regarde que les listes
+   d'UUID 128 bits (types 0x06 et 0x07), et on ne relève le nom (types 0x08 et 0x09) que si
+   l'annonce est bien celle d'un CONTACT TRACKER.
+   \param name reçoit le nom, terminé par '\0', s'il est présent
+   \return true si l'annonce est celle d'un CONTACT TRACKER
+*/
+bool bleAdvIsTracker(const uint8_t *data, uint8_t len, char *name, size_t nameSize) {
+  bool found = false;
+  const uint8_t *nameField = NULL;
+  uint8_t nameLen = 0;
+  for (uint8_t i = 0; i + 1 < len; ) {
+    uint8_t fieldLen = data[i];
+    if (fieldLen == 0 || i + 1 + fieldLen > len) {
+      break;
+    }
+    uint8_t type = data[i + 1];
+    if (type == 0x06 || type == 0x07) {
+      for (uint8_t u = i + 2; u + 16 <= i + 1 + fieldLen; u += 16) {
+        if (memcmp(data + u, trackerUUIDRaw, 16) == 0) {
+          found = true;
         }
-        MYDEBUG_PRINT("    -- Device RSSI : ");
-        MYDEBUG_PRINTLN(advertisedDevice.getRSSI());
-        float ratio = (-69 - advertisedDevice.getRSSI()) / (10 * 2);
-        float Distance = pow(10, ratio);
-        MYDEBUG_PRINT("    -- Device DISTANCE : ");
-        MYDEBUG_PRINTLN(Distance);
       }
+    } else if (type == 0x08 || type == 0x09) {
+      nameField = data + i + 2;
+      nameLen = fieldLen - 1;
     }
-};
+    i += 1 + fieldLen;
+  }
+  name[0] = '\0';
+  if (found && nameField) {
+    if (nameLen >= nameSize) nameLen = nameSize - 1;
+    memcpy(name, nameField, nameLen);
+    name[nameLen] = '\0';
+  }
+  return found;
+}
+
+/**
+   Traitement d'une annonce brute : filtre puis, si c'est un CONTACT TRACKER, ajout dans la file.
+   Appelée par le gestionnaire GAP pour les annonces réelles et par \ref bletrace pour les rejeux.
+   \param ms date de réception (millis, ou date dans la trace pour un rejeu)
+   \return true si l'annonce est celle d'un CONTACT TRACKER
+*/
+bool bleOnAdvertisement(const uint8_t *bda, int8_t rssi, const uint8_t *data, uint8_t len, uint32_t ms) {
+  uint32_t start = ESP.getCycleCount();
+  char name[BLE_NAME_LEN];
+  if (bleAdvIsTracker(data, len, name, sizeof(name))) {
+    bleFilterAccepted++;
+    bleRingPush(bda, rssi, name, ms);
+    return true;
+  }
+  uint32_t cycles = ESP.getCycleCount() - start;
+  bleFilterRejected++;
+  bleFilterRejectCycles += cycles;
+  if (cycles > bleFilterRejectMax) bleFilterRejectMax = cycles;
+  return false;
+}
+
+/**
+   Gestionnaire GAP appelé directement par la pile Bluetooth, pour chaque annonce reçue.
+   Le scan est piloté sans passer par BLEScan, qui construisait un BLEAdvertisedDevice (allocations,
+   conversions en texte) pour chaque annonce, même celles qui ne sont pas des CONTACT TRACKER.
+   Seules les annonces retenues par bleAdvIsTracker() sont placées dans la file \ref blering.
+*/
+void bleGapHandler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param) {
+  switch (event) {
+    case ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE_EVT:
+      esp_ble_gap_start_scanning(0);                  // 0 : scan sans fin
+      break;
+    case ESP_GAP_BLE_SCAN_START_COMPLETE_EVT:
+      bleScanning = param->scan_start_cmpl.status == ESP_BT_STATUS_SUCCESS;
+      break;
+    case ESP_GAP_BLE_SCAN_STOP_COMPLETE_EVT:
+      bleScanning = false;
+      break;
+    case ESP_GAP_BLE_SCAN_RESULT_EVT:
+      if (param->scan_rst.search_evt == ESP_GAP_SEARCH_INQ_RES_EVT && !bleReplaying) {
+        uint8_t len = param->scan_rst.adv_data_len + param->scan_rst.scan_rsp_len;
+        if (bleTraceHook) {
+          bleTraceHook(param->scan_rst.bda, param->scan_rst.rssi, param->scan_rst.ble_adv, len);
+        }
+        bleOnAdvertisement(param->scan_rst.bda, param->scan_rst.rssi, param->scan_rst.ble_adv, len, millis());
+      } else if (param->scan_rst.search_evt == ESP_GAP_SEARCH_INQ_CMPL_EVT) {
+        bleScanning = false;
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+/**
+   Traitement d'une annonce d'un CONTACT TRACKER sortie de la file.
+   L'annonce est ajoutée à la rencontre en cours avec cette carte, qui filtre le niveau de puissance (RSSI)
+   pour en déduire une distance approximative, cf. \ref rssi
+*/
+void bleHandleAdvert(const AdvRecord &r) {
+  const char *name = bleNameLookup(r.nameHash);
+  Encounter *e = encounterSighting(r);   // Le contact ne sera enregistré qu'après minutes_stand_by minutes, cf. \ref encounter
+  LOG_D("-BLE client : CONTACT TRACKER %s, RSSI %d dBm, distance %u cm", name ? name : "", r.rssi, e ? e->distanceCm : 0);
+  if (e) {
+    if (e->samples == 1 && bleNewPeerHook) {
+      bleNewPeerHook(r.addr, r.nameHash);
+    }
+  }
+}
+
+/**
+   Démarrage du scan continu, actif, sans bloquer : le scan démarre quand la pile Bluetooth
+   a pris en compte les paramètres, cf. bleGapHandler().
+   Le scan doit être actif : BLEAdvertising place le nom de la carte dans la réponse au scan (scan
+   response), que le contrôleur ne demande qu'en scan actif. La pile attend cette réponse et remonte
+   annonce et réponse à la suite dans ble_adv. En scan passif, aucune annonce n'a de nom, donc pas
+   d'identifiant, et aucune rencontre n'est enregistrée. La requête de scan ajoute une courte
+   émission par annonce d'un CONTACT TRACKER, comptée dans la fenêtre de scan (\ref energy).
+   La fenêtre et l'intervalle sont ceux du mode choisi par \ref scanscheduler
+*/
+void startBLEScan() {
+  esp_ble_scan_params_t scanParams = {
+    .scan_type = BLE_SCAN_TYPE_ACTIVE,                // Le nom n'est que dans la réponse au scan
+    .own_addr_type = BLE_ADDR_TYPE_PUBLIC,
+    .scan_filter_policy = BLE_SCAN_FILTER_ALLOW_ALL,
+    .scan_interval = scanModes[scanMode].interval,
+    .scan_window = scanModes[scanMode].window,        // Inférieur ou égal à l'intervalle
+    .scan_duplicate = BLE_SCAN_DUPLICATE_DISABLE      // Chaque annonce est remontée
+  };
+  bleScanning = true;                                 // En cours de démarrage
+  if (esp_ble_gap_set_scan_params(&scanParams) != ESP_OK) {
+    bleScanning = false;
+    MYDEBUG_PRINTLN("-BLE Client : Démarrage du scan impossible");
+  }
+}
 
 /**
-   Fonction régulière pour notre client BLE qui va scanner les devices à proximité
-   - on limite le temps de scan à scanTime secondes pour ne pas bloquer la carte
-   - une fois terminé, on efface les résultats pour pouvoir recommencer tranquillement
+   Fonction régulière pour notre client BLE (toutes les 10 ms), elle ne bloque plus :
+   - le scan tourne en continu en tâche de fond, on le relance s'il s'est arrêté (sauf s'il est
+     suspendu, ou arrêté par bleExpireJob() pour changer de mode)
+   - pendant un rejeu (\ref bletrace), la file et le scan sont à lui : rien à faire
+   - on traite les annonces reçues depuis le dernier appel, par lots, pendant au plus budgetMs
 */
-void loopBLEClient() {
-  MYDEBUG_PRINT("-BLE Client : Scan @ ");
-  timeClient.update();
-  MYDEBUG_PRINTLN(timeClient.getFormattedTime());
+void pollBLEClient(uint32_t budgetMs) {
+  if (!bleConfig.scan || bleReplaying) {
+    return;
+  }
+  if (!bleScanning && !blePaused) {
+    startBLEScan();
+  }
+  unsigned long start = millis();
+  while (bleRingDrain(bleHandleAdvert, BLE_DRAIN_MAX) == BLE_DRAIN_MAX && millis() - start < budgetMs) {}
+}
 
-  BLEScanResults foundDevices = pBLEScan->start(scanTime, false); //crash dans cette fonction si trop d'appareils
+/**
+   Toutes les secondes : fin des rencontres expirées et choix du rythme de scan, sauf pendant un
+   rejeu, qui fait expirer ses rencontres à la date de la trace
+*/
+void bleExpireJob() {
+  if (bleReplaying) {
+    return;
+  }
+  encounterExpire(millis());
+  if (scanSchedulerTick(encounterActive, bleScanning && !blePaused) && bleScanning) {
+    esp_ble_gap_stop_scanning();
+  }
+}
 
-  MYDEBUG_PRINT("-BLE Client : Devices trouvés ");
-  MYDEBUG_PRINTLN(foundDevices.getCount());
+/**
+   Annonce et réponse au scan de notre carte, à la suite, telles que le scan actif les remonte :
+   BLEAdvertising publie les drapeaux et l'UUID du service dans l'annonce, et le nom complet dans
+   la réponse au scan, cf. setupBLEServer()
+   \param out au moins 62 octets
+   \return la longueur totale
+*/
+uint8_t bleOwnAdvert(uint8_t *out) {
+  const uint8_t head[5] = { 0x02, 0x01, 0x06, 0x11, 0x07 };                            // Drapeaux, UUID 128 bits
+  memcpy(out, head, sizeof(head));
+  memcpy(out + 5, trackerUUIDRaw, 16);
+  uint8_t nameLen = strlen(bleConfig.name);
+  if (nameLen > 29) nameLen = 29;                                                      // 31 octets de réponse au scan
+  out[21] = nameLen + 1;
+  out[22] = 0x09;                                                                      // Nom complet
+  memcpy(out + 23, bleConfig.name, nameLen);
+  return 23 + nameLen;
+}
 
-  pBLEScan->clearResults();   // delete results fromBLEScan buffer to release memory
-  MYDEBUG_PRINTLN("-BLE Client : Scan terminé");
-  delay(512);
+/**
+   Vérification, avant le démarrage du scan, que notre propre annonce donne bien une rencontre :
+   filtre, annuaire des noms puis table des rencontres, qui est vidée ensuite
+   \return false si une étape perd l'annonce (nom absent ou tronqué, annuaire ou table pleine)
+*/
+bool bleAdvertCheck() {
+  uint8_t adv[62];
+  uint8_t len = bleOwnAdvert(adv);
+  char name[BLE_NAME_LEN];
+  AdvRecord r = {};
+  r.ms = millis();
+  if (!bleAdvIsTracker(adv, len, name, sizeof(name)) || strcmp(name, bleConfig.name) != 0) {
+    LOG_E("-BLE Client : Annonce de %s non reconnue", bleConfig.name);
+    return false;
+  }
+  uint32_t hash = positiveHash(name);
+  if (hash == 0) hash = 1;
+  if (bleNameStore(hash, name, r.ms)) {
+    r.nameHash = hash;
+  }
+  uint32_t sightings = encounterSightings;
+  uint32_t newPeerAt = scanNewPeerAt;
+  Encounter *e = encounterSighting(r);
+  bool ok = e != NULL;
+  if (e) {
+    encounterRemove(e - encounters);
+  }
+  encounterSightings = sightings;
+  scanNewPeerAt = newPeerAt;
+  if (!ok) {
+    LOG_E("-BLE Client : Annonce de %s sans rencontre", bleConfig.name);
+  }
+  return ok;
 }
 
 /**
    Configuration du client BLE
-   - Initialisation de l'objet qui va scanner
-   - Association d'un callback
-   - Activation du scan
+   - Initialisation de la pile Bluetooth, si le serveur ne l'a pas déjà fait
+   - Association de notre gestionnaire GAP qui filtre les annonces brutes
+   - Vérification du chemin annonce -> rencontre sur notre propre annonce
+   - Activation du scan continu
 */
 void setupBLEClient() {
   MYDEBUG_PRINTLN("-BLE Client : Démarrage");
-  BLEDevice::init("");
-  pBLEScan = BLEDevice::getScan(); //create new scan
-  pBLEScan->setAdvertisedDeviceCallbacks(new MyAdvertisedDeviceCallbacks());
-  pBLEScan->setActiveScan(false); //active scan uses more power, but get results faster
-  pBLEScan->setInterval(50);
-  pBLEScan->setWindow(49);  // less or equal setInterval value
+  if (!bleBegin()) {
+    return;
+  }
+  bleParseUUID(SERVICE_UUID, trackerUUIDRaw);
+  BLEDevice::setCustomGapHandler(bleGapHandler);
+  bleAdvertCheck();
+  startBLEScan();
+  bleJobPoll = timerPoll("ble", 10, 5, TIMER_PRIO_HIGH, pollBLEClient);
+  bleJobExpire = timerEvery("ble.expire", 1000, bleExpireJob);
   MYDEBUG_PRINTLN("-BLE Client : Démarré");
 }
+
+/**
+   Démarrage du BLE selon bleConfig : une seule initialisation de la pile, puis les rôles demandés
+*/
+void setupBLE() {
+  if (!bleBegin()) {
+    return;
+  }
+  if (bleConfig.advertise) {
+    setupBLEServer();
+  }
+  if (bleConfig.scan) {
+    setupBLEClient();
+  }
+}
+
+/**
+   Mesure du coût du filtre sur des annonces types, en cycles CPU par annonce
+*/
+void bleFilterBenchmark() {
+  uint8_t tracker[62];
+  uint8_t trackerLen = bleOwnAdvert(tracker);
+  const uint8_t beacon[30] = { 0x02, 0x01, 0x06, 0x1A, 0xFF, 0x4C, 0x00, 0x02, 0x15,   // iBeacon
+                               0xE2, 0xC5, 0x6D, 0xB5, 0xDF, 0xFB, 0x48, 0xD2, 0xB0, 0x60, 0xD0, 0xF5, 0xA7, 0x10, 0x96, 0xE0,
+                               0x00, 0x01, 0x00, 0x02, 0xC5 };
+  const uint8_t other128[21] = { 0x02, 0x01, 0x06, 0x11, 0x07,                          // Autre service 128 bits
+                                 0x9E, 0xCA, 0xDC, 0x24, 0x0E, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x01, 0x00, 0x40, 0x6E };
+  const uint8_t *samples[] = { tracker, beacon, other128 };
+  const uint8_t lengths[] = { trackerLen, 30, 21 };
+  const char *labels[] = { "tracker", "iBeacon", "autre UUID 128" };
+  char name[BLE_NAME_LEN];
+  for (int s = 0; s < 3; s++) {
+    uint32_t start = ESP.getCycleCount();
+    for (int n = 0; n < 1000; n++) {
+      bleAdvIsTracker(samples[s], lengths[s], name, sizeof(name));
+    }
+    uint32_t cycles = (ESP.getCycleCount() - start) / 1000;
+    MYDEBUG_PRINT("-BLE Client : Filtre ");
+    MYDEBUG_PRINT(labels[s]);
+    MYDEBUG_PRINT(" : ");
+    MYDEBUG_PRINT(cycles);
+    MYDEBUG_PRINTLN(" cycles");
+  }
+}
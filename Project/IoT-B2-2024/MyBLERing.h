@@ -0,0 +1,452 @@
+/**
+ * \file MyBLERing.h
+ * \page blering File des annonces BLE
+ * \brief Scanner en continu sans accumuler les résultats du scan
+ *
+ * Le scan BLE d'origine bloquait loop() pendant 2 secondes et gardait en mémoire chaque appareil
+ * trouvé jusqu'à la fin du scan : avec beaucoup d'appareils à proximité, la mémoire ne suffisait plus
+ * et la carte plantait.
+ *
+ * Le scan tourne maintenant en continu dans la tâche de la pile Bluetooth, sans garder les résultats.
+ * Pour chaque annonce reçue, la callback se contente de copier un enregistrement compact
+ * (adresse, RSSI, date, hash du nom) dans une file circulaire de taille fixe :
+ * - un seul producteur (la tâche Bluetooth) et un seul consommateur (loop()), la file est donc
+ *   sans verrou : le producteur n'écrit que la tête, le consommateur que la queue,
+ * - si la file est pleine, l'annonce est perdue et comptée, rien n'est alloué,
+ * - le nom de l'appareil n'est copié qu'une fois dans un annuaire (hash -> nom), lui aussi
+ *   écrit uniquement par le producteur.
+ *
+ * L'annuaire garde le nom complet : une annonce dont le nom a le même hash qu'un autre nom déjà
+ * connu est comptée (bleNameCollisions) et traitée comme une annonce sans nom, plutôt que d'être
+ * attribuée à la mauvaise carte. Quand l'annuaire est plein, le producteur réutilise l'entrée vue
+ * le moins récemment parmi celles qu'aucune rencontre en cours (\ref encounter) ne marque
+ * (bleNameHold()). Le consommateur lit un nom par copie (bleNameCopy()), protégée par un compteur
+ * de génération que le producteur rend impair pendant la réécriture d'une entrée.
+ *
+ * bleRingStress() simule un environnement de N appareils (500 par défaut) en injectant des annonces
+ * par le même chemin que la callback, depuis une tâche sur le core 0, pendant que loop() vide la file.
+ * Chaque annonce porte son numéro : le consommateur vérifie l'ordre, le contenu et que les numéros
+ * manquants correspondent exactement aux annonces perdues.
+ * Pour la lancer, décommenter l'appel dans setup(), avant setupBLE() : la file n'accepte
+ * qu'un seul producteur à la fois. L'annuaire est copié avant le test et rétabli après.
+ *
+ * Fichier \ref MyBLERing.h
+ */
+
+#include <atomic>
+
+#define BLE_RING_SIZE       256     // Taille de la file, puissance de 2
+#define BLE_NAME_DIR_SIZE   128     // Taille de l'annuaire des noms, puissance de 2
+#define BLE_NAME_LEN        30      // Longueur maximale d'un nom BLE (29 octets + '\0')
+#define BLE_DRAIN_MAX       64      // Nombre maximum d'annonces traitées par appel à bleRingDrain()
+
+/* Une annonce BLE reçue */
+struct AdvRecord {
+    uint8_t addr[6];
+    int8_t rssi;
+    uint8_t flags;
+    uint32_t ms;                    // Date de réception (millis)
+    uint32_t nameHash;              // 0 si l'appareil n'a pas de nom
+};
+
+/* Une entrée de l'annuaire des noms
+ * - hash : 0 si l'entrée n'a jamais servi
+ * - gen : impair pendant la réécriture de l'entrée par le producteur
+ * - lastSeen : date de la dernière annonce portant ce nom, pour choisir l'entrée à réutiliser
+ * - held : hash marqué par une rencontre en cours (écrit par le consommateur), 0 si aucune
+ */
+struct BleName {
+    std::atomic<uint32_t> hash;
+    std::atomic<uint32_t> gen;
+    std::atomic<uint32_t> lastSeen;
+    std::atomic<uint32_t> held;
+    char name[BLE_NAME_LEN];
+};
+
+AdvRecord bleRing[BLE_RING_SIZE];
+std::atomic<uint16_t> bleRingHead(0);   // Ecrit par le producteur
+std::atomic<uint16_t> bleRingTail(0);   // Ecrit par le consommateur
+BleName bleNames[BLE_NAME_DIR_SIZE];
+
+// Statistiques de la file
+uint32_t bleAdvReceived = 0;        // Annonces reçues
+uint32_t bleAdvDropped = 0;         // Annonces perdues, file pleine
+uint16_t bleRingHighWater = 0;      // Remplissage maximum de la file
+// Statistiques de l'annuaire
+uint32_t bleNameEvicted = 0;        // Entrées réutilisées pour un autre nom
+uint32_t bleNameCollisions = 0;     // Noms différents de même hash, annonces traitées sans nom
+uint32_t bleNameFull = 0;           // Noms non enregistrés, toutes les entrées marquées
+
+/**
+ * Enregistrement d'un nom dans l'annuaire (producteur uniquement)
+ * \param ms date de l'annonce
+ * \return false si le nom n'a pas pu être enregistré sous ce hash
+ */
+bool bleNameStore(uint32_t hash, const char *name, uint32_t ms) {
+    int freeSlot = -1;
+    int oldest = -1;
+    for (int n = 0; n < BLE_NAME_DIR_SIZE; n++) {
+        int slot = (hash + n) & (BLE_NAME_DIR_SIZE - 1);
+        BleName &e = bleNames[slot];
+        uint32_t h = e.hash.load(std::memory_order_relaxed);
+        if (h == hash) {
+            if (strncmp(e.name, name, BLE_NAME_LEN - 1) != 0) {
+                bleNameCollisions++;
+                return false;
+            }
+            e.lastSeen.store(ms, std::memory_order_relaxed);
+            return true;
+        }
+        if (h == 0) {
+            freeSlot = slot;            // Fin de la chaîne : le nom n'est pas plus loin
+            break;
+        }
+        if (e.held.load(std::memory_order_acquire) != h &&
+            (oldest < 0 || (int32_t)(e.lastSeen.load(std::memory_order_relaxed) -
+                                     bleNames[oldest].lastSeen.load(std::memory_order_relaxed)) < 0)) {
+            oldest = slot;
+        }
+    }
+    int slot = freeSlot >= 0 ? freeSlot : oldest;
+    if (slot < 0) {
+        bleNameFull++;
+        return false;
+    }
+    BleName &e = bleNames[slot];
+    if (freeSlot < 0) {
+        bleNameEvicted++;
+    }
+    e.gen.fetch_add(1, std::memory_order_relaxed);          // Impair : réécriture en cours
+    std::atomic_thread_fence(std::memory_order_release);
+    strncpy(e.name, name, BLE_NAME_LEN - 1);
+    e.name[BLE_NAME_LEN - 1] = '\0';
+    e.lastSeen.store(ms, std::memory_order_relaxed);
+    e.hash.store(hash, std::memory_order_relaxed);
+    e.gen.fetch_add(1, std::memory_order_release);          // Pair : entrée publiée
+    return true;
+}
+
+/**
+ * Recherche de l'entrée d'un hash, -1 s'il n'est pas (ou plus) dans l'annuaire
+ */
+int bleNameFind(uint32_t hash) {
+    if (hash == 0) {
+        return -1;
+    }
+    for (int n = 0; n < BLE_NAME_DIR_SIZE; n++) {
+        int slot = (hash + n) & (BLE_NAME_DIR_SIZE - 1);
+        uint32_t h = bleNames[slot].hash.load(std::memory_order_acquire);
+        if (h == hash) {
+            return slot;
+        }
+        if (h == 0) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Nom associé à un hash, NULL s'il n'est pas (ou plus) connu. Le pointeur reste valide, mais
+ * l'entrée peut être réutilisée ensuite pour un autre nom : à réserver aux journaux, utiliser
+ * bleNameCopy() pour garder le nom.
+ */
+const char *bleNameLookup(uint32_t hash) {
+    int slot = bleNameFind(hash);
+    return slot < 0 ? NULL : bleNames[slot].name;
+}
+
+/**
+ * Copie du nom associé à un hash (consommateur)
+ * \return false si le nom n'est pas (ou plus) connu, out est alors vide
+ */
+bool bleNameCopy(uint32_t hash, char *out, size_t size) {
+    out[0] = '\0';
+    int slot = bleNameFind(hash);
+    if (slot < 0) {
+        return false;
+    }
+    BleName &e = bleNames[slot];
+    for (int tries = 0; tries < 4; tries++) {
+        uint32_t gen = e.gen.load(std::memory_order_acquire);
+        if (gen & 1) {
+            continue;                   // Réécriture en cours
+        }
+        if (e.hash.load(std::memory_order_relaxed) != hash) {
+            break;                      // Entrée réutilisée pour un autre nom
+        }
+        strncpy(out, e.name, size - 1);
+        out[size - 1] = '\0';
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (e.gen.load(std::memory_order_relaxed) == gen) {
+            return true;
+        }
+    }
+    out[0] = '\0';
+    return false;
+}
+
+/**
+ * Marquage d'un nom par une rencontre en cours (consommateur) : son entrée n'est pas réutilisée
+ * \param hold false à la fin de la rencontre
+ */
+void bleNameHold(uint32_t hash, bool hold) {
+    int slot = bleNameFind(hash);
+    if (slot < 0) {
+        return;
+    }
+    if (hold) {
+        bleNames[slot].held.store(hash, std::memory_order_release);
+    } else {
+        uint32_t expected = hash;       // Entrée réutilisée entre temps : son marque n'est pas la nôtre
+        bleNames[slot].held.compare_exchange_strong(expected, 0, std::memory_order_release);
+    }
+}
+
+/**
+ * Fin de tous les marquages (consommateur), cf. encounterClear()
+ */
+void bleNameReleaseAll() {
+    for (int n = 0; n < BLE_NAME_DIR_SIZE; n++) {
+        bleNames[n].held.store(0, std::memory_order_release);
+    }
+}
+
+/* Copie d'une entrée de l'annuaire, cf. bleNameSave() */
+struct BleNameSaved {
+    uint32_t hash;
+    uint32_t lastSeen;
+    uint32_t held;
+    char name[BLE_NAME_LEN];
+};
+
+/**
+ * Copie de l'annuaire dans saved, de BLE_NAME_DIR_SIZE entrées, déjà alloué (aucun producteur actif)
+ */
+void bleNameSaveTo(BleNameSaved *saved) {
+    for (int n = 0; n < BLE_NAME_DIR_SIZE; n++) {
+        saved[n].hash = bleNames[n].hash.load(std::memory_order_relaxed);
+        saved[n].lastSeen = bleNames[n].lastSeen.load(std::memory_order_relaxed);
+        saved[n].held = bleNames[n].held.load(std::memory_order_relaxed);
+        memcpy(saved[n].name, bleNames[n].name, BLE_NAME_LEN);
+    }
+}
+
+/**
+ * Copie de l'annuaire, avant un test qui le remplit de noms simulés (aucun producteur actif)
+ * \return la copie, à rendre à bleNameRestore(), NULL si la mémoire est insuffisante
+ */
+BleNameSaved *bleNameSave() {
+    BleNameSaved *saved = (BleNameSaved *)malloc(BLE_NAME_DIR_SIZE * sizeof(BleNameSaved));
+    if (!saved) {
+        return NULL;
+    }
+    bleNameSaveTo(saved);
+    return saved;
+}
+
+/**
+ * Retour à l'annuaire copié par bleNameSave() (aucun producteur actif), puis libération de la copie
+ */
+void bleNameRestore(BleNameSaved *saved) {
+    for (int n = 0; n < BLE_NAME_DIR_SIZE; n++) {
+        BleName &e = bleNames[n];
+        e.gen.fetch_add(1, std::memory_order_relaxed);      // Impair : réécriture en cours
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(e.name, saved[n].name, BLE_NAME_LEN);
+        e.lastSeen.store(saved[n].lastSeen, std::memory_order_relaxed);
+        e.held.store(saved[n].held, std::memory_order_relaxed);
+        e.hash.store(saved[n].hash, std::memory_order_relaxed);
+        e.gen.fetch_add(1, std::memory_order_release);      // Pair : entrée publiée
+    }
+    free(saved);
+}
+
+/**
+ * Ajout d'une annonce dans la file (producteur uniquement), sans allocation
+ * \param ms date de réception
+ * \return false si la file est pleine et que l'annonce est perdue
+ */
+bool bleRingPush(const uint8_t *addr, int8_t rssi, const char *name, uint32_t ms) {
+    bleAdvReceived++;
+    uint16_t head = bleRingHead.load(std::memory_order_relaxed);
+    uint16_t tail = bleRingTail.load(std::memory_order_acquire);
+    uint16_t used = head - tail;
+    if (used >= BLE_RING_SIZE) {
+        bleAdvDropped++;
+        return false;
+    }
+    if (used + 1 > bleRingHighWater) {
+        bleRingHighWater = used + 1;
+    }
+    AdvRecord &r = bleRing[head & (BLE_RING_SIZE - 1)];
+    memcpy(r.addr, addr, 6);
+    r.rssi = rssi;
+    r.flags = 0;
+    r.ms = ms;
+    r.nameHash = 0;
+    if (name && name[0]) {
+        uint32_t hash = positiveHash(name);
+        if (hash == 0) hash = 1;
+        if (bleNameStore(hash, name, ms)) {
+            r.nameHash = hash;
+        }
+    }
+    bleRingHead.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+/**
+ * Retrait de la plus ancienne annonce de la file (consommateur uniquement)
+ * \return false si la file est vide
+ */
+bool bleRingPop(AdvRecord &r) {
+    uint16_t tail = bleRingTail.load(std::memory_order_relaxed);
+    if (tail == bleRingHead.load(std::memory_order_acquire)) {
+        return false;
+    }
+    r = bleRing[tail & (BLE_RING_SIZE - 1)];
+    bleRingTail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+/**
+ * Traitement des annonces en attente, au plus max par appel pour ne pas bloquer loop()
+ * \return le nombre d'annonces traitées
+ */
+int bleRingDrain(void (*handler)(const AdvRecord &), int max) {
+    AdvRecord r;
+    int n = 0;
+    while (n < max && bleRingPop(r)) {
+        handler(r);
+        n++;
+    }
+    return n;
+}
+
+/************************** Test de charge ***********************************/
+
+volatile bool bleStressRunning = false;
+uint16_t bleStressAdvertisers = 0;
+uint32_t bleStressDurationMs = 0;
+uint32_t bleStressConsumed = 0;
+uint32_t bleStressNext = 0;         // Numéro attendu de la prochaine annonce
+uint32_t bleStressGaps = 0;         // Numéros sautés : doit être égal au nombre d'annonces perdues
+uint32_t bleStressOrderErrors = 0;  // Annonces reçues dans le désordre ou en double
+uint32_t bleStressPayloadErrors = 0; // Annonces dont le contenu ne correspond pas à leur numéro
+
+/**
+ * Contenu de l'annonce numéro seq, recalculé à l'identique par le producteur et le consommateur
+ */
+uint16_t bleStressDevice(uint32_t seq) {
+    return seq % bleStressAdvertisers;
+}
+
+int8_t bleStressRssi(uint32_t seq) {
+    return -40 - (int8_t)(seq % 60);
+}
+
+/**
+ * Tâche productrice du test de charge : chaque appareil simulé émet 10 annonces par seconde.
+ * Le numéro de l'annonce remplace sa date de réception (champ ms), le consommateur peut ainsi
+ * vérifier l'ordre et le contenu de chaque enregistrement.
+ */
+void bleStressTask(void *parameter) {
+    unsigned long start = millis();
+    uint8_t addr[6] = { 0x24, 0x0A, 0xC4, 0, 0, 0 };
+    char name[BLE_NAME_LEN];
+    uint32_t sent = 0;
+    while (millis() - start < bleStressDurationMs) {
+        // Nombre d'annonces qui auraient dû être émises depuis le début
+        uint32_t due = (millis() - start) * bleStressAdvertisers / 100;
+        while (sent < due) {
+            uint16_t dev = bleStressDevice(sent);
+            addr[4] = dev >> 8;
+            addr[5] = dev & 0xFF;
+            snprintf(name, sizeof(name), "SIM-%u", dev);
+            bleRingPush(addr, bleStressRssi(sent), (dev % 4 == 0) ? name : NULL, sent);
+            sent++;
+        }
+        delay(1);
+    }
+    bleStressRunning = false;
+    vTaskDelete(NULL);
+}
+
+/**
+ * Vérification d'une annonce du test de charge : numéro croissant, adresse, RSSI et nom
+ * conformes à ce que le producteur a écrit pour ce numéro
+ */
+void bleStressCheck(const AdvRecord &r) {
+    bleStressConsumed++;
+    uint32_t seq = r.ms;
+    if (seq < bleStressNext) {
+        bleStressOrderErrors++;
+        return;
+    }
+    bleStressGaps += seq - bleStressNext;
+    bleStressNext = seq + 1;
+
+    uint16_t dev = bleStressDevice(seq);
+    char name[BLE_NAME_LEN];
+    snprintf(name, sizeof(name), "SIM-%u", dev);
+    uint32_t hash = positiveHash(name);
+    if (hash == 0) hash = 1;
+    // Nom absent admis : annuaire plein ou collision, déjà comptés par bleNameStore()
+    bool nameOk = r.nameHash == 0 || (dev % 4 == 0 && r.nameHash == hash);
+    if (r.addr[0] != 0x24 || r.addr[1] != 0x0A || r.addr[2] != 0xC4 || r.addr[3] != 0 ||
+        r.addr[4] != (dev >> 8) || r.addr[5] != (dev & 0xFF) ||
+        r.rssi != bleStressRssi(seq) || r.flags != 0 || !nameOk) {
+        bleStressPayloadErrors++;
+    }
+}
+
+/**
+ * Test de charge de la file : advertisers appareils simulés pendant durationMs millisecondes.
+ * Le consommateur vide la file comme le ferait loop(), toutes les 10 ms, et vérifie chaque
+ * enregistrement (bleStressCheck()).
+ */
+void bleRingStress(uint16_t advertisers = 500, uint32_t durationMs = 10000) {
+    MYDEBUG_PRINT("-BLE Ring : Test de charge avec ");
+    MYDEBUG_PRINT(advertisers);
+    MYDEBUG_PRINTLN(" appareils");
+    BleNameSaved *names = bleNameSave();    // Les noms SIM-n ne doivent pas chasser ceux des vraies cartes
+    if (!names) {
+        MYDEBUG_PRINTLN("-BLE Ring : Mémoire insuffisante");
+        return;
+    }
+    uint32_t heapBefore = ESP.getFreeHeap();
+    uint32_t received = bleAdvReceived;
+    uint32_t dropped = bleAdvDropped;
+    bleStressAdvertisers = advertisers;
+    bleStressDurationMs = durationMs;
+    bleStressConsumed = 0;
+    bleStressNext = 0;
+    bleStressGaps = 0;
+    bleStressOrderErrors = 0;
+    bleStressPayloadErrors = 0;
+    bleStressRunning = true;
+    xTaskCreatePinnedToCore(bleStressTask, "bleStress", 4096, NULL, 1, NULL, 0);
+    while (bleStressRunning) {
+        bleRingDrain(bleStressCheck, BLE_DRAIN_MAX);
+        delay(10);
+    }
+    while (bleRingDrain(bleStressCheck, BLE_DRAIN_MAX) > 0) {}
+
+    uint32_t sent = bleAdvReceived - received;
+    uint32_t lost = bleAdvDropped - dropped;
+    // Les annonces perdues en fin de test ne laissent pas de trou avant la dernière reçue
+    uint32_t gaps = bleStressGaps + (sent - bleStressNext);
+    char line[160];
+    snprintf(line, sizeof(line), "-BLE Ring : %lu annonces, %lu traitées, %lu perdues, file max %u/%u, tas %ld octets",
+             (unsigned long)sent, (unsigned long)bleStressConsumed,
+             (unsigned long)lost, bleRingHighWater, BLE_RING_SIZE,
+             (long)ESP.getFreeHeap() - (long)heapBefore);
+    MYDEBUG_PRINTLN(line);
+    snprintf(line, sizeof(line), "-BLE Ring : %lu hors d'ordre, %lu contenus faux, %lu numéros manquants%s",
+             (unsigned long)bleStressOrderErrors, (unsigned long)bleStressPayloadErrors, (unsigned long)gaps,
+             (bleStressOrderErrors == 0 && bleStressPayloadErrors == 0 && gaps == lost &&
+              bleStressConsumed + lost == sent) ? " : OK" : " : ERREUR");
+    MYDEBUG_PRINTLN(line);
+    bleNameRestore(names);
+}
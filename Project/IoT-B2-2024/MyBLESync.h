@@ -0,0 +1,449 @@
+/**
+ * \file MyBLESync.h
+ * \page blesync Echange de la liste des positifs en BLE
+ * \brief Synchroniser la liste des positifs de carte à carte, sans réseau
+ *
+ * Le service SERVICE_UUID publié par setupBLEServer() ne proposait aucune caractéristique : une carte
+ * n'apprenait les positifs que par Adafruit IO, donc uniquement avec le WiFi.
+ *
+ * Le service propose maintenant une caractéristique POSITIVE_CHAR_UUID (lecture, écriture, notification) :
+ * - en lecture, elle renvoie le condensat de la liste locale des positifs (cf. \ref positivesync) :
+ *   [protocole 1][version 4][nombre d'entrées 2][digest 16 x 2], 39 octets, entiers en petit boutiste,
+ * - le client y écrit une requête [protocole 1][MTU 2][version 4][digest 16 x 2], avec sa propre
+ *   version et son propre digest,
+ * - le serveur répond par notifications avec les entrées qui manquent probablement au client, au format
+ *   texte du feed data.positivelist ("P:seq:id\n"), découpées en morceaux de MTU - 3 octets :
+ *   [numéro du morceau 1][drapeaux 1][données]. Le drapeau BLE_SYNC_LAST marque le dernier morceau.
+ *
+ * Quand une nouvelle carte est détectée (première annonce d'une rencontre), la carte s'y connecte en
+ * client, depuis une tâche sur le core 0 pour ne pas bloquer loop(), lit son digest et ne demande les
+ * entrées que si les digests diffèrent. Une même carte n'est pas resynchronisée avant BLE_SYNC_PEER_MS.
+ * Le scan est suspendu pendant la connexion.
+ *
+ * La liaison BLE n'est ni authentifiée ni chiffrée : n'importe quel appareil peut publier ce service
+ * et annoncer de faux positifs. Les entrées inconnues reçues en BLE ne sont donc pas ajoutées à la
+ * liste mais gardées comme positifs provisoires (cf. \ref positivesync) : sans réseau, si l'une d'elles
+ * est un de nos contacts directs, la carte signale une exposition non confirmée (\ref yct). La carte
+ * demande aussi un rattrapage sur Adafruit IO (requestPositiveSync(), au plus une fois par
+ * BLE_SYNC_CATCHUP_MS), dont la liste vient du broker authentifié par TLS (\ref tls) : c'est lui qui
+ * confirme ou infirme les positifs provisoires dès que le réseau est là.
+ *
+ * Le MTU demandé est BLE_SYNC_MTU : avec le MTU par défaut (23 octets), un morceau ne transporte que
+ * 18 octets de données. Le MTU obtenu, les temps de connexion et de transfert et le débit de la dernière
+ * synchronisation sont visibles sur /stats ; bleSyncChunkBenchmark() compare le découpage de la liste
+ * locale pour différents MTU.
+ *
+ * Fichier \ref MyBLESync.h
+ */
+
+#include <BLEDevice.h>
+#include <BLEServer.h>
+#include <BLE2902.h>
+#include <atomic>
+
+#define POSITIVE_CHAR_UUID  "436f6e74-6163-7420-5472-61636b657201" // Caractéristique de la liste des positifs
+#define BLE_SYNC_PROTO      1       // Version du protocole
+#define BLE_SYNC_MTU        185     // MTU demandé à la connexion
+#define BLE_SYNC_DIGEST_LEN (7 + 2 * POSITIVE_SYNC_BUCKETS)  // Taille du digest comme de la requête
+#define BLE_SYNC_BUF        (POSITIVE_SYNC_MAX * (POSITIVE_SYNC_ID_LEN + 14))  // Liste complète au format texte
+#define BLE_SYNC_LAST       0x01    // Drapeau du dernier morceau
+#define BLE_SYNC_PEER_MS    600000  // Délai minimum entre deux synchronisations avec la même carte
+#define BLE_SYNC_PEERS      8       // Nombre de cartes synchronisées récemment dont on se souvient
+#define BLE_SYNC_TIMEOUT_MS 5000    // Durée maximale d'une synchronisation
+#define BLE_SYNC_STACK      6144    // Pile de la tâche de synchronisation, cf. pipe.blesync_stack_free
+#define BLE_SYNC_CHUNKS     4       // Nombre maximum de morceaux notifiés par appel à loopBLESync()
+#define BLE_SYNC_CATCHUP_MS 60000   // Délai minimum entre deux rattrapages MQTT demandés par le BLE
+
+/* Une carte synchronisée récemment */
+struct BleSyncPeer {
+    uint32_t peer;                  // Hash du nom, 0 si libre
+    uint32_t at;                    // millis
+};
+
+BLECharacteristic *bleSyncChar = NULL;
+uint8_t bleSyncDigest[BLE_SYNC_DIGEST_LEN];     // Valeur renvoyée en lecture, mise à jour par loop()
+uint32_t bleSyncDigestVersion = 0xFFFFFFFF;
+uint32_t bleSyncDigestAdded = 0xFFFFFFFF;
+
+// Côté serveur : requête reçue (tâche Bluetooth) puis réponse envoyée par loop()
+uint8_t bleSyncRequest[BLE_SYNC_DIGEST_LEN];
+std::atomic<bool> bleSyncRequestPending(false);
+char bleSyncTx[BLE_SYNC_BUF];
+int bleSyncTxLen = 0;
+int bleSyncTxPos = -1;              // -1 : aucune réponse en cours
+uint8_t bleSyncTxIndex = 0;
+uint16_t bleSyncTxChunk = 0;        // Données par morceau
+
+// Côté client : synchronisation menée par une tâche sur le core 0
+BleSyncPeer bleSyncPeers[BLE_SYNC_PEERS];
+uint8_t bleSyncTarget[6];
+uint8_t bleSyncLocal[BLE_SYNC_DIGEST_LEN];      // Notre requête, préparée par loop()
+char bleSyncRx[BLE_SYNC_BUF];
+volatile int bleSyncRxLen = 0;
+volatile int bleSyncRxNext = 0;     // Numéro du prochain morceau attendu
+volatile bool bleSyncRxDone = false;
+volatile bool bleSyncRxError = false;
+volatile bool bleSyncFinished = false;  // Résultat à traiter par loop()
+
+// Statistiques
+uint32_t bleSyncSessions = 0;       // Synchronisations menées en client
+uint32_t bleSyncUpToDate = 0;       // dont digests identiques, rien à transférer
+uint32_t bleSyncFailed = 0;         // dont échecs (connexion, service absent, délai dépassé)
+uint32_t bleSyncHints = 0;          // Positifs inconnus annoncés en BLE, gardés comme provisoires
+uint32_t bleSyncCatchups = 0;       // Rattrapages MQTT demandés suite à une synchronisation BLE
+unsigned long bleSyncCatchupAt = 0; // Date du dernier rattrapage demandé, 0 si aucun
+uint32_t bleSyncServed = 0;         // Requêtes servies en serveur
+uint32_t bleSyncBytesRx = 0;        // Octets de données reçus en notification
+uint32_t bleSyncBytesTx = 0;        // Octets de données envoyés en notification
+uint32_t bleSyncStackFree = 0;      // Plus petite marge de pile de la tâche de synchronisation, en octets
+uint16_t bleSyncLastMtu = 0;
+uint32_t bleSyncLastConnectMs = 0;
+uint32_t bleSyncLastTransferMs = 0;
+uint32_t bleSyncLastBps = 0;        // Débit utile de la dernière synchronisation, octets par seconde
+
+/**
+ * Ecriture d'un entier en petit boutiste
+ */
+void bleSyncPut(uint8_t *out, uint32_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        out[i] = value >> (8 * i);
+    }
+}
+
+uint32_t bleSyncGet(const uint8_t *in, int bytes) {
+    uint32_t value = 0;
+    for (int i = bytes - 1; i >= 0; i--) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+/**
+ * Digest de la liste locale, 16 seaux de 2 octets
+ */
+void bleSyncPutDigest(uint8_t *out) {
+    uint16_t digest[POSITIVE_SYNC_BUCKETS];
+    positiveDigest(digest);
+    for (int b = 0; b < POSITIVE_SYNC_BUCKETS; b++) {
+        bleSyncPut(out + 2 * b, digest[b], 2);
+    }
+}
+
+/**
+ * Valeur de la caractéristique en lecture : [protocole][version][nombre d'entrées][digest]
+ */
+void bleSyncEncodeDigest(uint8_t *out) {
+    out[0] = BLE_SYNC_PROTO;
+    bleSyncPut(out + 1, positiveVersion, 4);
+    bleSyncPut(out + 5, positiveCount, 2);
+    bleSyncPutDigest(out + 7);
+}
+
+/**
+ * Requête du client : [protocole][MTU][version][digest]
+ */
+void bleSyncEncodeRequest(uint8_t *out, uint16_t mtu) {
+    out[0] = BLE_SYNC_PROTO;
+    bleSyncPut(out + 1, mtu, 2);
+    bleSyncPut(out + 3, positiveVersion, 4);
+    bleSyncPutDigest(out + 7);
+}
+
+/**
+ * Entrées qui manquent probablement à une carte de version et de digest donnés, au format "P:seq:id\n"
+ * \return la taille du texte
+ */
+int bleSyncEncodeDelta(uint32_t version, const uint8_t *theirs, char *out, int size) {
+    uint16_t ours[POSITIVE_SYNC_BUCKETS];
+    positiveDigest(ours);
+    int n = 0;
+    for (int i = 0; i < positiveCount && n < size; i++) {
+        const PositiveEntry &e = positiveTable[i];
+        int b = e.hash % POSITIVE_SYNC_BUCKETS;
+        if (e.seq > version || ours[b] != bleSyncGet(theirs + 2 * b, 2)) {
+            int len = positiveSyncFormatEntry(e, out + n, size - n);
+            if (n + len + 1 >= size) {
+                break;
+            }
+            n += len;
+            out[n++] = '\n';
+        }
+    }
+    return n;
+}
+
+/************************** Serveur ******************************************/
+
+/* Callbacks de la caractéristique, appelées dans la tâche Bluetooth */
+class BleSyncCharCallbacks : public BLECharacteristicCallbacks {
+    void onRead(BLECharacteristic *c) {
+        c->setValue(bleSyncDigest, BLE_SYNC_DIGEST_LEN);
+    }
+    void onWrite(BLECharacteristic *c) {
+        if (c->getLength() < BLE_SYNC_DIGEST_LEN || c->getData()[0] != BLE_SYNC_PROTO || bleSyncRequestPending) {
+            return;
+        }
+        memcpy(bleSyncRequest, c->getData(), BLE_SYNC_DIGEST_LEN);
+        bleSyncRequestPending = true;
+    }
+};
+
+/* Callbacks du serveur : l'advertising s'arrête à chaque connexion, on le relance à la déconnexion */
+class BleSyncServerCallbacks : public BLEServerCallbacks {
+    void onDisconnect(BLEServer *s) {
+        bleSyncTxPos = -1;
+        BLEDevice::startAdvertising();
+    }
+};
+
+/**
+ * Ajout de la caractéristique au service, avant son démarrage (appelée par setupBLEServer())
+ */
+void bleSyncAddCharacteristic(BLEServer *pServer, BLEService *pService) {
+    BLEDevice::setMTU(BLE_SYNC_MTU);
+    bleSyncChar = pService->createCharacteristic(POSITIVE_CHAR_UUID,
+        BLECharacteristic::PROPERTY_READ | BLECharacteristic::PROPERTY_WRITE | BLECharacteristic::PROPERTY_NOTIFY);
+    bleSyncChar->addDescriptor(new BLE2902());
+    bleSyncChar->setCallbacks(new BleSyncCharCallbacks());
+    pServer->setCallbacks(new BleSyncServerCallbacks());
+}
+
+/**
+ * Envoi de la réponse en cours, quelques morceaux à la fois
+ */
+void bleSyncServe() {
+    if (bleSyncTxPos < 0 && bleSyncRequestPending) {
+        uint16_t mtu = bleSyncGet(bleSyncRequest + 1, 2);
+        if (mtu > BLE_SYNC_MTU) mtu = BLE_SYNC_MTU;
+        if (mtu < 23) mtu = 23;
+        bleSyncTxChunk = mtu - 3 - 2;
+        bleSyncTxLen = bleSyncEncodeDelta(bleSyncGet(bleSyncRequest + 3, 4), bleSyncRequest + 7, bleSyncTx, sizeof(bleSyncTx));
+        bleSyncTxPos = 0;
+        bleSyncTxIndex = 0;
+        bleSyncServed++;
+        bleSyncRequestPending = false;
+        LOG_I("-BLE Sync : Requête reçue, octets à envoyer : %d", bleSyncTxLen);
+    }
+    uint8_t chunk[BLE_SYNC_MTU];
+    for (int n = 0; n < BLE_SYNC_CHUNKS && bleSyncTxPos >= 0; n++) {
+        int len = bleSyncTxLen - bleSyncTxPos;
+        if (len > bleSyncTxChunk) len = bleSyncTxChunk;
+        chunk[0] = bleSyncTxIndex++;
+        chunk[1] = (bleSyncTxPos + len >= bleSyncTxLen) ? BLE_SYNC_LAST : 0;
+        memcpy(chunk + 2, bleSyncTx + bleSyncTxPos, len);
+        bleSyncChar->setValue(chunk, len + 2);
+        bleSyncChar->notify();
+        bleSyncBytesTx += len;
+        bleSyncTxPos = chunk[1] ? -1 : bleSyncTxPos + len;
+    }
+}
+
+/************************** Client *******************************************/
+
+/**
+ * Réception d'un morceau de la réponse (tâche Bluetooth)
+ */
+void bleSyncOnNotify(BLERemoteCharacteristic *c, uint8_t *data, size_t len, bool isNotify) {
+    if (bleSyncRxDone || len < 2) {
+        return;
+    }
+    if (data[0] != (uint8_t)bleSyncRxNext || bleSyncRxLen + (int)len - 2 > BLE_SYNC_BUF) {
+        bleSyncRxError = true;      // Morceau perdu ou réponse trop grande
+        bleSyncRxDone = true;
+        return;
+    }
+    memcpy(bleSyncRx + bleSyncRxLen, data + 2, len - 2);
+    bleSyncRxLen += len - 2;
+    bleSyncRxNext++;
+    if (data[1] & BLE_SYNC_LAST) {
+        bleSyncRxDone = true;
+    }
+}
+
+/**
+ * Synchronisation avec bleSyncTarget, en client : connexion, lecture du digest, requête si besoin
+ * \return false en cas d'échec
+ */
+bool bleSyncPull() {
+    static BLEClient *client = NULL;
+    if (!client) {
+        client = BLEDevice::createClient();
+    }
+    unsigned long start = millis();
+    for (int n = 0; n < 20 && bleScanning; n++) {
+        delay(10);                  // Fin du scan, demandée par bleSyncOffer()
+    }
+    if (!client->connect(BLEAddress(bleSyncTarget))) {
+        return false;
+    }
+    bool ok = false;
+    bleSyncLastConnectMs = millis() - start;
+    bleSyncLastMtu = client->getMTU();
+    BLERemoteService *service = client->getService(SERVICE_UUID);
+    BLERemoteCharacteristic *c = service ? service->getCharacteristic(POSITIVE_CHAR_UUID) : NULL;
+    if (c && c->canRead() && c->canNotify()) {
+        auto digest = c->readValue();
+        const uint8_t *theirs = (const uint8_t *)digest.c_str();
+        if (digest.length() >= BLE_SYNC_DIGEST_LEN && theirs[0] == BLE_SYNC_PROTO &&
+            memcmp(theirs + 7, bleSyncLocal + 7, 2 * POSITIVE_SYNC_BUCKETS) == 0 &&
+            bleSyncGet(theirs + 1, 4) <= bleSyncGet(bleSyncLocal + 3, 4)) {
+            bleSyncUpToDate++;      // Même liste, rien à demander
+            ok = true;
+        } else if (digest.length() >= BLE_SYNC_DIGEST_LEN && theirs[0] == BLE_SYNC_PROTO) {
+            bleSyncPut(bleSyncLocal + 1, bleSyncLastMtu, 2);
+            c->registerForNotify(bleSyncOnNotify);
+            unsigned long transfer = millis();
+            c->writeValue(bleSyncLocal, BLE_SYNC_DIGEST_LEN, true);
+            while (!bleSyncRxDone && millis() - start < BLE_SYNC_TIMEOUT_MS) {
+                delay(10);
+            }
+            bleSyncLastTransferMs = millis() - transfer;
+            bleSyncLastBps = bleSyncLastTransferMs ? bleSyncRxLen * 1000UL / bleSyncLastTransferMs : 0;
+            bleSyncBytesRx += bleSyncRxLen;
+            ok = bleSyncRxDone && !bleSyncRxError;
+        }
+    }
+    client->disconnect();
+    return ok;
+}
+
+/**
+ * Tâche de synchronisation en client, sur le core 0
+ */
+void bleSyncTask(void *parameter) {
+    if (!bleSyncPull()) {
+        bleSyncFailed++;
+        bleSyncRxLen = 0;           // Rien de fiable à intégrer
+    }
+    bleSyncFinished = true;
+    uint32_t stackFree = uxTaskGetStackHighWaterMark(NULL);
+    if (bleSyncStackFree == 0 || stackFree < bleSyncStackFree) bleSyncStackFree = stackFree;
+    vTaskDelete(NULL);
+}
+
+/**
+ * Proposition de synchronisation avec une carte qui vient d'être détectée
+ * Sans effet si une synchronisation est en cours ou si la carte a été synchronisée récemment.
+ */
+void bleSyncOffer(const uint8_t *addr, uint32_t peer) {
+    if (blePaused || bleReplaying || peer == 0) {
+        return;
+    }
+    uint32_t now = millis();
+    int slot = 0;
+    for (int i = 0; i < BLE_SYNC_PEERS; i++) {
+        if (bleSyncPeers[i].peer == peer && now - bleSyncPeers[i].at < BLE_SYNC_PEER_MS) {
+            return;
+        }
+        if (bleSyncPeers[i].at < bleSyncPeers[slot].at) {
+            slot = i;               // La plus ancienne entrée sera remplacée
+        }
+    }
+    bleSyncPeers[slot].peer = peer;
+    bleSyncPeers[slot].at = now;
+
+    LOG_I("-BLE Sync : Synchronisation avec %s", bleNameLookup(peer) ? bleNameLookup(peer) : "?");
+    memcpy(bleSyncTarget, addr, 6);
+    bleSyncEncodeRequest(bleSyncLocal, BLE_SYNC_MTU);
+    bleSyncRxLen = 0;
+    bleSyncRxNext = 0;
+    bleSyncRxDone = false;
+    bleSyncRxError = false;
+    bleSyncFinished = false;
+    blePaused = true;
+    bleSyncSessions++;
+    if (bleScanning) {
+        esp_ble_gap_stop_scanning();
+    }
+    xTaskCreatePinnedToCore(bleSyncTask, "bleSync", BLE_SYNC_STACK, NULL, 1, NULL, 0);
+}
+
+/**
+ * Examen des entrées reçues, dans loop() : une entrée inconnue devient un positif provisoire, l'état
+ * de santé est revu, et un rattrapage par Adafruit IO est demandé pour la confirmer
+ */
+void bleSyncApply() {
+    char *line = bleSyncRx;
+    char *end = bleSyncRx + bleSyncRxLen;
+    int unknown = 0;
+    char first[POSITIVE_SYNC_ID_LEN] = "";
+    while (line < end) {
+        char *eol = (char *)memchr(line, '\n', end - line);
+        if (!eol) {
+            break;
+        }
+        *eol = '\0';
+        uint32_t seq;
+        char id[POSITIVE_SYNC_ID_LEN];
+        if (positiveSyncParseAnnounce(line, &seq, id) && positiveSyncAddProvisional(id)) {
+            if (unknown++ == 0) strcpy(first, id);
+        }
+        line = eol + 1;
+    }
+    if (unknown == 0) {
+        return;
+    }
+    bleSyncHints += unknown;
+    eventPost(EVENT_POSITIVE, EVENT_SRC_BLE, first);
+    if (bleSyncCatchupAt != 0 && millis() - bleSyncCatchupAt < BLE_SYNC_CATCHUP_MS) {
+        return;
+    }
+    bleSyncCatchupAt = millis();
+    bleSyncCatchups++;
+    LOG_I("-BLE Sync : %d positifs inconnus annoncés, rattrapage MQTT", unknown);
+    requestPositiveSync();
+}
+
+/**
+ * Appelée toutes les 20 ms :
+ * - mise à jour du digest servi en lecture quand la liste a changé,
+ * - envoi de la réponse à une requête reçue,
+ * - intégration du résultat de la dernière synchronisation client.
+ */
+void loopBLESync() {
+    if (!bleSyncChar) {
+        return;
+    }
+    if (positiveVersion != bleSyncDigestVersion || positiveAdded != bleSyncDigestAdded) {
+        bleSyncEncodeDigest(bleSyncDigest);
+        bleSyncDigestVersion = positiveVersion;
+        bleSyncDigestAdded = positiveAdded;
+    }
+    bleSyncServe();
+    if (bleSyncFinished) {
+        bleSyncApply();
+        bleSyncFinished = false;
+        blePaused = false;        // Le scan sera relancé par pollBLEClient()
+    }
+}
+
+/**
+ * Découpage de la liste locale complète selon le MTU, et coût de l'encodage en cycles CPU
+ */
+void bleSyncChunkBenchmark() {
+    const uint16_t mtus[] = { 23, 185, 247, 517 };
+    uint8_t none[2 * POSITIVE_SYNC_BUCKETS] = { 0 };
+    uint32_t start = ESP.getCycleCount();
+    int len = bleSyncEncodeDelta(0, none, bleSyncTx, sizeof(bleSyncTx));
+    uint32_t cycles = ESP.getCycleCount() - start;
+    char line[120];
+    snprintf(line, sizeof(line), "-BLE Sync : %d positifs, %d octets, encodage %lu cycles",
+             positiveCount, len, (unsigned long)cycles);
+    MYDEBUG_PRINTLN(line);
+    for (int m = 0; m < 4; m++) {
+        int payload = mtus[m] - 3 - 2;
+        int chunks = len == 0 ? 1 : (len + payload - 1) / payload;
+        snprintf(line, sizeof(line), "-BLE Sync : MTU %u, %d morceaux, %d octets d'en-têtes (ATT + morceau)",
+                 mtus[m], chunks, chunks * 5);
+        MYDEBUG_PRINTLN(line);
+    }
+}
+
+/**
+ * Activation de l'échange en BLE, à appeler avant setupBLE()
+ */
+void setupBLESync() {
+    bleServiceHook = bleSyncAddCharacteristic;
+    bleNewPeerHook = bleSyncOffer;
+    timerEvery("blesync", 20, loopBLESync);
+}
@@ -0,0 +1,542 @@
+/**
+ * \file MyBLETrace.h
+ * \page bletrace Enregistrement et rejeu des annonces BLE
+ * \brief Reproduire une salle pleine de cartes sans la salle
+ *
+ * Tester la chaîne de traitement des annonces BLE (filtre, file, rencontres, contacts) avec
+ * beaucoup d'appareils demande une salle pleine de cartes. Ce module permet :
+ * - d'enregistrer les annonces brutes reçues (date, adresse, RSSI, données de l'annonce qui
+ *   contiennent l'UUID et le nom) dans un fichier binaire compact sur SPIFFS,
+ * - de rejouer un tel fichier, jusqu'à 100 fois plus vite que le temps réel ou au maximum,
+ * - de générer une foule synthétique de milliers d'appareils (1 sur 4 est un CONTACT TRACKER,
+ *   les autres émettent des annonces quelconques), chacun avec son propre rythme d'émission.
+ *
+ * Les annonces rejouées passent par bleOnAdvertisement(), c'est à dire exactement le chemin des
+ * annonces réelles : filtre, file \ref blering, rencontres \ref encounter. Pendant un rejeu, le scan
+ * réel est arrêté et les contacts sont comptés mais pas enregistrés. L'annuaire des noms et la
+ * table des rencontres réelles sont copiés avant le rejeu, qui part de tables vides, et rétablis
+ * après : les cartes simulées ne chassent ni les noms ni les rencontres des vraies cartes. Le rejeu
+ * rapporte le débit, les annonces perdues, l'occupation maximale de la file et de la table des
+ * rencontres, et la mémoire libre (tas) avant, pendant et après.
+ *
+ * Un rejeu avance par étapes de TRACE_STEP_MS au plus, dans le travail "bletrace.run" : la
+ * requête qui le démarre répond tout de suite, et loop() (MQTT, serveur web...) continue pendant
+ * le rejeu. Les premières étapes attendent la passation : la pause de la tâche de capture \ref core0,
+ * acquittée à la fin de son tour, puis la fin du scan réel, signalée par la pile Bluetooth
+ * (ESP_GAP_BLE_SCAN_STOP_COMPLETE_EVT) ; aucune annonce réelle n'est alors en cours de traitement.
+ * Sans passation dans TRACE_HANDOFF_MS, le rejeu est abandonné (trace.handoff_failed). Le tout est piloté depuis la route /trace :
+ * - /trace?record=60 : enregistre 60 secondes d'annonces dans /bletrace.bin
+ * - /trace?replay=100 : rejoue /bletrace.bin 100 fois plus vite (0 : au maximum), réponse 202
+ * - /trace?crowd=2000&seconds=60&speed=100 : foule synthétique de 2000 appareils pendant 60 s,
+ *   réponse 202
+ * - /trace : état de l'enregistrement, du rejeu en cours, et rapport du dernier rejeu terminé
+ *
+ * Format du fichier : "BLET", puis pour chaque annonce [date ms : 4][adresse : 6][RSSI : 1]
+ * [longueur : 1][données : longueur], les entiers en little endian.
+ *
+ * Fichier \ref MyBLETrace.h
+ */
+
+#define TRACE_FILE          "/bletrace.bin"
+#define TRACE_BUFFER_SIZE   4096    // Tampon entre la tâche Bluetooth et l'écriture sur SPIFFS, puissance de 2
+#define TRACE_MAX_BYTES     65536   // Taille maximale d'un enregistrement
+#define TRACE_HEADER_LEN    12      // Date, adresse, RSSI, longueur
+#define TRACE_MAX_DEVICES   5000    // Taille maximale d'une foule synthétique
+#define TRACE_STEP_PERIOD   10      // Rythme des étapes d'un rejeu
+#define TRACE_STEP_MS       5       // Durée maximale d'une étape, le reste de loop() continue entre deux
+#define TRACE_HANDOFF_MS    500     // Attente maximale de la pause de la capture et de l'arrêt du scan
+
+uint8_t traceBuffer[TRACE_BUFFER_SIZE];
+std::atomic<uint32_t> traceHead(0);     // Ecrit par la tâche Bluetooth
+std::atomic<uint32_t> traceTail(0);     // Ecrit par loop()
+File traceFile;
+uint32_t traceBytes = 0;
+uint32_t traceRecords = 0;
+uint32_t traceDropped = 0;
+unsigned long traceStopAt = 0;
+uint32_t traceLastExpire = 0;           // Date (dans la trace) de la dernière fin des rencontres
+uint32_t traceHandoffFailed = 0;        // Rejeux abandonnés, faute de passation
+// Pause de la capture sur le core 0 (true : demande, à rappeler jusqu'à l'acquittement ; false :
+// reprise), NULL sans tâche de capture, cf. \ref core0
+bool (*traceCapturePause)(bool pause) = NULL;
+
+/* Rapport d'un rejeu */
+struct TraceReport {
+    uint32_t adverts;
+    uint32_t trackers;
+    uint32_t handled;
+    uint32_t dropped;
+    uint32_t elapsedMs;
+    uint32_t traceMs;
+    uint32_t heapBefore;
+    uint32_t heapMin;
+    uint32_t heapAfter;
+    uint16_t ringHighWater;
+    uint16_t encountersMax;
+    uint32_t encountersFull;
+    uint32_t promoted;
+};
+
+/**
+ * Copie d'une annonce brute dans le tampon d'enregistrement (tâche Bluetooth), sans allocation
+ */
+void bleTraceCapture(const uint8_t *bda, int8_t rssi, const uint8_t *data, uint8_t len) {
+    uint32_t head = traceHead.load(std::memory_order_relaxed);
+    uint32_t tail = traceTail.load(std::memory_order_acquire);
+    uint32_t size = TRACE_HEADER_LEN + len;
+    if (TRACE_BUFFER_SIZE - (head - tail) < size) {
+        traceDropped++;
+        return;
+    }
+    uint8_t header[TRACE_HEADER_LEN];
+    uint32_t ms = millis();
+    memcpy(header, &ms, 4);
+    memcpy(header + 4, bda, 6);
+    header[10] = (uint8_t)rssi;
+    header[11] = len;
+    for (uint32_t i = 0; i < size; i++) {
+        traceBuffer[(head + i) & (TRACE_BUFFER_SIZE - 1)] = i < TRACE_HEADER_LEN ? header[i] : data[i - TRACE_HEADER_LEN];
+    }
+    traceRecords++;
+    traceHead.store(head + size, std::memory_order_release);
+}
+
+/**
+ * Démarrage de l'enregistrement des annonces pendant seconds secondes
+ */
+bool bleTraceRecord(uint16_t seconds) {
+    if (bleTraceHook) {
+        return false;               // Déjà en cours
+    }
+    traceFile = SPIFFS.open(TRACE_FILE, "w");
+    if (!traceFile) {
+        MYDEBUG_PRINTLN("-BLE Trace : Impossible de créer le fichier");
+        return false;
+    }
+    traceFile.write((const uint8_t *)"BLET", 4);
+    traceBytes = 4;
+    traceRecords = 0;
+    traceDropped = 0;
+    traceTail.store(traceHead.load());
+    traceStopAt = millis() + seconds * 1000UL;
+    bleTraceHook = bleTraceCapture;
+    MYDEBUG_PRINTLN("-BLE Trace : Enregistrement démarré");
+    return true;
+}
+
+/**
+ * Ecriture du tampon sur SPIFFS et arrêt de l'enregistrement à l'échéance, toutes les 20 ms
+ */
+void loopBLETrace() {
+    if (!bleTraceHook) {
+        return;
+    }
+    uint32_t head = traceHead.load(std::memory_order_acquire);
+    uint32_t tail = traceTail.load(std::memory_order_relaxed);
+    while (tail != head && traceBytes < TRACE_MAX_BYTES) {
+        uint32_t offset = tail & (TRACE_BUFFER_SIZE - 1);
+        uint32_t chunk = head - tail;
+        if (chunk > TRACE_BUFFER_SIZE - offset) chunk = TRACE_BUFFER_SIZE - offset;   // Jusqu'à la fin du tampon
+        traceFile.write(traceBuffer + offset, chunk);
+        traceBytes += chunk;
+        tail += chunk;
+    }
+    traceTail.store(tail, std::memory_order_release);
+    if ((long)(millis() - traceStopAt) >= 0 || traceBytes >= TRACE_MAX_BYTES) {
+        bleTraceHook = NULL;
+        traceFile.close();
+        MYDEBUG_PRINT("-BLE Trace : Enregistrement terminé, annonces : ");
+        MYDEBUG_PRINT(traceRecords);
+        MYDEBUG_PRINT(", perdues : ");
+        MYDEBUG_PRINTLN(traceDropped);
+    }
+}
+
+/**
+ * Enregistrement de l'écriture périodique du tampon, qui ne fait rien hors enregistrement
+ */
+void setupBLETrace() {
+    timerEvery("bletrace", 20, loopBLETrace);
+}
+
+/************************** Rejeu ********************************************/
+
+/* Rejeu en cours, avancé par étapes par le travail "bletrace.run" */
+struct TraceRun {
+    bool crowd;                     // Foule synthétique, sinon rejeu de TRACE_FILE
+    uint16_t speed;
+    uint32_t base;                  // millis() au début : les dates de la trace sont décalées pour le suivre
+    unsigned long startUs;
+    uint32_t offsetMs;              // Date de la prochaine annonce (ou du prochain pas), depuis le début
+    void (*step)(uint32_t budgetMs);
+    bool ready;                     // Passation terminée, tables réelles copiées
+    bool stopSent;                  // Arrêt du scan réel demandé
+    unsigned long handoffAt;        // Début de la passation
+    // Rejeu du fichier
+    File file;
+    uint32_t first;                 // Date de la première annonce du fichier
+    bool pending;                   // Annonce lue, en attente de sa date
+    uint8_t header[TRACE_HEADER_LEN];
+    uint8_t data[62];
+    // Foule synthétique
+    uint16_t devices;
+    uint32_t durationMs;
+    uint32_t *nextAt;
+    uint16_t *period;
+    int8_t *rssi;
+    // Etat réel, rétabli à la fin
+    BleNameSaved *names;
+    Encounter *encounters;
+};
+
+TraceRun traceRun;
+TraceReport traceReport;                // Rapport du rejeu en cours, puis du dernier rejeu
+int8_t traceJob = TIMER_NONE;           // Travail du rejeu en cours
+bool traceReportReady = false;          // traceReport est celui d'un rejeu terminé
+
+/**
+ * Préparation d'un rejeu, depuis la requête : réservation des copies de l'annuaire et des
+ * rencontres réelles, puis demande de pause de la capture, sans attendre
+ * \return false si la mémoire est insuffisante pour les copies
+ */
+bool bleTraceBegin(TraceReport &report) {
+    memset(&report, 0, sizeof(report));
+    traceRun.names = (BleNameSaved *)malloc(BLE_NAME_DIR_SIZE * sizeof(BleNameSaved));
+    traceRun.encounters = (Encounter *)malloc(sizeof(encounters));
+    if (!traceRun.names || !traceRun.encounters) {
+        free(traceRun.names);
+        free(traceRun.encounters);
+        return false;
+    }
+    bleReplaying = true;            // Les annonces réelles ne sont plus mises en file
+    if (traceCapturePause) {
+        traceCapturePause(true);
+    }
+    return true;
+}
+
+/**
+ * Passation, à rappeler à chaque étape : pause de la capture acquittée, puis arrêt du scan réel
+ * confirmé par la pile Bluetooth
+ * \return true quand plus aucune annonce réelle n'est en cours de traitement
+ */
+bool bleTraceHandoff() {
+    if (traceCapturePause && !traceCapturePause(true)) {
+        return false;
+    }
+    if (bleScanning && !traceRun.stopSent) {
+        esp_ble_gap_stop_scanning();
+        traceRun.stopSent = true;
+    }
+    return !bleScanning;
+}
+
+/**
+ * Passation terminée : vidage de la file, copie de l'annuaire et des rencontres réelles, puis
+ * remise à zéro ; le rejeu démarre
+ */
+void bleTraceReady(TraceReport &report) {
+    while (bleRingDrain(bleHandleAdvert, BLE_DRAIN_MAX) > 0) {}
+    bleNameSaveTo(traceRun.names);
+    encounterSaveTo(traceRun.encounters);
+    encounterClear();
+    encounterDryRun = true;
+    traceLastExpire = millis();
+    report.heapBefore = ESP.getFreeHeap();
+    report.heapMin = report.heapBefore;
+    report.encountersFull = encounterFull;
+    report.promoted = encounterPromoted;
+    report.dropped = bleAdvDropped;
+    bleRingHighWater = 0;
+    traceRun.base = millis();
+    traceRun.startUs = micros();
+    traceRun.ready = true;
+}
+
+/**
+ * Traitement des annonces en file pendant un rejeu, et fin des rencontres à la date de la trace
+ */
+void bleTracePump(TraceReport &report, uint32_t traceNow) {
+    report.handled += bleRingDrain(bleHandleAdvert, BLE_DRAIN_MAX);
+    if (encounterActive > report.encountersMax) report.encountersMax = encounterActive;
+    if (traceNow - traceLastExpire > 1000) {
+        encounterExpire(traceNow);
+        traceLastExpire = traceNow;
+    }
+    uint32_t heap = ESP.getFreeHeap();
+    if (heap < report.heapMin) report.heapMin = heap;
+}
+
+/**
+ * La date réelle correspondant à une date de la trace est-elle atteinte ?
+ */
+bool bleTraceDue(uint32_t traceOffsetMs) {
+    if (traceRun.speed == 0) {
+        return true;
+    }
+    return micros() - traceRun.startUs >= (uint64_t)traceOffsetMs * 1000 / traceRun.speed;
+}
+
+/**
+ * Fin d'un rejeu : vidage de la file, calcul du rapport, retour à l'annuaire et aux rencontres
+ * réelles, le scan réel reprendra dans pollBLEClient()
+ */
+void bleTraceEnd(TraceReport &report, uint32_t traceNow) {
+    int n;
+    while ((n = bleRingDrain(bleHandleAdvert, BLE_DRAIN_MAX)) > 0) {
+        report.handled += n;
+    }
+    report.elapsedMs = (micros() - traceRun.startUs) / 1000;
+    report.traceMs = traceNow - traceRun.base;
+    report.ringHighWater = bleRingHighWater;
+    report.dropped = bleAdvDropped - report.dropped;
+    report.encountersFull = encounterFull - report.encountersFull;
+    report.promoted = encounterPromoted - report.promoted;
+    encounterClear();
+    encounterDryRun = false;
+    bleNameRestore(traceRun.names);
+    encounterRestore(traceRun.encounters);
+    report.heapAfter = ESP.getFreeHeap();
+    bleReplaying = false;
+    if (traceCapturePause) {
+        traceCapturePause(false);
+    }
+}
+
+/**
+ * Libération des ressources propres au rejeu : fichier ou appareils de la foule
+ */
+void bleTraceRelease() {
+    if (traceRun.crowd) {
+        free(traceRun.nextAt); free(traceRun.period); free(traceRun.rssi);
+    } else {
+        traceRun.file.close();
+    }
+}
+
+/**
+ * Fin du rejeu en cours : libération des ressources et arrêt du travail
+ */
+void bleTraceFinish() {
+    uint32_t traceNow = traceRun.base + (traceRun.crowd ? traceRun.durationMs : traceRun.offsetMs);
+    bleTraceRelease();
+    bleTraceEnd(traceReport, traceNow);
+    timerCancel(traceJob);
+    traceJob = TIMER_NONE;
+    traceReportReady = true;
+    LOG_I("-BLE Trace : Rejeu terminé, %u annonces en %u ms", traceReport.adverts, traceReport.elapsedMs);
+}
+
+/**
+ * Abandon d'un rejeu dont la passation n'a pas abouti : les tables réelles n'ont pas été touchées,
+ * la capture et le scan reprennent
+ */
+void bleTraceAbort() {
+    bleTraceRelease();
+    free(traceRun.names);
+    free(traceRun.encounters);
+    bleReplaying = false;
+    if (traceCapturePause) {
+        traceCapturePause(false);
+    }
+    timerCancel(traceJob);
+    traceJob = TIMER_NONE;
+    traceHandoffFailed++;
+    LOG_W("-BLE Trace : Rejeu abandonné, capture ou scan pas arrêtés après %u ms", TRACE_HANDOFF_MS);
+}
+
+/**
+ * Etape du travail "bletrace.run" : la passation, puis le rejeu lui-même
+ */
+void bleTraceStep(uint32_t budgetMs) {
+    if (!traceRun.ready) {
+        if (!bleTraceHandoff()) {
+            if (millis() - traceRun.handoffAt > TRACE_HANDOFF_MS) {
+                bleTraceAbort();
+            }
+            return;
+        }
+        bleTraceReady(traceReport);
+    }
+    traceRun.step(budgetMs);
+}
+
+/**
+ * Etape du rejeu du fichier, dans la limite de budgetMs : les annonces dont la date est atteinte
+ * sont injectées, la suite attend l'étape suivante
+ */
+void bleTraceReplayStep(uint32_t budgetMs) {
+    TraceRun &run = traceRun;
+    unsigned long start = millis();
+    while (millis() - start < budgetMs) {
+        if (!run.pending) {
+            uint8_t len;
+            if (run.file.read(run.header, TRACE_HEADER_LEN) != TRACE_HEADER_LEN ||
+                (len = run.header[11]) > sizeof(run.data) || run.file.read(run.data, len) != len) {
+                bleTraceFinish();
+                return;
+            }
+            uint32_t ms;
+            memcpy(&ms, run.header, 4);
+            if (traceReport.adverts == 0) run.first = ms;
+            run.offsetMs = ms - run.first;
+            run.pending = true;
+        }
+        bleTracePump(traceReport, run.base + run.offsetMs);
+        if (!bleTraceDue(run.offsetMs)) {
+            return;
+        }
+        if (bleOnAdvertisement(run.header + 4, (int8_t)run.header[10], run.data, run.header[11], run.base + run.offsetMs)) {
+            traceReport.trackers++;
+        }
+        traceReport.adverts++;
+        run.pending = false;
+    }
+}
+
+/**
+ * Construction d'une annonce synthétique : CONTACT TRACKER nommé SIM-n, ou annonce constructeur quelconque
+ */
+uint8_t bleTraceSynthetic(uint16_t device, uint8_t *data) {
+    data[0] = 0x02; data[1] = 0x01; data[2] = 0x06;                 // Flags
+    if (device % 4 == 0) {
+        data[3] = 0x11; data[4] = 0x07;                             // UUID 128 bits
+        memcpy(data + 5, trackerUUIDRaw, 16);
+        int n = snprintf((char *)data + 23, 9, "SIM-%u", device);   // Nom complet
+        data[21] = n + 1; data[22] = 0x09;
+        return 23 + n;
+    }
+    data[3] = 0x1A; data[4] = 0xFF;                                 // Données constructeur
+    for (int i = 5; i < 30; i++) data[i] = device + i;
+    return 30;
+}
+
+/**
+ * Etape de la foule synthétique, par pas de 10 ms de temps simulé, dans la limite de budgetMs
+ */
+void bleTraceCrowdStep(uint32_t budgetMs) {
+    TraceRun &run = traceRun;
+    unsigned long start = millis();
+    uint8_t addr[6] = { 0x5A, 0x5A, 0, 0, 0, 0 };
+    uint8_t data[32];
+    while (millis() - start < budgetMs) {
+        if (run.offsetMs >= run.durationMs) {
+            bleTraceFinish();
+            return;
+        }
+        uint32_t t = run.offsetMs;
+        bleTracePump(traceReport, run.base + t);
+        if (!bleTraceDue(t)) {
+            return;
+        }
+        for (uint16_t d = 0; d < run.devices; d++) {
+            if (run.nextAt[d] > t) continue;
+            addr[4] = d >> 8;
+            addr[5] = d & 0xFF;
+            uint8_t len = bleTraceSynthetic(d, data);
+            if (bleOnAdvertisement(addr, run.rssi[d] - random(6), data, len, run.base + t)) {
+                traceReport.trackers++;
+            }
+            traceReport.adverts++;
+            run.nextAt[d] += run.period[d] + random(11);
+        }
+        run.offsetMs += 10;
+    }
+}
+
+/**
+ * Démarrage de l'étape périodique du rejeu, qui commence par la passation
+ */
+void bleTraceStart(bool crowd, uint16_t speed, void (*step)(uint32_t budgetMs)) {
+    traceRun.crowd = crowd;
+    traceRun.speed = speed;
+    traceRun.offsetMs = 0;
+    traceRun.step = step;
+    traceRun.ready = false;
+    traceRun.stopSent = false;
+    traceRun.handoffAt = millis();
+    traceReportReady = false;
+    traceJob = timerPoll("bletrace.run", TRACE_STEP_PERIOD, TRACE_STEP_MS, TIMER_PRIO_LOW, bleTraceStep);
+}
+
+/**
+ * Démarrage du rejeu du fichier enregistré, par étapes
+ * \param speed facteur d'accélération, 0 pour rejouer au maximum
+ * \return false si un rejeu est en cours, si le fichier est absent ou invalide, ou si la mémoire
+ *         est insuffisante
+ */
+bool bleTraceReplay(uint16_t speed) {
+    if (traceJob != TIMER_NONE) {
+        return false;
+    }
+    File f = SPIFFS.open(TRACE_FILE, "r");
+    char magic[4];
+    if (!f || f.read((uint8_t *)magic, 4) != 4 || memcmp(magic, "BLET", 4) != 0) {
+        MYDEBUG_PRINTLN("-BLE Trace : Pas de trace à rejouer");
+        return false;
+    }
+    if (!bleTraceBegin(traceReport)) {
+        f.close();
+        return false;
+    }
+    traceRun.file = f;
+    traceRun.first = 0;
+    traceRun.pending = false;
+    bleTraceStart(false, speed, bleTraceReplayStep);
+    return true;
+}
+
+/**
+ * Démarrage d'une foule synthétique de devices appareils pendant seconds secondes de temps simulé,
+ * par étapes. Chaque appareil émet toutes les 100 à 1000 ms (plus 0 à 10 ms d'aléa, comme le
+ * prévoit BLE), avec un RSSI propre à l'appareil.
+ * \return false si un rejeu est en cours, si le nombre d'appareils est invalide ou si la mémoire
+ *         est insuffisante
+ */
+bool bleTraceCrowd(uint16_t devices, uint16_t seconds, uint16_t speed) {
+    if (traceJob != TIMER_NONE || devices == 0 || devices > TRACE_MAX_DEVICES) {
+        return false;
+    }
+    uint32_t *nextAt = (uint32_t *)malloc(devices * sizeof(uint32_t));
+    uint16_t *period = (uint16_t *)malloc(devices * sizeof(uint16_t));
+    int8_t *rssi = (int8_t *)malloc(devices);
+    if (!nextAt || !period || !rssi || !bleTraceBegin(traceReport)) {
+        free(nextAt); free(period); free(rssi);
+        return false;
+    }
+    for (uint16_t d = 0; d < devices; d++) {
+        period[d] = 100 + random(900);
+        nextAt[d] = random(period[d]);
+        rssi[d] = -45 - random(50);
+    }
+    traceRun.devices = devices;
+    traceRun.durationMs = seconds * 1000UL;
+    traceRun.nextAt = nextAt;
+    traceRun.period = period;
+    traceRun.rssi = rssi;
+    bleTraceStart(true, speed, bleTraceCrowdStep);
+    return true;
+}
+
+/**
+ * Rapport d'un rejeu au format texte "clé valeur"
+ * \param prefix préfixe des clés
+ */
+String bleTraceReportText(const TraceReport &r, const String &prefix) {
+    String out = "";
+    out += prefix + "adverts " + String(r.adverts) + "\n";
+    out += prefix + "trackers " + String(r.trackers) + "\n";
+    out += prefix + "handled " + String(r.handled) + "\n";
+    out += prefix + "dropped " + String(r.dropped) + "\n";
+    out += prefix + "trace_ms " + String(r.traceMs) + "\n";
+    out += prefix + "elapsed_ms " + String(r.elapsedMs) + "\n";
+    out += prefix + "adverts_per_s " + String(r.elapsedMs ? r.adverts * 1000.0 / r.elapsedMs : 0) + "\n";
+    out += prefix + "ring_high_water " + String(r.ringHighWater) + "\n";
+    out += prefix + "encounters_max " + String(r.encountersMax) + "\n";
+    out += prefix + "encounters_full " + String(r.encountersFull) + "\n";
+    out += prefix + "contacts " + String(r.promoted) + "\n";
+    out += prefix + "heap_before " + String(r.heapBefore) + "\n";
+    out += prefix + "heap_min " + String(r.heapMin) + "\n";
+    out += prefix + "heap_after " + String(r.heapAfter) + "\n";
+    return out;
+}
@@ -0,0 +1,285 @@
+/**
+ * \file MyBoot.h
+ * \page boot Démarrage
+ * \brief Démarrage des modules selon leurs dépendances, en parallèle quand c'est possible
+ *
+ * setup() appelait les fonctions setupXxx() les unes après les autres : montage du SPIFFS,
+ * connexion WiFi, MQTT, serveur web, NTP, BLE, OTA. Le scan BLE, et donc le premier contact, ne
+ * démarrait qu'après la connexion au réseau et la mise à l'heure ; plusieurs modules vérifiaient
+ * encore WiFi.status() et rappelaient setupWiFi().
+ *
+ * Le démarrage est maintenant décrit dans setup() par des étapes, chacune avec ses étapes
+ * préalables (bootPhase()), puis confié à bootRun() :
+ * - une étape dont les dépendances sont terminées est lancée aussitôt, dans l'ordre de déclaration,
+ * - une étape marquée BOOT_CORE0 s'exécute dans une tâche sur le core 0, en parallèle de la suite
+ *   (initialisation de la pile Bluetooth pendant le montage du SPIFFS, par exemple),
+ * - une étape qui dépend de BOOT_NET attend l'obtention d'une adresse IP, signalée par l'événement
+ *   WiFi correspondant : setup() rend la main sans l'attendre, et le travail "boot" de
+ *   \ref timerwheel lance ces étapes dès que le réseau est là.
+ *
+ * La chronologie (début, durée et core de chaque étape) est affichée quand la dernière étape est
+ * terminée, et visible sur /stats (boot.*) avec le moment de la fin de setup(), de l'obtention de
+ * l'adresse IP et du premier contact enregistré. Toutes les dates sont en millisecondes depuis le
+ * démarrage du programme.
+ *
+ * \section bootmeasure Mesure du gain
+ * Le scan BLE n'attend plus ni l'association WiFi ni la mise à l'heure : le premier contact peut
+ * être enregistré plus tôt, au mieux de la durée de ces deux étapes (quelques secondes avec une
+ * connexion complète, cf. \ref wifi). Ce gain n'a pas encore été mesuré sur une carte. Pour le
+ * mesurer avec le même programme, BOOT_SEQUENTIAL à 1 retrouve l'ancien enchaînement : les étapes
+ * s'exécutent une par une sur le core 1, dans l'ordre de déclaration, et celles déclarées après
+ * l'étape BOOT_NET_START attendent l'adresse IP, comme après l'ancien setupWiFi() bloquant. On
+ * compare alors boot.ble_start_ms et boot.first_contact_ms sur /stats, deux cartes côte à côte,
+ * avec et sans cette option, à froid et au réveil (reconnexion directe).
+ *
+ * Fichier \ref MyBoot.h
+ */
+
+#define BOOT_PHASES         12          // Nombre maximum d'étapes
+#define BOOT_TASK_STACK     6144        // Pile des tâches des étapes BOOT_CORE0, en octets
+#define BOOT_POLL_MS        20          // Suivi des étapes en attente du réseau
+#define BOOT_NET            0x80000000UL // Dépendance : adresse IP obtenue en mode Station
+#define BOOT_SEQUENTIAL     0           // 1 : étapes une par une, comme l'ancien setup(), cf. \ref bootmeasure
+
+// Options d'une étape
+#define BOOT_CORE0          0x01        // Exécutée dans une tâche sur le core 0
+#define BOOT_NET_START      0x02        // Lance la connexion WiFi, pour BOOT_SEQUENTIAL
+
+// Etat d'une étape
+#define BOOT_WAITING        0
+#define BOOT_RUNNING        1
+#define BOOT_DONE           2
+
+/* Une étape du démarrage */
+struct BootPhase {
+    const char *name;
+    void (*fn)();
+    uint32_t deps;                  // Etapes préalables, éventuellement BOOT_NET
+    uint8_t flags;
+    volatile uint8_t state;         // Ecrit par la tâche du core 0 pour une étape BOOT_CORE0
+    uint8_t core;
+    uint32_t startMs;
+    uint32_t endMs;
+};
+
+BootPhase bootPhases[BOOT_PHASES];
+uint8_t bootPhaseCount = 0;
+volatile uint32_t bootNetMs = 0;    // Obtention de l'adresse IP
+uint32_t bootSetupMs = 0;           // Fin de setup()
+uint32_t bootDoneMs = 0;            // Fin de la dernière étape
+uint32_t bootFirstContactMs = 0;    // Premier contact enregistré, cf. saveContact()
+int8_t bootJob = TIMER_NONE;
+
+/**
+ * Déclaration d'une étape, à appeler dans setup() avant bootRun()
+ * \param deps étapes préalables : valeurs retournées par bootPhase(), combinées par |, et BOOT_NET
+ * \return la valeur à utiliser comme dépendance par les étapes suivantes
+ */
+uint32_t bootPhase(const char *name, void (*fn)(), uint32_t deps, uint8_t flags = 0) {
+    if (bootPhaseCount >= BOOT_PHASES) {
+        MYDEBUG_PRINT("-BOOT : Trop d'étapes, ignorée : ");
+        MYDEBUG_PRINTLN(name);
+        return 0;
+    }
+    BootPhase &p = bootPhases[bootPhaseCount];
+    p.name = name;
+    p.fn = fn;
+    p.deps = deps;
+    p.flags = flags;
+    p.state = BOOT_WAITING;
+    return 1UL << bootPhaseCount++;
+}
+
+/**
+ * Obtention de l'adresse IP, appelée par la tâche des événements WiFi. L'adresse du cache
+ * d'une reconnexion directe est ignorée : le client DHCP va la remettre à zéro, cf. \ref wifi
+ */
+void bootWiFiEvent(WiFiEvent_t event, WiFiEventInfo_t info) {
+    if (wifiAttempt == WIFI_ATTEMPT_FAST || WiFi.localIP() == INADDR_NONE) {
+        return;
+    }
+    if (bootNetMs == 0) {
+        bootNetMs = millis();
+    }
+}
+
+/**
+ * Tâche d'une étape BOOT_CORE0, supprimée à la fin de l'étape
+ */
+void bootTask(void *parameter) {
+    BootPhase *p = (BootPhase *)parameter;
+    p->fn();
+    p->core = xPortGetCoreID();
+    p->endMs = millis();
+    p->state = BOOT_DONE;
+    vTaskDelete(NULL);
+}
+
+/**
+ * Etapes terminées, et BOOT_NET si l'adresse IP est obtenue
+ */
+uint32_t bootDoneMask() {
+    uint32_t mask = bootNetMs ? BOOT_NET : 0;
+    for (uint8_t i = 0; i < bootPhaseCount; i++) {
+        if (bootPhases[i].state == BOOT_DONE) {
+            mask |= 1UL << i;
+        }
+    }
+    return mask;
+}
+
+/**
+ * Dépendances d'une étape ; avec BOOT_SEQUENTIAL, toutes les étapes déclarées avant elle, et
+ * l'adresse IP si l'une d'elles lance la connexion WiFi
+ */
+uint32_t bootDeps(uint8_t i) {
+    uint32_t deps = bootPhases[i].deps;
+    if (BOOT_SEQUENTIAL) {
+        for (uint8_t j = 0; j < i; j++) {
+            deps |= 1UL << j;
+            if (bootPhases[j].flags & BOOT_NET_START) {
+                deps |= BOOT_NET;
+            }
+        }
+    }
+    return deps;
+}
+
+/**
+ * Lancement des étapes dont les dépendances sont terminées, jusqu'à ce qu'il n'y en ait plus :
+ * les étapes BOOT_CORE0 d'abord, pour qu'elles avancent pendant celles du core 1
+ * \return true quand toutes les étapes sont terminées
+ */
+bool bootStep() {
+    for (;;) {
+        uint32_t done = bootDoneMask();
+        int8_t next = -1;           // Première étape à exécuter sur le core 1
+        for (uint8_t i = 0; i < bootPhaseCount; i++) {
+            BootPhase &p = bootPhases[i];
+            uint32_t deps = bootDeps(i);
+            if (p.state != BOOT_WAITING || (deps & done) != deps) {
+                continue;
+            }
+            if ((p.flags & BOOT_CORE0) && !BOOT_SEQUENTIAL) {
+                p.startMs = millis();
+                p.state = BOOT_RUNNING;
+                if (xTaskCreatePinnedToCore(bootTask, p.name, BOOT_TASK_STACK, &p, 1, NULL, 0) == pdPASS) {
+                    continue;
+                }
+                MYDEBUG_PRINT("-BOOT : Tâche impossible, étape exécutée sur le core 1 : ");
+                MYDEBUG_PRINTLN(p.name);
+                p.state = BOOT_WAITING;
+                p.flags &= ~BOOT_CORE0;
+            }
+            if (next < 0) {
+                next = i;
+            }
+        }
+        if (next < 0) {
+            break;
+        }
+        BootPhase &p = bootPhases[next];
+        p.startMs = millis();
+        p.state = BOOT_RUNNING;
+        p.fn();
+        p.core = xPortGetCoreID();
+        p.endMs = millis();
+        p.state = BOOT_DONE;        // Dépendances à recalculer
+    }
+    for (uint8_t i = 0; i < bootPhaseCount; i++) {
+        if (bootPhases[i].state != BOOT_DONE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Affichage de la chronologie du démarrage
+ */
+void bootTimeline() {
+    MYDEBUG_PRINTLN("-BOOT : Chronologie (début, durée en ms, core)");
+    for (uint8_t i = 0; i < bootPhaseCount; i++) {
+        BootPhase &p = bootPhases[i];
+        MYDEBUG_PRINT("-BOOT :   ");
+        MYDEBUG_PRINT(p.name);
+        MYDEBUG_PRINT(" ");
+        MYDEBUG_PRINT(p.startMs);
+        MYDEBUG_PRINT(" +");
+        MYDEBUG_PRINT(p.endMs - p.startMs);
+        MYDEBUG_PRINT(" core ");
+        MYDEBUG_PRINTLN(p.core);
+    }
+    MYDEBUG_PRINT("-BOOT : Fin de setup() à ");
+    MYDEBUG_PRINT(bootSetupMs);
+    MYDEBUG_PRINT(" ms, adresse IP à ");
+    MYDEBUG_PRINT(bootNetMs);
+    MYDEBUG_PRINT(" ms, démarrage terminé à ");
+    MYDEBUG_PRINT(bootDoneMs);
+    MYDEBUG_PRINTLN(" ms");
+}
+
+/**
+ * Travail "boot" : lancement des étapes qui attendaient le réseau, puis fin du démarrage
+ */
+void bootPoll() {
+    if (!bootStep()) {
+        return;
+    }
+    bootDoneMs = millis();
+    bootTimeline();
+    timerCancel(bootJob);
+    bootJob = TIMER_NONE;
+}
+
+/**
+ * Exécution des étapes déclarées, à appeler à la fin de setup() : rend la main quand il ne reste
+ * que des étapes en attente du réseau
+ */
+void bootRun() {
+    WiFi.onEvent(bootWiFiEvent, ARDUINO_EVENT_WIFI_STA_GOT_IP);
+    bool finished;
+    for (;;) {
+        finished = bootStep();
+        bool running = false;
+        for (uint8_t i = 0; i < bootPhaseCount; i++) {
+            if (bootPhases[i].state == BOOT_RUNNING) {
+                running = true;
+            }
+        }
+        if (finished || !running) {
+            break;
+        }
+        delay(1);                   // Une étape du core 0 est en cours, d'autres peuvent en dépendre
+    }
+    bootSetupMs = millis();
+    if (finished) {
+        bootDoneMs = bootSetupMs;
+        bootTimeline();
+        return;
+    }
+    MYDEBUG_PRINTLN("-BOOT : Etapes restantes lancées à l'obtention de l'adresse IP");
+    bootJob = timerEvery("boot", BOOT_POLL_MS, bootPoll);
+}
+
+/**
+ * Chronologie du démarrage au format "clé valeur" de /stats
+ */
+String bootStats() {
+    String out = "";
+    for (uint8_t i = 0; i < bootPhaseCount; i++) {
+        BootPhase &p = bootPhases[i];
+        if (p.state != BOOT_DONE) {
+            out += "boot." + String(p.name) + "_start_ms -1\n";
+            continue;
+        }
+        out += "boot." + String(p.name) + "_start_ms " + String(p.startMs) + "\n";
+        out += "boot." + String(p.name) + "_ms " + String(p.endMs - p.startMs) + "\n";
+        out += "boot." + String(p.name) + "_core " + String(p.core) + "\n";
+    }
+    out += "boot.setup_ms " + String(bootSetupMs) + "\n";
+    out += "boot.net_ms " + String(bootNetMs) + "\n";
+    out += "boot.done_ms " + String(bootDoneMs) + "\n";
+    out += "boot.first_contact_ms " + String(bootFirstContactMs) + "\n";
+    return out;
+}
@@ -1,57 +1,367 @@
 /**
  * \file MyCore0.h
  * \page core0 Utilisation du Core 0
- * 
+ * \brief Capture radio sur le core 0, enregistrement et réseau sur le core 1
+ *
  * L'ESP32 dispose d'un microprocesseur dual core : Core 0 et Core 1.
  * \image html ESP32-DUALCORE.webp
- * 
- * Le code Arduino tourne par défaut sur le core 1. Nous allons voir comment affecter une
- * tâche pour qu'elle tourne sur le core 0 en parrallèle du core 1.
- * 
- * Dans cet exemple nous créer une tâche qui va gérer les requêtes reçues par le serveur
- * web et l'affecter au core 0, délestant ainsi que Core 1 de cette tâche, apportant
- * potentiellement plus de réactivité pour l'utilisateur.
- * 
+ *
+ * Le code Arduino tourne par défaut sur le core 1. La pile Bluetooth, elle, tourne sur le core 0 :
+ * jusqu'ici les annonces reçues traversaient les deux cores, puis tout (agrégation des rencontres,
+ * écriture des contacts en flash, MQTT, HTTP) était traité par loop() sur le core 1.
+ *
+ * Le traitement est maintenant découpé en étages :
+ * - core 0, tâche de capture (PIPE_CAPTURE_STACK octets de pile) : vidage de la file des annonces
+ *   \ref blering, agrégation des rencontres \ref encounter, estimation de distance, rythme du scan ;
+ * - core 1, travail "commit" de \ref timerwheel : écriture des contacts en flash, événements
+ *   pour \ref yct, propositions de synchronisation \ref blesync ; MQTT et HTTP restent sur le core 1.
+ *
+ * Les étages sont reliés par deux files FreeRTOS de taille fixe : les contacts promus et les
+ * nouvelles cartes détectées. Quand la file des contacts est pleine, la tâche de capture attend au
+ * plus PIPE_SEND_WAIT_MS ; si elle reste pleine, la rencontre n'est pas marquée comme contact et sera
+ * proposée à nouveau à l'annonce suivante : rien n'est perdu, le contact est retardé. Une nouvelle
+ * carte qui ne trouve pas de place est simplement ignorée (la synchronisation est facultative).
+ *
+ * Pendant un rejeu de trace (\ref bletrace), la tâche de capture est mise en pause de la même
+ * façon par pipeCapturePause() : la pause n'est acquittée qu'entre deux tours, le rejeu ne touche
+ * aux rencontres et à l'annuaire qu'après cet acquittement.
+ *
+ * Avant le sommeil profond, la tâche de capture est arrêtée de façon coopérative par
+ * pipeCaptureStop() : elle termine son tour (vidage de la file, rencontres, rythme du scan) et
+ * s'arrête entre deux tours, sans verrou ni écriture en cours, puis l'acquitte. vTaskSuspend()
+ * pourrait au contraire l'interrompre au milieu d'une mise à jour de la table des rencontres ou
+ * de l'annuaire des noms, que le core 1 copierait alors à moitié écrite.
+ *
+ * Les rencontres et le rythme du scan sont écrits par la tâche de capture : le core 1 ne les lit
+ * pas directement (un compteur 64 bits ou un couple somme/nombre pourrait être lu à moitié mis à
+ * jour), mais dans une copie publiée par le core 0 à la fin de chaque tour sous le verrou
+ * pipeStatsMux, comme les compteurs de \ref energy. Sans tâche de capture, tout reste sur le core 1
+ * et la copie est faite directement.
+ *
+ * Sont visibles sur /stats (pipe.*) : le remplissage maximum de chaque file, les envois, les
+ * attentes et les refus, ainsi que la plus petite marge de pile jamais atteinte (high water mark)
+ * de la tâche de capture, de loop() et de la tâche de synchronisation BLE, pour dimensionner les
+ * piles au lieu des 10000 octets fixés jusqu'ici.
+ *
  * Fichier \ref MyCore0.h
  */
 
-TaskHandle_t Task1;
+#define PIPE_CAPTURE_STACK      4096    // Pile de la tâche de capture, en octets
+#define PIPE_CAPTURE_PRIORITY   1       // Au dessus de la tâche idle, en dessous de la pile Bluetooth
+#define PIPE_CAPTURE_PERIOD_MS  10      // Rythme de la tâche de capture
+#define PIPE_CAPTURE_BUDGET_MS  5       // Temps de traitement maximum des annonces par tour
+#define PIPE_CONTACT_QUEUE      8       // Contacts en attente d'enregistrement
+#define PIPE_PEER_QUEUE         4       // Nouvelles cartes en attente de synchronisation
+#define PIPE_SEND_WAIT_MS       50      // Attente maximale de la capture quand la file des contacts est pleine
+#define PIPE_STOP_WAIT_MS       200     // Attente maximale de l'arrêt de la tâche de capture
 
-void loop2( void * parameter )
-{
-  for (;;) {
-    loopWebServer();
-    delay(20);
-  }
+/* Contact promu, de la capture vers l'enregistrement */
+struct PipeContact {
+    char name[BLE_NAME_LEN];
+    char timestamp[20];
+};
+
+/* Nouvelle carte détectée, de la capture vers la synchronisation */
+struct PipePeer {
+    uint8_t addr[6];
+    uint32_t peer;
+};
+
+TaskHandle_t pipeCaptureTask = NULL;
+TaskHandle_t volatile pipeStopWaiter = NULL;  // Tâche qui attend l'arrêt de la capture
+volatile bool pipeStopRequested = false;
+std::atomic<bool> pipeStopped(false); // La tâche de capture est arrêtée entre deux tours
+std::atomic<bool> pipePauseRequested(false);
+std::atomic<bool> pipePaused(false); // Pause acquittée : la capture ne touche plus aux rencontres ni au scan
+QueueHandle_t pipeContactQueue = NULL;
+QueueHandle_t pipePeerQueue = NULL;
+void (*pipePeerTarget)(const uint8_t *addr, uint32_t peer) = NULL;   // Destinataire des nouvelles cartes sur le core 1
+
+// Statistiques du pipeline
+uint32_t pipeContactsSent = 0;
+uint32_t pipeContactsWaited = 0;    // Envois qui ont dû attendre une place
+uint32_t pipeContactsRefused = 0;   // File restée pleine, contact retardé
+uint32_t pipeContactsWaitMaxMs = 0;
+uint8_t pipeContactHighWater = 0;
+uint32_t pipePeersSent = 0;
+uint32_t pipePeersDropped = 0;
+uint8_t pipePeerHighWater = 0;
+uint32_t pipeCommitted = 0;         // Contacts enregistrés par le core 1
+uint32_t pipeCaptureLoops = 0;
+
+/* Rencontres et rythme du scan, écrits par la capture, copiés pour le core 1 */
+struct PipeCaptureStats {
+    uint16_t encounterActive;
+    uint32_t encounterPromoted;
+    uint32_t encounterSightings;
+    uint32_t encounterFull;
+    uint32_t encounterNameMisses;
+    uint8_t scanMode;
+    uint32_t scanModeChanges;
+    uint64_t scanRadioOnUs;
+    uint32_t scanGapSumMs;
+    uint32_t scanGapCount;
+    uint32_t scanGapMaxMs;
+};
+
+portMUX_TYPE pipeStatsMux = portMUX_INITIALIZER_UNLOCKED;
+PipeCaptureStats pipeStatsPublished;    // Dernière copie publiée par la tâche de capture
+
+/**
+ * Copie de l'état courant, par le core qui l'écrit
+ */
+void pipeStatsCopy(PipeCaptureStats &s) {
+    s.encounterActive = encounterActive;
+    s.encounterPromoted = encounterPromoted;
+    s.encounterSightings = encounterSightings;
+    s.encounterFull = encounterFull;
+    s.encounterNameMisses = encounterNameMisses;
+    s.scanMode = scanMode;
+    s.scanModeChanges = scanModeChanges;
+    s.scanRadioOnUs = scanRadioOnUs;
+    s.scanGapSumMs = scanGapSumMs;
+    s.scanGapCount = scanGapCount;
+    s.scanGapMaxMs = scanGapMaxMs;
+}
+
+/**
+ * Publication de l'état à la fin d'un tour de la tâche de capture (core 0)
+ */
+void pipeStatsPublish() {
+    PipeCaptureStats s;
+    pipeStatsCopy(s);
+    portENTER_CRITICAL(&pipeStatsMux);
+    pipeStatsPublished = s;
+    portEXIT_CRITICAL(&pipeStatsMux);
+}
+
+/**
+ * Lecture cohérente de l'état des rencontres et du scan, depuis le core 1
+ */
+void pipeStatsSnapshot(PipeCaptureStats &s) {
+    if (!pipeCaptureTask) {
+        pipeStatsCopy(s);           // Capture traitée par loop(), sur ce core
+        return;
+    }
+    portENTER_CRITICAL(&pipeStatsMux);
+    s = pipeStatsPublished;
+    portEXIT_CRITICAL(&pipeStatsMux);
+}
+
+/**
+ * Remise d'un contact promu à l'étage d'enregistrement (core 0)
+ * \return false si la file est restée pleine
+ */
+bool pipeContactPush(const char *name, const char *timestamp) {
+    PipeContact c;
+    strncpy(c.name, name, BLE_NAME_LEN - 1);
+    c.name[BLE_NAME_LEN - 1] = '\0';
+    strncpy(c.timestamp, timestamp, sizeof(c.timestamp) - 1);
+    c.timestamp[sizeof(c.timestamp) - 1] = '\0';
+    if (xQueueSend(pipeContactQueue, &c, 0) != pdTRUE) {
+        pipeContactsWaited++;
+        uint32_t start = millis();
+        BaseType_t sent = xQueueSend(pipeContactQueue, &c, pdMS_TO_TICKS(PIPE_SEND_WAIT_MS));
+        uint32_t waited = millis() - start;
+        if (waited > pipeContactsWaitMaxMs) pipeContactsWaitMaxMs = waited;
+        if (sent != pdTRUE) {
+            pipeContactsRefused++;
+            return false;
+        }
+    }
+    pipeContactsSent++;
+    uint8_t used = uxQueueMessagesWaiting(pipeContactQueue);
+    if (used > pipeContactHighWater) pipeContactHighWater = used;
+    return true;
+}
+
+/**
+ * Remise d'une nouvelle carte à l'étage de synchronisation (core 0), sans attente
+ */
+void pipePeerPush(const uint8_t *addr, uint32_t peer) {
+    PipePeer p;
+    memcpy(p.addr, addr, 6);
+    p.peer = peer;
+    if (xQueueSend(pipePeerQueue, &p, 0) != pdTRUE) {
+        pipePeersDropped++;
+        return;
+    }
+    pipePeersSent++;
+    uint8_t used = uxQueueMessagesWaiting(pipePeerQueue);
+    if (used > pipePeerHighWater) pipePeerHighWater = used;
+}
+
+/**
+ * Tâche de capture, sur le core 0 : annonces, rencontres et rythme du scan.
+ * En pause pendant un rejeu de trace, qui traite lui-même les annonces depuis loop().
+ */
+void pipeCaptureLoop(void *parameter) {
+    uint32_t lastExpire = millis();
+    for (;;) {
+        if (pipeStopRequested) {
+            // Point d'arrêt sûr : aucun tour en cours, acquittement puis attente définitive
+            pipeStopped.store(true);
+            xTaskNotifyGive(pipeStopWaiter);
+            for (;;) {
+                ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            }
+        }
+        if (pipePauseRequested.load()) {
+            // Rejeu de trace : même point sûr, acquitté, jusqu'à la reprise
+            pipePaused.store(true);
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(PIPE_CAPTURE_PERIOD_MS));
+            continue;
+        }
+        pipePaused.store(false);
+        pollBLEClient(PIPE_CAPTURE_BUDGET_MS);
+        if (millis() - lastExpire >= 1000) {
+            bleExpireJob();
+            lastExpire = millis();
+        }
+        pipeStatsPublish();
+        pipeCaptureLoops++;
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(PIPE_CAPTURE_PERIOD_MS));   // Réveillée plus tôt par pipeCaptureStop()
+    }
+}
+
+/**
+ * Arrêt de la tâche de capture à la fin de son tour, depuis le core 1, avant le sommeil profond
+ * \return false si elle n'a pas acquitté dans PIPE_STOP_WAIT_MS : ses données ne sont pas sûres
+ */
+bool pipeCaptureStop() {
+    if (!pipeCaptureTask || pipeStopped) {
+        return true;
+    }
+    pipeStopWaiter = xTaskGetCurrentTaskHandle();
+    pipeStopRequested = true;
+    xTaskNotifyGive(pipeCaptureTask);
+    uint32_t start = millis();
+    while (!pipeStopped && millis() - start < PIPE_STOP_WAIT_MS) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(PIPE_STOP_WAIT_MS));
+    }
+    return pipeStopped;
+}
+
+/**
+ * Pause de la tâche de capture pendant un rejeu de trace, sans attendre : à rappeler jusqu'à
+ * l'acquittement, qui arrive à la fin du tour en cours
+ * \param pause false pour la reprise
+ * \return true si la pause est acquittée
+ */
+bool pipeCapturePause(bool pause) {
+    if (!pause) {
+        pipePauseRequested.store(false);
+        xTaskNotifyGive(pipeCaptureTask);
+        return false;
+    }
+    if (!pipePauseRequested.load()) {
+        pipePaused.store(false);        // Un acquittement d'une pause précédente ne compte pas
+        pipePauseRequested.store(true);
+        xTaskNotifyGive(pipeCaptureTask);
+    }
+    return pipePaused.load();
+}
+
+/**
+ * Etage d'enregistrement, sur le core 1 (travail de la roue) : écriture des contacts en flash,
+ * événements et propositions de synchronisation
+ */
+void pipeCommit() {
+    PipeContact c;
+    // Sans place dans la file d'événements, les contacts attendent dans pipeContactQueue
+    while (eventRoom() > 0 && xQueueReceive(pipeContactQueue, &c, 0) == pdTRUE) {
+        saveContact(DEVICE_NAME, c.name, c.timestamp);
+        eventPost(EVENT_CONTACT, EVENT_SRC_BLE, c.name);
+        pipeCommitted++;
+    }
+    PipePeer p;
+    while (xQueueReceive(pipePeerQueue, &p, 0) == pdTRUE) {
+        if (pipePeerTarget) {
+            pipePeerTarget(p.addr, p.peer);
+        }
+    }
+}
+
+/**
+ * Enregistrement de tous les contacts en attente, avant le sommeil profond : sans place dans la file
+ * d'événements, ils sont enregistrés sans événement, le graphe d'exposition est reconstruit à partir
+ * du fichier des contacts au réveil complet suivant
+ */
+void pipeCommitAll() {
+    PipeContact c;
+    while (xQueueReceive(pipeContactQueue, &c, 0) == pdTRUE) {
+        saveContact(DEVICE_NAME, c.name, c.timestamp);
+        if (eventRoom() > 0) {
+            eventPost(EVENT_CONTACT, EVENT_SRC_BLE, c.name);
+        }
+        pipeCommitted++;
+    }
+}
+
+/**
+ * Statistiques du pipeline au format "clé valeur" de /stats, à appeler depuis loop()
+ */
+String pipeStats() {
+    String out = "";
+    out += "pipe.contacts_sent " + String(pipeContactsSent) + "\n";
+    out += "pipe.contacts_waited " + String(pipeContactsWaited) + "\n";
+    out += "pipe.contacts_refused " + String(pipeContactsRefused) + "\n";
+    out += "pipe.contacts_wait_max_ms " + String(pipeContactsWaitMaxMs) + "\n";
+    out += "pipe.contacts_high_water " + String(pipeContactHighWater) + "/" + String(PIPE_CONTACT_QUEUE) + "\n";
+    out += "pipe.contacts_committed " + String(pipeCommitted) + "\n";
+    out += "pipe.peers_sent " + String(pipePeersSent) + "\n";
+    out += "pipe.peers_dropped " + String(pipePeersDropped) + "\n";
+    out += "pipe.peers_high_water " + String(pipePeerHighWater) + "/" + String(PIPE_PEER_QUEUE) + "\n";
+    out += "pipe.capture_loops " + String(pipeCaptureLoops) + "\n";
+    if (pipeCaptureTask) {
+        out += "pipe.capture_stack_free " + String(uxTaskGetStackHighWaterMark(pipeCaptureTask)) + "/" + String(PIPE_CAPTURE_STACK) + "\n";
+    }
+    out += "pipe.loop_stack_free " + String(uxTaskGetStackHighWaterMark(NULL)) + "\n";
+    out += "pipe.blesync_stack_free " + String(bleSyncStackFree) + "/" + String(BLE_SYNC_STACK) + "\n";
+    return out;
 }
 
 /**
- * \brief Fonction de configuration du Core 0
- * 
- * Cette fonction permet de configurer le Core 0 pour y affecter une tâche.
- * 
+ * \brief Démarrage du pipeline, après setupBLESync() et setupBLE()
+ *
+ * Les travaux BLE de loop() sont remplacés par la tâche de capture, affectée au core 0 :
  * \code{.cpp}
- * void setupMyCore0(){
- *   // Initialisation d'une tâche que nous allons mettre sur le Core 0
- *   xTaskCreatePinnedToCore(
- *     loop2,          // Nom de la fonction associée à la tâche
- *     "secondLoop",   // Nom de la tâche
- *     10000,           // Taille mémoire assignée à la tâche
- *     NULL,           // Mettre NULL dans tous les cas
- *     0,              // Priorité de la tâche : 0 étant la haute priorité. *IMPORTANT* Si priorité 1 et pas d'activité sur la tâche alors l'ESP est redémarré
- *     &Task1,         // Reference d'une variable taskHandle
- *     0);             // Choisir le core 0 ou 1
- * }
+ * xTaskCreatePinnedToCore(
+ *   pipeCaptureLoop,       // Nom de la fonction associée à la tâche
+ *   "bleCapture",          // Nom de la tâche
+ *   PIPE_CAPTURE_STACK,    // Taille mémoire assignée à la tâche, cf. pipe.capture_stack_free sur /stats
+ *   NULL,                  // Mettre NULL dans tous les cas
+ *   PIPE_CAPTURE_PRIORITY, // Priorité de la tâche
+ *   &pipeCaptureTask,      // Reference d'une variable taskHandle
+ *   0);                    // Choisir le core 0 ou 1
  * \endcode
  */
 void setupMyCore0(){
-  // Initialisation d'une tâche que nous allons mettre sur le Core 0
-  xTaskCreatePinnedToCore(
-    loop2,          // Nom de la fonction associée à la tâche
-    "secondLoop",   // Nom de la tâche
-    10000,           // Taille mémoire assignée à la tâche
-    NULL,           // Mettre NULL dans tous les cas
-    0,              // Priorité de la tâche : 0 étant la haute priorité. *IMPORTANT* Si priorité 1 et pas d'activité sur la tâche alors l'ESP est redémarré
-    &Task1,         // Reference d'une variable taskHandle
-    0);             // Choisir le core 0 ou 1
+    if (!bleConfig.scan) {
+        return;
+    }
+    pipeContactQueue = xQueueCreate(PIPE_CONTACT_QUEUE, sizeof(PipeContact));
+    pipePeerQueue = xQueueCreate(PIPE_PEER_QUEUE, sizeof(PipePeer));
+    if (!pipeContactQueue || !pipePeerQueue) {
+        MYDEBUG_PRINTLN("-CORE0 : Création des files impossible, le BLE reste traité par loop()");
+        return;
+    }
+    pipePeerTarget = bleNewPeerHook;
+    bleNewPeerHook = pipePeerPush;
+    encounterContactHook = pipeContactPush;
+    timerSetPriority(timerEvery("commit", 20, pipeCommit), TIMER_PRIO_HIGH);
+    timerCancel(bleJobPoll);
+    timerCancel(bleJobExpire);
+    xTaskCreatePinnedToCore(
+      pipeCaptureLoop,        // Nom de la fonction associée à la tâche
+      "bleCapture",           // Nom de la tâche
+      PIPE_CAPTURE_STACK,     // Taille mémoire assignée à la tâche
+      NULL,                   // Mettre NULL dans tous les cas
+      PIPE_CAPTURE_PRIORITY,  // Priorité de la tâche
+      &pipeCaptureTask,       // Reference d'une variable taskHandle
+      0);                     // Choisir le core 0 ou 1
+    if (pipeCaptureTask) {
+        traceCapturePause = pipeCapturePause;
+    }
+    MYDEBUG_PRINTLN("-CORE0 : Capture BLE sur le core 0, enregistrement sur le core 1");
 }
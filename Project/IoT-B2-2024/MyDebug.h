@@ -9,7 +9,11 @@
  * 
  * Ainsi, la macro MYDEBUG permet de configurer le comportement dans le fichier principal :
  * - #define MYDEBUG 1 : le compilateur remplace les macros par des appels au port série,
- * - #define MYDEBUG 0 : le compilateur remplace les macros par ... rien et les ignore donc.
+ * - #define MYDEBUG 0 (ou pas de #define) : le compilateur remplace les macros par ... rien et les
+ *   ignore donc. Le test est un #if et non un #ifdef, qui était vrai même avec MYDEBUG à 0.
+ *
+ * Ces appels sont synchrones : ils sont gardés pour les messages du démarrage. Les chemins
+ * fréquents utilisent le journal en mémoire de \ref log.
  * 
  * \note L'activation du mode debug se fait à l'aide de la macro MYDEBUG. Il faut donc qu'elle soit initialisée \b avant 
  * le #include de ce fichier si on veut qu'il soit pris en compte.
@@ -18,7 +22,11 @@
  * Fichier \ref MyDebug.h
  */
 
-#ifdef MYDEBUG
+#ifndef MYDEBUG
+ #define MYDEBUG 0
+#endif
+
+#if MYDEBUG
  #define MYDEBUG_PRINT(x)     Serial.print (x)
  #define MYDEBUG_PRINTDEC(x)  Serial.print (x, DEC)
  #define MYDEBUG_PRINTHEX(x)  Serial.print (x, HEX)
@@ -29,11 +37,11 @@
  #define MYDEBUG_PRINTDEC(x)
  #define MYDEBUG_PRINTHEX(x)
  #define MYDEBUG_PRINTLN(x)
- #define MYDEBUG_PRINTF(x)
+ #define MYDEBUG_PRINTF(...)
 #endif
 
 void setupDebug(){
-#ifdef MYDEBUG 
+#if MYDEBUG
   Serial.begin(115200);
   MYDEBUG_PRINTLN("Ouverture du port série");
 #endif  
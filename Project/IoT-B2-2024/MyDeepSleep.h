@@ -11,6 +11,31 @@
  * Vous pouvez utiliser le prefixe RTC_DATA_ATTR devant la déclaration d'une variable pour qu'elle soit stockée
  * en mémoire et récupérée au redémarrage.
  * 
+ * \section lowpower Mode basse consommation
+ * Avec LOWPOWER_ENABLED, la carte ne tourne plus en continu mais par cycles :
+ * - réveil court (LOWPOWER_SCAN_MS) : écoute et annonce BLE seulement, agrégation des rencontres,
+ *   sans monter le SPIFFS ni démarrer le WiFi ;
+ * - écriture groupée : quand LOWPOWER_PERSIST_AT contacts attendent, ou tous les
+ *   LOWPOWER_PERSIST_WAKES réveils, les contacts en attente sont écrits dans contacts.json avant
+ *   de se rendormir (toujours sans WiFi) ;
+ * - réveil complet, au démarrage, toutes les LOWPOWER_PUBLISH_S secondes ou quand la file des
+ *   contacts est presque pleine : setup() complet, synchronisation des positifs, publication des
+ *   contacts, puis sommeil dès que tout est publié (au moins LOWPOWER_ONLINE_MS, au plus
+ *   LOWPOWER_ONLINE_MAX_MS) ;
+ * - sommeil profond de LOWPOWER_SLEEP_S secondes.
+ *
+ * La table des rencontres \ref encounter, les contacts en attente et les paramètres de config.json
+ * utiles au scan sont conservés en mémoire RTC (RTC_DATA_ATTR). Les dates des rencontres sont
+ * recalées sur le millis() du réveil suivant : une rencontre continue d'accumuler du temps de
+ * proximité d'un réveil à l'autre, tant que LOWPOWER_SCAN_MS + LOWPOWER_SLEEP_S reste inférieur à
+ * ENCOUNTER_GAP_MS. L'heure est celle de l'horloge système, conservée pendant le sommeil profond
+ * et mise à l'heure par \ref ntp lors des réveils complets.
+ *
+ * Le courant moyen est estimé à partir des durées d'éveil (démarrage compris) et de sommeil et des
+ * courants typiques LOWPOWER_MA_xxx ; il est visible sur /stats (lowpower.*) avec la durée moyenne
+ * d'un réveil court et complet et le nombre de contacts capturés par réveil, et affiché à chaque
+ * mise en sommeil.
+ *
  * Fichier \ref MyDeepSleep.h
  */
 
@@ -41,3 +66,254 @@ void myDeepSleep(){
   esp_sleep_enable_timer_wakeup(TIME_TO_SLEEP * uS_TO_S_FACTOR);
   esp_deep_sleep_start();
 }
+
+/************************** Mode basse consommation **************************/
+
+#define LOWPOWER_ENABLED        0       // 1 : cycles réveil / sommeil profond au lieu d'un fonctionnement continu
+#define LOWPOWER_SCAN_MS        4000    // Durée d'un réveil court
+#define LOWPOWER_SLEEP_S        20      // Durée du sommeil profond
+#define LOWPOWER_PERSIST_AT     8       // Contacts en attente déclenchant une écriture en flash
+#define LOWPOWER_PERSIST_WAKES  30      // Ecriture des contacts en attente au moins tous les N réveils
+#define LOWPOWER_PUBLISH_S      900     // Réveil complet (WiFi, MQTT) au plus tard toutes les 15 minutes
+#define LOWPOWER_ONLINE_MS      20000   // Durée minimale d'un réveil complet, pour recevoir les positifs
+#define LOWPOWER_ONLINE_MAX_MS  60000   // Durée maximale d'un réveil complet
+#define LOWPOWER_RING           16      // Contacts en attente conservés en mémoire RTC
+#define LOWPOWER_BOOT_MS        250     // Démarrage avant setup(), non compté par millis()
+// Courants typiques d'un module ESP32, en mA
+#define LOWPOWER_MA_SCAN        100.0   // CPU et radio BLE en réception
+#define LOWPOWER_MA_ONLINE      130.0   // CPU, WiFi et BLE
+#define LOWPOWER_MA_SLEEP       0.01    // Sommeil profond, horloge RTC seule
+
+// Types de réveil
+#define LOWPOWER_WAKE_SCAN      0
+#define LOWPOWER_WAKE_FULL      1
+
+/* Contact en attente, de la capture vers l'enregistrement et la publication */
+struct LowPowerContact {
+    char name[BLE_NAME_LEN];
+    char timestamp[20];
+    bool persisted;                 // Déjà écrit dans contacts.json
+};
+
+// Etat conservé pendant le sommeil profond
+RTC_DATA_ATTR Encounter lpEncounters[ENCOUNTER_TABLE_SIZE];
+RTC_DATA_ATTR uint16_t lpEncounterActive = 0;
+RTC_DATA_ATTR LowPowerContact lpRing[LOWPOWER_RING];
+RTC_DATA_ATTR uint8_t lpRingHead = 0;
+RTC_DATA_ATTR uint8_t lpRingTail = 0;
+RTC_DATA_ATTR int lpStandBy = 0;        // Paramètres de config.json utiles au scan
+RTC_DATA_ATTR int lpTxPower = 0;
+RTC_DATA_ATTR float lpPathLoss = 0;
+RTC_DATA_ATTR uint32_t lpSincePublishMs = 0;
+RTC_DATA_ATTR uint16_t lpWakesSincePersist = 0;
+// Statistiques, depuis la mise sous tension
+RTC_DATA_ATTR uint32_t lpWakes = 0;
+RTC_DATA_ATTR uint32_t lpWakesFull = 0;
+RTC_DATA_ATTR uint64_t lpScanWakeMs = 0;        // Durée cumulée des réveils courts
+RTC_DATA_ATTR uint64_t lpFullWakeMs = 0;        // Durée cumulée des réveils complets
+RTC_DATA_ATTR uint64_t lpTotalMs = 0;           // Durée totale, sommeil compris
+RTC_DATA_ATTR double lpChargeMaMs = 0;          // Charge consommée estimée, mA.ms
+RTC_DATA_ATTR uint32_t lpContacts = 0;          // Contacts capturés
+RTC_DATA_ATTR uint32_t lpPersistWrites = 0;     // Ecritures groupées en flash
+RTC_DATA_ATTR uint32_t lpLastWakeMs = 0;
+
+uint8_t lpWakeKind = LOWPOWER_WAKE_FULL;
+uint32_t lpWakeContacts = 0;                    // Contacts capturés pendant ce réveil
+
+/**
+ * Contact promu pendant un réveil : mis en attente en mémoire RTC, sans écriture en flash
+ * \return false si la file est pleine, la rencontre sera promue au réveil suivant
+ */
+bool lowPowerContactPush(const char *name, const char *timestamp) {
+    if ((uint8_t)(lpRingHead - lpRingTail) >= LOWPOWER_RING) {
+        return false;
+    }
+    LowPowerContact &c = lpRing[lpRingHead % LOWPOWER_RING];
+    strncpy(c.name, name, BLE_NAME_LEN - 1);
+    c.name[BLE_NAME_LEN - 1] = '\0';
+    strncpy(c.timestamp, timestamp, sizeof(c.timestamp) - 1);
+    c.timestamp[sizeof(c.timestamp) - 1] = '\0';
+    c.persisted = false;
+    lpRingHead++;
+    lpWakeContacts++;
+    lpContacts++;
+    return true;
+}
+
+/**
+ * Ecriture dans contacts.json des contacts en attente qui n'y sont pas encore
+ */
+void lowPowerPersist() {
+    for (uint8_t i = lpRingTail; i != lpRingHead; i++) {
+        LowPowerContact &c = lpRing[i % LOWPOWER_RING];
+        if (!c.persisted) {
+            saveContact(DEVICE_NAME, c.name, c.timestamp);
+            c.persisted = true;
+        }
+    }
+    lpWakesSincePersist = 0;
+    lpPersistWrites++;
+}
+
+/**
+ * Réveil complet : les contacts en attente sont enregistrés puis confiés à la file de publication
+ * de \ref exposure, au rythme où elle se vide
+ */
+void lowPowerFlush() {
+    while (lpRingTail != lpRingHead) {
+        LowPowerContact &c = lpRing[lpRingTail % LOWPOWER_RING];
+        if (!c.persisted) {
+            saveContact(DEVICE_NAME, c.name, c.timestamp);
+            c.persisted = true;
+        }
+        if (eventRoom() == 0 || !exposureQueueContact(c.name)) {
+            return;                 // File d'événements ou de publication pleine, la suite au prochain appel
+        }
+        eventPost(EVENT_CONTACT, EVENT_SRC_BLE, c.name);   // Mise à jour de l'état de santé
+        lpRingTail++;
+    }
+}
+
+/**
+ * Bilan du réveil, sauvegarde des rencontres en mémoire RTC et sommeil profond
+ */
+void lowPowerSleep() {
+    blePaused = true;
+    if (bleScanning) {
+        esp_ble_gap_stop_scanning();
+    }
+    bool captureStopped = pipeCaptureStop();
+    if (captureStopped) {
+        while (bleRingDrain(bleHandleAdvert, BLE_DRAIN_MAX) > 0) {}
+    } else {
+        LOG_W("-DEEPSLEEP : Capture non arrêtée, rencontres en cours abandonnées");
+    }
+    if (pipeContactQueue) {
+        pipeCommitAll();            // Contacts promus sur le core 0, pas encore enregistrés
+    }
+    uint8_t pending = lpRingHead - lpRingTail;
+    lpWakesSincePersist++;
+    if (lpWakeKind == LOWPOWER_WAKE_SCAN && pending > 0 &&
+        (pending >= LOWPOWER_PERSIST_AT || lpWakesSincePersist >= LOWPOWER_PERSIST_WAKES)) {
+        if (SPIFFS.begin(true)) {
+            lowPowerPersist();
+        }
+    }
+
+    uint32_t awake = millis() + LOWPOWER_BOOT_MS;
+    uint32_t sleepMs = LOWPOWER_SLEEP_S * 1000UL;
+    if (lpWakeKind == LOWPOWER_WAKE_FULL) {
+        lpFullWakeMs += awake;
+        lpChargeMaMs += awake * LOWPOWER_MA_ONLINE;
+        lpSincePublishMs = 0;
+    } else {
+        lpScanWakeMs += awake;
+        lpChargeMaMs += awake * LOWPOWER_MA_SCAN;
+        lpSincePublishMs += awake;
+    }
+    lpChargeMaMs += sleepMs * LOWPOWER_MA_SLEEP;
+    lpTotalMs += awake + sleepMs;
+    lpSincePublishMs += sleepMs;
+    lpLastWakeMs = awake;
+    energySample();                 // Fin du réveil, puis sommeil compté d'avance, cf. \ref energy
+    energyAdd(ENERGY_DEEP_SLEEP, sleepMs * 1000ULL);
+
+    // Rencontres en cours, dates recalées sur le millis() du prochain réveil
+    if (captureStopped) {
+        encounterExpire(millis());
+        uint32_t shift = millis() + sleepMs;
+        for (int i = 0; i < ENCOUNTER_TABLE_SIZE; i++) {
+            if (encounters[i].peer != 0) {
+                encounters[i].firstSeen -= shift;
+                encounters[i].lastSeen -= shift;
+            }
+        }
+        memcpy(lpEncounters, encounters, sizeof(lpEncounters));
+        lpEncounterActive = encounterActive;
+    } else {
+        memset(lpEncounters, 0, sizeof(lpEncounters));   // Table peut-être à moitié écrite par le core 0
+        lpEncounterActive = 0;
+    }
+    lpStandBy = minutes_stand_by;
+    lpTxPower = tx_power;
+    lpPathLoss = path_loss;
+
+    char line[140];
+    snprintf(line, sizeof(line), "-DEEPSLEEP : Réveil %s de %lu ms, %lu contacts, %u en attente, courant moyen estimé %.2f mA",
+             lpWakeKind == LOWPOWER_WAKE_FULL ? "complet" : "court", (unsigned long)awake,
+             (unsigned long)lpWakeContacts, (uint8_t)(lpRingHead - lpRingTail),
+             lpTotalMs ? lpChargeMaMs / lpTotalMs : 0.0);
+    MYDEBUG_PRINTLN(line);
+    esp_sleep_enable_timer_wakeup(sleepMs * 1000ULL);
+    esp_deep_sleep_start();
+}
+
+/**
+ * Réveil complet : sommeil dès que les contacts en attente sont publiés, après un temps minimum
+ * pour recevoir les positifs
+ */
+void lowPowerOnlineCheck() {
+    bool done = lpRingTail == lpRingHead && exposureOutboxTail == exposureOutboxHead && publisherPending() == 0;
+    if ((millis() > LOWPOWER_ONLINE_MS && done) || millis() > LOWPOWER_ONLINE_MAX_MS) {
+        lowPowerSleep();
+    }
+}
+
+/**
+ * Choix du type de réveil et restauration de l'état conservé, à appeler au tout début de setup()
+ * \return LOWPOWER_WAKE_SCAN pour un réveil court (BLE seulement), LOWPOWER_WAKE_FULL sinon
+ */
+uint8_t setupLowPower() {
+    if (!LOWPOWER_ENABLED) {
+        return LOWPOWER_WAKE_FULL;
+    }
+    bool fromSleep = esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER;
+    if (fromSleep) {
+        memcpy(encounters, lpEncounters, sizeof(encounters));
+        encounterActive = lpEncounterActive;
+        minutes_stand_by = lpStandBy;
+        tx_power = lpTxPower;
+        path_loss = lpPathLoss;
+    } else {
+        lpRingHead = lpRingTail = 0;  // Mise sous tension : pas d'état à reprendre
+        lpSincePublishMs = 0;
+        lpWakesSincePersist = 0;
+    }
+    lpWakes++;
+    bootCount++;
+    encounterContactHook = lowPowerContactPush;
+    uint8_t pending = lpRingHead - lpRingTail;
+    if (!fromSleep || lpSincePublishMs >= LOWPOWER_PUBLISH_S * 1000UL || pending >= LOWPOWER_RING - 2) {
+        lpWakeKind = LOWPOWER_WAKE_FULL;
+        lpWakesFull++;
+        timerSetPriority(timerEvery("lowpower.flush", 200, lowPowerFlush), TIMER_PRIO_HIGH);
+        timerEvery("lowpower", 1000, lowPowerOnlineCheck);
+    } else {
+        lpWakeKind = LOWPOWER_WAKE_SCAN;
+        timerOnce("lowpower", LOWPOWER_SCAN_MS, lowPowerSleep);
+    }
+    return lpWakeKind;
+}
+
+/**
+ * Statistiques du mode basse consommation au format "clé valeur" de /stats
+ */
+String lowPowerStats() {
+    String out = "";
+    out += "lowpower.enabled " + String(LOWPOWER_ENABLED) + "\n";
+    if (!LOWPOWER_ENABLED) {
+        return out;
+    }
+    uint32_t scanWakes = lpWakes - lpWakesFull;
+    out += "lowpower.wakes " + String(lpWakes) + "\n";
+    out += "lowpower.wakes_full " + String(lpWakesFull) + "\n";
+    out += "lowpower.scan_wake_ms_avg " + String(scanWakes ? (uint32_t)(lpScanWakeMs / scanWakes) : 0) + "\n";
+    out += "lowpower.full_wake_ms_avg " + String(lpWakesFull > 1 ? (uint32_t)(lpFullWakeMs / (lpWakesFull - 1)) : 0) + "\n";
+    out += "lowpower.last_wake_ms " + String(lpLastWakeMs) + "\n";
+    out += "lowpower.avg_current_ma " + String(lpTotalMs ? lpChargeMaMs / lpTotalMs : 0.0, 3) + "\n";
+    out += "lowpower.contacts " + String(lpContacts) + "\n";
+    out += "lowpower.contacts_per_wake " + String(lpWakes ? (float)lpContacts / lpWakes : 0.0, 3) + "\n";
+    out += "lowpower.pending " + String((uint8_t)(lpRingHead - lpRingTail)) + "\n";
+    out += "lowpower.persist_writes " + String(lpPersistWrites) + "\n";
+    return out;
+}
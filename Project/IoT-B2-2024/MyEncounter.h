@@ -0,0 +1,246 @@
+/**
+ * \file MyEncounter.h
+ * \page encounter Rencontres en cours
+ * \brief Ne retenir un contact qu'après minutes_stand_by minutes de proximité
+ *
+ * Chaque annonce d'un CONTACT TRACKER enregistrait un contact dans SPIFFS, avec un horodatage
+ * fictif, sans tenir compte du paramètre minutes_stand_by : une salle pleine provoquait une
+ * écriture en flash par annonce reçue.
+ *
+ * Les annonces sont maintenant agrégées dans une table des rencontres en cours, indexée par
+ * l'identifiant (hash du nom) de l'autre carte : une table à adressage ouvert, à sondage linéaire,
+ * de taille fixe. Chaque rencontre mémorise :
+ * - la date de première et de dernière annonce,
+ * - le temps de proximité cumulé : l'écart entre deux annonces n'est compté que s'il est inférieur
+ *   à ENCOUNTER_GAP_MS (au delà, la carte est considérée comme partie entre temps) et si la
+ *   distance estimée est inférieure à ENCOUNTER_DISTANCE_CM,
+ * - des statistiques sur le RSSI (nombre d'annonces, minimum, maximum, moyenne),
+ * - le RSSI filtré et la distance estimée, cf. \ref rssi.
+ *
+ * Une rencontre devient un contact (saveContact(), avec l'heure réelle) une seule fois, quand le
+ * temps de proximité cumulé atteint minutes_stand_by minutes. Une rencontre sans annonce depuis
+ * ENCOUNTER_EXPIRE_MS est retirée de la table.
+ *
+ * Fichier \ref MyEncounter.h
+ */
+
+#define ENCOUNTER_TABLE_SIZE    64      // Nombre maximum de rencontres en cours, puissance de 2
+#define ENCOUNTER_GAP_MS        30000   // Ecart maximum entre deux annonces compté comme de la proximité
+#define ENCOUNTER_EXPIRE_MS     120000  // Une rencontre sans annonce depuis cette durée est terminée
+#define ENCOUNTER_DISTANCE_CM   200     // Distance maximale (filtrée) comptée comme de la proximité
+
+/* Une rencontre en cours */
+struct Encounter {
+    uint32_t peer;                  // Hash du nom de l'autre carte, 0 si l'entrée est libre
+    uint32_t firstSeen;             // millis
+    uint32_t lastSeen;              // millis
+    uint32_t dwellMs;               // Temps de proximité cumulé
+    uint16_t samples;               // Nombre d'annonces reçues, bloqué à UINT16_MAX (rssiSum aussi)
+    int8_t rssiMin;
+    int8_t rssiMax;
+    int32_t rssiSum;
+    float rssiFiltered;             // Etat du filtre de Kalman : estimation du RSSI
+    float rssiVariance;             // Etat du filtre de Kalman : variance de l'estimation
+    uint16_t distanceCm;            // Distance estimée à partir du RSSI filtré
+    bool promoted;                  // Déjà enregistrée comme contact
+    bool nameMissing;               // Promotion en attente du nom, absent de l'annuaire
+};
+
+Encounter encounters[ENCOUNTER_TABLE_SIZE];
+
+// Statistiques des rencontres
+uint16_t encounterActive = 0;       // Rencontres en cours
+uint32_t encounterPromoted = 0;     // Rencontres enregistrées comme contact
+uint32_t encounterSightings = 0;    // Annonces agrégées
+uint32_t encounterFull = 0;         // Annonces ignorées, table pleine
+uint32_t encounterNameMisses = 0;   // Promotions retardées faute de nom dans l'annuaire
+bool encounterDryRun = false;       // Rejeu de trace : les contacts sont comptés mais pas enregistrés
+// Remise du contact à l'étage d'enregistrement (cf. \ref core0), NULL : enregistrement immédiat
+bool (*encounterContactHook)(const char *name, const char *timestamp) = NULL;
+
+/**
+ * Horodatage UTC au format de contacts.json, ex : "2024-05-17T14:03:59", d'après l'horloge
+ * locale de \ref ntp, sans accès au réseau (elle continue pendant le sommeil profond, cf. \ref deepsleep)
+ */
+void encounterTimestamp(char *out, size_t size) {
+    time_t now = timeNow();
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    strftime(out, size, "%Y-%m-%dT%H:%M:%S", &tm);
+}
+
+/**
+ * Recherche de la rencontre avec une carte, ou de l'entrée libre où l'insérer
+ * \return l'index de l'entrée, -1 si la table est pleine
+ */
+int encounterSlot(uint32_t peer) {
+    for (int n = 0; n < ENCOUNTER_TABLE_SIZE; n++) {
+        int i = (peer + n) & (ENCOUNTER_TABLE_SIZE - 1);
+        if (encounters[i].peer == peer || encounters[i].peer == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Suppression d'une entrée, en recompactant les entrées suivantes de la même chaîne
+ * (pas de marqueur de suppression à gérer)
+ */
+void encounterRemove(int i) {
+    bleNameHold(encounters[i].peer, false);
+    int hole = i;
+    for (int n = 1; n < ENCOUNTER_TABLE_SIZE; n++) {
+        int j = (i + n) & (ENCOUNTER_TABLE_SIZE - 1);
+        if (encounters[j].peer == 0) {
+            break;
+        }
+        int home = encounters[j].peer & (ENCOUNTER_TABLE_SIZE - 1);
+        // L'entrée j peut combler le trou si sa place idéale n'est pas entre le trou et j
+        if (((j - home) & (ENCOUNTER_TABLE_SIZE - 1)) >= ((j - hole) & (ENCOUNTER_TABLE_SIZE - 1))) {
+            encounters[hole] = encounters[j];
+            hole = j;
+        }
+    }
+    encounters[hole].peer = 0;
+    encounterActive--;
+}
+
+/**
+ * Enregistrement de la rencontre comme contact
+ */
+void encounterPromote(Encounter &e) {
+    char name[BLE_NAME_LEN];
+    if (!bleNameCopy(e.peer, name, sizeof(name))) {
+        // Nom réutilisé avant que la rencontre ne le marque : la prochaine annonce nommée le
+        // réenregistre, la promotion est retentée à chaque annonce jusque là
+        if (!e.nameMissing) {
+            e.nameMissing = true;
+            encounterNameMisses++;
+            LOG_W("-ENCOUNTER : Nom de %08x inconnu, contact retardé", e.peer);
+        }
+        return;
+    }
+    e.nameMissing = false;
+    char timestamp[20];
+    encounterTimestamp(timestamp, sizeof(timestamp));
+    if (!encounterDryRun && encounterContactHook && !encounterContactHook(name, timestamp)) {
+        return;                     // Etage d'enregistrement saturé : nouvel essai à la prochaine annonce
+    }
+    if (!encounterDryRun && !encounterContactHook && eventRoom() == 0) {
+        return;                     // File d'événements pleine : nouvel essai à la prochaine annonce
+    }
+    // Le journal est mis en forme plus tard : il lui faut le nom de l'annuaire, pas la copie locale
+    LOG_I("-ENCOUNTER : Nouveau contact %s après %u s, distance %u cm", bleNameLookup(e.peer), e.dwellMs / 1000, e.distanceCm);
+    if (!encounterDryRun && !encounterContactHook) {
+        saveContact(DEVICE_NAME, name, timestamp);
+        eventPost(EVENT_CONTACT, EVENT_SRC_BLE, name);
+    }
+    e.promoted = true;
+    encounterPromoted++;
+}
+
+/**
+ * Prise en compte d'une annonce reçue d'une autre carte
+ * \return la rencontre mise à jour, NULL si l'annonce a été ignorée
+ */
+Encounter *encounterSighting(const AdvRecord &r) {
+    if (r.nameHash == 0) {
+        return NULL;                // Pas de nom, pas d'identifiant
+    }
+    int i = encounterSlot(r.nameHash);
+    if (i < 0) {
+        encounterFull++;
+        return NULL;
+    }
+    encounterSightings++;
+    Encounter &e = encounters[i];
+    if (e.peer == 0) {
+        memset(&e, 0, sizeof(e));
+        e.peer = r.nameHash;
+        e.firstSeen = r.ms;
+        e.lastSeen = r.ms;
+        e.rssiMin = r.rssi;
+        e.rssiMax = r.rssi;
+        rssiKalmanInit(e.rssiFiltered, e.rssiVariance, r.rssi);
+        encounterActive++;
+        scanSchedulerNewPeer();
+    } else {
+        rssiKalmanUpdate(e.rssiFiltered, e.rssiVariance, r.rssi);
+    }
+    // Le nom reste dans l'annuaire jusqu'à la fin de la rencontre, y compris s'il y revient après
+    // avoir été remplacé
+    bleNameHold(e.peer, true);
+    e.distanceCm = rssiDistanceCm(e.rssiFiltered);
+    uint32_t gap = r.ms - e.lastSeen;
+    if (gap <= ENCOUNTER_GAP_MS) {
+        if (e.samples > 0) scanSchedulerSighting(gap);
+        if (e.distanceCm <= ENCOUNTER_DISTANCE_CM) e.dwellMs += gap;
+    }
+    e.lastSeen = r.ms;
+    if (e.samples < UINT16_MAX) {   // Au delà, la moyenne reste celle des UINT16_MAX premières annonces
+        e.samples++;
+        e.rssiSum += r.rssi;
+    }
+    if (r.rssi < e.rssiMin) e.rssiMin = r.rssi;
+    if (r.rssi > e.rssiMax) e.rssiMax = r.rssi;
+
+    if (!e.promoted && e.distanceCm <= ENCOUNTER_DISTANCE_CM && e.dwellMs >= (uint32_t)minutes_stand_by * 60000UL) {
+        encounterPromote(e);
+    }
+    return &e;
+}
+
+/**
+ * Fin des rencontres sans annonce depuis ENCOUNTER_EXPIRE_MS
+ * \param now date courante (millis, ou date dans la trace pour un rejeu)
+ */
+void encounterExpire(uint32_t now) {
+    for (int i = 0; i < ENCOUNTER_TABLE_SIZE; i++) {
+        // Après une suppression, une autre entrée a pu être déplacée en i : on la vérifie aussi
+        while (encounters[i].peer != 0 && now - encounters[i].lastSeen > ENCOUNTER_EXPIRE_MS) {
+            encounterRemove(i);
+        }
+    }
+}
+
+/**
+ * Fin de toutes les rencontres en cours
+ */
+void encounterClear() {
+    bleNameReleaseAll();
+    memset(encounters, 0, sizeof(encounters));
+    encounterActive = 0;
+}
+
+/**
+ * Copie de la table des rencontres dans saved, de ENCOUNTER_TABLE_SIZE entrées, déjà alloué
+ */
+void encounterSaveTo(Encounter *saved) {
+    memcpy(saved, encounters, sizeof(encounters));
+}
+
+/**
+ * Copie de la table des rencontres, avant un rejeu qui la remplit de cartes simulées
+ * \return la copie, à rendre à encounterRestore(), NULL si la mémoire est insuffisante
+ */
+Encounter *encounterSave() {
+    Encounter *saved = (Encounter *)malloc(sizeof(encounters));
+    if (saved) {
+        encounterSaveTo(saved);
+    }
+    return saved;
+}
+
+/**
+ * Retour aux rencontres copiées par encounterSave(), puis libération de la copie. Les marques
+ * de l'annuaire sont celles de la copie de l'annuaire, rétablie avant, cf. bleNameRestore()
+ */
+void encounterRestore(Encounter *saved) {
+    memcpy(encounters, saved, sizeof(encounters));
+    free(saved);
+    encounterActive = 0;
+    for (int i = 0; i < ENCOUNTER_TABLE_SIZE; i++) {
+        if (encounters[i].peer != 0) encounterActive++;
+    }
+}
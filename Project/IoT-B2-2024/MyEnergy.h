@@ -0,0 +1,285 @@
+/**
+ * \file MyEnergy.h
+ * \page energy Bilan énergétique
+ * \brief Temps passé dans chaque état radio et charge consommée estimée, par sous-système
+ *
+ * Le rythme du scan BLE (\ref scanscheduler), le mode WIFI_AP_STA (\ref wifi), les PINGREQ MQTT
+ * (\ref adafruitio) et le mode basse consommation (\ref deepsleep) sont autant de compromis avec
+ * l'autonomie de la batterie, mais seul le mode basse consommation en donnait une estimation
+ * globale.
+ *
+ * Ce module compte le temps passé dans chaque état, en microsecondes :
+ * - cpu : carte éveillée,
+ * - ble_scan : fenêtres de scan BLE, d'après le mode de scan en cours (scanSchedulerAccount()),
+ *   seulement quand le scan tourne (ni arrêté, ni suspendu pendant une synchronisation BLE),
+ * - wifi_tx, wifi_rx : temps d'antenne estimé à partir des octets échangés (MQTT, contenu des
+ *   réponses du serveur web, console telnet) : ENERGY_WIFI_PACKET_US par paquet, plus la durée des
+ *   octets au débit ENERGY_WIFI_MBPS ; l'échange NTP, quelques octets par heure, les en-têtes HTTP
+ *   et les requêtes reçues par le serveur web, qui ne sont pas mesurés, sont négligés,
+ * - wifi_ap : point d'accès actif, récepteur allumé en permanence et balises toutes les 102 ms,
+ * - wifi_listen : mode Station sans économie d'énergie, ou à la recherche du point d'accès,
+ * - modem_sleep : mode Station associé, la radio ne se réveille que pour les balises (DTIM),
+ * - deep_sleep : sommeil profond, cf. lowPowerSleep().
+ *
+ * Les états radio s'ajoutent à l'état cpu : le modèle donne pour chaque état le courant ajouté, en
+ * mA, ENERGY_MA_xxx par défaut, remplacé par le fichier /energy.json s'il existe (cf. \ref spiffs),
+ * ou par la route /energy du serveur web (ex : /energy?wifi_tx=190). La charge est recalculée à
+ * partir des durées à chaque lecture : un changement de modèle s'applique à tout l'historique.
+ *
+ * Sur /stats (energy.*) : durée et charge en mAh de chaque état, et pour chaque sous-système (cpu,
+ * ble, wifi, sleep) la charge moyenne par heure, en mAh/h, c'est à dire le courant moyen. Les
+ * compteurs sont conservés en mémoire RTC pendant le sommeil profond. Chaque jour (heure locale,
+ * une fois la carte à l'heure), le bilan de la veille est ajouté au fichier /energy.csv ; pendant
+ * les réveils courts du mode basse consommation, sans SPIFFS, le changement de jour attend le
+ * réveil complet suivant.
+ *
+ * Le temps de scan BLE est compté sur le core 0 (tâche de capture, \ref core0), le reste et la
+ * remise à zéro du jour sur le core 1 : les compteurs de 64 bits sont protégés par un verrou
+ * (portMUX, section critique de quelques instructions), et lus par copie.
+ *
+ * Fichier \ref MyEnergy.h
+ */
+
+// Courants ajoutés par chaque état, en mA, valeurs typiques d'un module ESP32 à 240 MHz
+#define ENERGY_MA_CPU           40.0
+#define ENERGY_MA_BLE_SCAN      60.0
+#define ENERGY_MA_WIFI_TX       180.0
+#define ENERGY_MA_WIFI_RX       60.0
+#define ENERGY_MA_WIFI_AP       80.0
+#define ENERGY_MA_WIFI_LISTEN   60.0
+#define ENERGY_MA_MODEM_SLEEP   15.0
+#define ENERGY_MA_DEEP_SLEEP    0.01
+
+#define ENERGY_WIFI_MBPS        24      // Débit radio moyen supposé
+#define ENERGY_WIFI_PACKET_US   150     // Préambule, attente du canal et acquittement, par paquet
+#define ENERGY_WIFI_MSS         1460    // Octets utiles par paquet TCP
+#define ENERGY_SAMPLE_MS        1000    // Rythme du travail "energy"
+
+// Etats
+#define ENERGY_CPU              0
+#define ENERGY_BLE_SCAN         1
+#define ENERGY_WIFI_TX          2
+#define ENERGY_WIFI_RX          3
+#define ENERGY_WIFI_AP          4
+#define ENERGY_WIFI_LISTEN      5
+#define ENERGY_MODEM_SLEEP      6
+#define ENERGY_DEEP_SLEEP       7
+#define ENERGY_STATES           8
+
+/* Un état et son courant dans le modèle */
+struct EnergyState {
+    const char *name;
+    const char *subsystem;
+    float ma;
+};
+
+EnergyState energyStates[ENERGY_STATES] = {
+    { "cpu",         "cpu",   ENERGY_MA_CPU },
+    { "ble_scan",    "ble",   ENERGY_MA_BLE_SCAN },
+    { "wifi_tx",     "wifi",  ENERGY_MA_WIFI_TX },
+    { "wifi_rx",     "wifi",  ENERGY_MA_WIFI_RX },
+    { "wifi_ap",     "wifi",  ENERGY_MA_WIFI_AP },
+    { "wifi_listen", "wifi",  ENERGY_MA_WIFI_LISTEN },
+    { "modem_sleep", "wifi",  ENERGY_MA_MODEM_SLEEP },
+    { "deep_sleep",  "sleep", ENERGY_MA_DEEP_SLEEP },
+};
+const char *energySubsystems[] = { "cpu", "ble", "wifi", "sleep" };
+
+// Durées depuis la mise sous tension, et depuis le début du jour, conservées pendant le sommeil profond
+RTC_DATA_ATTR uint64_t energyUs[ENERGY_STATES];
+RTC_DATA_ATTR uint64_t energyDayUs[ENERGY_STATES];
+RTC_DATA_ATTR char energyDate[11] = "";    // Jour en cours, "2024-05-17", vide : pas encore à l'heure
+RTC_DATA_ATTR uint32_t energyDaysLogged = 0;
+
+int64_t energyLastUs = 0;           // Dernier échantillon, esp_timer
+portMUX_TYPE energyMux = portMUX_INITIALIZER_UNLOCKED;   // energyUs et energyDayUs, écrits depuis les deux cores
+// Bilan d'un jour, renseigné par setupSPIFFS()
+void (*energyDaySink)(const String &line) = NULL;
+
+/**
+ * Temps passé dans un état
+ */
+inline void energyAdd(uint8_t state, uint64_t us) {
+    portENTER_CRITICAL(&energyMux);
+    energyUs[state] += us;
+    energyDayUs[state] += us;
+    portEXIT_CRITICAL(&energyMux);
+}
+
+/**
+ * Copie cohérente des compteurs, pour les lire sans verrou
+ */
+void energySnapshot(uint64_t *us, uint64_t *dayUs) {
+    portENTER_CRITICAL(&energyMux);
+    memcpy(us, energyUs, sizeof(energyUs));
+    memcpy(dayUs, energyDayUs, sizeof(energyDayUs));
+    portEXIT_CRITICAL(&energyMux);
+}
+
+/**
+ * Temps d'antenne d'un échange WiFi
+ * \param state ENERGY_WIFI_TX ou ENERGY_WIFI_RX
+ * \param packets nombre de paquets, ou 0 s'ils sont comptés ailleurs (lectures par morceaux)
+ */
+void energyWifiTraffic(uint8_t state, uint32_t bytes, uint32_t packets) {
+    energyAdd(state, (uint64_t)packets * ENERGY_WIFI_PACKET_US + (uint64_t)bytes * 8 / ENERGY_WIFI_MBPS);
+}
+
+inline void energyWifiTx(uint32_t bytes) {
+    energyWifiTraffic(ENERGY_WIFI_TX, bytes, (bytes + ENERGY_WIFI_MSS - 1) / ENERGY_WIFI_MSS);
+}
+
+/**
+ * Charge consommée dans un état, en mAh
+ */
+double energyMah(const uint64_t *us, uint8_t state) {
+    return (double)us[state] * energyStates[state].ma / 3.6e9;
+}
+
+/**
+ * Charge consommée par un sous-système, en mAh
+ */
+double energySubsystemMah(const uint64_t *us, const char *subsystem) {
+    double mah = 0;
+    for (uint8_t i = 0; i < ENERGY_STATES; i++) {
+        if (strcmp(energyStates[i].subsystem, subsystem) == 0) {
+            mah += energyMah(us, i);
+        }
+    }
+    return mah;
+}
+
+/**
+ * Charge totale consommée, en mAh
+ */
+double energyTotalMah(const uint64_t *us) {
+    double mah = 0;
+    for (uint8_t i = 0; i < ENERGY_STATES; i++) {
+        mah += energyMah(us, i);
+    }
+    return mah;
+}
+
+/**
+ * Bilan d'un jour, une ligne de /energy.csv : date;cpu;ble;wifi;sleep;total, en mAh
+ */
+String energyDayLine(const char *date, const uint64_t *dayUs) {
+    String line = date;
+    for (uint8_t s = 0; s < sizeof(energySubsystems) / sizeof(energySubsystems[0]); s++) {
+        line += ";" + String(energySubsystemMah(dayUs, energySubsystems[s]), 2);
+    }
+    line += ";" + String(energyTotalMah(dayUs), 2);
+    return line;
+}
+
+/**
+ * Changement de jour, heure locale : écriture du bilan de la veille et remise à zéro
+ */
+void energyDayCheck() {
+    if (!timeSynced || !energyDaySink) {
+        return;
+    }
+    char date[11];
+    timeFormatLocal(date, sizeof(date), "%Y-%m-%d");
+    if (energyDate[0] == 0) {
+        strcpy(energyDate, date);   // Premier jour, incomplet, compté depuis la mise sous tension
+        return;
+    }
+    if (strcmp(date, energyDate) == 0) {
+        return;
+    }
+    uint64_t dayUs[ENERGY_STATES];
+    portENTER_CRITICAL(&energyMux);
+    memcpy(dayUs, energyDayUs, sizeof(dayUs));
+    memset(energyDayUs, 0, sizeof(energyDayUs));
+    portEXIT_CRITICAL(&energyMux);
+    String line = energyDayLine(energyDate, dayUs);
+    energyDaySink(line);
+    MYDEBUG_PRINT("-ENERGY : Bilan (date;cpu;ble;wifi;sleep;total mAh) ");
+    MYDEBUG_PRINTLN(line);
+    strcpy(energyDate, date);
+    energyDaysLogged++;
+}
+
+/**
+ * Travail "energy" : temps écoulé depuis l'échantillon précédent, attribué à l'état du CPU et du WiFi
+ */
+void energySample() {
+    int64_t now = esp_timer_get_time();
+    uint64_t dt = now - energyLastUs;
+    energyLastUs = now;
+    energyAdd(ENERGY_CPU, dt);
+    wifi_mode_t mode = WiFi.getMode();
+    if (mode & WIFI_MODE_AP) {
+        energyAdd(ENERGY_WIFI_AP, dt);      // Le point d'accès empêche aussi l'économie d'énergie de la Station
+    } else if (mode & WIFI_MODE_STA) {
+        if (WiFi.status() == WL_CONNECTED && WiFi.getSleep()) {
+            energyAdd(ENERGY_MODEM_SLEEP, dt);
+        } else {
+            energyAdd(ENERGY_WIFI_LISTEN, dt);
+        }
+    }
+    energyDayCheck();
+}
+
+/**
+ * Bilan énergétique au format "clé valeur" de /stats
+ */
+String energyStats() {
+    String out = "";
+    uint64_t us[ENERGY_STATES], dayUs[ENERGY_STATES];
+    energySnapshot(us, dayUs);
+    uint64_t totalUs = us[ENERGY_CPU] + us[ENERGY_DEEP_SLEEP];
+    double hours = totalUs / 3.6e9;
+    double total = energyTotalMah(us);
+    for (uint8_t i = 0; i < ENERGY_STATES; i++) {
+        out += "energy." + String(energyStates[i].name) + "_ms " + String((uint32_t)(us[i] / 1000)) + "\n";
+        out += "energy." + String(energyStates[i].name) + "_mah " + String(energyMah(us, i), 3) + "\n";
+    }
+    for (uint8_t s = 0; s < sizeof(energySubsystems) / sizeof(energySubsystems[0]); s++) {
+        double mah = energySubsystemMah(us, energySubsystems[s]);
+        out += "energy." + String(energySubsystems[s]) + "_mah_per_h " + String(hours > 0 ? mah / hours : 0.0, 3) + "\n";
+    }
+    out += "energy.total_mah " + String(total, 3) + "\n";
+    out += "energy.avg_ma " + String(hours > 0 ? total / hours : 0.0, 3) + "\n";
+    out += "energy.day_mah " + String(energyTotalMah(dayUs), 3) + "\n";
+    out += "energy.days_logged " + String(energyDaysLogged) + "\n";
+    return out;
+}
+
+/**
+ * Modèle de courant au format "état mA", pour /energy
+ */
+String energyModel() {
+    String out = "";
+    for (uint8_t i = 0; i < ENERGY_STATES; i++) {
+        out += String(energyStates[i].name) + " " + String(energyStates[i].ma, 2) + "\n";
+    }
+    return out;
+}
+
+/**
+ * Modification du courant d'un état
+ * \return false si l'état est inconnu ou le courant négatif
+ */
+bool energySetModel(const char *name, float ma) {
+    if (ma < 0) {
+        return false;
+    }
+    for (uint8_t i = 0; i < ENERGY_STATES; i++) {
+        if (strcmp(energyStates[i].name, name) == 0) {
+            energyStates[i].ma = ma;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Démarrage du décompte, au tout début de setup() (réveil court compris) : le temps écoulé depuis
+ * le démarrage de la carte est compté au premier échantillon
+ */
+void setupEnergy() {
+    energyLastUs = 0;
+    timerSetPriority(timerEvery("energy", ENERGY_SAMPLE_MS, energySample), TIMER_PRIO_LOW);
+}
@@ -0,0 +1,109 @@
+/**
+ * \file MyEvents.h
+ * \page events File d'événements
+ * \brief Prévenir l'application de ce qui se passe, sans qu'elle relise les fichiers
+ *
+ * L'état de santé était déduit à plusieurs endroits (handleContactTracer(), positiveListCallback(),
+ * callbacks BLE), chacun relisant contacts.json et positivelist.json.
+ *
+ * Les modules (BLE, MQTT, HTTP) postent maintenant des événements typés dans une file circulaire de
+ * taille fixe, vidée par la machine à états de \ref yct. Les producteurs comme le consommateur tournent
+ * tous dans loop() : la file n'a pas besoin de verrou.
+ *
+ * Les rafales ne doivent pas la remplir :
+ * - un EVENT_POSITIVE n'est qu'un signal, le consommateur reprend la liste des positifs là où il
+ *   s'était arrêté : il est fusionné avec celui déjà en attente, une rafale de positifs (rattrapage
+ *   \ref positivesync) ne prend qu'une place,
+ * - les messages MQTT ne sont lus que s'il reste plus de EVENT_RESERVE places (cf. processFeeds()),
+ *   les suivants attendent dans la connexion TCP ; les places réservées restent aux contacts BLE,
+ *   aux requêtes HTTP et aux messages reçus pendant l'attente d'un PINGRESP ou d'un SUBACK,
+ * - les contacts BLE attendent dans leur propre file (\ref core0, \ref deepsleep) tant qu'il n'y a
+ *   pas de place.
+ * Si la file est malgré tout pleine, l'événement est perdu et compté.
+ *
+ * Fichier \ref MyEvents.h
+ */
+
+#define EVENT_QUEUE_SIZE    32      // Taille de la file, puissance de 2
+#define EVENT_RESERVE       8       // Places que la lecture des messages MQTT laisse aux autres producteurs
+#define EVENT_DATA_LEN      52      // Données d'un événement (avec le \0), assez pour "C:id1:id2"
+
+// Types d'événements
+#define EVENT_CONTACT       1       // Nouveau contact enregistré, data : nom de l'autre carte
+#define EVENT_POSITIVE      2       // Nouveaux positifs dans la liste, data : identifiant du premier
+#define EVENT_CONTACT_LIST  3       // Contact publié par une autre carte, data : "C:id1:id2"
+#define EVENT_DECLARE       4       // Déclaration de notre positivité, data : notre nom
+
+// Origines des événements
+#define EVENT_SRC_BLE       0
+#define EVENT_SRC_MQTT      1
+#define EVENT_SRC_HTTP      2
+
+/* Un événement */
+struct Event {
+    uint8_t type;
+    uint8_t source;
+    char data[EVENT_DATA_LEN];
+};
+
+Event eventQueue[EVENT_QUEUE_SIZE];
+uint8_t eventHead = 0;
+uint8_t eventTail = 0;
+
+// Statistiques de la file
+uint32_t eventsPosted = 0;
+uint32_t eventsDropped = 0;         // Evénements perdus, file pleine
+uint32_t eventsCoalesced = 0;       // EVENT_POSITIVE fusionnés avec celui déjà en attente
+uint8_t eventHighWater = 0;         // Remplissage maximum de la file
+
+/**
+ * Places libres dans la file
+ */
+inline uint8_t eventRoom() {
+    return EVENT_QUEUE_SIZE - (uint8_t)(eventHead - eventTail);
+}
+
+/**
+ * Ajout d'un événement dans la file
+ * \return false si la file est pleine et que l'événement est perdu
+ */
+bool eventPost(uint8_t type, uint8_t source, const char *data) {
+    if (type == EVENT_POSITIVE) {
+        for (uint8_t i = eventTail; i != eventHead; i++) {
+            if (eventQueue[i % EVENT_QUEUE_SIZE].type == EVENT_POSITIVE) {
+                eventsCoalesced++;
+                return true;
+            }
+        }
+    }
+    uint8_t used = eventHead - eventTail;
+    if (used >= EVENT_QUEUE_SIZE) {
+        eventsDropped++;
+        LOG_W("-EVENTS : File pleine, événement perdu");
+        return false;
+    }
+    if (used + 1 > eventHighWater) {
+        eventHighWater = used + 1;
+    }
+    Event &e = eventQueue[eventHead % EVENT_QUEUE_SIZE];
+    e.type = type;
+    e.source = source;
+    strncpy(e.data, data ? data : "", EVENT_DATA_LEN - 1);
+    e.data[EVENT_DATA_LEN - 1] = '\0';
+    eventHead++;
+    eventsPosted++;
+    return true;
+}
+
+/**
+ * Retrait du plus ancien événement
+ * \return false si la file est vide
+ */
+bool eventPop(Event &e) {
+    if (eventTail == eventHead) {
+        return false;
+    }
+    e = eventQueue[eventTail % EVENT_QUEUE_SIZE];
+    eventTail++;
+    return true;
+}
@@ -0,0 +1,672 @@
+/**
+ * \file MyExposure.h
+ * \page exposure Graphe d'exposition
+ * \brief Savoir si un contact de nos contacts est positif, sans tout recalculer
+ *
+ * getEtatSante() relit contacts.json et positivelist.json à chaque appel et ne répond qu'à une question :
+ * un de nos contacts directs est-il positif ?
+ *
+ * Ce module maintient en mémoire un graphe des contacts connus :
+ * - les noeuds sont les cartes (identifiées par le hash FNV-1a de leur nom, cf. \ref positivesync),
+ * - les arêtes sont les contacts : nos propres contacts (contacts.json, rencontres promues par
+ *   \ref encounter, ajouts manuels) et ceux publiés par les autres cartes sur le feed data.contactlist
+ *   au format "C:id1:id2".
+ *
+ * Chaque noeud garde sa distance à notre carte, bornée à 2 (0 : nous, 1 : contact direct, 2 : contact
+ * d'un contact, EXPOSURE_FAR au delà), et le graphe compte les positifs à chaque distance. Les mises
+ * à jour sont incrémentales :
+ * - un nouveau positif ne coûte qu'une recherche dans la table des noeuds,
+ * - un nouveau contact ne fait baisser la distance que des deux extrémités et, au plus, de leurs voisins
+ *   (la distance étant bornée à 2, la propagation s'arrête après deux sauts).
+ * exposureRecompute() refait le calcul complet (parcours en largeur), pour vérification, et après
+ * chaque retrait de contacts (qui peut faire remonter des distances).
+ *
+ * Le graphe est de taille fixe (EXPOSURE_NODES noeuds, EXPOSURE_EDGES demi-arêtes) ; il est reconstruit
+ * au démarrage depuis contacts.json. Pour qu'il ne se remplisse pas une fois pour toutes :
+ * - seules les cartes qui ont un contact sont des noeuds : un positif sans contact connu reste dans la
+ *   liste de \ref positivesync, et son noeud est marqué positif s'il apparaît plus tard,
+ * - chaque contact porte son jour ; les contacts de plus de days_of_historic jours sont retirés
+ *   (exposureAge(), toutes les EXPOSURE_AGE_MS), et les noeuds qui n'ont plus de contact avec eux,
+ * - EXPOSURE_OWN_NODES noeuds et EXPOSURE_OWN_EDGES demi-arêtes sont réservés à nos propres contacts :
+ *   le feed data.contactlist ne peut pas les prendre,
+ * - quand la place manque, un contact est retiré pour faire de la place : d'abord un contact entre
+ *   d'autres cartes, le plus loin de nous (la distance la plus petite de ses deux extrémités est la
+ *   plus grande) puis le plus ancien ; un des nôtres seulement pour un des nôtres, le plus ancien.
+ *
+ * exposureBenchmark() construit un graphe aléatoire (10 000 noeuds par défaut), dans des tableaux alloués
+ * le temps du test, et compare le coût des mises à jour incrémentales à celui du recalcul complet.
+ * Pour le lancer, décommenter l'appel dans setup(), avant setupWiFi() : il faut environ 230 Ko de tas.
+ *
+ * Fichier \ref MyExposure.h
+ */
+
+#define EXPOSURE_NODES      256     // Nombre maximum de cartes suivies
+#define EXPOSURE_INDEX      512     // Taille de l'index des noeuds, puissance de 2 supérieure à EXPOSURE_NODES
+#define EXPOSURE_EDGES      1024    // Nombre maximum de demi-arêtes (2 par contact), pair
+#define EXPOSURE_OWN_NODES  64      // Noeuds réservés à nos propres contacts
+#define EXPOSURE_OWN_EDGES  128     // Demi-arêtes réservées à nos propres contacts
+#define EXPOSURE_EVICT_MAX  4       // Contacts retirés au plus pour faire de la place à un nouveau
+#define EXPOSURE_AGE_MS     3600000 // Rythme du retrait des contacts trop anciens
+#define EXPOSURE_FAR        3       // Distance des cartes à plus de 2 contacts de nous
+#define EXPOSURE_NONE       0xFFFF  // Fin d'une liste d'adjacence
+#define EXPOSURE_OUTBOX     4       // Nombre de nos contacts en attente de publication
+
+/* Une carte du graphe */
+struct ExposureNode {
+    uint32_t id;                    // Hash du nom
+    uint16_t head;                  // Première demi-arête, EXPOSURE_NONE si aucune
+    uint8_t level;                  // Distance à notre carte, bornée à EXPOSURE_FAR
+    uint8_t positive;
+};
+
+/* Une demi-arête : un contact vu depuis une de ses extrémités. Les deux demi-arêtes d'un contact
+ * forment une paire (2k, 2k + 1) : l'extrémité d'où part la demi-arête e est edges[e ^ 1].to */
+struct ExposureEdge {
+    uint16_t to;                    // EXPOSURE_NONE si la paire est libre
+    uint16_t next;                  // Demi-arête suivante du même noeud, ou paire libre suivante
+    uint16_t day;                   // Jour du contact, en jours depuis 1970, 0 si inconnu
+};
+
+/* Un graphe d'exposition, dans des tableaux fournis par l'appelant */
+struct ExposureGraph {
+    ExposureNode *nodes;
+    uint16_t nodeCount;
+    uint16_t nodeMax;
+    uint16_t nodeReserve;           // Noeuds réservés à nos propres contacts
+    uint16_t *index;                // Numéro du noeud + 1 par hash, 0 si libre
+    uint16_t indexSize;             // Puissance de 2
+    ExposureEdge *edges;
+    uint16_t edgeCount;             // Demi-arêtes utilisées
+    uint16_t edgeTop;               // Demi-arêtes déjà servies au moins une fois
+    uint16_t edgeFree;              // Première paire libérée, EXPOSURE_NONE si aucune
+    uint16_t edgeMax;
+    uint16_t edgeReserve;           // Demi-arêtes réservées à nos propres contacts
+    uint16_t ownEdges;              // Demi-arêtes de nos propres contacts
+    uint8_t (*isPositive)(uint32_t id);     // Etat d'une carte qui entre dans le graphe, NULL : négative
+    uint16_t positives[EXPOSURE_FAR];   // Nombre de positifs à distance 0, 1 et 2
+    uint32_t full;                  // Contacts ignorés, graphe plein
+    uint32_t evicted;               // Contacts retirés pour faire de la place
+    uint32_t expired;               // Contacts retirés après days_of_historic jours
+};
+
+ExposureNode exposureNodes[EXPOSURE_NODES];
+uint16_t exposureIndex[EXPOSURE_INDEX];
+ExposureEdge exposureEdges[EXPOSURE_EDGES];
+ExposureGraph exposure;
+
+// Nos nouveaux contacts, à publier sur data.contactlist par \ref adafruitio
+char exposureOutbox[EXPOSURE_OUTBOX][POSITIVE_SYNC_ID_LEN];
+uint8_t exposureOutboxHead = 0;
+uint8_t exposureOutboxTail = 0;
+
+// Statistiques
+uint32_t exposureContacts = 0;      // Contacts ajoutés au graphe
+uint32_t exposureUpdates = 0;       // Changements de distance lors des mises à jour incrémentales
+
+/**
+ * Initialisation d'un graphe vide, avec notre carte à distance 0, sans réserve pour nos contacts
+ */
+void exposureInit(ExposureGraph &g, ExposureNode *nodes, uint16_t nodeMax, uint16_t *index, uint16_t indexSize,
+                  ExposureEdge *edges, uint16_t edgeMax, uint32_t self) {
+    g.nodes = nodes;
+    g.nodeMax = nodeMax;
+    g.nodeCount = 0;
+    g.nodeReserve = 0;
+    g.index = index;
+    g.indexSize = indexSize;
+    memset(index, 0, indexSize * sizeof(uint16_t));
+    g.edges = edges;
+    g.edgeMax = edgeMax & ~1;
+    g.edgeCount = 0;
+    g.edgeTop = 0;
+    g.edgeFree = EXPOSURE_NONE;
+    g.edgeReserve = 0;
+    g.ownEdges = 0;
+    g.isPositive = NULL;
+    memset(g.positives, 0, sizeof(g.positives));
+    g.full = 0;
+    g.evicted = 0;
+    g.expired = 0;
+    g.nodes[0].id = self;
+    g.nodes[0].head = EXPOSURE_NONE;
+    g.nodes[0].level = 0;
+    g.nodes[0].positive = 0;
+    g.index[self & (indexSize - 1)] = 1;
+    g.nodeCount = 1;
+}
+
+/**
+ * Recherche d'une carte dans le graphe
+ * \param create ajout de la carte si elle est inconnue
+ * \param own la carte est un de nos contacts, elle peut prendre un noeud réservé
+ * \return le numéro du noeud, -1 si inconnue (ou graphe plein)
+ */
+int exposureNode(ExposureGraph &g, uint32_t id, bool create, bool own = false) {
+    for (uint16_t n = 0; n < g.indexSize; n++) {
+        uint16_t &slot = g.index[(id + n) & (g.indexSize - 1)];
+        if (slot == 0) {
+            if (!create || g.nodeCount >= (own ? g.nodeMax : g.nodeMax - g.nodeReserve)) {
+                return -1;
+            }
+            ExposureNode &node = g.nodes[g.nodeCount];
+            node.id = id;
+            node.head = EXPOSURE_NONE;
+            node.level = EXPOSURE_FAR;
+            node.positive = g.isPositive ? g.isPositive(id) : 0;
+            slot = ++g.nodeCount;
+            return slot - 1;
+        }
+        if (g.nodes[slot - 1].id == id) {
+            return slot - 1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Retrait d'un noeud qui n'a plus de contact (jamais le nôtre) : la suite de sa chaîne dans l'index
+ * est recompactée (comme pour \ref encounter), et le dernier noeud prend son numéro
+ */
+void exposureDropNode(ExposureGraph &g, uint16_t n) {
+    uint16_t mask = g.indexSize - 1;
+    ExposureNode &node = g.nodes[n];
+    if (node.positive && node.level < EXPOSURE_FAR) {
+        g.positives[node.level]--;
+    }
+    uint16_t i = node.id & mask;
+    while (g.index[i] != n + 1) {
+        i = (i + 1) & mask;
+    }
+    uint16_t hole = i;
+    for (uint16_t k = 1; k < g.indexSize; k++) {
+        uint16_t j = (i + k) & mask;
+        if (g.index[j] == 0) {
+            break;
+        }
+        uint16_t home = g.nodes[g.index[j] - 1].id & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            g.index[hole] = g.index[j];
+            hole = j;
+        }
+    }
+    g.index[hole] = 0;
+    uint16_t last = --g.nodeCount;
+    if (n == last) {
+        return;
+    }
+    g.nodes[n] = g.nodes[last];
+    for (i = g.nodes[n].id & mask; g.index[i] != last + 1; i = (i + 1) & mask) {}
+    g.index[i] = n + 1;
+    for (uint16_t e = g.nodes[n].head; e != EXPOSURE_NONE; e = g.edges[e].next) {
+        g.edges[e ^ 1].to = n;      // Les demi-arêtes qui arrivent au noeud déplacé
+    }
+}
+
+/**
+ * Retrait d'une demi-arête de la liste de son noeud
+ */
+void exposureUnlink(ExposureGraph &g, uint16_t e) {
+    uint16_t *p = &g.nodes[g.edges[e ^ 1].to].head;
+    while (*p != e) {
+        p = &g.edges[*p].next;
+    }
+    *p = g.edges[e].next;
+}
+
+/**
+ * Retrait d'un contact (paire p, p + 1), et des noeuds qui n'ont plus de contact. Les distances
+ * ne sont pas recalculées, cf. exposureRecompute()
+ */
+void exposureRemovePair(ExposureGraph &g, uint16_t p) {
+    uint16_t a = g.edges[p + 1].to;
+    uint16_t b = g.edges[p].to;
+    exposureUnlink(g, p);
+    exposureUnlink(g, p + 1);
+    if (a == 0 || b == 0) {
+        g.ownEdges -= 2;
+    }
+    g.edges[p].to = EXPOSURE_NONE;
+    g.edges[p + 1].to = EXPOSURE_NONE;
+    g.edges[p].next = g.edgeFree;
+    g.edgeFree = p;
+    g.edgeCount -= 2;
+    // Le plus grand numéro d'abord : le retrait d'un noeud ne déplace que le dernier
+    uint16_t hi = a > b ? a : b;
+    uint16_t lo = a > b ? b : a;
+    if (hi != 0 && g.nodes[hi].head == EXPOSURE_NONE) exposureDropNode(g, hi);
+    if (lo != 0 && g.nodes[lo].head == EXPOSURE_NONE) exposureDropNode(g, lo);
+}
+
+/**
+ * Nouvelle distance d'un noeud, en tenant à jour le nombre de positifs par distance
+ */
+void exposureSetLevel(ExposureGraph &g, uint16_t n, uint8_t level) {
+    ExposureNode &node = g.nodes[n];
+    if (node.positive) {
+        if (node.level < EXPOSURE_FAR) g.positives[node.level]--;
+        if (level < EXPOSURE_FAR) g.positives[level]++;
+    }
+    node.level = level;
+    exposureUpdates++;
+}
+
+/**
+ * Propagation d'une baisse de distance : le noeud n passe à la distance level, ses voisins à level + 1 au plus
+ */
+void exposureRelax(ExposureGraph &g, uint16_t n, uint8_t level) {
+    if (level >= g.nodes[n].level) {
+        return;
+    }
+    exposureSetLevel(g, n, level);
+    if (level + 1 >= EXPOSURE_FAR) {
+        return;
+    }
+    for (uint16_t e = g.nodes[n].head; e != EXPOSURE_NONE; e = g.edges[e].next) {
+        exposureRelax(g, g.edges[e].to, level + 1);
+    }
+}
+
+/**
+ * Recalcul complet des distances et des compteurs, par un parcours en largeur depuis notre carte
+ */
+void exposureRecompute(ExposureGraph &g) {
+    memset(g.positives, 0, sizeof(g.positives));
+    for (uint16_t n = 1; n < g.nodeCount; n++) {
+        g.nodes[n].level = EXPOSURE_FAR;
+    }
+    g.nodes[0].level = 0;
+    for (uint8_t level = 0; level + 1 < EXPOSURE_FAR; level++) {
+        for (uint16_t n = 0; n < g.nodeCount; n++) {
+            if (g.nodes[n].level != level) continue;
+            for (uint16_t e = g.nodes[n].head; e != EXPOSURE_NONE; e = g.edges[e].next) {
+                ExposureNode &to = g.nodes[g.edges[e].to];
+                if (to.level > level + 1) to.level = level + 1;
+            }
+        }
+    }
+    for (uint16_t n = 0; n < g.nodeCount; n++) {
+        if (g.nodes[n].positive && g.nodes[n].level < EXPOSURE_FAR) {
+            g.positives[g.nodes[n].level]++;
+        }
+    }
+}
+
+/**
+ * Retrait d'un contact pour faire de la place : un contact entre d'autres cartes, le plus loin de
+ * nous puis le plus ancien ; un des nôtres, le plus ancien, seulement pour un des nôtres (own)
+ * \return false si aucun contact ne peut être retiré
+ */
+bool exposureEvict(ExposureGraph &g, bool own) {
+    int victim = -1;
+    uint32_t victimKey = 0;
+    for (uint16_t p = 0; p < g.edgeTop; p += 2) {
+        if (g.edges[p].to == EXPOSURE_NONE) continue;
+        uint16_t a = g.edges[p + 1].to;
+        uint16_t b = g.edges[p].to;
+        bool mine = a == 0 || b == 0;
+        if (mine && !own) continue;
+        uint8_t near = g.nodes[a].level < g.nodes[b].level ? g.nodes[a].level : g.nodes[b].level;
+        uint16_t day = g.edges[p].day ? g.edges[p].day : 0xFFFF;   // Jour inconnu : le plus récent
+        // Clé croissante avec la valeur du contact : les nôtres, les plus proches, les plus récents
+        uint32_t key = ((uint32_t)mine << 20) | ((uint32_t)(EXPOSURE_FAR - near) << 16) | day;
+        if (victim < 0 || key < victimKey) {
+            victim = p;
+            victimKey = key;
+        }
+    }
+    if (victim < 0) {
+        return false;
+    }
+    exposureRemovePair(g, victim);
+    exposureRecompute(g);
+    g.evicted++;
+    return true;
+}
+
+/**
+ * Retrait des contacts de plus de days jours ; les contacts de jour inconnu (carte pas encore à
+ * l'heure quand ils ont été ajoutés) prennent le jour courant
+ * \param today jour courant, 0 si la carte n'est pas à l'heure : rien n'est retiré
+ * \return le nombre de contacts retirés
+ */
+uint16_t exposureAge(ExposureGraph &g, uint16_t today, uint16_t days) {
+    if (today == 0) {
+        return 0;
+    }
+    uint16_t removed = 0;
+    for (uint16_t p = 0; p < g.edgeTop; p += 2) {
+        ExposureEdge &e = g.edges[p];
+        if (e.to == EXPOSURE_NONE) continue;
+        if (e.day == 0) {
+            e.day = today;
+            g.edges[p + 1].day = today;
+        } else if ((int)today - (int)e.day > days) {
+            exposureRemovePair(g, p);
+            removed++;
+        }
+    }
+    if (removed) {
+        g.expired += removed;
+        exposureRecompute(g);
+    }
+    return removed;
+}
+
+/**
+ * Déclaration d'une carte positive, sans effet si elle n'a aucun contact dans le graphe
+ * (cf. isPositive pour celles qui y entrent ensuite)
+ * \return true si la carte n'était pas déjà positive
+ */
+bool exposureAddPositive(ExposureGraph &g, uint32_t id) {
+    int n = exposureNode(g, id, false);
+    if (n < 0 || g.nodes[n].positive) {
+        return false;
+    }
+    g.nodes[n].positive = 1;
+    if (g.nodes[n].level < EXPOSURE_FAR) {
+        g.positives[g.nodes[n].level]++;
+    }
+    return true;
+}
+
+/**
+ * Ajout d'un contact entre deux cartes, en retirant au besoin des contacts moins utiles
+ * (exposureEvict()) ; un contact déjà connu prend le jour le plus récent
+ * \param day jour du contact, 0 si inconnu
+ * \return true si le contact était inconnu
+ */
+bool exposureAddContact(ExposureGraph &g, uint32_t a, uint32_t b, uint16_t day) {
+    if (a == b) {
+        return false;
+    }
+    bool own = a == g.nodes[0].id || b == g.nodes[0].id;
+    int na = exposureNode(g, a, false);
+    int nb = exposureNode(g, b, false);
+    if (na >= 0 && nb >= 0) {
+        for (uint16_t e = g.nodes[na].head; e != EXPOSURE_NONE; e = g.edges[e].next) {
+            if (g.edges[e].to == nb) {
+                if (day > g.edges[e].day) {
+                    g.edges[e].day = day;
+                    g.edges[e ^ 1].day = day;
+                }
+                return false;       // Contact déjà connu
+            }
+        }
+    }
+    uint16_t nodeLimit = own ? g.nodeMax : g.nodeMax - g.nodeReserve;
+    for (uint8_t evictions = 0; ; evictions++) {
+        uint16_t needed = (na < 0) + (nb < 0);
+        bool edgeRoom = g.edgeCount + 2 <= g.edgeMax &&
+                        (own || g.edgeCount - g.ownEdges + 2 <= g.edgeMax - g.edgeReserve);
+        if (edgeRoom && g.nodeCount + needed <= nodeLimit) {
+            break;
+        }
+        if (evictions >= EXPOSURE_EVICT_MAX || !exposureEvict(g, own)) {
+            g.full++;
+            return false;
+        }
+        na = exposureNode(g, a, false);     // Numéros changés par le retrait de noeuds
+        nb = exposureNode(g, b, false);
+    }
+    na = exposureNode(g, a, true, own);
+    nb = exposureNode(g, b, true, own);
+    uint16_t p;
+    if (g.edgeFree != EXPOSURE_NONE) {
+        p = g.edgeFree;
+        g.edgeFree = g.edges[p].next;
+    } else {
+        p = g.edgeTop;
+        g.edgeTop += 2;
+    }
+    g.edges[p] = { (uint16_t)nb, g.nodes[na].head, day };
+    g.nodes[na].head = p;
+    g.edges[p + 1] = { (uint16_t)na, g.nodes[nb].head, day };
+    g.nodes[nb].head = p + 1;
+    g.edgeCount += 2;
+    if (own) {
+        g.ownEdges += 2;
+    }
+    if (g.nodes[na].level + 1 < g.nodes[nb].level) {
+        exposureRelax(g, nb, g.nodes[na].level + 1);
+    } else if (g.nodes[nb].level + 1 < g.nodes[na].level) {
+        exposureRelax(g, na, g.nodes[nb].level + 1);
+    }
+    return true;
+}
+
+/**
+ * Degré d'exposition : 0 si nous sommes positifs, 1 si un contact direct l'est, 2 si un contact
+ * d'un contact l'est, EXPOSURE_FAR sinon
+ */
+uint8_t exposureDegree(const ExposureGraph &g) {
+    for (uint8_t level = 0; level < EXPOSURE_FAR; level++) {
+        if (g.positives[level] > 0) {
+            return level;
+        }
+    }
+    return EXPOSURE_FAR;
+}
+
+/************************** Graphe de la carte *******************************/
+
+/**
+ * Jour courant, en jours depuis 1970, 0 si la carte n'est pas encore à l'heure
+ */
+uint16_t exposureToday() {
+    return timeSynced ? timeNow() / 86400 : 0;
+}
+
+/**
+ * Jour d'un horodatage de contacts.json, "2024-05-17T14:03:59", 0 s'il est invalide
+ */
+uint16_t exposureDayOf(const char *timestamp) {
+    int y, m, d;
+    if (sscanf(timestamp, "%d-%d-%d", &y, &m, &d) != 3 || y < 1970 || m < 1 || m > 12) {
+        return 0;
+    }
+    // Nombre de jours du calendrier grégorien, l'année commençant en mars
+    y -= m <= 2;
+    int era = y / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+/**
+ * Etat d'une carte qui entre dans le graphe, d'après la liste de \ref positivesync
+ */
+uint8_t exposureIsPositive(uint32_t id) {
+    for (int i = 0; i < positiveCount; i++) {
+        if (positiveTable[i].hash == id) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Ajout d'un de nos contacts, qui sera aussi publié sur data.contactlist
+ */
+void exposureLocalContact(const char *peer) {
+    if (exposureAddContact(exposure, exposure.nodes[0].id, positiveHash(peer), exposureToday())) {
+        exposureContacts++;
+        if ((uint8_t)(exposureOutboxHead - exposureOutboxTail) < EXPOSURE_OUTBOX) {
+            strncpy(exposureOutbox[exposureOutboxHead % EXPOSURE_OUTBOX], peer, POSITIVE_SYNC_ID_LEN - 1);
+            exposureOutbox[exposureOutboxHead % EXPOSURE_OUTBOX][POSITIVE_SYNC_ID_LEN - 1] = '\0';
+            exposureOutboxHead++;
+        }
+    }
+}
+
+/**
+ * Ajout d'un de nos contacts déjà enregistré (et peut-être déjà dans le graphe) à publier,
+ * cf. \ref deepsleep
+ * \return false si la file de publication est pleine
+ */
+bool exposureQueueContact(const char *peer) {
+    if ((uint8_t)(exposureOutboxHead - exposureOutboxTail) >= EXPOSURE_OUTBOX) {
+        return false;
+    }
+    if (exposureAddContact(exposure, exposure.nodes[0].id, positiveHash(peer), exposureToday())) {
+        exposureContacts++;
+    }
+    strncpy(exposureOutbox[exposureOutboxHead % EXPOSURE_OUTBOX], peer, POSITIVE_SYNC_ID_LEN - 1);
+    exposureOutbox[exposureOutboxHead % EXPOSURE_OUTBOX][POSITIVE_SYNC_ID_LEN - 1] = '\0';
+    exposureOutboxHead++;
+    return true;
+}
+
+/**
+ * Prochain de nos contacts à publier, laissé dans la file jusqu'à exposurePopOutbox()
+ * \return NULL si aucun
+ */
+const char *exposurePeekOutbox() {
+    if (exposureOutboxTail == exposureOutboxHead) {
+        return NULL;
+    }
+    return exposureOutbox[exposureOutboxTail % EXPOSURE_OUTBOX];
+}
+
+/**
+ * Retrait du contact rendu par exposurePeekOutbox(), une fois confié à la file de publication
+ */
+void exposurePopOutbox() {
+    if (exposureOutboxTail != exposureOutboxHead) {
+        exposureOutboxTail++;
+    }
+}
+
+/**
+ * Traitement d'un contact publié sur le feed data.contactlist, "C:id1:id2"
+ * \return true si le contact était inconnu
+ */
+bool exposureOnContactList(const char *data) {
+    if (data[0] != 'C' || data[1] != ':') {
+        return false;
+    }
+    const char *id1 = data + 2;
+    const char *sep = strchr(id1, ':');
+    if (!sep || sep == id1 || sep[1] == '\0' || sep - id1 >= POSITIVE_SYNC_ID_LEN) {
+        return false;
+    }
+    char first[POSITIVE_SYNC_ID_LEN];
+    memcpy(first, id1, sep - id1);
+    first[sep - id1] = '\0';
+    if (!exposureAddContact(exposure, positiveHash(first), positiveHash(sep + 1), exposureToday())) {
+        return false;
+    }
+    exposureContacts++;
+    return true;
+}
+
+/**
+ * Graphe de la carte vide : notre carte, les réserves pour nos contacts et l'état des cartes qui y entrent
+ */
+void exposureReset() {
+    exposureInit(exposure, exposureNodes, EXPOSURE_NODES, exposureIndex, EXPOSURE_INDEX,
+                 exposureEdges, EXPOSURE_EDGES, positiveHash(DEVICE_NAME));
+    exposure.nodeReserve = EXPOSURE_OWN_NODES;
+    exposure.edgeReserve = EXPOSURE_OWN_EDGES;
+    exposure.isPositive = exposureIsPositive;
+    positiveConsumed = positiveAdded - positiveCount; // Les entrées encore dans la table sont à reprendre
+}
+
+/**
+ * Construction du graphe au démarrage, avec nos contacts enregistrés dans contacts.json
+ */
+void setupExposure() {
+    exposureReset();
+    File f = SPIFFS.open(strContactsFile, "r");
+    if (!f) {
+        MYDEBUG_PRINTLN("-EXPOSURE : Aucun contact à charger");
+        return;
+    }
+    DynamicJsonDocument jsonDocument(1024 + MAX_CONTACTS * 96);
+    DeserializationError error = deserializeJson(jsonDocument, f);
+    f.close();
+    if (error) {
+        MYDEBUG_PRINTLN("-EXPOSURE : Impossible de parser contacts.json");
+        return;
+    }
+    for (JsonObject contact : jsonDocument["list_of_contacts"].as<JsonArray>()) {
+        const char *id1 = contact["id-1"] | "";
+        const char *id2 = contact["id-2"] | "";
+        uint16_t day = exposureDayOf(contact["timestamp"] | "");
+        if (id1[0] && id2[0] && exposureAddContact(exposure, positiveHash(id1), positiveHash(id2), day)) {
+            exposureContacts++;
+        }
+    }
+    exposureAge(exposure, exposureToday(), days_of_historic);
+    MYDEBUG_PRINT("-EXPOSURE : Graphe chargé, contacts ");
+    MYDEBUG_PRINTLN(exposure.edgeCount / 2);
+}
+
+/**
+ * Prise en compte des positifs apparus dans la liste depuis le dernier appel
+ * (\ref positivesync retient où on en est dans sa table circulaire) ; ceux qui n'ont pas de
+ * contact dans le graphe n'y entrent pas
+ * \param direct appelée pour chaque nouveau positif qui est un de nos contacts directs, NULL si rien à faire
+ */
+void loopExposure(void (*direct)(const char *id) = NULL) {
+    while (positiveConsumed != positiveAdded) {
+        const PositiveEntry &p = positiveTable[positiveConsumed++ % POSITIVE_SYNC_MAX];
+        exposureAddPositive(exposure, p.hash);
+        int n = direct ? exposureNode(exposure, p.hash, false) : -1;
+        if (n >= 0 && exposure.nodes[n].level == 1) {
+            direct(p.id);
+        }
+    }
+}
+
+/**
+ * Coût des mises à jour incrémentales et du recalcul complet sur un graphe aléatoire
+ * \param nodes nombre de cartes
+ * \param contacts nombre de contacts, tirés au hasard
+ */
+void exposureBenchmark(uint16_t nodes = 10000, uint16_t contacts = 10000) {
+    uint16_t indexSize = 1;
+    while (indexSize < nodes + nodes / 2) indexSize <<= 1;
+    ExposureGraph g;
+    ExposureNode *n = (ExposureNode *)malloc(nodes * sizeof(ExposureNode));
+    uint16_t *index = (uint16_t *)malloc(indexSize * sizeof(uint16_t));
+    ExposureEdge *edges = (ExposureEdge *)malloc(2 * contacts * sizeof(ExposureEdge));
+    if (!n || !index || !edges) {
+        MYDEBUG_PRINTLN("-EXPOSURE : Mémoire insuffisante pour le test");
+        free(n);
+        free(index);
+        free(edges);
+        return;
+    }
+    exposureInit(g, n, nodes, index, indexSize, edges, 2 * contacts, 0);
+
+    // Les contacts relient des cartes 1 à nodes - 1, et notre carte (0) à quelques unes
+    uint32_t start = micros();
+    for (uint16_t c = 0; c < contacts; c++) {
+        uint32_t a = (c % 100 == 0) ? 0 : 1 + random(nodes - 1);
+        exposureAddContact(g, a, 1 + random(nodes - 1), 0);
+    }
+    uint32_t contactUs = micros() - start;
+    const uint16_t declarations = 100;
+    start = micros();
+    for (uint16_t p = 0; p < declarations; p++) {
+        exposureAddPositive(g, 1 + random(nodes - 1));
+    }
+    uint32_t positiveUs = micros() - start;
+    uint16_t positives[EXPOSURE_FAR];
+    memcpy(positives, g.positives, sizeof(positives));
+    start = micros();
+    exposureRecompute(g);
+    uint32_t recomputeUs = micros() - start;
+    bool consistent = memcmp(positives, g.positives, sizeof(positives)) == 0;
+
+    char line[160];
+    snprintf(line, sizeof(line), "-EXPOSURE : %u cartes, %u contacts (%u ignorés), contact %.2f us, positif %.2f us, recalcul complet %lu us, %s",
+             g.nodeCount, g.edgeCount / 2, (unsigned)g.full, (float)contactUs / contacts, (float)positiveUs / declarations,
+             (unsigned long)recomputeUs, consistent ? "cohérent" : "INCOHERENT");
+    MYDEBUG_PRINTLN(line);
+    snprintf(line, sizeof(line), "-EXPOSURE : positifs à distance 1 : %u, à distance 2 : %u", g.positives[1], g.positives[2]);
+    MYDEBUG_PRINTLN(line);
+    free(n);
+    free(index);
+    free(edges);
+}
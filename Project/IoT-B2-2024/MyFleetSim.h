@@ -0,0 +1,478 @@
+/**
+ * \file MyFleetSim.h
+ * \page fleetsim Simulation d'une flotte de cartes
+ * \brief Voir comment se comporte la diffusion des positifs avec des centaines de cartes
+ *
+ * Tester le comportement de \ref adafruitio avec des centaines de cartes demanderait autant
+ * de cartes et de comptes Adafruit. Ce module simule, directement sur l'ESP32, un broker MQTT
+ * (en mémoire, sans réseau) et une flotte de N cartes abonnées aux feeds data.contactlist,
+ * data.positivelist et data.positivesync.
+ *
+ * La carte 0 est la vraie carte (DEVICE_NAME), la seule dont le temps CPU est mesuré :
+ * - les messages du broker lui sont remis par feedDispatch(), le routeur utilisé par
+ *   FeedMqttClient pour chaque PUBLISH reçu, donc par les vraies callbacks des feeds,
+ * - les événements qu'elles produisent sont traités par pollYCT() (\ref yct), comme le travail "yct",
+ * - ce qu'elle publie passe par queueAdafruitIO() et la file de \ref publisher, avec ses quotas ;
+ *   seul l'envoi (publisherSendHook) est remplacé par le broker simulé.
+ * Les N-1 autres cartes sont virtuelles : elles publient des contacts et des déclarations au
+ * format de \ref positivesync et retiennent seulement leurs contacts et les positifs reçus, pour
+ * savoir si elles passent en "cas contact".
+ *
+ * Déroulement :
+ * - chaque carte publie un contact avec sa voisine ("C:id1:id2") ; celui de la vraie carte part
+ *   d'un événement EVENT_CONTACT, comme une rencontre BLE promue,
+ * - la vraie carte se déclare positive (EVENT_DECLARE, comme le bouton DeclarePositive de
+ *   /contact-tracer), puis quelques cartes virtuelles ("P:seq:id"),
+ * - une carte virtuelle hors ligne pendant les déclarations demande ensuite les positifs manqués
+ *   ("Q:id:0:digest vide") : la vraie carte y répond avec positiveSyncOnRequest() et
+ *   positiveSyncNextResend().
+ *
+ * Le temps réseau est simulé (latence montante, descendante et gigue configurables), de même que
+ * l'horloge de la file de publication (publisherClock), avancée de SIM_POLL_MS à chaque passage :
+ * les attentes imposées par les quotas d'Adafruit IO ne ralentissent pas la simulation. Le délai
+ * aléatoire avant de répondre à une requête de synchronisation est en revanche attendu en temps
+ * réel (au plus POSITIVE_SYNC_JITTER_MS). Le temps CPU du broker et des handlers de la vraie
+ * carte est mesuré avec micros(), à chaque message, et ajouté au temps simulé. Les cartes
+ * virtuelles n'exécutent pas le firmware : leur temps de traitement n'est pas mesuré mais
+ * extrapolé (temps moyen mesuré sur la vraie carte), comme les latences qui l'incluent.
+ *
+ * Le rapport donne pour N = 10, 100 et 1000 :
+ * - la latence de propagation d'une déclaration de positif (médiane et maximum, traitement des
+ *   cartes virtuelles extrapolé), file de publication comprise pour celle de la vraie carte,
+ *   calculée uniquement sur les cartes qui ont reçu l'annonce, et la couverture (annonces reçues
+ *   sur annonces attendues) ; l'attente maximale dans la file de publication (réponses de
+ *   synchronisation comprises),
+ * - le coût du fan-out du broker (µs par publication et par message délivré, octets délivrés),
+ * - le temps CPU des handlers de la vraie carte, mesuré (moyen et maximum par message reçu, total),
+ * - le nombre de cartes virtuelles passées en cas contact et l'état final de la vraie carte,
+ * - les événements perdus, les annonces republiées pour la carte hors ligne et le temps qu'elle
+ *   a mis à rattraper la liste.
+ *
+ * La simulation modifie l'état de la vraie carte (liste des positifs, graphe d'exposition, file
+ * de publication...) : elle doit être lancée avant bootRun(), qui charge ensuite l'état réel, et
+ * le remet à zéro en sortant. Pour la lancer, décommenter l'inclusion de ce fichier et l'appel à
+ * runFleetSimulation() dans setup().
+ *
+ * Fichier \ref MyFleetSim.h
+ */
+
+#define SIM_UPLINK_US       30000   // Latence simulée carte -> broker
+#define SIM_DOWNLINK_US     30000   // Latence simulée broker -> carte
+#define SIM_JITTER_US       20000   // Gigue maximale ajoutée à chaque lien
+#define SIM_CONTACTS        4       // Nombre de contacts mémorisés par carte virtuelle
+#define SIM_DECLARATIONS    4       // Nombre de déclarations de positifs simulées, dont celle de la vraie carte
+#define SIM_POLL_MS         100     // Rythme simulé des travaux "mqtt" et "yct" de la vraie carte
+#define SIM_DRAIN_MS        600000  // Attente simulée maximale pour vider la file de publication
+#define SIM_NOT_RECEIVED    0xFFFFFFFF  // Date d'arrivée d'une carte qui n'a pas reçu l'annonce
+
+/* Une carte virtuelle */
+struct SimDevice {
+    uint16_t contacts[SIM_CONTACTS];
+    uint8_t numContacts;
+    bool contactCase;               // Passée en "cas contact"
+    uint16_t positives;             // Annonces de positifs reçues
+    uint32_t lastPositiveUs;        // Date simulée d'arrivée de la dernière annonce
+};
+
+/* Résultats d'une simulation */
+struct SimReport {
+    uint16_t devices;
+    uint32_t latencyMedianUs;       // Latence de propagation médiane d'une déclaration, cartes atteintes
+    uint32_t latencyMaxUs;          // Latence de propagation maximale d'une déclaration, cartes atteintes
+    uint32_t reached;               // Annonces reçues, toutes déclarations confondues
+    uint32_t expected;              // Annonces attendues (toutes les cartes en ligne sauf l'émettrice)
+    uint32_t publishWaitMaxMs;      // Attente maximale dans la file de publication de la vraie carte
+    uint32_t fanoutUsPerPublish;    // Coût CPU du broker par publication
+    float fanoutUsPerDelivery;      // Coût CPU du broker par message délivré
+    uint32_t bytesDelivered;
+    uint32_t deliveries;
+    uint32_t received;              // Messages remis à la vraie carte
+    uint32_t handlerUs;             // Temps CPU total des handlers de la vraie carte
+    uint32_t handlerUsMax;          // Temps CPU maximum pour un message
+    uint16_t contactCases;          // Cartes virtuelles passées en cas contact
+    uint8_t state;                  // Etat de santé final de la vraie carte
+    uint32_t eventsDropped;         // Evénements perdus par la vraie carte, file pleine
+    uint32_t resent;                // Annonces republiées par la vraie carte pour la carte hors ligne
+    uint32_t syncMs;                // Temps mis par la carte hors ligne pour rattraper la liste
+};
+
+SimDevice *simDevices = NULL;
+uint16_t simCount = 0;
+uint32_t simNowUs = 0;              // Horloge simulée
+uint16_t simOffline = 0;            // Carte virtuelle hors ligne, 0 si aucune
+uint32_t *simArrivals = NULL;       // Dates d'arrivée de la déclaration en cours, si mesurées
+SimReport *simReport = NULL;
+
+/**
+ * Latence simulée d'un lien réseau
+ */
+uint32_t simLink(uint32_t base) {
+    return base + random(SIM_JITTER_US);
+}
+
+/**
+ * Horloge de la file de publication pendant la simulation, en ms (jamais 0, cf. tokenBucketRefill())
+ */
+unsigned long simClock() {
+    return simNowUs / 1000 + 1;
+}
+
+/**
+ * Identifiant de la carte i, ex : "SIM-42", DEVICE_NAME pour la vraie carte
+ */
+void simName(uint16_t i, char *out, size_t size) {
+    if (i == 0) {
+        snprintf(out, size, "%s", DEVICE_NAME);
+    } else {
+        snprintf(out, size, "SIM-%u", i);
+    }
+}
+
+/**
+ * Numéro d'une carte à partir de son identifiant, -1 si elle ne fait pas partie de la flotte
+ */
+int simIndex(const char *id, size_t len) {
+    if (len == strlen(DEVICE_NAME) && strncmp(id, DEVICE_NAME, len) == 0) {
+        return 0;
+    }
+    if (len <= 4 || strncmp(id, "SIM-", 4) != 0) {
+        return -1;
+    }
+    return atoi(id + 4);
+}
+
+/**
+ * Remise à zéro de l'état de la vraie carte touché par la simulation
+ */
+void simReset() {
+    positiveCount = 0;
+    positiveAdded = 0;
+    positiveVersion = 0;
+    positiveDirty = false;
+    syncBytesIn = syncBytesOut = 0;
+    syncEntriesGained = syncResent = syncSuppressed = syncEvicted = 0;
+    syncRequestAt = syncRequestEchoAt = syncLastGainAt = syncConvergenceMs = 0;
+    positiveProvisionalCount = 0;
+    syncProvisionalConfirmed = syncProvisionalRejected = 0;
+    exposureReset();
+    exposureOutboxHead = exposureOutboxTail = 0;
+    exposureContacts = exposureUpdates = 0;
+    eventHead = eventTail = 0;
+    eventsPosted = eventsDropped = eventsCoalesced = 0;
+    eventHighWater = 0;
+    yctState = YCT_NEGATIVE;
+    yctExposure = EXPOSURE_FAR;
+    yctTransitions = yctRecomputes = 0;
+    memset(publishQueue, 0, sizeof(publishQueue));
+    publishFeedCount = 0;
+    accountBucket.tokens = IO_ACCOUNT_BURST;
+    accountBucket.lastRefill = 0;
+    pubSent = pubFailed = pubRetried = pubAbandoned = pubDeferred = pubCoalesced = pubDropped = pubEvicted = 0;
+    pubMaxWaitMs = 0;
+    publisherClock = millis;
+    publisherSendHook = NULL;
+}
+
+/**
+ * Remise d'un message à la vraie carte, par le routeur des PUBLISH reçus, puis traitement des
+ * événements produits
+ * \return le temps CPU consommé (µs)
+ */
+uint32_t simReceive(int feed, const char *payload) {
+    char data[SUBSCRIPTIONDATALEN];
+    strncpy(data, payload, sizeof(data) - 1);
+    data[sizeof(data) - 1] = '\0';
+    uint32_t t0 = micros();
+    feedDispatch(feedTopics[feed], data, strlen(data));
+    pollYCT(SIM_POLL_MS);
+    uint32_t cpu = micros() - t0;
+    simReport->received++;
+    simReport->handlerUs += cpu;
+    if (cpu > simReport->handlerUsMax) {
+        simReport->handlerUsMax = cpu;
+    }
+    return cpu;
+}
+
+/**
+ * Traitement d'un message par une carte virtuelle
+ */
+void simDeliver(uint16_t dev, int feed, const char *payload, uint32_t arrival) {
+    SimDevice &d = simDevices[dev];
+    if (feed == FEED_ID_CONTACT_LIST && payload[0] == 'C' && payload[1] == ':') {  // "C:id1:id2"
+        const char *id1 = payload + 2;
+        const char *sep = strchr(id1, ':');
+        if (!sep) return;
+        int a = simIndex(id1, sep - id1);
+        int b = simIndex(sep + 1, strlen(sep + 1));
+        int other = (a == dev) ? b : (b == dev ? a : -1);
+        if (other >= 0 && d.numContacts < SIM_CONTACTS) {
+            d.contacts[d.numContacts++] = other;
+        }
+    } else if (feed == FEED_ID_POSITIVE_LIST) {        // "P:seq:id"
+        uint32_t seq;
+        char id[POSITIVE_SYNC_ID_LEN];
+        if (!positiveSyncParseAnnounce(payload, &seq, id)) return;
+        d.positives++;
+        d.lastPositiveUs = arrival;
+        int positive = simIndex(id, strlen(id));
+        for (int c = 0; c < d.numContacts; c++) {
+            if (d.contacts[c] == positive) {
+                d.contactCase = true;
+            }
+        }
+    }
+}
+
+/**
+ * Publication d'un message : le broker le diffuse à toutes les autres cartes.
+ * \param from carte émettrice
+ * \param feed feed de publication (FEED_ID_xxx)
+ * \param payload message
+ * \param publishedAt date simulée de publication (µs)
+ */
+void simPublish(uint16_t from, int feed, const char *payload, uint32_t publishedAt) {
+    size_t len = strlen(payload);
+    uint32_t atBroker = publishedAt + simLink(SIM_UPLINK_US);
+    uint32_t brokerStart = micros();
+    uint32_t handlers = 0;                              // Temps passé chez la vraie carte, hors broker
+    for (uint16_t dev = 0; dev < simCount; dev++) {
+        if (dev == from || (simOffline && dev == simOffline)) continue;
+        uint32_t queued = micros() - brokerStart - handlers;   // Le broker délivre les messages les uns après les autres
+        uint32_t sentAt = atBroker + queued + simLink(SIM_DOWNLINK_US);
+        uint32_t cpu;
+        if (dev == 0) {
+            cpu = simReceive(feed, payload);
+            handlers += cpu;
+        } else {
+            // Même firmware : temps moyen mesuré sur la vraie carte
+            cpu = simReport->received ? simReport->handlerUs / simReport->received : 0;
+            simDeliver(dev, feed, payload, sentAt + cpu);
+        }
+        simReport->deliveries++;
+        simReport->bytesDelivered += len;
+        if (simArrivals && feed == FEED_ID_POSITIVE_LIST && simArrivals[dev] == SIM_NOT_RECEIVED) {
+            simArrivals[dev] = sentAt + cpu;                // Première annonce reçue
+        }
+    }
+    simReport->fanoutUsPerPublish += micros() - brokerStart - handlers;
+}
+
+/**
+ * Envoi d'un message de la file de publication de la vraie carte au broker simulé
+ */
+bool simBrokerPublish(int feed, const char *payload) {
+    simPublish(0, feed, payload, simNowUs);
+    return true;
+}
+
+/**
+ * Travaux "yct" et "mqtt" de la vraie carte, sans le réseau
+ */
+void simPollDevice() {
+    pollYCT(SIM_POLL_MS);
+    queueAdafruitIO();
+    loopPublisher();
+}
+
+/**
+ * Avance de l'horloge simulée jusqu'à ce que la vraie carte n'ait plus rien à publier
+ */
+void simDrain() {
+    uint32_t start = simNowUs;
+    do {
+        simNowUs += SIM_POLL_MS * 1000UL;
+        simPollDevice();
+    } while ((publisherPending() > 0 || eventTail != eventHead) && simNowUs - start < SIM_DRAIN_MS * 1000UL);
+}
+
+/**
+ * Tri par insertion (les tableaux sont petits ou déjà presque triés)
+ */
+void simSort(uint32_t *values, uint16_t n) {
+    for (uint16_t i = 1; i < n; i++) {
+        uint32_t v = values[i];
+        int j = i - 1;
+        while (j >= 0 && values[j] > v) {
+            values[j + 1] = values[j];
+            j--;
+        }
+        values[j + 1] = v;
+    }
+}
+
+/**
+ * Latences de propagation de la dernière déclaration, à partir des dates d'arrivée : les cartes
+ * qui ne l'ont pas reçue ne comptent que dans la couverture
+ * \return la latence médiane des cartes atteintes, 0 si aucune
+ */
+uint32_t simLatencies(uint16_t positive, uint32_t declaredAt, uint32_t *latencies, SimReport &report) {
+    uint16_t m = 0;
+    for (uint16_t dev = 0; dev < simCount; dev++) {
+        if (dev == positive || (simOffline && dev == simOffline)) continue;
+        report.expected++;
+        if (simArrivals[dev] != SIM_NOT_RECEIVED) {
+            latencies[m++] = simArrivals[dev] - declaredAt;
+        }
+    }
+    report.reached += m;
+    if (m == 0) {
+        return 0;
+    }
+    simSort(latencies, m);
+    if (latencies[m - 1] > report.latencyMaxUs) {
+        report.latencyMaxUs = latencies[m - 1];
+    }
+    return latencies[m / 2];
+}
+
+/**
+ * Simulation d'une flotte de n cartes, dont la vraie carte
+ * \return false si la mémoire est insuffisante
+ */
+bool simulateFleet(uint16_t n, SimReport &report) {
+    memset(&report, 0, sizeof(report));
+    report.devices = n;
+    simCount = n;
+    simDevices = (SimDevice *)calloc(n, sizeof(SimDevice));
+    uint32_t *arrivals = (uint32_t *)malloc(n * sizeof(uint32_t));
+    uint32_t *latencies = (uint32_t *)malloc(n * sizeof(uint32_t));
+    if (n < 3 || !simDevices || !arrivals || !latencies) {
+        free(simDevices); free(arrivals); free(latencies);
+        simDevices = NULL;
+        return false;
+    }
+
+    // La vraie carte, dans l'état d'une carte neuve, publie sur le broker simulé
+    simReset();
+    for (int f = 0; f < FEED_COUNT; f++) {
+        publisherAddFeed(&feedPublishers[f], FEED_FREQ * 1000UL);
+    }
+    simReport = &report;
+    simNowUs = 0;
+    publisherClock = simClock;
+    publisherSendHook = simBrokerPublish;
+
+    char payload[SUBSCRIPTIONDATALEN];
+    char id1[POSITIVE_SYNC_ID_LEN], id2[POSITIVE_SYNC_ID_LEN];
+    uint32_t publishes = 0;
+
+    // Phase 1 : chaque carte publie un contact avec sa voisine pendant la première seconde
+    for (uint16_t i = 1; i < n; i++) {
+        simName(i, id1, sizeof(id1));
+        simName((i + 1) % n, id2, sizeof(id2));
+        snprintf(payload, sizeof(payload), "C:%s:%s", id1, id2);
+        simDeliver(i, FEED_ID_CONTACT_LIST, payload, 0);   // L'émettrice mémorise aussi le contact
+        simPublish(i, FEED_ID_CONTACT_LIST, payload, random(1000000));
+        publishes++;
+    }
+    simName(1, id2, sizeof(id2));
+    eventPost(EVENT_CONTACT, EVENT_SRC_BLE, id2);           // Rencontre BLE promue de la vraie carte
+    uint32_t sent = pubSent;
+    simDrain();
+    publishes += pubSent - sent;
+
+    // Phase 2 : déclarations, la première par la vraie carte, pendant que la dernière est hors ligne ;
+    // on mesure la propagation
+    simOffline = n - 1;
+    simArrivals = arrivals;
+    uint32_t medianSum = 0;
+    uint8_t medians = 0;                // Déclarations reçues par au moins une carte
+    if (simNowUs < 2000000UL) {
+        simNowUs = 2000000UL;
+    }
+    for (int k = 0; k < SIM_DECLARATIONS; k++) {
+        uint16_t positive = (k == 0) ? 0 : 1 + random(n - 2);
+        uint32_t declaredAt = simNowUs;
+        for (uint16_t dev = 0; dev < n; dev++) {
+            arrivals[dev] = SIM_NOT_RECEIVED;
+        }
+        simName(positive, id1, sizeof(id1));
+        sent = pubSent;
+        if (positive == 0) {
+            eventPost(EVENT_DECLARE, EVENT_SRC_HTTP, id1);  // Comme le bouton DeclarePositive
+            simDrain();
+        } else {
+            snprintf(payload, sizeof(payload), "P:%lu:%s", (unsigned long)positiveVersion + 1, id1);
+            simPublish(positive, FEED_ID_POSITIVE_LIST, payload, declaredAt);
+            publishes++;
+            simDrain();
+        }
+        publishes += pubSent - sent;
+        uint32_t reached = report.reached;
+        medianSum += simLatencies(positive, declaredAt, latencies, report);
+        if (report.reached != reached) medians++;
+        simNowUs += 100000UL;
+    }
+    report.latencyMedianUs = medians ? medianSum / medians : 0;
+    simArrivals = NULL;
+    simOffline = 0;
+
+    // Phase 3 : la dernière carte, de retour, demande les positifs qui lui manquent
+    SimDevice &late = simDevices[n - 1];
+    uint32_t requestAt = simNowUs;
+    simName(n - 1, id1, sizeof(id1));
+    int len = snprintf(payload, sizeof(payload), "Q:%s:0:", id1);
+    for (int b = 0; b < POSITIVE_SYNC_BUCKETS && len < (int)sizeof(payload); b++) {
+        len += snprintf(payload + len, sizeof(payload) - len, "0000");
+    }
+    simPublish(n - 1, FEED_ID_POSITIVE_SYNC, payload, requestAt);
+    publishes++;
+    sent = pubSent;
+    unsigned long waitStart = millis();
+    while (millis() - waitStart < POSITIVE_SYNC_JITTER_MS + SIM_POLL_MS) {   // Délai aléatoire des réponses
+        delay(SIM_POLL_MS);
+        simNowUs += SIM_POLL_MS * 1000UL;
+        simPollDevice();
+    }
+    simDrain();
+    publishes += pubSent - sent;
+    report.resent = syncResent;
+    report.publishWaitMaxMs = pubMaxWaitMs;
+    report.syncMs = late.positives ? (late.lastPositiveUs - requestAt) / 1000 : 0;
+
+    for (uint16_t dev = 1; dev < n; dev++) {
+        if (simDevices[dev].contactCase) {
+            report.contactCases++;
+        }
+    }
+    report.state = yctState;
+    report.eventsDropped = eventsDropped;
+    report.fanoutUsPerDelivery = report.deliveries ? (float)report.fanoutUsPerPublish / report.deliveries : 0;
+    report.fanoutUsPerPublish /= publishes;
+
+    free(simDevices); free(arrivals); free(latencies);
+    simDevices = NULL;
+    simCount = 0;
+    simReport = NULL;
+    simReset();
+    return true;
+}
+
+/**
+ * Lancement de la simulation pour N = 10, 100 et 1000 et affichage du rapport sur le port série
+ */
+void runFleetSimulation() {
+    const uint16_t sizes[] = { 10, 100, 1000 };
+    char line[224];
+    MYDEBUG_PRINTLN("-FLEETSIM : N | latence med/max (ms, extrapolée) | couverture | attente file (ms) | fan-out us/pub us/msg | "
+                    "octets | handlers carte 0 us/msg moy/max total | cas contact | état | evt perdus | renvois | rattrapage (ms)");
+    for (uint16_t n : sizes) {
+        SimReport r;
+        if (!simulateFleet(n, r)) {
+            MYDEBUG_PRINT("-FLEETSIM : Mémoire insuffisante pour N = ");
+            MYDEBUG_PRINTLN(n);
+            continue;
+        }
+        snprintf(line, sizeof(line),
+                 "-FLEETSIM : %u | %.1f / %.1f | %lu/%lu | %lu | %lu / %.2f | %lu | %.1f / %lu %lu | %u | %s | %lu | %lu | %lu",
+                 r.devices, r.latencyMedianUs / 1000.0, r.latencyMaxUs / 1000.0,
+                 (unsigned long)r.reached, (unsigned long)r.expected, (unsigned long)r.publishWaitMaxMs,
+                 (unsigned long)r.fanoutUsPerPublish, r.fanoutUsPerDelivery, (unsigned long)r.bytesDelivered,
+                 r.received ? (float)r.handlerUs / r.received : 0.0, (unsigned long)r.handlerUsMax,
+                 (unsigned long)r.handlerUs, r.contactCases, yctStateNames[r.state],
+                 (unsigned long)r.eventsDropped, (unsigned long)r.resent, (unsigned long)r.syncMs);
+        MYDEBUG_PRINTLN(line);
+        yield();
+    }
+}
@@ -0,0 +1,295 @@
+/**
+ * \file MyLog.h
+ * \page log Journal
+ * \brief Journal binaire en mémoire, mis en forme plus tard par un travail de faible priorité
+ *
+ * Les macros MYDEBUG_PRINT de \ref debug écrivent directement sur le port série : à 115200 bauds,
+ * un caractère prend près de 87 µs et les quelques lignes affichées pour chaque annonce BLE
+ * occupaient la tâche de capture plusieurs millisecondes.
+ *
+ * Les messages des chemins fréquents passent maintenant par les macros LOG_E, LOG_W, LOG_I, LOG_D
+ * et LOG_V (erreur, avertissement, information, debug, détail) :
+ * \code{.cpp}
+ * LOG_I("-ENCOUNTER : Nouveau contact %s après %u s", name, dwellMs / 1000);
+ * \endcode
+ * - les niveaux au dessus de LOG_LEVEL ne sont pas compilés du tout ;
+ * - les niveaux au dessus de LOG_LOCAL_LEVEL (port série, /log.txt) et de logRemoteLevel (clients
+ *   de la console telnet, cf. \ref remotelog) sont écartés à l'appel par une simple comparaison,
+ *   sans rien enregistrer ;
+ * - un appel n'enregistre que l'adresse du format (la chaîne reste en flash, son adresse lui sert
+ *   d'identifiant), le niveau, le core, l'heure en microsecondes et au plus LOG_MAX_ARGS arguments
+ *   de 32 bits, dans une file circulaire en RAM de LOG_RING_SIZE entrées ;
+ * - la file accepte plusieurs producteurs sans verrou (core 0, core 1, callbacks) : chaque case
+ *   porte un numéro de séquence, la place est réservée par une instruction atomique ; quand la file
+ *   est pleine le message est compté comme perdu, l'appelant n'attend jamais ;
+ * - le travail "log" de \ref timerwheel, de priorité basse, vide la file dans la limite de son
+ *   budget : mise en forme avec snprintf(), puis écriture sur le port série (si MYDEBUG vaut 1),
+ *   aux clients de la console telnet qui le demandent (cf. \ref remotelog) et, à partir du niveau
+ *   LOG_FLASH_LEVEL, dans le fichier /log.txt du SPIFFS (cf. \ref spiffs), par lots. Un message
+ *   qu'aucune destination ne veut n'est pas mis en forme.
+ *
+ * Les arguments sont des mots de 32 bits : entiers, caractères, et chaînes (%s) seulement si elles
+ * existent encore quand le message est mis en forme (littéraux, noms de la table BLE...). Les
+ * nombres à virgule sont refusés à la compilation, à passer en entiers (centièmes, millièmes...).
+ *
+ * logBenchmark() mesure le coût d'un appel, en cycles CPU, comparé à l'écriture directe sur le
+ * port série.
+ *
+ * Fichier \ref MyLog.h
+ */
+
+#include "esp_timer.h"
+
+// Niveaux
+#define LOG_LEVEL_NONE      0
+#define LOG_LEVEL_ERROR     1
+#define LOG_LEVEL_WARN      2
+#define LOG_LEVEL_INFO      3
+#define LOG_LEVEL_DEBUG     4
+#define LOG_LEVEL_VERBOSE   5
+
+#ifndef LOG_LEVEL
+ #define LOG_LEVEL          LOG_LEVEL_INFO  // Niveaux compilés
+#endif
+#define LOG_FLASH_LEVEL     LOG_LEVEL_WARN  // Niveaux recopiés dans /log.txt
+#define LOG_LOCAL_LEVEL     (MYDEBUG ? LOG_LEVEL : LOG_FLASH_LEVEL) // Niveaux toujours enregistrés
+#define LOG_RING_SIZE       128             // Entrées de la file, puissance de 2
+#define LOG_MAX_ARGS        4
+#define LOG_LINE_MAX        160
+#define LOG_DRAIN_MS        20              // Rythme du travail "log"
+#define LOG_DRAIN_BUDGET_MS 5               // Temps de mise en forme maximum par passage
+
+/* Un message, tel qu'enregistré par l'appelant */
+struct LogRecord {
+    volatile uint32_t seq;          // Numéro de séquence de la case
+    const char *fmt;
+    uint32_t timeUs;                // Poids faible de esp_timer
+    uint8_t level;
+    uint8_t core;
+    uint8_t nargs;
+    uint32_t args[LOG_MAX_ARGS];
+};
+
+LogRecord logRing[LOG_RING_SIZE];
+uint32_t logHead = 0;               // Prochaine case à réserver, modifiée atomiquement
+uint32_t logTail = 0;               // Prochaine case à mettre en forme, par le travail "log" seul
+uint32_t logDropped = 0;
+uint32_t logDrained = 0;
+uint32_t logSkipped = 0;            // Messages retirés de la file sans mise en forme
+uint8_t logHighWater = 0;
+const char logLevelLetters[] = "-EWIDV";
+
+// Destinations, renseignées par les modules concernés
+void (*logFlashSink)(const String &lines) = NULL;   // Fichier /log.txt, cf. setupSPIFFS()
+// Console telnet, cf. setupRemoteLog() : niveau le plus détaillé demandé par un client (0 : aucun
+// client), filtre par client avant la mise en forme, et envoi
+volatile uint8_t logRemoteLevel = LOG_LEVEL_NONE;
+bool (*logRemoteFilter)(uint8_t level, const char *fmt) = NULL;
+void (*logRemoteSink)(uint8_t level, const char *fmt, const char *line) = NULL;
+
+/**
+ * Initialisation des numéros de séquence : la case i attend le message i
+ */
+void logBegin() {
+    for (uint32_t i = 0; i < LOG_RING_SIZE; i++) {
+        logRing[i].seq = i;
+    }
+}
+
+/**
+ * Enregistrement d'un message, sans verrou ni attente
+ */
+void logPush(uint8_t level, const char *fmt, const uint32_t *args, uint8_t nargs) {
+    uint32_t pos = __atomic_load_n(&logHead, __ATOMIC_RELAXED);
+    LogRecord *r;
+    for (;;) {
+        r = &logRing[pos & (LOG_RING_SIZE - 1)];
+        int32_t dif = (int32_t)(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) - pos);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&logHead, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            __atomic_fetch_add(&logDropped, 1, __ATOMIC_RELAXED);   // File pleine
+            return;
+        } else {
+            pos = __atomic_load_n(&logHead, __ATOMIC_RELAXED);
+        }
+    }
+    r->fmt = fmt;
+    r->timeUs = (uint32_t)esp_timer_get_time();
+    r->level = level;
+    r->core = xPortGetCoreID();
+    r->nargs = nargs;
+    for (uint8_t i = 0; i < nargs; i++) {
+        r->args[i] = args[i];
+    }
+    __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);      // Visible pour le travail "log"
+}
+
+// Conversion des arguments en mots de 32 bits ; pas de float ni de double, cf. \ref log
+inline uint32_t logArg(int v) { return (uint32_t)v; }
+inline uint32_t logArg(unsigned int v) { return v; }
+inline uint32_t logArg(long v) { return (uint32_t)v; }
+inline uint32_t logArg(unsigned long v) { return (uint32_t)v; }
+inline uint32_t logArg(const char *v) { return (uint32_t)(uintptr_t)v; }
+
+template<typename... Args>
+inline void logWrite(uint8_t level, const char *fmt, Args... args) {
+    static_assert(sizeof...(args) <= LOG_MAX_ARGS, "LOG : trop d'arguments");
+    if (level > LOG_LOCAL_LEVEL && level > logRemoteLevel) {
+        return;                     // Personne n'écoute ce niveau
+    }
+    uint32_t values[] = { logArg(args)..., 0 };
+    logPush(level, fmt, values, sizeof...(args));
+}
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+ #define LOG_E(fmt, ...)    logWrite(LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
+#else
+ #define LOG_E(fmt, ...)    do {} while (0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+ #define LOG_W(fmt, ...)    logWrite(LOG_LEVEL_WARN, fmt, ##__VA_ARGS__)
+#else
+ #define LOG_W(fmt, ...)    do {} while (0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+ #define LOG_I(fmt, ...)    logWrite(LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#else
+ #define LOG_I(fmt, ...)    do {} while (0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+ #define LOG_D(fmt, ...)    logWrite(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+#else
+ #define LOG_D(fmt, ...)    do {} while (0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_VERBOSE
+ #define LOG_V(fmt, ...)    logWrite(LOG_LEVEL_VERBOSE, fmt, ##__VA_ARGS__)
+#else
+ #define LOG_V(fmt, ...)    do {} while (0)
+#endif
+
+/**
+ * Mise en forme d'un message : "[   12.345678] I1 texte", heure en secondes depuis le démarrage,
+ * niveau et core
+ * \param nowUs esp_timer courant, pour reconstituer l'heure sur 64 bits
+ */
+void logFormat(const LogRecord &r, int64_t nowUs, char *line, size_t size) {
+    int64_t t = nowUs - (uint32_t)((uint32_t)nowUs - r.timeUs);
+    int n = snprintf(line, size, "[%5lu.%06lu] %c%u ", (unsigned long)(t / 1000000), (unsigned long)(t % 1000000),
+                     logLevelLetters[r.level], r.core);
+    if (n < 0 || (size_t)n >= size) {
+        return;
+    }
+    const uint32_t *a = r.args;
+    snprintf(line + n, size - n, r.fmt, a[0], a[1], a[2], a[3]);
+}
+
+/**
+ * Travail "log" : mise en forme et écriture des messages en attente, dans la limite du budget
+ */
+void pollLog(uint32_t budgetMs) {
+    uint32_t start = millis();
+    char line[LOG_LINE_MAX];
+    String flashLines = "";
+    uint32_t used = __atomic_load_n(&logHead, __ATOMIC_RELAXED) - logTail;
+    if (used > logHighWater) logHighWater = used > 255 ? 255 : used;
+    while (millis() - start < budgetMs) {
+        LogRecord &r = logRing[logTail & (LOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&r.seq, __ATOMIC_ACQUIRE) != logTail + 1) {
+            break;                  // Vide, ou message en cours d'écriture
+        }
+        uint8_t level = r.level;
+        const char *fmt = r.fmt;
+        bool local = level <= LOG_LOCAL_LEVEL;
+        bool remote = logRemoteFilter && logRemoteFilter(level, fmt);
+        if (local || remote) {
+            logFormat(r, esp_timer_get_time(), line, sizeof(line));
+        }
+        __atomic_store_n(&r.seq, logTail + LOG_RING_SIZE, __ATOMIC_RELEASE);   // Case libérée
+        logTail++;
+        logDrained++;
+        if (!local && !remote) {
+            logSkipped++;           // Client déconnecté ou filtre modifié depuis l'appel
+            continue;
+        }
+#if MYDEBUG
+        if (local) {
+            Serial.println(line);
+        }
+#endif
+        if (remote) {
+            logRemoteSink(level, fmt, line);
+        }
+        if (logFlashSink && level <= LOG_FLASH_LEVEL) {
+            flashLines += line;
+            flashLines += "\n";
+        }
+    }
+    if (flashLines.length() > 0) {
+        logFlashSink(flashLines);
+    }
+}
+
+/**
+ * Coût d'un message, en cycles CPU : message écarté faute de destination, enregistrement dans la
+ * file, comparé à l'écriture directe sur le port série du même message. A appeler depuis setup(),
+ * la file est vidée ensuite.
+ */
+void logBenchmark() {
+    const int samples = 100;
+    uint32_t start = ESP.getCycleCount();
+    for (int i = 0; i < samples; i++) {
+        logWrite(LOG_LEVEL_VERBOSE, "-LOG : Test %d, distance %u cm", i, 150u);
+    }
+    uint32_t idleCycles = (ESP.getCycleCount() - start) / samples;
+
+    start = ESP.getCycleCount();
+    for (int i = 0; i < samples; i++) {
+        uint32_t args[] = { (uint32_t)i, 150u };
+        logPush(LOG_LEVEL_DEBUG, "-LOG : Test %d, distance %u cm", args, 2);
+    }
+    uint32_t ringCycles = (ESP.getCycleCount() - start) / samples;
+    logTail = __atomic_load_n(&logHead, __ATOMIC_RELAXED);     // Messages de test ignorés
+    for (uint32_t i = 0; i < LOG_RING_SIZE; i++) {
+        logRing[(logTail + i) & (LOG_RING_SIZE - 1)].seq = logTail + i;
+    }
+
+    const int serialSamples = 10;
+    start = ESP.getCycleCount();
+    for (int i = 0; i < serialSamples; i++) {
+        Serial.print("-LOG : Test ");
+        Serial.print(i);
+        Serial.print(", distance ");
+        Serial.print(150);
+        Serial.println(" cm");
+    }
+    uint32_t serialCycles = (ESP.getCycleCount() - start) / serialSamples;
+
+    LOG_I("-LOG : Message écarté %u cycles, en file %u cycles, port série direct %u cycles",
+          idleCycles, ringCycles, serialCycles);
+}
+
+/**
+ * Statistiques du journal au format "clé valeur" de /stats
+ */
+String logStats() {
+    String out = "";
+    out += "log.level " + String(LOG_LEVEL) + "\n";
+    out += "log.written " + String(__atomic_load_n(&logHead, __ATOMIC_RELAXED)) + "\n";
+    out += "log.drained " + String(logDrained) + "\n";
+    out += "log.skipped " + String(logSkipped) + "\n";
+    out += "log.remote_level " + String(logRemoteLevel) + "\n";
+    out += "log.dropped " + String(logDropped) + "\n";
+    out += "log.high_water " + String(logHighWater) + "/" + String(LOG_RING_SIZE) + "\n";
+    return out;
+}
+
+/**
+ * Démarrage du journal, juste après setupDebug()
+ */
+void setupLog() {
+    logBegin();
+    timerPoll("log", LOG_DRAIN_MS, LOG_DRAIN_BUDGET_MS, TIMER_PRIO_LOW, pollLog);
+}
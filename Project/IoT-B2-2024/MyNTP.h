@@ -13,22 +13,336 @@
  * Nous pourrons ainsi horodater (timestamp) des mesures, connaître le temps écoulé entre deux événements, 
  * afficher l’heure courante sur une interface WEB, déclencher une action programmée ...
  * 
- * La bibliothèque NTPClient est nécessaire.
- * 
+ * \subsection ntpclock Horloge locale disciplinée
+ * La bibliothèque NTPClient ne donnait que des secondes, imposait un décalage fixe de +3600 s
+ * (sans heure d'été), et timeClient.update() était appelé à chaque écriture dans le fichier de
+ * tracking. L'heure est maintenant servie par une horloge locale :
+ * - timeNowUs() donne l'heure UTC en microsecondes depuis le 1er janvier 1970, à partir du
+ *   compteur esp_timer (microsecondes depuis le démarrage) et d'une base (date d'origine, dérive),
+ *   sans accès au réseau : quelques dizaines de cycles, utilisable depuis le callback BLE sur le
+ *   core 0. La base est publiée par double tampon, le core 1 ne la modifie jamais en place.
+ * - le travail "ntp" de \ref timerwheel interroge le serveur NTP_SERVER en tâche de fond, toutes
+ *   les ntp_interval minutes (paramètre de configuration) : une rafale de NTP_BURST requêtes SNTP,
+ *   dont la réponse est guettée toutes les millisecondes sans bloquer loop(), et seule la réponse
+ *   au plus court aller-retour est retenue. L'heure du serveur est lue à la microseconde et
+ *   corrigée de la moitié du temps de transit.
+ * - l'adresse du serveur est résolue sans bloquer : dns_gethostbyname() de lwIP rend la main
+ *   tout de suite et la réponse arrive par un callback, guetté par le travail "ntp" pendant au
+ *   plus NTP_DNS_TIMEOUT_MS (WiFi.hostByName() attendait la réponse dans loop()). Après une rafale
+ *   sans réponse, l'adresse est oubliée et résolue à nouveau à la tentative suivante : NTP_SERVER
+ *   est un pool, le serveur choisi a pu disparaître.
+ * - une seule synchronisation à la fois : ntpInFlight reste levé jusqu'à la fin de la chaîne
+ *   "ntp.rx" (dernière réponse ou dernier délai dépassé). Après un échec, la tentative suivante
+ *   attend NTP_RETRY_MS sur esp_timer, que l'horloge ait déjà été mise à l'heure ou non.
+ * - à chaque synchronisation, l'écart entre l'heure du serveur et l'heure prédite donne la dérive
+ *   du quartz, en ppm (corrigée de moitié à chaque fois, pour ne pas suivre le bruit du transit),
+ *   appliquée ensuite par timeNowUs() entre deux synchronisations.
+ * - l'horloge système (time(), gettimeofday()) est recalée à chaque synchronisation : l'ESP32 la
+ *   fait avancer pendant le sommeil profond. La date de la prochaine synchronisation et la dérive
+ *   sont conservées en mémoire RTC : au réveil, setupTime() reprend la base depuis l'horloge
+ *   système, sans réseau, et la dérive estimée avant le sommeil reste appliquée.
+ * - l'heure locale (fuseau TIME_ZONE, heure d'été comprise) est obtenue par localtime_r().
+ *
+ * L'écart mesuré à chaque synchronisation, la dérive et l'aller-retour sont visibles sur /stats
+ * (ntp.*).
+ *
  * Fichier \ref MyNTP.h
  */
 
-#include <NTPClient.h>           //https://github.com/arduino-libraries/NTPClient
 #include <WiFiUdp.h>
+#include "esp_timer.h"
+#include "lwip/dns.h"
+
+#define NTP_SERVER          "pool.ntp.org"
+#define NTP_PORT            123
+#define NTP_LOCAL_PORT      2390        // Port UDP local des réponses
+#define NTP_BURST           4           // Requêtes par synchronisation, la meilleure est retenue
+#define NTP_TIMEOUT_MS      1000        // Attente maximale d'une réponse
+#define NTP_RETRY_MS        60000       // Nouvel essai après une synchronisation manquée
+#define NTP_DNS_TIMEOUT_MS  5000        // Attente maximale de la résolution du nom du serveur
+#define NTP_DRIFT_MIN_S     300         // Intervalle minimum pour estimer la dérive
+#define NTP_DRIFT_MAX_PPM   500         // Au delà, la mesure est ignorée (pas le même quartz, saut d'heure...)
+#define NTP_UNIX_OFFSET     2208988800UL // Secondes entre 1900 (NTP) et 1970 (Unix)
+#define TIME_ZONE           "CET-1CEST,M3.5.0,M10.5.0/3"   // Paris, heure d'été comprise
+
+/* Base de l'horloge locale : heure = epochUs + écoulé + écoulé * rate / 2^32 */
+struct TimeBase {
+    int64_t refUs;                  // esp_timer à l'origine
+    int64_t epochUs;                // Heure UTC à l'origine
+    int64_t rate;                   // Dérive corrigée, en 2^-32 (1 ppm = 4295)
+};
+
+TimeBase timeBases[2];
+volatile uint8_t timeBaseIdx = 0;   // Base courante, l'autre est préparée par le core 1
+
+// Conservés pendant le sommeil profond
+RTC_DATA_ATTR bool timeSynced = false;
+RTC_DATA_ATTR int64_t timeRate = 0;
+RTC_DATA_ATTR int64_t ntpNextSyncUs = 0;    // Heure UTC de la prochaine synchronisation
+RTC_DATA_ATTR uint32_t ntpSyncs = 0;
+RTC_DATA_ATTR uint32_t ntpFailures = 0;
+RTC_DATA_ATTR int32_t ntpLastErrorUs = 0;   // Ecart entre le serveur et l'heure prédite
+RTC_DATA_ATTR uint32_t ntpLastRttUs = 0;
 
 WiFiUDP ntpUDP;
-NTPClient timeClient(ntpUDP);
+IPAddress ntpServerIP;
+// Résolution du nom du serveur, réponse écrite par le callback de lwIP (tâche tcpip)
+volatile bool ntpDnsPending = false;
+volatile bool ntpDnsDone = false;
+volatile uint32_t ntpDnsResult = 0;     // 0 : nom inconnu
+uint32_t ntpDnsStart = 0;
+int64_t ntpLastSyncRefUs = -1;      // esp_timer de la dernière synchronisation depuis le démarrage
+uint8_t ntpBurstLeft = 0;
+bool ntpInFlight = false;           // Synchronisation en cours, jusqu'à la fin de la chaîne "ntp.rx"
+int64_t ntpRetryAtUs = 0;           // esp_timer de la prochaine tentative après un échec, 0 si aucune
+int64_t ntpSentUs = 0;
+int64_t ntpBestRttUs = -1;
+int64_t ntpBestEpochUs = 0;         // Heure du serveur, à ntpBestRefUs
+int64_t ntpBestRefUs = 0;
 
 /**
- * \brief Fonction de récupération de l'heure
- * 
- * Cette fonction permet de récupérer l'heure auprès d'un serveur de temps NTP.
- * 
+ * Heure UTC en microsecondes depuis 1970, sans accès au réseau
+ * \return 0 tant que l'horloge n'a jamais été mise à l'heure
+ */
+inline int64_t timeNowUs() {
+    const TimeBase &b = timeBases[timeBaseIdx];
+    int64_t elapsed = esp_timer_get_time() - b.refUs;
+    return b.epochUs ? b.epochUs + elapsed + ((elapsed * b.rate) >> 32) : 0;
+}
+
+/**
+ * Heure UTC en secondes depuis 1970
+ */
+inline time_t timeNow() {
+    return (time_t)(timeNowUs() / 1000000);
+}
+
+/**
+ * Publication d'une nouvelle base : écrite dans le tampon inactif, puis basculée
+ */
+void timeSetBase(int64_t refUs, int64_t epochUs, int64_t rate) {
+    uint8_t next = timeBaseIdx ^ 1;
+    timeBases[next].refUs = refUs;
+    timeBases[next].epochUs = epochUs;
+    timeBases[next].rate = rate;
+    timeBaseIdx = next;
+}
+
+/**
+ * Heure locale (fuseau TIME_ZONE) au format strftime, ex : "%H:%M:%S"
+ */
+void timeFormatLocal(char *out, size_t size, const char *format) {
+    time_t now = timeNow();
+    struct tm tm;
+    localtime_r(&now, &tm);
+    strftime(out, size, format, &tm);
+}
+
+/**
+ * Lecture d'un horodatage NTP (secondes depuis 1900, fraction en 2^-32 s) en microsecondes Unix
+ */
+int64_t ntpReadTimestamp(const uint8_t *p) {
+    uint32_t seconds = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    uint32_t fraction = (uint32_t)p[4] << 24 | (uint32_t)p[5] << 16 | (uint32_t)p[6] << 8 | p[7];
+    return (int64_t)(seconds - NTP_UNIX_OFFSET) * 1000000 + (((uint64_t)fraction * 1000000) >> 32);
+}
+
+/**
+ * Envoi d'une requête SNTP ; le champ "transmit" contient esp_timer, renvoyé par le serveur
+ * dans le champ "originate" pour reconnaître la réponse
+ */
+bool ntpSend() {
+    uint8_t packet[48];
+    memset(packet, 0, sizeof(packet));
+    packet[0] = 0x23;               // LI 0, version 4, mode 3 (client)
+    ntpSentUs = esp_timer_get_time();
+    for (int i = 0; i < 8; i++) {
+        packet[40 + i] = (uint8_t)(ntpSentUs >> (56 - 8 * i));
+    }
+    while (ntpUDP.parsePacket() > 0) {
+        ntpUDP.flush();             // Réponses en retard d'une requête précédente
+    }
+    if (!ntpUDP.beginPacket(ntpServerIP, NTP_PORT)) {
+        return false;
+    }
+    ntpUDP.write(packet, sizeof(packet));
+    return ntpUDP.endPacket();
+}
+
+void ntpReceive();
+
+/**
+ * Fin d'une synchronisation : dérive, nouvelle base, horloge système, prochaine échéance
+ */
+void ntpApply() {
+    int64_t epochUs = ntpBestEpochUs;
+    int64_t refUs = ntpBestRefUs;
+    int64_t rate = timeRate;
+    if (timeSynced) {
+        const TimeBase &b = timeBases[timeBaseIdx];
+        int64_t elapsed = refUs - b.refUs;
+        int64_t predicted = b.epochUs + elapsed + ((elapsed * b.rate) >> 32);
+        ntpLastErrorUs = (int32_t)(epochUs - predicted);
+        // La dérive n'est estimée qu'entre deux synchronisations du même démarrage : le sommeil
+        // profond est compté par l'horloge RTC, bien moins précise que le quartz
+        int64_t since = refUs - ntpLastSyncRefUs;
+        if (ntpLastSyncRefUs >= 0 && since >= (int64_t)NTP_DRIFT_MIN_S * 1000000) {
+            // La moitié de la correction mesurée seulement, pour filtrer le bruit du transit
+            int64_t candidate = b.rate + ((int64_t)ntpLastErrorUs << 31) / since;
+            int64_t limit = ((int64_t)NTP_DRIFT_MAX_PPM << 32) / 1000000;
+            if (candidate > -limit && candidate < limit) {
+                rate = candidate;
+            }
+        }
+    }
+    timeSetBase(refUs, epochUs, rate);
+    timeRate = rate;
+    timeSynced = true;
+    ntpLastSyncRefUs = refUs;
+    ntpLastRttUs = (uint32_t)ntpBestRttUs;
+    ntpSyncs++;
+    int64_t now = timeNowUs();
+    struct timeval tv = { (time_t)(now / 1000000), (suseconds_t)(now % 1000000) };
+    settimeofday(&tv, NULL);
+    ntpNextSyncUs = now + (int64_t)ntp_interval * 60000000;
+    char local[24];
+    timeFormatLocal(local, sizeof(local), "%Y-%m-%d %H:%M:%S");
+    MYDEBUG_PRINT("-NTP : ");
+    MYDEBUG_PRINT(local);
+    MYDEBUG_PRINT(", écart ");
+    MYDEBUG_PRINT(ntpLastErrorUs);
+    MYDEBUG_PRINT(" us, aller-retour ");
+    MYDEBUG_PRINT(ntpLastRttUs);
+    MYDEBUG_PRINTLN(" us");
+}
+
+/**
+ * Requête suivante de la rafale, ou fin de la synchronisation
+ */
+void ntpNext() {
+    if (ntpBurstLeft > 0 && ntpSend()) {
+        ntpBurstLeft--;
+        timerSetPriority(timerOnce("ntp.rx", 1, ntpReceive), TIMER_PRIO_HIGH);
+        return;
+    }
+    ntpBurstLeft = 0;
+    ntpInFlight = false;
+    if (ntpBestRttUs >= 0) {
+        ntpRetryAtUs = 0;
+        ntpApply();
+        return;
+    }
+    ntpFailures++;
+    ntpRetryAtUs = esp_timer_get_time() + (int64_t)NTP_RETRY_MS * 1000;
+    ntpServerIP = IPAddress((uint32_t)0);    // Serveur du pool peut-être disparu, nom résolu à nouveau
+    MYDEBUG_PRINTLN("-NTP : Pas de réponse du serveur");
+}
+
+/**
+ * Attente de la réponse, relancée toutes les millisecondes jusqu'à NTP_TIMEOUT_MS
+ */
+void ntpReceive() {
+    int64_t nowUs = esp_timer_get_time();
+    if (ntpUDP.parsePacket() >= 48) {
+        uint8_t packet[48];
+        ntpUDP.read(packet, sizeof(packet));
+        int64_t originate = 0;
+        for (int i = 0; i < 8; i++) {
+            originate = originate << 8 | packet[24 + i];
+        }
+        uint8_t mode = packet[0] & 0x07;
+        if (originate == ntpSentUs && mode == 4 && packet[1] != 0) {   // Réponse serveur, pas un "kiss-o'-death"
+            int64_t received = ntpReadTimestamp(packet + 32);
+            int64_t transmit = ntpReadTimestamp(packet + 40);
+            int64_t rtt = (nowUs - ntpSentUs) - (transmit - received);
+            if (rtt >= 0 && (ntpBestRttUs < 0 || rtt < ntpBestRttUs)) {
+                ntpBestRttUs = rtt;
+                ntpBestEpochUs = transmit + rtt / 2;
+                ntpBestRefUs = nowUs;
+            }
+            ntpNext();
+            return;
+        }
+    }
+    if (nowUs - ntpSentUs > (int64_t)NTP_TIMEOUT_MS * 1000) {
+        ntpNext();
+        return;
+    }
+    timerSetPriority(timerOnce("ntp.rx", 1, ntpReceive), TIMER_PRIO_HIGH);
+}
+
+/**
+ * Réponse de la résolution du nom du serveur, sur la tâche tcpip de lwIP
+ */
+void ntpDnsFound(const char *name, const ip_addr_t *ipaddr, void *arg) {
+    ntpDnsResult = ipaddr ? ip4_addr_get_u32(ip_2_ip4(ipaddr)) : 0;
+    ntpDnsDone = true;
+}
+
+/**
+ * Résolution du nom du serveur sans bloquer, à rappeler jusqu'à la réponse
+ * \return true quand ntpServerIP est connue ; false si elle est en cours ou a échoué (ntpDnsPending)
+ */
+bool ntpResolve() {
+    if ((uint32_t)ntpServerIP != 0) {
+        return true;
+    }
+    if (!ntpDnsPending) {
+        ip_addr_t addr;
+        ntpDnsDone = false;
+        err_t err = dns_gethostbyname(NTP_SERVER, &addr, ntpDnsFound, NULL);
+        if (err == ERR_OK) {            // Déjà dans le cache de lwIP
+            ntpServerIP = IPAddress(ip4_addr_get_u32(ip_2_ip4(&addr)));
+            return true;
+        }
+        if (err != ERR_INPROGRESS) {
+            return false;
+        }
+        ntpDnsPending = true;
+        ntpDnsStart = millis();
+        return false;
+    }
+    if (ntpDnsDone) {
+        ntpDnsPending = false;
+        ntpServerIP = IPAddress((uint32_t)ntpDnsResult);
+        return ntpDnsResult != 0;
+    }
+    if (millis() - ntpDnsStart > NTP_DNS_TIMEOUT_MS) {
+        ntpDnsPending = false;          // Nouvelle requête au prochain essai
+    }
+    return false;
+}
+
+/**
+ * Travail "ntp" : lancement d'une synchronisation quand elle est due et que le réseau est là
+ */
+void ntpPoll() {
+    if (ntpInFlight || WiFi.status() != WL_CONNECTED) {
+        return;
+    }
+    if (esp_timer_get_time() < ntpRetryAtUs) {
+        return;                         // Echec récent, y compris avant la première synchronisation
+    }
+    if (timeSynced && timeNowUs() < ntpNextSyncUs) {
+        return;
+    }
+    if (!ntpResolve()) {
+        if (!ntpDnsPending) {           // Nom inconnu ou pas de réponse
+            ntpFailures++;
+            ntpRetryAtUs = esp_timer_get_time() + (int64_t)NTP_RETRY_MS * 1000;
+        }
+        return;
+    }
+    ntpBestRttUs = -1;
+    ntpBurstLeft = NTP_BURST;
+    ntpInFlight = true;
+    ntpNext();
+}
+
+/**
+ * \brief Synchronisation immédiate
+ *
+ * Autrefois lecture bloquante de l'heure avec NTPClient :
  * \code{.cpp}
  * void getNTP(){
  *   MYDEBUG_PRINT("-NTP : ");
@@ -38,24 +352,45 @@ NTPClient timeClient(ntpUDP);
  *   MYDEBUG_PRINTLN(timeClient.getFormattedTime());
  * }
  * \endcode
+ * Elle demande maintenant une synchronisation au prochain passage du travail "ntp".
  */
 void getNTP(){
-  MYDEBUG_PRINT("-NTP : ");
-  // mise à jour de l'heure
-  timeClient.update();
-  // Affichage de l'heure
-  MYDEBUG_PRINTLN(timeClient.getFormattedTime());
+  ntpNextSyncUs = 0;
+  ntpRetryAtUs = 0;
+}
 
+/**
+ * Statistiques de l'horloge au format "clé valeur" de /stats
+ */
+String ntpStats() {
+  String out = "";
+  out += "ntp.synced " + String(timeSynced) + "\n";
+  out += "ntp.syncs " + String(ntpSyncs) + "\n";
+  out += "ntp.failures " + String(ntpFailures) + "\n";
+  out += "ntp.last_error_us " + String(ntpLastErrorUs) + "\n";
+  out += "ntp.drift_ppm " + String((float)timeRate * 1000000.0 / 4294967296.0, 3) + "\n";
+  out += "ntp.rtt_us " + String(ntpLastRttUs) + "\n";
+  out += "ntp.next_sync_s " + String(timeSynced ? (int32_t)((ntpNextSyncUs - timeNowUs()) / 1000000) : 0) + "\n";
+  return out;
+}
+
+/**
+ * Horloge locale, à appeler au tout début de setup() (réveil court compris) : fuseau horaire,
+ * et reprise de l'heure depuis l'horloge système après un sommeil profond, sans réseau
+ */
+void setupTime(){
+  setenv("TZ", TIME_ZONE, 1);
+  tzset();
+  if (timeSynced) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    timeSetBase(esp_timer_get_time(), (int64_t)tv.tv_sec * 1000000 + tv.tv_usec, timeRate);
+  }
 }
 
 void setupNTP(){
-  // On a besoin d'une connexion à Internet !
-  if (WiFi.status() != WL_CONNECTED){
-    setupWiFi();
-  }  
-  timeClient.begin();
-  // Avec l'heure d'été, nous avons en France 1h (3600s) de décalage avec le méridien de Greenwich (Greenwich Meridian Time : GMT) en hiver.
-  timeClient.setTimeOffset(3600);
-
-  getNTP();
+  // On a besoin d'une connexion à Internet : étape lancée à l'obtention de l'adresse IP, cf. \ref boot
+  ntpUDP.begin(NTP_LOCAL_PORT);
+  timerSetPriority(timerEvery("ntp", 1000, ntpPoll), TIMER_PRIO_LOW);
+  ntpPoll();
 }
@@ -43,22 +43,10 @@
  * \subsection remote Debug à distance
  * S'affranchir de la liaison série est appréciable, toutefois on perd en même temps une
  * fonctionnalité très utile : l'affichage des messages de debug !
- * Une solution pour palier à ce problème est l'utilisation de la bibliothèque RemoteDebug qui 
- * permet de se connecter en telnet à notre carte et de récupérer les messages par ce biais.
- * 
- * \note \b Tous les messages de debug qui sont présents dans votre code doivent être modifiés
- * pour appeler les fonctions de génération de debug de la bibliothèque RemoteDebug.
- * 
- * Il y a possibilités de créer des messages avec différents niveaux de logs, les voici par niveau 
- * de détail :
- * - Verbose
- * - Debug
- * - Info
- * - Warnings
- * - Errors
- * Quand vous sélectionner un niveau de détail, tous les messages de niveau "inférieur" sont
- * également visibles.
- * 
+ * La bibliothèque RemoteDebug, autrefois démarrée ici, servait ces messages en telnet, accompagnée d'un
+ * travail qui générait cinq messages de test toutes les 2 secondes, mis en forme même sans client
+ * connecté. La console telnet est maintenant servie à partir du journal, cf. \ref remotelog.
+ *
  * Une fois ce firmware téléversé:
  * - Dans le menu "Outils/Port", vérifier que le nouveau port <OTA_HOSTNAME> at <IP ADDRESS> 
  *   apparaît dans la liste des "Ports réseau".
@@ -67,54 +55,34 @@
  * - Il n'apparait donc plus dans la liste de vos "Ports série" mais est toujours présent dans
  *   les "Ports réseau".
  * - Vous pouvez désormais téléversez vos nouveaux firmwares \b Over \b The \b Air.
- * - Pour accéder aux logs, 2 possibilités :
- *   - Ouvrez un terminal et saisissez "telnet <adresse IP>" pour y voir
- *     apparaître vos messages de logs, ou utilisez un logiciel du type Putty : 
- *     https://www.chiark.greenend.org.uk/~sgtatham/putty/latest.html
- *   - Remote Debug embarque une bibliothèque de web socket qui permet d'accéder aux logs.
- *     Télécharger la Web App (le zip décompressé de https://github.com/JoaoLopesF/RemoteDebugApp)
- *     sur votre ordinateur et lancer index.html pour pouvoir vous connecter à votre carte 
- *     à l'aide d'une web socket et récupérer les logs.
+ * - Pour accéder aux logs, ouvrez un terminal et saisissez "telnet <adresse IP>", ou utilisez un
+ *   logiciel du type Putty : https://www.chiark.greenend.org.uk/~sgtatham/putty/latest.html
  * 
  * \subsection otalib Librairies nécessaires
- * Bibliothèques à installer pour utiliser ce module :
+ * Bibliothèque à installer pour utiliser ce module :
  * - Arduino OTA by Arduino Juraj Andrassy : https://github.com/jandrassy/ArduinoOTA
- * - RemoteDebug by Joao Lopez : https://github.com/JoaoLopesF/RemoteDebug
- * 
- * \note Vous devriez rencontrer une erreur de compilation du type
- * \verbatim .../libraries/RemoteDebug/src/utility/WebSockets.cpp:42:10: fatal error: hwcrypto/sha.h: No such file or directory\endverbatim
- * Si c'est le cas, pour corriger le problème, éditez le fichier en question et remplacer 
- * hwcrypto/sha.h par sha/sha_parallel_engine.h !
  * 
  * Fichier \ref MyOTA.h
  */
 
 #include <ArduinoOTA.h>
-#include <RemoteDebug.h>
 
 #define OTA_HOSTNAME  "ESP32_Valentin"
 #define OTA_PASSWORD  "1234567890"
 
-RemoteDebug Debug;
-Ticker debugTicker;
-
 /**
- * Fonction appelée par un ticker pour générer des messages de debug à différents niveaux
+ * Toutes les 20 ms, on verifie si une mise a jour nous est envoyée.
+ * Si tel est cas, la bibliothèque ArduinoOTA se charge de tout !
  */
-void generateDebugLog(){
-  rdebugVln("-Remote DEBUG : Message VERBOSE");
-  rdebugDln("-Remote DEBUG : Message DEBUG");
-  rdebugIln("-Remote DEBUG : Message INFO");
-  rdebugWln("-Remote DEBUG : Message WARNING");
-  rdebugEln("-Remote DEBUG : Message ERROR");
+void loopOTA(){
+  ArduinoOTA.handle();          // Gestion des demandes de téléversement
 }
 
 /**
- * Configuration et démarrage des services OTA & Remote Debug
+ * Configuration et démarrage du service OTA
  */
 void setupOTA(){
-  // On a besoin d'une connexion WiFi !
-  if (WiFi.status() != WL_CONNECTED){setupWiFi();}  // Connexion WiFi
+  // On a besoin d'une connexion WiFi : étape lancée à l'obtention de l'adresse IP, cf. \ref boot
 
   // Démarrage d'OTA
   MYDEBUG_PRINTLN("-OTA : Démarrage");
@@ -122,23 +90,6 @@ void setupOTA(){
   ArduinoOTA.setPassword(OTA_PASSWORD); // Mot de passe pour les téléversements
   ArduinoOTA.begin();                   // Initialisation de l'OTA
 
-  // Initialisation de la librairie RemoteDebug
-  Debug.begin(OTA_HOSTNAME); 
-  Debug.setPassword(OTA_PASSWORD);      // Mot de passe pour les connexions telnet et Web app
-  Debug.setResetCmdEnabled(true);       // Pour permettre le Reset par telnet
-  Debug.showColors(true);               // Un peu de couleurs pour faire joli
-  //Debug.setSerialEnabled(true);       // Pour activer un écho des logs sur le port série (si branché)
-
-  // Ticker pour générer des logs
-  debugTicker.attach(2, generateDebugLog);
-}
-
-/**
- * A chaque itération, on verifie si une mise a jour nous est envoyée.
- * Si tel est cas, la bibliothèque ArduinoOTA se charge de tout !
- */
-void loopOTA(){
-  ArduinoOTA.handle();          // Gestion des demandes de téléversement
-  debugTicker.attach(2, generateDebugLog);
-  Debug.handle();               // Gestion des messages de remote debug
+  // Travail périodique : gestion OTA
+  timerEvery("ota", 20, loopOTA);
 }
@@ -0,0 +1,510 @@
+/**
+ * \file MyPositiveSync.h
+ * \page positivesync Synchronisation de la liste des positifs
+ * \brief Rattraper les déclarations de positifs manquées pendant une déconnexion
+ *
+ * Jusqu'ici chaque carte n'apprend les positifs qu'au fil des messages reçus sur le feed
+ * data.positivelist : tout ce qui a été publié pendant que la carte était éteinte ou hors
+ * réseau est perdu.
+ *
+ * Ce module maintient une copie locale de la liste des positifs où chaque entrée porte un
+ * numéro de séquence monotone (horloge de Lamport : chaque nouvelle déclaration prend le plus
+ * grand numéro connu + 1). La liste est résumée par un condensat (digest) de 16 "seaux" de
+ * 16 bits : chaque identifiant est haché (FNV-1a) et le hash, replié sur 16 bits, est combiné
+ * par XOR dans le seau hash % 16. Le digest tient ainsi en 64 caractères hexadécimaux, ce qui
+ * permet à la requête de rester sous la taille maximale d'un message reçu par la bibliothèque
+ * Adafruit MQTT (SUBSCRIPTIONDATALEN, 100 octets).
+ *
+ * Protocole (messages texte) :
+ * - Sur le feed data.positivelist : <b>P:seq:id</b> annonce un positif. Un message contenant
+ *   uniquement l'identifiant (ancien format) est toujours accepté.
+ * - Sur le feed data.positivesync : <b>Q:nom:version:d0d1...d15</b> est envoyé par une carte
+ *   qui (re)vient sur le réseau. Les autres cartes lui renvoient uniquement les entrées dont
+ *   le numéro de séquence est supérieur à sa version ou qui sont dans un seau dont le digest
+ *   diffère.
+ *
+ * Pour éviter que toutes les cartes répondent en même temps, chaque réponse est différée d'un
+ * délai aléatoire et annulée si l'entrée a été vue passer sur le feed entre temps.
+ *
+ * Un positif annoncé par une source non authentifiée (le BLE, cf. \ref blesync) n'entre pas dans
+ * la liste : il est gardé à part comme provisoire, ce qui suffit à signaler une exposition non
+ * confirmée (\ref yct), jusqu'à ce que MQTT le confirme (il arrive sur le feed et rejoint la liste)
+ * ou l'infirme : notre requête de synchronisation a fait l'aller-retour par le broker (nous en
+ * avons reçu l'écho) et POSITIVE_CONFIRM_MS plus tard, aucune carte ne l'a annoncé.
+ *
+ * Les octets échangés et le temps de convergence sont comptabilisés et visibles sur la
+ * route /stats du serveur web.
+ *
+ * Fichier \ref MyPositiveSync.h
+ */
+
+#define POSITIVE_SYNC_MAX       64      // Nombre maximum de positifs suivis
+#define POSITIVE_SYNC_BUCKETS   16      // Nombre de seaux du digest
+#define POSITIVE_SYNC_ID_LEN    24      // Taille maximale d'un identifiant (avec le \0)
+#define POSITIVE_SYNC_JITTER_MS 3000    // Délai aléatoire maximum avant de répondre à une requête
+#define POSITIVE_SYNC_SAVE_MS   5000    // Délai minimum entre 2 sauvegardes sur le SPIFFS
+#define POSITIVE_PROVISIONAL_MAX 8      // Positifs provisoires (annoncés en BLE) en attente de confirmation
+#define POSITIVE_CONFIRM_MS     30000   // Attente des réponses des autres cartes après l'écho de notre requête
+
+String strPositiveSyncFile("/positivesync.json"); // ---------------- Nom du fichier de la liste versionnée
+
+/* Une entrée de la liste des positifs
+ * - resendAt : date (millis) à laquelle l'entrée doit être republiée, 0 si rien à faire
+ * - seenAt : date (millis) de la dernière fois où l'entrée est passée sur le feed
+ */
+struct PositiveEntry {
+    char id[POSITIVE_SYNC_ID_LEN];
+    uint32_t seq;
+    uint32_t hash;
+    unsigned long resendAt;
+    unsigned long seenAt;
+};
+
+/* Table circulaire : la n-ième entrée ajoutée est rangée dans positiveTable[n % POSITIVE_SYNC_MAX].
+ * Une fois la table pleine, une nouvelle entrée prend la place de la plus ancienne, après que
+ * celle-ci a été prise en compte par l'état de santé (positiveConsumeHook).
+ */
+/* Un positif provisoire, annoncé sans preuve, en attente de confirmation par MQTT */
+struct PositiveProvisional {
+    char id[POSITIVE_SYNC_ID_LEN];
+    uint32_t hash;
+    unsigned long receivedAt;
+};
+
+PositiveEntry positiveTable[POSITIVE_SYNC_MAX];
+int positiveCount = 0;                      // Entrées présentes dans la table
+uint32_t positiveAdded = 0;                 // Entrées ajoutées depuis le chargement
+uint32_t positiveConsumed = 0;              // Entrées déjà prises en compte par \ref exposure
+void (*positiveConsumeHook)() = NULL;       // Prise en compte des entrées en attente, avant une éviction
+uint32_t positiveVersion = 0;               // Plus grand numéro de séquence connu
+bool positiveDirty = false;                 // La table doit être sauvegardée
+unsigned long positiveSavedAt = 0;
+PositiveProvisional positiveProvisional[POSITIVE_PROVISIONAL_MAX];
+uint8_t positiveProvisionalCount = 0;
+
+// Statistiques de synchronisation
+uint32_t syncBytesIn = 0;                   // Octets reçus (annonces + requêtes)
+uint32_t syncBytesOut = 0;                  // Octets envoyés (annonces + requêtes + réponses)
+uint32_t syncEntriesGained = 0;             // Entrées apprises depuis la dernière requête
+uint32_t syncResent = 0;                    // Entrées republiées en réponse à une requête
+uint32_t syncSuppressed = 0;                // Réponses annulées car déjà publiées par un autre
+uint32_t syncEvicted = 0;                   // Entrées les plus anciennes retirées de la table pleine
+unsigned long syncRequestAt = 0;            // Date de la dernière requête envoyée
+unsigned long syncRequestEchoAt = 0;        // Date de réception de l'écho de cette requête, 0 si pas encore
+uint32_t syncProvisionalConfirmed = 0;      // Positifs provisoires arrivés ensuite par MQTT
+uint32_t syncProvisionalRejected = 0;       // Positifs provisoires qu'aucune carte n'a annoncés sur MQTT
+unsigned long syncLastGainAt = 0;           // Date de la dernière entrée apprise
+unsigned long syncConvergenceMs = 0;        // Temps entre la requête et la dernière entrée apprise
+
+/**
+ * Hash FNV-1a 32 bits d'un identifiant
+ */
+uint32_t positiveHash(const char *id) {
+    uint32_t h = 2166136261UL;
+    while (*id) {
+        h ^= (uint8_t)*id++;
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+/**
+ * Recherche d'un identifiant dans la table, retourne son index ou -1
+ */
+int positiveFind(const char *id) {
+    uint32_t h = positiveHash(id);
+    for (int i = 0; i < positiveCount; i++) {
+        if (positiveTable[i].hash == h && strcmp(positiveTable[i].id, id) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Calcul du digest de la liste : un XOR des hash (repliés sur 16 bits) des identifiants par seau
+ */
+void positiveDigest(uint16_t digest[POSITIVE_SYNC_BUCKETS]) {
+    for (int b = 0; b < POSITIVE_SYNC_BUCKETS; b++) {
+        digest[b] = 0;
+    }
+    for (int i = 0; i < positiveCount; i++) {
+        uint32_t h = positiveTable[i].hash;
+        digest[h % POSITIVE_SYNC_BUCKETS] ^= (uint16_t)(h ^ (h >> 16));
+    }
+}
+
+/**
+ * Recherche d'un positif provisoire, retourne son index ou -1
+ */
+int positiveProvisionalFind(const char *id) {
+    uint32_t h = positiveHash(id);
+    for (int i = 0; i < positiveProvisionalCount; i++) {
+        if (positiveProvisional[i].hash == h && strcmp(positiveProvisional[i].id, id) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Retrait d'un positif provisoire, confirmé ou infirmé
+ */
+void positiveProvisionalRemove(int i) {
+    positiveProvisional[i] = positiveProvisional[--positiveProvisionalCount];
+}
+
+/**
+ * Positif annoncé par une source non authentifiée : gardé à part, en attente de confirmation.
+ * Table pleine, le plus ancien laisse sa place.
+ * \return true si l'identifiant n'était connu ni dans la liste ni parmi les provisoires
+ */
+bool positiveSyncAddProvisional(const char *id) {
+    if (positiveFind(id) >= 0 || positiveProvisionalFind(id) >= 0) {
+        return false;
+    }
+    int i = positiveProvisionalCount;
+    if (i >= POSITIVE_PROVISIONAL_MAX) {
+        i = 0;
+        for (int j = 1; j < POSITIVE_PROVISIONAL_MAX; j++) {
+            if (positiveProvisional[j].receivedAt - positiveProvisional[i].receivedAt > 0x7FFFFFFFUL) {
+                i = j;              // Reçu avant
+            }
+        }
+    } else {
+        positiveProvisionalCount++;
+    }
+    strcpy(positiveProvisional[i].id, id);
+    positiveProvisional[i].hash = positiveHash(id);
+    positiveProvisional[i].receivedAt = millis();
+    return true;
+}
+
+/**
+ * Ajout (ou fusion) d'une entrée dans la table
+ * \param id identifiant du positif
+ * \param seq numéro de séquence annoncé, 0 si inconnu (ancien format)
+ * \return true si l'identifiant était inconnu
+ */
+bool positiveSyncAdd(const char *id, uint32_t seq) {
+    if (id == NULL || id[0] == '\0' || strlen(id) >= POSITIVE_SYNC_ID_LEN) {
+        return false;
+    }
+    if (seq == 0) {
+        seq = positiveVersion + 1;          // Ancien format : on numérote localement
+    }
+    int i = positiveFind(id);
+    if (i >= 0) {
+        positiveTable[i].seenAt = millis();
+        if (positiveTable[i].resendAt != 0) { // Quelqu'un l'a déjà republiée
+            positiveTable[i].resendAt = 0;
+            syncSuppressed++;
+        }
+        if (seq < positiveTable[i].seq) {   // Deux déclarations concurrentes : on garde la plus ancienne
+            positiveTable[i].seq = seq;
+            positiveDirty = true;
+        }
+        return false;
+    }
+    if (positiveCount >= POSITIVE_SYNC_MAX) {
+        // Table pleine : la plus ancienne entrée doit avoir été prise en compte avant d'être écrasée
+        if (positiveConsumed <= positiveAdded - POSITIVE_SYNC_MAX && positiveConsumeHook) {
+            positiveConsumeHook();
+        }
+        syncEvicted++;
+        MYDEBUG_PRINTLN("-SYNC : Table des positifs pleine, entrée la plus ancienne retirée");
+    } else {
+        positiveCount++;
+    }
+    PositiveEntry &e = positiveTable[positiveAdded++ % POSITIVE_SYNC_MAX];
+    strcpy(e.id, id);
+    e.seq = seq;
+    e.hash = positiveHash(id);
+    e.resendAt = 0;
+    e.seenAt = millis();
+    if (seq > positiveVersion) {
+        positiveVersion = seq;
+    }
+    positiveDirty = true;
+    int p = positiveProvisionalFind(id);
+    if (p >= 0) {
+        positiveProvisionalRemove(p);
+        syncProvisionalConfirmed++;
+    }
+    syncEntriesGained++;
+    syncLastGainAt = millis();
+    if (syncRequestAt != 0) {
+        syncConvergenceMs = syncLastGainAt - syncRequestAt;
+    }
+    return true;
+}
+
+/**
+ * Déclaration locale d'un positif : il prend le numéro de séquence suivant
+ * \return le numéro de séquence attribué
+ */
+uint32_t positiveSyncDeclare(const char *id) {
+    int i = positiveFind(id);
+    if (i >= 0) {
+        return positiveTable[i].seq;
+    }
+    uint32_t seq = positiveVersion + 1;
+    positiveSyncAdd(id, seq);
+    return seq;
+}
+
+/**
+ * Formatage d'une annonce "P:seq:id"
+ */
+int positiveSyncFormatEntry(const PositiveEntry &e, char *out, size_t size) {
+    return snprintf(out, size, "P:%lu:%s", (unsigned long)e.seq, e.id);
+}
+
+/**
+ * Décodage d'une annonce, sans modifier la table
+ * \param data "P:seq:id" ou "id" (ancien format)
+ * \param seq en sortie, le numéro de séquence (0 pour l'ancien format)
+ * \param id en sortie, l'identifiant extrait
+ * \return false si le message est mal formé
+ */
+bool positiveSyncParseAnnounce(const char *data, uint32_t *seq, char id[POSITIVE_SYNC_ID_LEN]) {
+    *seq = 0;
+    const char *start = data;
+    if (data[0] == 'P' && data[1] == ':') {
+        char *end;
+        *seq = strtoul(data + 2, &end, 10);
+        if (*end != ':') {
+            return false;
+        }
+        start = end + 1;
+    }
+    if (start[0] == '\0' || strlen(start) >= POSITIVE_SYNC_ID_LEN) {
+        return false;                       // Un identifiant tronqué désignerait une autre carte
+    }
+    strcpy(id, start);
+    return true;
+}
+
+/**
+ * Traitement d'un message reçu sur le feed des positifs
+ * \param data "P:seq:id" ou "id" (ancien format)
+ * \param id en sortie, l'identifiant extrait
+ * \return true si le positif était inconnu
+ */
+bool positiveSyncOnAnnounce(const char *data, char id[POSITIVE_SYNC_ID_LEN]) {
+    syncBytesIn += strlen(data);
+    uint32_t seq;
+    if (!positiveSyncParseAnnounce(data, &seq, id)) {
+        return false;
+    }
+    return positiveSyncAdd(id, seq);
+}
+
+/**
+ * Construction de la requête de synchronisation "Q:nom:version:d0d1...d15"
+ */
+int positiveSyncFormatRequest(const char *name, char *out, size_t size) {
+    uint16_t digest[POSITIVE_SYNC_BUCKETS];
+    positiveDigest(digest);
+    int n = snprintf(out, size, "Q:%s:%lu:", name, (unsigned long)positiveVersion);
+    for (int b = 0; b < POSITIVE_SYNC_BUCKETS && n < (int)size; b++) {
+        n += snprintf(out + n, size - n, "%04x", digest[b]);
+    }
+    syncRequestAt = millis();
+    syncRequestEchoAt = 0;
+    syncEntriesGained = 0;
+    syncConvergenceMs = 0;
+    syncBytesOut += n;
+    return n;
+}
+
+/**
+ * Traitement d'une requête de synchronisation reçue d'une autre carte.
+ * Les entrées manquantes chez le demandeur sont marquées pour être republiées après un délai aléatoire.
+ * \param data la requête
+ * \param self notre propre nom, pour ignorer nos requêtes
+ * \return le nombre d'entrées programmées
+ */
+int positiveSyncOnRequest(const char *data, const char *self) {
+    syncBytesIn += strlen(data);
+    if (data[0] != 'Q' || data[1] != ':') {
+        return 0;
+    }
+    const char *name = data + 2;
+    const char *sep = strchr(name, ':');
+    if (!sep) {
+        return 0;
+    }
+    if ((size_t)(sep - name) == strlen(self) && strncmp(name, self, sep - name) == 0) {
+        if (syncRequestEchoAt == 0) {
+            syncRequestEchoAt = millis();   // Notre propre requête : l'aller-retour par le broker fonctionne
+        }
+        return 0;
+    }
+    char *end;
+    uint32_t version = strtoul(sep + 1, &end, 10);
+    if (*end != ':') {
+        return 0;
+    }
+    const char *p = end + 1;
+    if (strlen(p) < 4 * POSITIVE_SYNC_BUCKETS) {
+        return 0;
+    }
+    uint16_t theirs[POSITIVE_SYNC_BUCKETS];
+    for (int b = 0; b < POSITIVE_SYNC_BUCKETS; b++) {
+        char word[5] = { p[0], p[1], p[2], p[3], '\0' };
+        theirs[b] = (uint16_t)strtoul(word, NULL, 16);
+        p += 4;
+    }
+    uint16_t ours[POSITIVE_SYNC_BUCKETS];
+    positiveDigest(ours);
+
+    int scheduled = 0;
+    unsigned long now = millis();
+    for (int i = 0; i < positiveCount; i++) {
+        PositiveEntry &e = positiveTable[i];
+        int b = e.hash % POSITIVE_SYNC_BUCKETS;
+        if (e.seq > version || ours[b] != theirs[b]) {
+            if (e.resendAt == 0) {
+                e.resendAt = now + 1 + random(POSITIVE_SYNC_JITTER_MS);
+                scheduled++;
+            }
+        }
+    }
+    return scheduled;
+}
+
+/**
+ * Récupération de la prochaine annonce à republier.
+ * Une entrée vue sur le feed après la réception de la requête n'est pas republiée.
+ * \return true si une annonce a été écrite dans out
+ */
+bool positiveSyncNextResend(char *out, size_t size) {
+    unsigned long now = millis();
+    for (int i = 0; i < positiveCount; i++) {
+        PositiveEntry &e = positiveTable[i];
+        if (e.resendAt != 0 && (long)(now - e.resendAt) >= 0) {
+            e.resendAt = 0;
+            e.seenAt = now;
+            syncBytesOut += positiveSyncFormatEntry(e, out, size);
+            syncResent++;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Sauvegarde de la table versionnée dans le SPIFFS
+ */
+void positiveSyncSave() {
+    File f = SPIFFS.open(strPositiveSyncFile, "w");
+    if (!f) {
+        MYDEBUG_PRINTLN("-SYNC : Impossible d'ouvrir positivesync.json en écriture");
+        return;
+    }
+    DynamicJsonDocument jsonDocument(256 + POSITIVE_SYNC_MAX * (POSITIVE_SYNC_ID_LEN + 24));
+    jsonDocument["version"] = positiveVersion;
+    JsonArray entries = jsonDocument.createNestedArray("entries");
+    for (uint32_t n = positiveAdded - positiveCount; n != positiveAdded; n++) { // De la plus ancienne à la plus récente
+        const PositiveEntry &e = positiveTable[n % POSITIVE_SYNC_MAX];
+        JsonArray entry = entries.createNestedArray();
+        entry.add(e.id);
+        entry.add(e.seq);
+    }
+    if (serializeJson(jsonDocument, f) == 0) {
+        MYDEBUG_PRINTLN("-SYNC : Impossible d'écrire positivesync.json");
+    }
+    f.close();
+    positiveDirty = false;
+    positiveSavedAt = millis();
+}
+
+/**
+ * Chargement de la table versionnée depuis le SPIFFS.
+ * Au premier démarrage, la table est initialisée depuis positivelist.json.
+ */
+void setupPositiveSync() {
+    positiveCount = 0;
+    positiveAdded = 0;
+    positiveConsumed = 0;
+    positiveVersion = 0;
+    positiveProvisionalCount = 0;
+    bool legacy = !SPIFFS.exists(strPositiveSyncFile);
+    File f = SPIFFS.open(legacy ? strPositiveListFile : strPositiveSyncFile, "r");
+    if (!f) {
+        MYDEBUG_PRINTLN("-SYNC : Aucune liste de positifs à charger");
+        return;
+    }
+    DynamicJsonDocument jsonDocument(256 + POSITIVE_SYNC_MAX * (POSITIVE_SYNC_ID_LEN + 24));
+    DeserializationError error = deserializeJson(jsonDocument, f);
+    f.close();
+    if (error) {
+        MYDEBUG_PRINTLN("-SYNC : Impossible de parser la liste des positifs");
+        return;
+    }
+    uint16_t skipped = 0;           // Entrées mal formées, ignorées
+    if (legacy) {
+        for (JsonVariant id : jsonDocument["positive_list"].as<JsonArray>()) {
+            if (!id.is<const char*>()) {
+                skipped++;
+                continue;
+            }
+            positiveSyncAdd(id.as<const char*>(), 0);
+        }
+        positiveSyncSave();
+    } else {
+        for (JsonVariant entry : jsonDocument["entries"].as<JsonArray>()) {
+            if (!entry[0].is<const char*>()) {
+                skipped++;
+                continue;
+            }
+            positiveSyncAdd(entry[0].as<const char*>(), entry[1].as<uint32_t>());
+        }
+        uint32_t version = jsonDocument["version"].as<uint32_t>();
+        if (version > positiveVersion) {
+            positiveVersion = version;
+        }
+        positiveDirty = false;
+    }
+    syncEntriesGained = 0;
+    if (skipped > 0) {
+        MYDEBUG_PRINT("-SYNC : Entrées mal formées ignorées : ");
+        MYDEBUG_PRINTLN(skipped);
+    }
+    MYDEBUG_PRINT("-SYNC : Liste des positifs chargée, version ");
+    MYDEBUG_PRINTLN(positiveVersion);
+}
+
+/**
+ * Retrait des positifs provisoires infirmés : reçus avant notre dernière requête, dont l'écho est
+ * revenu depuis plus de POSITIVE_CONFIRM_MS sans qu'aucune carte ne les annonce
+ */
+void positiveSyncReviewProvisional() {
+    if (syncRequestEchoAt == 0 || millis() - syncRequestEchoAt < POSITIVE_CONFIRM_MS) {
+        return;
+    }
+    bool rejected = false;
+    for (int i = positiveProvisionalCount - 1; i >= 0; i--) {
+        if ((long)(syncRequestAt - positiveProvisional[i].receivedAt) >= 0) {
+            LOG_I("-SYNC : Positif provisoire non confirmé par MQTT, retiré");
+            positiveProvisionalRemove(i);
+            syncProvisionalRejected++;
+            rejected = true;
+        }
+    }
+    if (rejected) {
+        eventPost(EVENT_POSITIVE, EVENT_SRC_MQTT, "");     // L'état de santé est à revoir
+    }
+}
+
+/**
+ * A appeler régulièrement : sauvegarde différée pour regrouper les écritures en flash, et revue
+ * des positifs provisoires
+ */
+void loopPositiveSync() {
+    if (positiveDirty && millis() - positiveSavedAt > POSITIVE_SYNC_SAVE_MS) {
+        positiveSyncSave();
+    }
+    positiveSyncReviewProvisional();
+}
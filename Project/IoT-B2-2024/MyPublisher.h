@@ -0,0 +1,261 @@
+/**
+ * \file MyPublisher.h
+ * \page publisher Publications MQTT limitées
+ * \brief Respecter les quotas de publication d'Adafruit IO
+ *
+ * Adafruit IO limite le nombre de publications par minute et par compte (30 par minute en
+ * version gratuite). Au delà, le broker ralentit voire bannit temporairement le compte.
+ * Une rafale de déclarations depuis le serveur web ou de réponses de synchronisation peut
+ * facilement dépasser ce quota.
+ *
+ * Toutes les publications passent donc par une file d'attente :
+ * - un "seau à jetons" (token bucket) par feed, rechargé d'un jeton toutes les FEED_FREQ secondes
+ *   (fréquence d'envoi des données définie dans \ref MyAdafruitIO.h),
+ * - un seau à jetons pour le compte, rechargé de IO_RATE_PER_MINUTE jetons par minute,
+ * - une priorité par classe de message : l'état de santé passe avant nos contacts, qui passent
+ *   avant la synchronisation, puis la télémétrie,
+ * - une clé de fusion (coalesce) : un message en attente avec la même clé sur le même feed
+ *   est remplacé par le nouveau, seule la dernière valeur est envoyée.
+ *
+ * Un message dont la publication échoue (connexion perdue, broker qui refuse) reste dans la file
+ * et est retenté après PUB_RETRY_MS, puis deux fois plus tard à chaque nouvel échec ; il n'est
+ * abandonné qu'après PUB_MAX_ATTEMPTS essais.
+ *
+ * Les compteurs de messages envoyés, différés, fusionnés et perdus sont visibles sur la
+ * route /stats.
+ *
+ * L'horloge des seaux (publisherClock) et l'envoi (publisherSendHook) peuvent être remplacés, par
+ * exemple par le broker simulé de \ref fleetsim, sans changer le reste de la file.
+ *
+ * Fichier \ref MyPublisher.h
+ */
+
+#include "Adafruit_MQTT.h"
+
+#define IO_RATE_PER_MINUTE  30      // Quota de publications par minute pour le compte
+#define IO_ACCOUNT_BURST    5       // Nombre de publications possibles d'affilée pour le compte
+#define PUB_FEED_BURST      2       // Nombre de publications possibles d'affilée par feed
+#define PUB_QUEUE_SIZE      16      // Taille de la file d'attente
+#define PUB_MAX_FEEDS       8       // Nombre maximum de feeds gérés
+#define PUB_MAX_ATTEMPTS    4       // Essais de publication d'un message avant abandon
+#define PUB_RETRY_MS        2000    // Attente avant le premier nouvel essai, doublée à chaque échec
+
+// Classes de messages, par ordre de priorité
+#define PUB_CLASS_STATE     0       // Etat de santé
+#define PUB_CLASS_CONTACT   1       // Nos contacts, pour le graphe d'exposition des autres cartes
+#define PUB_CLASS_SYNC      2       // Synchronisation de la liste des positifs
+#define PUB_CLASS_TELEMETRY 3       // Données de télémétrie
+
+/* Un seau à jetons
+ * - tokens : jetons disponibles
+ * - capacity : nombre maximum de jetons
+ * - refillMs : durée pour regagner un jeton
+ */
+struct TokenBucket {
+    float tokens;
+    float capacity;
+    unsigned long refillMs;
+    unsigned long lastRefill;
+};
+
+/* Un feed géré par la file de publication */
+struct PublishFeed {
+    Adafruit_MQTT_Publish *pub;
+    TokenBucket bucket;
+};
+
+/* Un message en attente de publication */
+struct PendingPublish {
+    bool used;
+    bool deferred;                  // Déjà compté comme différé
+    uint8_t feed;
+    uint8_t cls;
+    uint32_t key;                   // Clé de fusion, 0 si le message ne doit pas être fusionné
+    uint8_t attempts;               // Publications échouées
+    unsigned long retryAt;          // Prochain essai après un échec
+    unsigned long enqueuedAt;
+    char payload[SUBSCRIPTIONDATALEN];
+};
+
+PublishFeed publishFeeds[PUB_MAX_FEEDS];
+int publishFeedCount = 0;
+TokenBucket accountBucket = { IO_ACCOUNT_BURST, IO_ACCOUNT_BURST, 60000UL / IO_RATE_PER_MINUTE, 0 };
+PendingPublish publishQueue[PUB_QUEUE_SIZE];
+
+// Statistiques de publication
+uint32_t pubSent = 0;               // Messages publiés
+uint32_t pubFailed = 0;             // Publications refusées par la bibliothèque
+uint32_t pubRetried = 0;            // Nouveaux essais après un échec
+uint32_t pubAbandoned = 0;          // Messages abandonnés après PUB_MAX_ATTEMPTS échecs
+uint32_t pubDeferred = 0;           // Messages qui ont dû attendre un jeton
+uint32_t pubCoalesced = 0;          // Messages remplacés par une valeur plus récente
+uint32_t pubDropped = 0;            // Nouveaux messages perdus, file pleine
+uint32_t pubEvicted = 0;            // Messages moins prioritaires retirés de la file pleine
+unsigned long pubMaxWaitMs = 0;     // Attente maximale d'un message dans la file
+
+// Horloge des seaux et de l'attente des messages, en ms
+unsigned long (*publisherClock)() = millis;
+// Envoi d'un message à la place de la bibliothèque MQTT, NULL : publication sur le broker
+bool (*publisherSendHook)(int feed, const char *payload) = NULL;
+
+/**
+ * Recharge d'un seau en fonction du temps écoulé
+ */
+void tokenBucketRefill(TokenBucket &b, unsigned long now) {
+    if (b.lastRefill == 0) {
+        b.lastRefill = now;
+        return;
+    }
+    float gained = (float)(now - b.lastRefill) / b.refillMs;
+    if (gained > 0) {
+        b.tokens = (b.tokens + gained > b.capacity) ? b.capacity : b.tokens + gained;
+        b.lastRefill = now;
+    }
+}
+
+/**
+ * Enregistrement d'un feed dans la file de publication
+ * \param pub l'objet de publication Adafruit
+ * \param refillMs durée minimale moyenne entre 2 publications sur ce feed
+ * \return l'index du feed à utiliser avec publisherEnqueue()
+ */
+int publisherAddFeed(Adafruit_MQTT_Publish *pub, unsigned long refillMs) {
+    if (publishFeedCount >= PUB_MAX_FEEDS) {
+        MYDEBUG_PRINTLN("-PUBLISH : Trop de feeds");
+        return -1;
+    }
+    PublishFeed &f = publishFeeds[publishFeedCount];
+    f.pub = pub;
+    f.bucket.tokens = PUB_FEED_BURST;
+    f.bucket.capacity = PUB_FEED_BURST;
+    f.bucket.refillMs = refillMs;
+    f.bucket.lastRefill = 0;
+    return publishFeedCount++;
+}
+
+/**
+ * Ajout d'un message dans la file de publication
+ * \param feed index du feed retourné par publisherAddFeed()
+ * \param payload message à publier
+ * \param cls classe du message (PUB_CLASS_...)
+ * \param key clé de fusion : un message en attente avec la même clé sur le même feed est remplacé, 0 pour ne jamais fusionner
+ * \return false si le message a été perdu
+ */
+bool publisherEnqueue(int feed, const char *payload, uint8_t cls, uint32_t key) {
+    if (feed < 0 || feed >= publishFeedCount) {
+        return false;
+    }
+    int freeSlot = -1;
+    for (int i = 0; i < PUB_QUEUE_SIZE; i++) {
+        PendingPublish &p = publishQueue[i];
+        if (!p.used) {
+            if (freeSlot < 0) freeSlot = i;
+            continue;
+        }
+        if (key != 0 && p.key == key && p.feed == feed) {   // Valeur remplacée
+            strncpy(p.payload, payload, sizeof(p.payload) - 1);
+            p.payload[sizeof(p.payload) - 1] = '\0';
+            if (cls < p.cls) p.cls = cls;
+            pubCoalesced++;
+            return true;
+        }
+    }
+    if (freeSlot < 0) {
+        // File pleine : on sacrifie le message le moins prioritaire si le nouveau est plus important
+        int victim = -1;
+        for (int i = 0; i < PUB_QUEUE_SIZE; i++) {
+            if (publishQueue[i].cls > cls && (victim < 0 || publishQueue[i].cls > publishQueue[victim].cls)) {
+                victim = i;
+            }
+        }
+        if (victim < 0) {
+            pubDropped++;
+            LOG_W("-PUBLISH : File pleine, message perdu");
+            return false;
+        }
+        pubEvicted++;               // Le message sacrifié est perdu, pas le nouveau
+        freeSlot = victim;
+    }
+    PendingPublish &p = publishQueue[freeSlot];
+    p.used = true;
+    p.deferred = false;
+    p.feed = feed;
+    p.cls = cls;
+    p.key = key;
+    p.attempts = 0;
+    p.enqueuedAt = publisherClock();
+    strncpy(p.payload, payload, sizeof(p.payload) - 1);
+    p.payload[sizeof(p.payload) - 1] = '\0';
+    return true;
+}
+
+/**
+ * Nombre de messages en attente
+ */
+int publisherPending() {
+    int n = 0;
+    for (int i = 0; i < PUB_QUEUE_SIZE; i++) {
+        if (publishQueue[i].used) n++;
+    }
+    return n;
+}
+
+/**
+ * Publication des messages dont le feed et le compte disposent d'un jeton,
+ * par ordre de priorité puis d'ancienneté.
+ * A appeler dans la boucle, uniquement quand le client MQTT est connecté.
+ */
+void loopPublisher() {
+    unsigned long now = publisherClock();
+    tokenBucketRefill(accountBucket, now);
+    for (int f = 0; f < publishFeedCount; f++) {
+        tokenBucketRefill(publishFeeds[f].bucket, now);
+    }
+
+    for (;;) {
+        int best = -1;
+        for (int i = 0; i < PUB_QUEUE_SIZE; i++) {
+            PendingPublish &p = publishQueue[i];
+            if (!p.used) continue;
+            if (p.attempts > 0 && (long)(now - p.retryAt) < 0) continue;
+            if (publishFeeds[p.feed].bucket.tokens < 1 || accountBucket.tokens < 1) {
+                if (!p.deferred) {
+                    p.deferred = true;
+                    pubDeferred++;
+                }
+                continue;
+            }
+            if (best < 0 || p.cls < publishQueue[best].cls ||
+                (p.cls == publishQueue[best].cls && (long)(p.enqueuedAt - publishQueue[best].enqueuedAt) < 0)) {
+                best = i;
+            }
+        }
+        if (best < 0) {
+            return;
+        }
+        PendingPublish &p = publishQueue[best];
+        publishFeeds[p.feed].bucket.tokens -= 1;
+        accountBucket.tokens -= 1;
+        scanSchedulerWifiActivity();        // Le scan BLE laisse l'antenne au WiFi
+        bool ok = publisherSendHook ? publisherSendHook(p.feed, p.payload) : publishFeeds[p.feed].pub->publish(p.payload);
+        if (!ok) {
+            // Les jetons consommés ralentissent aussi les essais ; la connexion est sans doute
+            // perdue, les autres messages attendent le passage suivant
+            pubFailed++;
+            if (++p.attempts >= PUB_MAX_ATTEMPTS) {
+                pubAbandoned++;
+                LOG_W("-PUBLISH : Message abandonné après %u essais", (unsigned)p.attempts);
+                p.used = false;
+            } else {
+                pubRetried++;
+                p.retryAt = now + (PUB_RETRY_MS << (p.attempts - 1));
+            }
+            return;
+        }
+        pubSent++;
+        if (now - p.enqueuedAt > pubMaxWaitMs) {
+            pubMaxWaitMs = now - p.enqueuedAt;
+        }
+        p.used = false;
+    }
+}
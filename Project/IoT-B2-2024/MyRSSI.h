@@ -0,0 +1,108 @@
+/**
+ * \file MyRSSI.h
+ * \page rssi Filtrage du RSSI et estimation de la distance
+ * \brief Une distance moins fausse et moins bruitée
+ *
+ * La distance était calculée à chaque annonce avec pow(10, (-69 - rssi) / (10 * 2)) :
+ * - la division entre entiers arrondissait l'exposant, la distance ne prenait donc que les
+ *   valeurs 1, 10, 100 m ...
+ * - un RSSI isolé varie de plusieurs dB d'une annonce à l'autre (réflexions, corps humain ...),
+ * - pow() est coûteux, et il était appelé pour chaque annonce.
+ *
+ * Ce module fournit :
+ * - un filtre de Kalman à une dimension, dont l'état (estimation et variance) est gardé pour
+ *   chaque rencontre dans \ref encounter,
+ * - une table précalculée de la distance (en cm) pour chaque valeur entière de RSSI, reconstruite
+ *   quand la configuration change, qui remplace pow() à chaque annonce.
+ *
+ * Le modèle de propagation est distance = 10 ^ ((tx_power - rssi) / (10 * path_loss)), avec
+ * tx_power le RSSI mesuré à 1 m et path_loss l'exposant d'atténuation (2 en champ libre,
+ * de 2,5 à 4 en intérieur). Les deux se règlent sur la page /config.
+ *
+ * rssiBenchmark() compare le coût par annonce de l'ancien calcul et du nouveau.
+ *
+ * Fichier \ref MyRSSI.h
+ */
+
+#define RSSI_KALMAN_Q       0.125   // Bruit de processus (dB² par annonce) : vitesse à laquelle le RSSI réel peut changer
+#define RSSI_KALMAN_R       16.0    // Bruit de mesure (dB²) : un RSSI isolé varie d'environ 4 dB
+#define RSSI_TABLE_SIZE     128     // RSSI de 0 à -127 dBm
+
+uint16_t rssiDistanceTable[RSSI_TABLE_SIZE];    // Distance en cm pour un RSSI de -i dBm
+
+/**
+ * Calcul de la table des distances à partir de tx_power et path_loss
+ */
+void rssiDistanceTableBuild() {
+    float n = path_loss > 0 ? path_loss : 2.0;
+    for (int i = 0; i < RSSI_TABLE_SIZE; i++) {
+        float cm = 100.0 * pow(10, (tx_power + i) / (10.0 * n));
+        rssiDistanceTable[i] = cm > 65535 ? 65535 : (uint16_t)cm;
+    }
+    MYDEBUG_PRINT("-RSSI : Table des distances calculée, 2 m = ");
+    MYDEBUG_PRINT(tx_power - 10.0 * n * log10(2.0));
+    MYDEBUG_PRINTLN(" dBm");
+}
+
+/**
+ * Distance en cm correspondant à un RSSI (filtré)
+ */
+uint16_t rssiDistanceCm(float rssi) {
+    int i = (int)(-rssi + 0.5);
+    if (i < 0) i = 0;
+    if (i >= RSSI_TABLE_SIZE) i = RSSI_TABLE_SIZE - 1;
+    return rssiDistanceTable[i];
+}
+
+/**
+ * Initialisation du filtre avec la première mesure
+ */
+void rssiKalmanInit(float &estimate, float &variance, int8_t rssi) {
+    estimate = rssi;
+    variance = RSSI_KALMAN_R;
+}
+
+/**
+ * Mise à jour du filtre avec une nouvelle mesure
+ * \return l'estimation du RSSI
+ */
+float rssiKalmanUpdate(float &estimate, float &variance, int8_t rssi) {
+    variance += RSSI_KALMAN_Q;
+    float gain = variance / (variance + RSSI_KALMAN_R);
+    estimate += gain * (rssi - estimate);
+    variance *= 1 - gain;
+    return estimate;
+}
+
+/**
+ * Coût par annonce de l'ancien calcul (pow) et du nouveau (filtre + table), en cycles CPU
+ */
+void rssiBenchmark() {
+    const int samples = 1000;
+    volatile float sink = 0;
+    int8_t rssi[samples];
+    for (int i = 0; i < samples; i++) {
+        rssi[i] = -60 - random(20);
+    }
+
+    uint32_t start = ESP.getCycleCount();
+    for (int i = 0; i < samples; i++) {
+        float ratio = (-69 - rssi[i]) / (10 * 2);
+        sink = pow(10, ratio);
+    }
+    uint32_t oldCycles = (ESP.getCycleCount() - start) / samples;
+
+    float estimate, variance;
+    rssiKalmanInit(estimate, variance, rssi[0]);
+    start = ESP.getCycleCount();
+    for (int i = 0; i < samples; i++) {
+        sink = rssiDistanceCm(rssiKalmanUpdate(estimate, variance, rssi[i]));
+    }
+    uint32_t newCycles = (ESP.getCycleCount() - start) / samples;
+
+    MYDEBUG_PRINT("-RSSI : pow() ");
+    MYDEBUG_PRINT(oldCycles);
+    MYDEBUG_PRINT(" cycles/annonce, Kalman + table ");
+    MYDEBUG_PRINT(newCycles);
+    MYDEBUG_PRINTLN(" cycles/annonce");
+}
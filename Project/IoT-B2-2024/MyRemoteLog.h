@@ -0,0 +1,400 @@
+/**
+ * \file MyRemoteLog.h
+ * \page remotelog Journal à distance
+ * \brief Console telnet du journal : rien n'est mis en forme sans client, filtres et tampon par client
+ *
+ * setupOTA() démarrait la bibliothèque RemoteDebug et un travail qui générait cinq messages toutes
+ * les 2 secondes : chaque message était mis en forme, qu'un client telnet soit connecté ou non.
+ *
+ * La console telnet (port REMOTELOG_PORT) est maintenant servie par ce module, à partir du journal
+ * de \ref log :
+ * - sans client connecté, un message au dessus du niveau local (port série, /log.txt) n'est même
+ *   pas enregistré dans la file du journal : logRemoteLevel vaut 0, une comparaison par appel ;
+ * - chaque client choisit son niveau et ses modules, le filtre est appliqué au niveau et au format
+ *   du message (préfixe "-MODULE :"), avant la mise en forme : un message qu'aucun client ne veut
+ *   n'est pas mis en forme ;
+ * - chaque client a son tampon de sortie de REMOTELOG_BUFFER octets, vidé par le travail
+ *   "remotelog" de \ref timerwheel, au plus REMOTELOG_CHUNK octets par client et par passage. La
+ *   socket est en mode non bloquant (O_NONBLOCK, send() avec MSG_DONTWAIT) : WiFiClient::write()
+ *   attendait que le client lise, jusqu'à plusieurs secondes. Quand la fenêtre TCP d'un client lent
+ *   est pleine, send() rend EAGAIN et le reste attend le passage suivant, dans son tampon. Quand ce
+ *   tampon est plein, les messages suivants sont perdus pour lui seul et comptés ; le nombre de
+ *   messages perdus lui est signalé dès que la place revient.
+ * - un client qui n'a pas donné le mot de passe après REMOTELOG_AUTH_MS est déconnecté, pour
+ *   qu'une connexion oubliée ne garde pas l'une des REMOTELOG_CLIENTS places.
+ *
+ * Commandes, une par ligne, après le mot de passe :
+ * - level E|W|I|D|V (ou 1 à 5) : niveau des messages reçus, I par défaut ; les niveaux au dessus
+ *   de LOG_LEVEL ne sont pas compilés,
+ * - module BLE,ENCOUNTER : seulement les messages de ces modules, "module" seul : tous,
+ * - stats : niveau, modules, messages envoyés et perdus pour ce client,
+ * - reset : redémarrage de la carte,
+ * - quit.
+ *
+ * Compteurs visibles sur /stats (remotelog.*).
+ *
+ * Fichier \ref MyRemoteLog.h
+ */
+
+#include "lwip/sockets.h"
+
+#define REMOTELOG_PORT          23
+#define REMOTELOG_PASSWORD      "1234567890"    // Comme OTA_PASSWORD
+#define REMOTELOG_CLIENTS       2               // Clients simultanés
+#define REMOTELOG_BUFFER        2048            // Tampon de sortie par client, puissance de 2
+#define REMOTELOG_CHUNK         512             // Octets envoyés au plus par client et par passage
+#define REMOTELOG_POLL_MS       20
+#define REMOTELOG_MODULES_MAX   48
+#define REMOTELOG_INPUT_MAX     64
+#define REMOTELOG_AUTH_MS       30000           // Délai pour donner le mot de passe
+
+/* Un client de la console */
+struct RemoteLogClient {
+    WiFiClient client;
+    bool active;
+    bool authed;                    // Mot de passe reçu
+    uint8_t level;
+    char modules[REMOTELOG_MODULES_MAX];    // "BLE,ENCOUNTER", vide : tous
+    char input[REMOTELOG_INPUT_MAX];        // Ligne de commande en cours
+    uint8_t inputLen;
+    uint8_t iac;                    // Octets d'une négociation telnet restant à ignorer
+    uint32_t connectedAt;           // millis() de la connexion
+    char out[REMOTELOG_BUFFER];
+    uint32_t outHead;               // Compteurs libres, l'index est pris modulo REMOTELOG_BUFFER
+    uint32_t outTail;
+    uint32_t sent;                  // Messages envoyés
+    uint32_t dropped;               // Messages perdus, tampon plein
+    uint32_t droppedNotified;       // Messages perdus déjà signalés au client
+};
+
+RemoteLogClient remoteLogClients[REMOTELOG_CLIENTS];
+WiFiServer remoteLogServer(REMOTELOG_PORT);
+
+// Statistiques de la console
+uint32_t remoteLogSessions = 0;     // Connexions acceptées
+uint32_t remoteLogRefused = 0;      // Connexions refusées, trop de clients
+uint32_t remoteLogLines = 0;        // Messages placés dans un tampon
+uint32_t remoteLogDropped = 0;      // Messages perdus, tampon d'un client plein
+uint32_t remoteLogBytes = 0;        // Octets envoyés
+uint32_t remoteLogBlocked = 0;      // Envois reportés, fenêtre TCP du client pleine
+uint32_t remoteLogTimeouts = 0;     // Clients déconnectés sans mot de passe
+
+/**
+ * Ajout dans le tampon de sortie d'un client, tout ou rien
+ * \return false si la place manque
+ */
+bool remoteLogPut(RemoteLogClient &c, const char *data, size_t len) {
+    if (len > REMOTELOG_BUFFER - (c.outHead - c.outTail)) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        c.out[(c.outHead + i) & (REMOTELOG_BUFFER - 1)] = data[i];
+    }
+    c.outHead += len;
+    return true;
+}
+
+/**
+ * Envoi sans attente d'un court message avant la fermeture de la connexion, perdu si le client ne lit pas
+ */
+void remoteLogSendNow(WiFiClient &client, const char *text) {
+    send(client.fd(), text, strlen(text), MSG_DONTWAIT);
+}
+
+/**
+ * Réponse à une commande, ignorée si la place manque
+ */
+void remoteLogReply(RemoteLogClient &c, const String &text) {
+    remoteLogPut(c, text.c_str(), text.length());
+    remoteLogPut(c, "\r\n", 2);
+}
+
+/**
+ * Le message de ce format appartient-il à l'un des modules de la liste ?
+ * Le module est le mot qui suit le tiret initial du format : "-ENCOUNTER : ..."
+ */
+bool remoteLogModuleMatch(const char *fmt, const char *modules) {
+    if (modules[0] == 0) {
+        return true;
+    }
+    if (fmt[0] != '-') {
+        return false;
+    }
+    const char *name = fmt + 1;
+    size_t nameLen = strcspn(name, " :");
+    const char *m = modules;
+    while (*m) {
+        size_t len = strcspn(m, ",");
+        if (len == nameLen && strncasecmp(m, name, len) == 0) {
+            return true;
+        }
+        m += len;
+        if (*m == ',') m++;
+    }
+    return false;
+}
+
+/**
+ * Recalcul de logRemoteLevel : le niveau le plus détaillé demandé par un client
+ */
+void remoteLogUpdateLevel() {
+    uint8_t level = LOG_LEVEL_NONE;
+    for (uint8_t i = 0; i < REMOTELOG_CLIENTS; i++) {
+        RemoteLogClient &c = remoteLogClients[i];
+        if (c.active && c.authed && c.level > level) {
+            level = c.level;
+        }
+    }
+    logRemoteLevel = level;
+}
+
+/**
+ * Filtre du journal, avant la mise en forme : un client au moins veut-il ce message ?
+ */
+bool remoteLogWants(uint8_t level, const char *fmt) {
+    for (uint8_t i = 0; i < REMOTELOG_CLIENTS; i++) {
+        RemoteLogClient &c = remoteLogClients[i];
+        if (c.active && c.authed && level <= c.level && remoteLogModuleMatch(fmt, c.modules)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Envoi d'un message mis en forme aux clients qui le veulent, sans attendre : dans leur tampon,
+ * ou compté comme perdu
+ */
+void remoteLogSink(uint8_t level, const char *fmt, const char *line) {
+    size_t len = strlen(line);
+    for (uint8_t i = 0; i < REMOTELOG_CLIENTS; i++) {
+        RemoteLogClient &c = remoteLogClients[i];
+        if (!c.active || !c.authed || level > c.level || !remoteLogModuleMatch(fmt, c.modules)) {
+            continue;
+        }
+        if (c.dropped != c.droppedNotified) {
+            char notice[48];
+            int n = snprintf(notice, sizeof(notice), "-REMOTELOG : %lu messages perdus\r\n",
+                             (unsigned long)(c.dropped - c.droppedNotified));
+            if (remoteLogPut(c, notice, n)) {
+                c.droppedNotified = c.dropped;
+            }
+        }
+        if (len + 2 > REMOTELOG_BUFFER - (c.outHead - c.outTail)) {
+            c.dropped++;
+            remoteLogDropped++;
+            continue;
+        }
+        remoteLogPut(c, line, len);
+        remoteLogPut(c, "\r\n", 2);
+        c.sent++;
+        remoteLogLines++;
+    }
+}
+
+/**
+ * Fin de la session d'un client
+ */
+void remoteLogClose(RemoteLogClient &c) {
+    c.client.stop();
+    c.active = false;
+    remoteLogUpdateLevel();
+}
+
+/**
+ * Exécution d'une ligne reçue d'un client
+ */
+void remoteLogCommand(RemoteLogClient &c, char *line) {
+    if (!c.authed) {
+        if (strcmp(line, REMOTELOG_PASSWORD) != 0) {
+            remoteLogSendNow(c.client, "Mot de passe incorrect\r\n");
+            remoteLogClose(c);
+            return;
+        }
+        c.authed = true;
+        remoteLogUpdateLevel();
+        remoteLogReply(c, "-REMOTELOG : " + String(DEVICE_NAME) + ", niveau " + String(logLevelLetters[c.level])
+                       + ", commandes : level, module, stats, reset, quit");
+        return;
+    }
+    char *arg = strchr(line, ' ');
+    if (arg) {
+        *arg++ = 0;
+        arg += strspn(arg, " ");
+    } else {
+        arg = line + strlen(line);
+    }
+
+    if (strcmp(line, "level") == 0) {
+        const char *letter = strchr(logLevelLetters + 1, toupper(arg[0]));
+        uint8_t level = letter && arg[0] ? letter - logLevelLetters : atoi(arg);
+        if (level < LOG_LEVEL_ERROR || level > LOG_LEVEL_VERBOSE) {
+            remoteLogReply(c, "Niveau : E, W, I, D ou V");
+            return;
+        }
+        c.level = level;
+        remoteLogUpdateLevel();
+        String reply = "-REMOTELOG : Niveau " + String(logLevelLetters[level]);
+        if (level > LOG_LEVEL) {
+            reply += ", niveaux compilés jusqu'à " + String(logLevelLetters[LOG_LEVEL]);
+        }
+        remoteLogReply(c, reply);
+    } else if (strcmp(line, "module") == 0) {
+        strncpy(c.modules, arg, sizeof(c.modules) - 1);
+        c.modules[sizeof(c.modules) - 1] = 0;
+        remoteLogReply(c, "-REMOTELOG : Modules " + String(c.modules[0] ? c.modules : "tous"));
+    } else if (strcmp(line, "stats") == 0) {
+        remoteLogReply(c, "-REMOTELOG : Niveau " + String(logLevelLetters[c.level]) + ", modules "
+                       + String(c.modules[0] ? c.modules : "tous") + ", envoyés " + String(c.sent)
+                       + ", perdus " + String(c.dropped) + ", perdus par le journal " + String(logDropped));
+    } else if (strcmp(line, "reset") == 0) {
+        remoteLogSendNow(c.client, "-REMOTELOG : Redémarrage\r\n");
+        c.client.stop();
+        ESP.restart();
+    } else if (strcmp(line, "quit") == 0) {
+        remoteLogClose(c);
+    } else if (line[0]) {
+        remoteLogReply(c, "Commandes : level E|W|I|D|V, module [A,B...], stats, reset, quit");
+    }
+}
+
+/**
+ * Lecture des commandes d'un client, en ignorant les négociations telnet
+ */
+void remoteLogRead(RemoteLogClient &c) {
+    while (c.active && c.client.available()) {
+        int ch = c.client.read();
+        if (c.iac > 0) {
+            c.iac--;
+        } else if (ch == 0xFF) {
+            c.iac = 2;              // IAC, commande, option
+        } else if (ch == '\n') {
+            c.input[c.inputLen] = 0;
+            c.inputLen = 0;
+            remoteLogCommand(c, c.input);
+        } else if (ch >= ' ' && ch < 0x7F && c.inputLen < REMOTELOG_INPUT_MAX - 1) {
+            c.input[c.inputLen++] = ch;
+        }
+    }
+}
+
+/**
+ * Envoi d'une partie du tampon de sortie d'un client, sans attendre : au plus REMOTELOG_CHUNK
+ * octets, ce que la fenêtre TCP accepte ; le reste au passage suivant
+ */
+void remoteLogFlush(RemoteLogClient &c) {
+    uint32_t pending = c.outHead - c.outTail;
+    if (pending == 0) {
+        return;
+    }
+    uint32_t index = c.outTail & (REMOTELOG_BUFFER - 1);
+    uint32_t len = pending;
+    if (len > REMOTELOG_BUFFER - index) len = REMOTELOG_BUFFER - index;   // Jusqu'à la fin du tampon
+    if (len > REMOTELOG_CHUNK) len = REMOTELOG_CHUNK;
+    int written = send(c.client.fd(), c.out + index, len, MSG_DONTWAIT);
+    if (written < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            remoteLogBlocked++;     // Le client ne lit pas assez vite
+        } else {
+            remoteLogClose(c);      // Connexion coupée
+        }
+        return;
+    }
+    c.outTail += written;
+    remoteLogBytes += written;
+    energyWifiTx(written);
+}
+
+/**
+ * Nouvelle connexion : une place libre, ou refus
+ */
+void remoteLogAccept() {
+    if (!remoteLogServer.hasClient()) {
+        return;
+    }
+    WiFiClient client = remoteLogServer.available();
+    for (uint8_t i = 0; i < REMOTELOG_CLIENTS; i++) {
+        RemoteLogClient &c = remoteLogClients[i];
+        if (c.active) {
+            continue;
+        }
+        c.client = client;
+        int fd = client.fd();
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        c.connectedAt = millis();
+        c.active = true;
+        c.authed = false;
+        c.level = LOG_LEVEL_INFO;
+        c.modules[0] = 0;
+        c.inputLen = 0;
+        c.iac = 0;
+        c.outHead = c.outTail = 0;
+        c.sent = c.dropped = c.droppedNotified = 0;
+        remoteLogSessions++;
+        remoteLogReply(c, "Mot de passe :");
+        return;
+    }
+    remoteLogSendNow(client, "-REMOTELOG : Trop de clients\r\n");
+    client.stop();
+    remoteLogRefused++;
+}
+
+/**
+ * Travail "remotelog" : connexions, commandes et envoi des tampons
+ */
+void pollRemoteLog() {
+    remoteLogAccept();
+    for (uint8_t i = 0; i < REMOTELOG_CLIENTS; i++) {
+        RemoteLogClient &c = remoteLogClients[i];
+        if (!c.active) {
+            continue;
+        }
+        if (!c.client.connected()) {
+            remoteLogClose(c);
+            continue;
+        }
+        if (!c.authed && millis() - c.connectedAt > REMOTELOG_AUTH_MS) {
+            remoteLogSendNow(c.client, "Délai dépassé\r\n");
+            remoteLogTimeouts++;
+            remoteLogClose(c);
+            continue;
+        }
+        remoteLogRead(c);
+        if (c.active) {
+            remoteLogFlush(c);
+        }
+    }
+}
+
+/**
+ * Statistiques de la console au format "clé valeur" de /stats
+ */
+String remoteLogStats() {
+    uint8_t clients = 0;
+    for (uint8_t i = 0; i < REMOTELOG_CLIENTS; i++) {
+        if (remoteLogClients[i].active) clients++;
+    }
+    String out = "";
+    out += "remotelog.clients " + String(clients) + "\n";
+    out += "remotelog.sessions " + String(remoteLogSessions) + "\n";
+    out += "remotelog.refused " + String(remoteLogRefused) + "\n";
+    out += "remotelog.lines " + String(remoteLogLines) + "\n";
+    out += "remotelog.dropped " + String(remoteLogDropped) + "\n";
+    out += "remotelog.bytes " + String(remoteLogBytes) + "\n";
+    out += "remotelog.blocked " + String(remoteLogBlocked) + "\n";
+    out += "remotelog.timeouts " + String(remoteLogTimeouts) + "\n";
+    return out;
+}
+
+/**
+ * Démarrage de la console telnet, à l'obtention de l'adresse IP (cf. \ref boot)
+ */
+void setupRemoteLog() {
+    MYDEBUG_PRINT("-REMOTELOG : Console telnet sur le port ");
+    MYDEBUG_PRINTLN(REMOTELOG_PORT);
+    remoteLogServer.begin();
+    remoteLogServer.setNoDelay(true);
+    logRemoteFilter = remoteLogWants;
+    logRemoteSink = remoteLogSink;
+    timerSetPriority(timerEvery("remotelog", REMOTELOG_POLL_MS, pollRemoteLog), TIMER_PRIO_LOW);
+}
@@ -53,6 +53,12 @@ String strContactsFile("/contacts.json"); // ------------------------ Nom du fic
 String strPositiveListFile("/positivelist.json"); // ---------------- Nom du fichier de liste des positifs
 String strTestFile("/spiffs_test.txt"); // -------------------------- Nom du fichier de test
 String strTrackingFile("/spiffs_tracking.txt"); // ------------------ Nom du fichier de tracking
+String strLogFile("/log.txt"); // ------------------------------------ Nom du fichier du journal, cf. \ref log
+String strLogOldFile("/log.old.txt"); // ----------------------------- Journal précédent
+#define LOG_FILE_MAX 16384 // ------------------------------------------ Taille du journal avant rotation
+String strEnergyFile("/energy.csv"); // ------------------------------ Bilan énergétique de chaque jour, cf. \ref energy
+String strEnergyModelFile("/energy.json"); // ------------------------ Modèle de courant, cf. \ref energy
+#define ENERGY_FILE_MAX 4096 // ---------------------------------------- Taille du bilan avant de retirer les jours les plus anciens
 File configFile, trackingFile, contactsFile, positiveListFile; // --- Fichiers
 const int MAX_CONTACTS = 50; // ------------------------------------- Maximum number of contacts
 
@@ -60,8 +66,9 @@ const int MAX_CONTACTS = 50; // ------------------------------------- Maximum nu
 void logTracking(String strTrackingText){ // ---------------------- Ecriture dans le fichier de tracking
     trackingFile = SPIFFS.open(strTrackingFile, FILE_APPEND); // ----- Ouverture du fichier en écriture
     if (trackingFile) { 
-        timeClient.update(); // ------------------------------------ Mise à jour de l'heure
-        trackingFile.print(timeClient.getFormattedTime()); // ------- Ecriture de l'heure
+        char heure[9];
+        timeFormatLocal(heure, sizeof(heure), "%H:%M:%S"); // -------- Heure locale, sans accès au réseau
+        trackingFile.print(heure); // ------------------------------- Ecriture de l'heure
         trackingFile.print("\t"); 
         trackingFile.println(strTrackingText); // ------------------- Ecriture du texte
         trackingFile.close(); // ------------------------------------ Fermeture du fichier
@@ -70,6 +77,68 @@ void logTracking(String strTrackingText){ // ---------------------- Ecriture dan
     }
 }
 
+void logFlashWrite(const String &lines){ // ------------------------ Ecriture d'un lot de messages du journal
+    File logFile = SPIFFS.open(strLogFile, FILE_APPEND);
+    if (!logFile) {
+        return;
+    }
+    logFile.print(lines);
+    size_t size = logFile.size();
+    logFile.close();
+    if (size > LOG_FILE_MAX) { // ---------------------------------- Rotation : un seul journal précédent est gardé
+        SPIFFS.remove(strLogOldFile);
+        SPIFFS.rename(strLogFile, strLogOldFile);
+    }
+}
+
+void energyDayWrite(const String &line){ // ------------------------ Ajout du bilan d'un jour
+    if (SPIFFS.exists(strEnergyFile)) {
+        File historyFile = SPIFFS.open(strEnergyFile, "r");
+        if (historyFile && historyFile.size() > ENERGY_FILE_MAX) { // -- Fichier trop gros : on garde la seconde moitié
+            historyFile.seek(historyFile.size() / 2);
+            historyFile.readStringUntil('\n');
+            String kept = historyFile.readString();
+            historyFile.close();
+            historyFile = SPIFFS.open(strEnergyFile, FILE_WRITE);
+            historyFile.print(kept);
+        }
+        historyFile.close();
+    }
+    File historyFile = SPIFFS.open(strEnergyFile, FILE_APPEND);
+    if (historyFile) {
+        historyFile.println(line);
+        historyFile.close();
+    }
+}
+
+void energyModelLoad(){ // ----------------------------------------- Lecture du modèle de courant, s'il a été modifié
+    File modelFile = SPIFFS.open(strEnergyModelFile, "r");
+    if (!modelFile) {
+        return;
+    }
+    DynamicJsonDocument jsonDocument(512);
+    if (deserializeJson(jsonDocument, modelFile)) {
+        MYDEBUG_PRINTLN("-SPIFFS : Impossible de parser energy.json");
+    } else {
+        for (JsonPair state : jsonDocument.as<JsonObject>()) { // --- {"wifi_tx": 190, ...}
+            energySetModel(state.key().c_str(), state.value().as<float>());
+        }
+    }
+    modelFile.close();
+}
+
+void energyModelSave(){ // ----------------------------------------- Ecriture du modèle de courant
+    DynamicJsonDocument jsonDocument(512);
+    for (uint8_t i = 0; i < ENERGY_STATES; i++) {
+        jsonDocument[energyStates[i].name] = energyStates[i].ma;
+    }
+    File modelFile = SPIFFS.open(strEnergyModelFile, FILE_WRITE);
+    if (modelFile) {
+        serializeJson(jsonDocument, modelFile);
+        modelFile.close();
+    }
+}
+
 /**
  * \fn void setupSPIFFS(bool bFormat = false)
  * \brief Initialisation du système de fichier
@@ -81,6 +150,9 @@ void setupSPIFFS(bool bFormat = false){ // -------------------------- Initialisa
 
     if (SPIFFS.begin(true)) { // ------------------------------------ Montage du système de fichier
         MYDEBUG_PRINTLN("-SPIFFS : MONTE");
+        logFlashSink = logFlashWrite; // ------------------------------ Avertissements et erreurs du journal
+        energyDaySink = energyDayWrite; // ---------------------------- Bilan énergétique de chaque jour
+        energyModelLoad();
 
         if (bFormat){
             SPIFFS.format(); // ------------- Au besoin, pour formatter le système de fichiers
@@ -120,6 +192,9 @@ void setupSPIFFS(bool bFormat = false){ // -------------------------- Initialisa
                     String parametre4 = jsonDocument["APpassword"].as<String>();
                     int parametre5 = jsonDocument["minutes_stand_by"].as<int>(); // --- Récupération des paramètres
                     int parametre6 = jsonDocument["days_of_historic"].as<int>();
+                    int parametre7 = jsonDocument["tx_power"] | -69;      // --- Valeurs par défaut si absents
+                    float parametre8 = jsonDocument["path_loss"] | 2.0;
+                    int parametre9 = jsonDocument["ntp_interval"] | 60;
 
                     sstation_ssid = parametre1; // ------------------------ Affectation des paramètres
                     sstation_password = parametre2; 
@@ -127,6 +202,9 @@ void setupSPIFFS(bool bFormat = false){ // -------------------------- Initialisa
                     aap_password = parametre4; 
                     minutes_stand_by = parametre5; 
                     days_of_historic = parametre6;
+                    tx_power = parametre7;
+                    path_loss = parametre8;
+                    ntp_interval = parametre9;
 
                     MYDEBUG_PRINT("-JSON [ssid] : "); // ------------------ Affichage des paramètres
                     MYDEBUG_PRINTLN(sstation_ssid);
@@ -140,6 +218,12 @@ void setupSPIFFS(bool bFormat = false){ // -------------------------- Initialisa
                     MYDEBUG_PRINTLN(minutes_stand_by);
                     MYDEBUG_PRINT("-JSON [days_of_historic] : ");
                     MYDEBUG_PRINTLN(days_of_historic);
+                    MYDEBUG_PRINT("-JSON [tx_power] : ");
+                    MYDEBUG_PRINTLN(tx_power);
+                    MYDEBUG_PRINT("-JSON [path_loss] : ");
+                    MYDEBUG_PRINTLN(path_loss);
+                    MYDEBUG_PRINT("-JSON [ntp_interval] : ");
+                    MYDEBUG_PRINTLN(ntp_interval);
 
                 }
             }
@@ -159,6 +243,9 @@ void setupSPIFFS(bool bFormat = false){ // -------------------------- Initialisa
                 jsonDocument["APpassword"] = String("12345678");
                 jsonDocument["minutes_stand_by"] = int(5);
                 jsonDocument["days_of_historic"] = int(30);
+                jsonDocument["tx_power"] = int(-69);
+                jsonDocument["path_loss"] = float(2.0);
+                jsonDocument["ntp_interval"] = int(60);
                 // Sérialisation du JSON dans le fichier de configuration
                 if (serializeJson(jsonDocument, configFile) == 0) {
                     MYDEBUG_PRINTLN("-SPIFFS : 2222 Impossible d'écrire le JSON dans le fichier de configuration");
@@ -307,6 +394,9 @@ struct Config {
     String APpassword;
     int minutes_stand_by;
     int days_of_historic;
+    int tx_power = -69;
+    float path_loss = 2.0;
+    int ntp_interval = 60;
 };
 
 // La fonction saveConfig() permet de sauvegarder les paramètres de configuration dans le fichier config.json
@@ -327,6 +417,9 @@ void saveConfig(struct Config config){
         jsonDocument["APpassword"] = config.APpassword;
         jsonDocument["minutes_stand_by"] = config.minutes_stand_by;
         jsonDocument["days_of_historic"] = config.days_of_historic;
+        jsonDocument["tx_power"] = config.tx_power;
+        jsonDocument["path_loss"] = config.path_loss;
+        jsonDocument["ntp_interval"] = config.ntp_interval;
 
         // Serialize the JSON document to the config file
         if (serializeJson(jsonDocument, configFile) == 0) {
@@ -357,6 +450,9 @@ struct Config loadConfig(){
             config.APpassword = jsonDocument["APpassword"].as<String>();
             config.minutes_stand_by = jsonDocument["minutes_stand_by"].as<int>();
             config.days_of_historic = jsonDocument["days_of_historic"].as<int>();
+            config.tx_power = jsonDocument["tx_power"] | -69;
+            config.path_loss = jsonDocument["path_loss"] | 2.0;
+            config.ntp_interval = jsonDocument["ntp_interval"] | 60;
         }
         configFile.close();
     } else {
@@ -617,6 +713,9 @@ void saveContact(String id1, String id2, String timestamp){
         }
         contactsFile.close(); // Close the file after writing
         MYDEBUG_PRINTLN("-SPIFFS: File closed");
+        if (bootFirstContactMs == 0) {
+            bootFirstContactMs = millis(); // Chronologie du démarrage, cf. \ref boot
+        }
     } else {
         MYDEBUG_PRINTLN("-SPIFFS: Error opening contacts.json for writing");
     }
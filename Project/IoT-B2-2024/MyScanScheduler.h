@@ -0,0 +1,131 @@
+/**
+ * \file MyScanScheduler.h
+ * \page scanscheduler Rythme du scan BLE
+ * \brief Ecouter juste assez pour détecter les autres cartes
+ *
+ * Le scan BLE écoutait 49 ms toutes les 50 ms : la radio était allumée presque en permanence,
+ * ce qui consomme de l'énergie et prend du temps d'antenne au WiFi (le BLE et le WiFi de l'ESP32
+ * partagent la même radio).
+ *
+ * La fenêtre (window) et l'intervalle (interval) du scan sont maintenant choisis chaque seconde
+ * en fonction de la situation :
+ * - WiFi occupé (publication ou réception MQTT, requête HTTP dans les dernières SCAN_WIFI_BUSY_MS) :
+ *   on laisse l'antenne au WiFi, SCAN_MODE_BACKOFF,
+ * - nouvelle carte détectée dans les dernières SCAN_BURST_MS : on écoute en continu pour
+ *   suivre rapidement la rencontre, SCAN_MODE_BURST,
+ * - sinon selon le nombre de cartes à proximité : aucune (on guette les arrivées), quelques unes,
+ *   beaucoup (chacune émet souvent, une petite fenêtre suffit).
+ *
+ * Pour régler le compromis, sont mesurés et visibles sur /stats :
+ * - le temps radio allumée (somme de la durée de chaque mode multipliée par window / interval),
+ * - l'écart moyen et maximal entre deux annonces reçues d'une même carte, c'est à dire le temps
+ *   de détection effectif d'une carte présente.
+ *
+ * Fichier \ref MyScanScheduler.h
+ */
+
+#define SCAN_WIFI_BUSY_MS   2000    // Durée pendant laquelle le WiFi est considéré occupé après une activité
+#define SCAN_BURST_MS       10000   // Durée d'écoute continue après l'arrivée d'une nouvelle carte
+#define SCAN_DENSE_PEERS    8       // Nombre de cartes à partir duquel l'environnement est dense
+
+/* Un mode de scan, durées en unités de 0,625 ms comme attendu par la pile Bluetooth */
+struct ScanMode {
+    const char *name;
+    uint16_t interval;
+    uint16_t window;
+};
+
+#define SCAN_MODE_BACKOFF   0
+#define SCAN_MODE_BURST     1
+#define SCAN_MODE_EMPTY     2
+#define SCAN_MODE_SPARSE    3
+#define SCAN_MODE_DENSE     4
+
+const ScanMode scanModes[] = {
+    { "backoff", 960, 24 },         // 15 ms toutes les 600 ms : 2,5 %
+    { "burst",   160, 160 },        // En continu : 100 %
+    { "empty",   480, 96 },         // 60 ms toutes les 300 ms : 20 %
+    { "sparse",  480, 48 },         // 30 ms toutes les 300 ms : 10 %
+    { "dense",   960, 48 },         // 30 ms toutes les 600 ms : 5 %
+};
+
+uint8_t scanMode = SCAN_MODE_EMPTY;
+unsigned long scanWifiActivityAt = 0;
+unsigned long scanNewPeerAt = 0;
+unsigned long scanModeSince = 0;
+
+// Statistiques du scan
+uint64_t scanRadioOnUs = 0;         // Temps radio allumée cumulé
+uint32_t scanModeChanges = 0;
+uint32_t scanGapSumMs = 0;          // Ecarts cumulés entre deux annonces d'une même carte
+uint32_t scanGapCount = 0;
+uint32_t scanGapMaxMs = 0;
+
+/**
+ * Signalement d'une activité WiFi (MQTT, HTTP), le scan laisse la place pendant SCAN_WIFI_BUSY_MS
+ */
+void scanSchedulerWifiActivity() {
+    scanWifiActivityAt = millis();
+    if (scanWifiActivityAt == 0) scanWifiActivityAt = 1;
+}
+
+/**
+ * Signalement de l'arrivée d'une nouvelle carte
+ */
+void scanSchedulerNewPeer() {
+    scanNewPeerAt = millis();
+    if (scanNewPeerAt == 0) scanNewPeerAt = 1;
+}
+
+/**
+ * Ecart entre deux annonces reçues d'une même carte
+ */
+void scanSchedulerSighting(uint32_t gapMs) {
+    scanGapSumMs += gapMs;
+    scanGapCount++;
+    if (gapMs > scanGapMaxMs) scanGapMaxMs = gapMs;
+}
+
+/**
+ * Temps radio allumée depuis l'appel précédent, compté seulement si le scan tourne
+ * \param scanning scan en cours, ni arrêté ni suspendu
+ */
+void scanSchedulerAccount(unsigned long now, bool scanning) {
+    if (scanning) {
+        const ScanMode &m = scanModes[scanMode];
+        uint64_t us = (uint64_t)(now - scanModeSince) * 1000 * m.window / m.interval;
+        scanRadioOnUs += us;
+        energyAdd(ENERGY_BLE_SCAN, us);
+    }
+    scanModeSince = now;
+}
+
+/**
+ * Choix du mode de scan, à appeler régulièrement
+ * \param peers nombre de cartes actuellement à proximité
+ * \param scanning scan en cours depuis l'appel précédent, pour le temps radio allumée
+ * \return true si le mode a changé et que le scan doit être relancé
+ */
+bool scanSchedulerTick(uint16_t peers, bool scanning) {
+    unsigned long now = millis();
+    uint8_t mode;
+    if (scanWifiActivityAt && now - scanWifiActivityAt < SCAN_WIFI_BUSY_MS) {
+        mode = SCAN_MODE_BACKOFF;
+    } else if (scanNewPeerAt && now - scanNewPeerAt < SCAN_BURST_MS) {
+        mode = SCAN_MODE_BURST;
+    } else if (peers == 0) {
+        mode = SCAN_MODE_EMPTY;
+    } else if (peers < SCAN_DENSE_PEERS) {
+        mode = SCAN_MODE_SPARSE;
+    } else {
+        mode = SCAN_MODE_DENSE;
+    }
+    scanSchedulerAccount(now, scanning);
+    if (mode == scanMode) {
+        return false;
+    }
+    LOG_I("-BLE Scan : Mode %s", scanModes[mode].name);
+    scanMode = mode;
+    scanModeChanges++;
+    return true;
+}
@@ -0,0 +1,434 @@
+/**
+ * \file MyTLS.h
+ * \page tls Connexion TLS au broker
+ * \brief Chiffrer la connexion MQTT sans payer une poignée de main complète à chaque reconnexion
+ *
+ * Par défaut, le client MQTT se connecte au port 1883 en clair : la clé Adafruit IO (IO_KEY)
+ * circule donc en clair sur le réseau. Adafruit IO accepte aussi les connexions TLS sur le port 8883,
+ * mais une poignée de main TLS complète (échange de clés, vérification du certificat) coûte plusieurs
+ * centaines de millisecondes de calcul à l'ESP32, à chaque reconnexion.
+ *
+ * Ce module fournit TlsSessionClient, un client (au sens de la classe Arduino Client) utilisable
+ * à la place de WiFiClient par Adafruit_MQTT_Client :
+ * - la configuration TLS (générateur aléatoire, certificat racine) est préparée une seule fois et
+ *   réutilisée à chaque connexion,
+ * - la session TLS négociée (identifiant de session ou ticket de session) est gardée en mémoire
+ *   RAM et en mémoire RTC, pour survivre à un deep sleep,
+ * - à la reconnexion, la session est proposée au broker : s'il l'accepte, la poignée de main est
+ *   abrégée (pas d'échange de clés ni de vérification de certificat).
+ *
+ * Le temps de chaque poignée de main est mesuré, ainsi que le temps CPU (temps total moins le temps
+ * passé à attendre le réseau), séparément pour les poignées de main complètes et abrégées.
+ * Les moyennes sont visibles sur la route /stats (tls.*).
+ *
+ * La session est sérialisée sans le certificat du broker : avec MBEDTLS_SSL_KEEP_PEER_CERTIFICATE
+ * (réglage d'arduino-esp32), mbedtls_ssl_session_save() y recopie le certificat DER, plus grand que
+ * la place réservée en mémoire RTC, et la sauvegarde échouait toujours. La reprise n'en a pas
+ * besoin : le résultat de sa vérification fait partie de la session. La taille sauvegardée et les
+ * échecs de sauvegarde sont visibles sur /stats (tls.rtc_session_bytes, tls.rtc_save_failed).
+ *
+ * Le certificat du broker est toujours vérifié (MBEDTLS_SSL_VERIFY_REQUIRED) avec les certificats
+ * racines de tlsRootCA : DigiCert Global Root CA et DigiCert Global Root G2, auxquelles remonte
+ * celui d'io.adafruit.com. Le nom vérifié est celui passé à connect() : une connexion par adresse
+ * IP est refusée, aucun certificat ne pourrait correspondre. Une reprise de session est reconnue à l'absence de certificat pendant
+ * la poignée de main (la fonction de vérification n'est pas appelée), ce qui vaut pour les
+ * identifiants comme pour les tickets de session. La session en cache n'est oubliée que si le
+ * broker l'a acceptée et que la reprise a ensuite échoué : une coupure réseau ou un refus de la
+ * session (poignée de main complète) la laissent en place.
+ *
+ * Pour activer TLS, décommenter IO_USE_TLS dans \ref MyAdafruitIO.h. Pour mesurer sans dépendre
+ * d'Internet, IO_SERVER peut pointer vers un broker TLS local (ex : mosquitto avec un listener 8883
+ * sur le réseau local), en remplaçant tlsRootCA par le certificat de son autorité.
+ *
+ * Fichier \ref MyTLS.h
+ */
+
+#include "mbedtls/ssl.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/error.h"
+#include "mbedtls/version.h"
+
+#define TLS_HANDSHAKE_TIMEOUT_MS 10000  // Durée maximale d'une poignée de main
+#define TLS_RTC_SESSION_MAX      1536   // Place réservée en mémoire RTC pour la session sérialisée
+
+// La sérialisation des sessions n'existe qu'à partir de mbedtls 2.21 (arduino-esp32 2.x)
+#if defined(MBEDTLS_VERSION_NUMBER) && MBEDTLS_VERSION_NUMBER >= 0x02150000
+#define TLS_RTC_SESSION
+#endif
+
+// Certificat du broker gardé dans la session, champ privé à partir de mbedtls 3
+#if defined(MBEDTLS_SSL_KEEP_PEER_CERTIFICATE) && MBEDTLS_VERSION_NUMBER >= 0x03000000
+#define TLS_SESSION_PEER_CERT(s) (s).MBEDTLS_PRIVATE(peer_cert)
+#elif defined(MBEDTLS_SSL_KEEP_PEER_CERTIFICATE)
+#define TLS_SESSION_PEER_CERT(s) (s).peer_cert
+#endif
+
+// Certificats racines (PEM) du broker : DigiCert Global Root CA et DigiCert Global Root G2
+const char *tlsRootCA =
+  "-----BEGIN CERTIFICATE-----\n"
+  "MIIDrzCCApegAwIBAgIQCDvgVpBCRrGhdWrJWZHHSjANBgkqhkiG9w0BAQUFADBh\n"
+  "MQswCQYDVQQGEwJVUzEVMBMGA1UEChMMRGlnaUNlcnQgSW5jMRkwFwYDVQQLExB3\n"
+  "d3cuZGlnaWNlcnQuY29tMSAwHgYDVQQDExdEaWdpQ2VydCBHbG9iYWwgUm9vdCBD\n"
+  "QTAeFw0wNjExMTAwMDAwMDBaFw0zMTExMTAwMDAwMDBaMGExCzAJBgNVBAYTAlVT\n"
+  "MRUwEwYDVQQKEwxEaWdpQ2VydCBJbmMxGTAXBgNVBAsTEHd3dy5kaWdpY2VydC5j\n"
+  "b20xIDAeBgNVBAMTF0RpZ2lDZXJ0IEdsb2JhbCBSb290IENBMIIBIjANBgkqhkiG\n"
+  "9w0BAQEFAAOCAQ8AMIIBCgKCAQEA4jvhEXLeqKTTo1eqUKKPC3eQyaKl7hLOllsB\n"
+  "CSDMAZOnTjC3U/dDxGkAV53ijSLdhwZAAIEJzs4bg7/fzTtxRuLWZscFs3YnFo97\n"
+  "nh6Vfe63SKMI2tavegw5BmV/Sl0fvBf4q77uKNd0f3p4mVmFaG5cIzJLv07A6Fpt\n"
+  "43C/dxC//AH2hdmoRBBYMql1GNXRor5H4idq9Joz+EkIYIvUX7Q6hL+hqkpMfT7P\n"
+  "T19sdl6gSzeRntwi5m3OFBqOasv+zbMUZBfHWymeMr/y7vrTC0LUq7dBMtoM1O/4\n"
+  "gdW7jVg/tRvoSSiicNoxBN33shbyTApOB6jtSj1etX+jkMOvJwIDAQABo2MwYTAO\n"
+  "BgNVHQ8BAf8EBAMCAYYwDwYDVR0TAQH/BAUwAwEB/zAdBgNVHQ4EFgQUA95QNVbR\n"
+  "TLtm8KPiGxvDl7I90VUwHwYDVR0jBBgwFoAUA95QNVbRTLtm8KPiGxvDl7I90VUw\n"
+  "DQYJKoZIhvcNAQEFBQADggEBAMucN6pIExIK+t1EnE9SsPTfrgT1eXkIoyQY/Esr\n"
+  "hMAtudXH/vTBH1jLuG2cenTnmCmrEbXjcKChzUyImZOMkXDiqw8cvpOp/2PV5Adg\n"
+  "06O/nVsJ8dWO41P0jmP6P6fbtGbfYmbW0W5BjfIttep3Sp+dWOIrWcBAI+0tKIJF\n"
+  "PnlUkiaY4IBIqDfv8NZ5YBberOgOzW6sRBc4L0na4UU+Krk2U886UAb3LujEV0ls\n"
+  "YSEY1QSteDwsOoBrp+uvFRTp2InBuThs4pFsiv9kuXclVzDAGySj4dzp30d8tbQk\n"
+  "CAUw7C29C79Fv1C5qfPrmAESrciIxpg0X40KPMbp1ZWVbd4=\n"
+  "-----END CERTIFICATE-----\n"
+  "-----BEGIN CERTIFICATE-----\n"
+  "MIIDjjCCAnagAwIBAgIQAzrx5qcRqaC7KGSxHQn65TANBgkqhkiG9w0BAQsFADBh\n"
+  "MQswCQYDVQQGEwJVUzEVMBMGA1UEChMMRGlnaUNlcnQgSW5jMRkwFwYDVQQLExB3\n"
+  "d3cuZGlnaWNlcnQuY29tMSAwHgYDVQQDExdEaWdpQ2VydCBHbG9iYWwgUm9vdCBH\n"
+  "MjAeFw0xMzA4MDExMjAwMDBaFw0zODAxMTUxMjAwMDBaMGExCzAJBgNVBAYTAlVT\n"
+  "MRUwEwYDVQQKEwxEaWdpQ2VydCBJbmMxGTAXBgNVBAsTEHd3dy5kaWdpY2VydC5j\n"
+  "b20xIDAeBgNVBAMTF0RpZ2lDZXJ0IEdsb2JhbCBSb290IEcyMIIBIjANBgkqhkiG\n"
+  "9w0BAQEFAAOCAQ8AMIIBCgKCAQEAuzfNNNx7a8myaJCtSnX/RrohCgiN9RlUyfuI\n"
+  "2/Ou8jqJkTx65qsGGmvPrC3oXgkkRLpimn7Wo6h+4FR1IAWsULecYxpsMNzaHxmx\n"
+  "1x7e/dfgy5SDN67sH0NO3Xss0r0upS/kqbitOtSZpLYl6ZtrAGCSYP9PIUkY92eQ\n"
+  "q2EGnI/yuum06ZIya7XzV+hdG82MHauVBJVJ8zUtluNJbd134/tJS7SsVQepj5Wz\n"
+  "tCO7TG1F8PapspUwtP1MVYwnSlcUfIKdzXOS0xZKBgyMUNGPHgm+F6HmIcr9g+UQ\n"
+  "vIOlCsRnKPZzFBQ9RnbDhxSJITRNrw9FDKZJobq7nMWxM4MphQIDAQABo0IwQDAP\n"
+  "BgNVHRMBAf8EBTADAQH/MA4GA1UdDwEB/wQEAwIBhjAdBgNVHQ4EFgQUTiJUIBiV\n"
+  "5uNu5g/6+rkS7QYXjzkwDQYJKoZIhvcNAQELBQADggEBAGBnKJRvDkhj6zHd6mcY\n"
+  "1Yl9PMWLSn/pvtsrF9+wX3N3KjITOYFnQoQj8kVnNeyIv/iPsGEMNKSuIEyExtv4\n"
+  "NeF22d+mQrvHRAiGfzZ0JFrabA0UWTW98kndth/Jsw1HKj2ZL7tcu7XUIOGZX1NG\n"
+  "Fdtom/DzMNU+MeKNhJ7jitralj41E6Vf8PlwUHBHQRFXGU7Aj64GxJUTFy8bJZ91\n"
+  "8rGOmaFvE7FBcf6IKshPECBV1/MUReXgRPTqh5Uykw7+U0b6LJ3/iyK5S9kJRaTe\n"
+  "pLiaWN0bfVKfjllDiIGknibVb63dDcY3fe0Dkhvld1927jyNxF1WW6LZZm6zNTfl\n"
+  "MrY=\n"
+  "-----END CERTIFICATE-----\n";
+
+// Session sauvegardée en mémoire RTC, conservée pendant le deep sleep
+RTC_DATA_ATTR uint16_t tlsRtcSessionLen = 0;
+RTC_DATA_ATTR uint8_t tlsRtcSession[TLS_RTC_SESSION_MAX];
+
+// Statistiques des poignées de main (durées cumulées en microsecondes)
+uint32_t tlsFullHandshakes = 0;
+uint32_t tlsResumedHandshakes = 0;
+uint32_t tlsFailedHandshakes = 0;
+uint32_t tlsFullUs = 0;
+uint32_t tlsFullCpuUs = 0;
+uint32_t tlsResumedUs = 0;
+uint32_t tlsResumedCpuUs = 0;
+uint32_t tlsRtcSaveFailed = 0;           // Sessions trop grandes pour la mémoire RTC
+
+/**
+ * Client TLS avec reprise de session, à passer à Adafruit_MQTT_Client à la place de WiFiClient
+ */
+class TlsSessionClient : public Client {
+public:
+  TlsSessionClient() {}
+  int connect(IPAddress ip, uint16_t port);
+  int connect(const char *host, uint16_t port);
+  size_t write(uint8_t b) { return write(&b, 1); }
+  size_t write(const uint8_t *buf, size_t size);
+  int available();
+  int read();
+  int read(uint8_t *buf, size_t size);
+  int peek();
+  void flush() {}
+  void stop();
+  uint8_t connected() { return open && tcp.connected(); }
+  operator bool() { return connected(); }
+private:
+  bool setupConfig();
+  void keepSession();
+  static int bioSend(void *ctx, const unsigned char *buf, size_t len);
+  static int bioRecv(void *ctx, unsigned char *buf, size_t len);
+  static int onVerify(void *ctx, mbedtls_x509_crt *crt, int depth, uint32_t *flags);
+  WiFiClient tcp;
+  mbedtls_ssl_context ssl;
+  mbedtls_ssl_config conf;
+  mbedtls_entropy_context entropy;
+  mbedtls_ctr_drbg_context drbg;
+  mbedtls_x509_crt ca;
+  mbedtls_ssl_session session;           // Dernière session négociée (cache RAM)
+  bool configured = false;
+  bool sessionValid = false;
+  bool open = false;
+  int peeked = -1;
+  uint8_t certsSeen = 0;                 // Certificats reçus pendant la poignée de main en cours
+};
+
+/**
+ * Envoi des données chiffrées sur la connexion TCP
+ */
+int TlsSessionClient::bioSend(void *ctx, const unsigned char *buf, size_t len) {
+  WiFiClient *tcp = (WiFiClient *)ctx;
+  if (!tcp->connected()) {
+    return MBEDTLS_ERR_NET_CONN_RESET;
+  }
+  size_t n = tcp->write(buf, len);
+  return n > 0 ? (int)n : MBEDTLS_ERR_SSL_WANT_WRITE;
+}
+
+/**
+ * Réception des données chiffrées depuis la connexion TCP, sans bloquer
+ */
+int TlsSessionClient::bioRecv(void *ctx, unsigned char *buf, size_t len) {
+  WiFiClient *tcp = (WiFiClient *)ctx;
+  if (!tcp->available()) {
+    return tcp->connected() ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_CONN_RESET;
+  }
+  int n = tcp->read(buf, len);
+  return n > 0 ? n : MBEDTLS_ERR_SSL_WANT_READ;
+}
+
+/**
+ * Vérification de chaque certificat de la chaîne du broker, appelée uniquement lors d'une poignée de
+ * main complète : le résultat de mbedtls (flags) est laissé tel quel, on compte seulement les appels
+ */
+int TlsSessionClient::onVerify(void *ctx, mbedtls_x509_crt *crt, int depth, uint32_t *flags) {
+  ((TlsSessionClient *)ctx)->certsSeen++;
+  return 0;
+}
+
+/**
+ * Préparation de la configuration TLS, une seule fois pour toutes les connexions
+ */
+bool TlsSessionClient::setupConfig() {
+  if (configured) {
+    return true;
+  }
+  mbedtls_ssl_init(&ssl);
+  mbedtls_ssl_config_init(&conf);
+  mbedtls_entropy_init(&entropy);
+  mbedtls_ctr_drbg_init(&drbg);
+  mbedtls_x509_crt_init(&ca);
+  mbedtls_ssl_session_init(&session);
+
+  if (mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy, (const unsigned char *)DEVICE_NAME, strlen(DEVICE_NAME)) != 0 ||
+      mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) != 0) {
+    MYDEBUG_PRINTLN("-TLS : Initialisation impossible");
+    return false;
+  }
+  if (mbedtls_x509_crt_parse(&ca, (const unsigned char *)tlsRootCA, strlen(tlsRootCA) + 1) != 0) {
+    MYDEBUG_PRINTLN("-TLS : Certificat racine illisible, connexion impossible");
+    return false;
+  }
+  mbedtls_ssl_conf_ca_chain(&conf, &ca, NULL);
+  mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+  mbedtls_ssl_conf_verify(&conf, onVerify, this);
+  mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &drbg);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+  mbedtls_ssl_conf_session_tickets(&conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+  if (mbedtls_ssl_setup(&ssl, &conf) != 0) {
+    MYDEBUG_PRINTLN("-TLS : Initialisation impossible");
+    return false;
+  }
+  mbedtls_ssl_set_bio(&ssl, &tcp, bioSend, bioRecv, NULL);
+
+#ifdef TLS_RTC_SESSION
+  // Au réveil, on reprend la session sauvegardée en mémoire RTC
+  if (tlsRtcSessionLen > 0 && mbedtls_ssl_session_load(&session, tlsRtcSession, tlsRtcSessionLen) == 0) {
+    sessionValid = true;
+    MYDEBUG_PRINTLN("-TLS : Session restaurée depuis la mémoire RTC");
+  }
+#endif
+  configured = true;
+  return true;
+}
+
+/**
+ * Sauvegarde de la session négociée en RAM et en mémoire RTC
+ */
+void TlsSessionClient::keepSession() {
+  mbedtls_ssl_session_free(&session);
+  mbedtls_ssl_session_init(&session);
+  if (mbedtls_ssl_get_session(&ssl, &session) != 0) {
+    sessionValid = false;
+    return;
+  }
+  sessionValid = true;
+#ifdef TLS_RTC_SESSION
+  size_t len = 0;
+#ifdef TLS_SESSION_PEER_CERT
+  mbedtls_x509_crt *peer = TLS_SESSION_PEER_CERT(session);
+  TLS_SESSION_PEER_CERT(session) = NULL; // Sérialisée sans le certificat, inutile à la reprise
+#endif
+  int ret = mbedtls_ssl_session_save(&session, tlsRtcSession, sizeof(tlsRtcSession), &len);
+#ifdef TLS_SESSION_PEER_CERT
+  TLS_SESSION_PEER_CERT(session) = peer;
+#endif
+  if (ret == 0) {
+    tlsRtcSessionLen = len;
+  } else {
+    tlsRtcSessionLen = 0;                // Trop grande pour la mémoire RTC, cache RAM uniquement
+    tlsRtcSaveFailed++;
+  }
+#endif
+}
+
+/**
+ * Connexion par adresse IP refusée : le certificat est vérifié sur un nom d'hôte
+ */
+int TlsSessionClient::connect(IPAddress ip, uint16_t port) {
+  MYDEBUG_PRINTLN("-TLS : Connexion par adresse IP impossible, nom d'hôte nécessaire");
+  tlsFailedHandshakes++;
+  return 0;
+}
+
+/**
+ * Connexion TCP puis poignée de main TLS, abrégée si le broker accepte la session en cache
+ */
+int TlsSessionClient::connect(const char *host, uint16_t port) {
+  stop();
+  if (!setupConfig() || !tcp.connect(host, port)) {
+    return 0;
+  }
+  mbedtls_ssl_set_hostname(&ssl, host);
+  bool offered = sessionValid && mbedtls_ssl_set_session(&ssl, &session) == 0;
+  certsSeen = 0;
+
+  unsigned long start = micros();
+  unsigned long waited = 0;              // Temps passé à attendre le réseau
+  int ret;
+  while ((ret = mbedtls_ssl_handshake(&ssl)) != 0) {
+    if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+      break;
+    }
+    if (micros() - start > TLS_HANDSHAKE_TIMEOUT_MS * 1000UL) {
+      break;
+    }
+    unsigned long w = micros();
+    delay(1);
+    waited += micros() - w;
+  }
+  unsigned long total = micros() - start;
+  if (ret != 0) {
+    char err[64];
+    mbedtls_strerror(ret, err, sizeof(err));
+    MYDEBUG_PRINT("-TLS : Echec de la poignée de main : ");
+    MYDEBUG_PRINTLN(err);
+    tlsFailedHandshakes++;
+    bool network = ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE ||   // Délai dépassé
+                   ret == MBEDTLS_ERR_NET_CONN_RESET || ret == MBEDTLS_ERR_NET_SEND_FAILED ||
+                   ret == MBEDTLS_ERR_NET_RECV_FAILED;
+    if (offered && certsSeen == 0 && !network) {
+      sessionValid = false;              // Echec sans certificat reçu : la reprise a échoué, on repartira de zéro
+      tlsRtcSessionLen = 0;
+    }
+    mbedtls_ssl_session_reset(&ssl);
+    tcp.stop();
+    return 0;
+  }
+
+  bool resumed = offered && certsSeen == 0;   // Pas de certificat : poignée de main abrégée
+  if (resumed) {
+    tlsResumedHandshakes++;
+    tlsResumedUs += total;
+    tlsResumedCpuUs += total - waited;
+  } else {
+    tlsFullHandshakes++;
+    tlsFullUs += total;
+    tlsFullCpuUs += total - waited;
+  }
+  keepSession();                         // Le broker a pu émettre un nouveau ticket
+  MYDEBUG_PRINT(resumed ? "-TLS : Session reprise en " : "-TLS : Nouvelle session en ");
+  MYDEBUG_PRINT(total / 1000);
+  MYDEBUG_PRINTLN(" ms");
+  open = true;
+  return 1;
+}
+
+size_t TlsSessionClient::write(const uint8_t *buf, size_t size) {
+  if (!open) {
+    return 0;
+  }
+  size_t sent = 0;
+  unsigned long start = millis();
+  while (sent < size) {
+    int ret = mbedtls_ssl_write(&ssl, buf + sent, size - sent);
+    if (ret > 0) {
+      sent += ret;
+    } else if ((ret != MBEDTLS_ERR_SSL_WANT_WRITE && ret != MBEDTLS_ERR_SSL_WANT_READ) || millis() - start > TLS_HANDSHAKE_TIMEOUT_MS) {
+      stop();
+      break;
+    }
+  }
+  return sent;
+}
+
+/**
+ * Nombre d'octets déchiffrés disponibles
+ */
+int TlsSessionClient::available() {
+  if (!open) {
+    return 0;
+  }
+  if (peeked >= 0) {
+    return 1;
+  }
+  int ret = mbedtls_ssl_read(&ssl, NULL, 0);   // Déchiffre un enregistrement s'il en est arrivé un
+  if (ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+    stop();
+    return 0;
+  }
+  return mbedtls_ssl_get_bytes_avail(&ssl);
+}
+
+int TlsSessionClient::read() {
+  uint8_t b;
+  return read(&b, 1) == 1 ? b : -1;
+}
+
+int TlsSessionClient::read(uint8_t *buf, size_t size) {
+  if (!open || size == 0) {
+    return -1;
+  }
+  int n = 0;
+  if (peeked >= 0) {
+    buf[n++] = peeked;
+    peeked = -1;
+    if (size == 1) {
+      return 1;
+    }
+  }
+  int ret = mbedtls_ssl_read(&ssl, buf + n, size - n);
+  if (ret > 0) {
+    return n + ret;
+  }
+  if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+    stop();
+  }
+  return n > 0 ? n : -1;
+}
+
+int TlsSessionClient::peek() {
+  if (peeked < 0) {
+    peeked = read();
+  }
+  return peeked;
+}
+
+/**
+ * Fermeture de la connexion. Le contexte TLS est réinitialisé (et non libéré) pour être
+ * réutilisé par la connexion suivante, la session reste en cache.
+ */
+void TlsSessionClient::stop() {
+  if (open) {
+    mbedtls_ssl_close_notify(&ssl);
+    open = false;
+  }
+  peeked = -1;
+  if (configured) {
+    mbedtls_ssl_session_reset(&ssl);
+  }
+  tcp.stop();
+}
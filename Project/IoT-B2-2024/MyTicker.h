@@ -18,12 +18,13 @@
  * A noter que comme on ne connaît pas l'heure (et que ce n'est pas forcément nécessaire dans
  * ce cas), o
  * 
+ * \note Chaque Ticker arme son propre timer matériel et appelle sa fonction depuis la tâche des
+ * timers, en parallèle de loop(). Les travaux périodiques de ce projet sont maintenant tous
+ * enregistrés dans la roue de temporisation (\ref timerwheel) avec timerEvery(), et exécutés
+ * dans loop().
+ * 
  * Fichier \ref MyTicker.h
  */
- 
-#include <Ticker.h>
-
-Ticker myTicker;
 
 int count = 0;
 unsigned long myTickerTime;
@@ -58,18 +59,18 @@ void tickerFunction() {
 /**
  * \brief Configuration du Ticker
  * 
- * Cette fonction permet de configurer un Ticker qui appelle la fonction tickerFunction toutes les 30 secondes.
+ * Cette fonction permet de configurer un travail périodique qui appelle la fonction tickerFunction toutes les 30 secondes.
  * 
  * \code{.cpp}
  * void setupTicker(){
  *   MYDEBUG_PRINTLN("-TICKER : Initialisation d'un ticker toutes les 30 secondes");
- *   myTicker.attach(30, tickerFunction);         // Association du Ticker avec une fonction appelée toutes les 30 secondes
+ *   timerEvery("ticker", 30000, tickerFunction); // Association d'un travail de la roue avec une fonction appelée toutes les 30 secondes
  *   myTickerTime = micros();                     // J'enregistre l'heure en nombre de us
  * }
  * \endcode
  */
 void setupTicker(){
   MYDEBUG_PRINTLN("-TICKER : Initialisation d'un ticker toutes les 30 secondes");
-  myTicker.attach(30, tickerFunction);         // Association du Ticker avec une fonction appelée toutes les 30 secondes
+  timerSetPriority(timerEvery("ticker", 30000, tickerFunction), TIMER_PRIO_LOW); // Association d'un travail de la roue avec une fonction appelée toutes les 30 secondes
   myTickerTime = micros();                     // J'enregistre l'heure en nombre de us
 }
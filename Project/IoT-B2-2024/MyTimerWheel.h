@@ -0,0 +1,443 @@
+/**
+ * \file MyTimerWheel.h
+ * \page timerwheel Roue de temporisation
+ * \brief Une seule horloge pour tous les travaux périodiques
+ *
+ * Les traitements périodiques étaient répartis entre des objets Ticker (MyTicker.h, MyAdafruitIO.h,
+ * MyOTA.h, ce dernier étant même réarmé à chaque passage dans loop(), ce qui repoussait sans cesse son
+ * échéance), des tests millis() dans les fonctions loopXxx(), et un delay(10) fixe à la fin de loop().
+ *
+ * Les modules enregistrent maintenant leurs travaux, périodiques (timerEvery()) ou à exécuter une seule
+ * fois (timerOnce()), dans une roue de temporisation hiérarchique à 3 niveaux, pas de 1 ms :
+ * - niveau 0 : 256 cases de 1 ms,
+ * - niveau 1 : 64 cases de 256 ms (16 s),
+ * - niveau 2 : 64 cases de 16 s (17 min), une échéance plus lointaine est replacée à chaque passage.
+ * Quand l'aiguille du niveau 0 fait un tour, la case suivante du niveau 1 est redistribuée dans le
+ * niveau 0 (de même entre les niveaux 2 et 1) : ajouter, retirer ou déclencher un travail ne coûte
+ * jamais un parcours de tous les travaux.
+ *
+ * Tous les travaux sont exécutés par timerRun(), depuis loop(), c'est à dire dans une seule tâche.
+ * Entre deux échéances, timerIdle() endort la tâche jusqu'à la prochaine échéance (au plus
+ * TIMER_IDLE_MAX_MS), au lieu d'un délai fixe.
+ *
+ * \section timerbudget Budgets et priorités
+ * L'ordonnancement est coopératif : un travail qui dure 10 s bloque tous les autres. Les modules
+ * qui ont une quantité de travail variable (messages MQTT, annonces BLE, requêtes HTTP, événements)
+ * s'enregistrent avec timerPoll() : leur fonction poll(budget) reçoit le nombre de millisecondes
+ * qu'elle peut utiliser et rend la main une fois ce budget consommé, le reste sera traité au
+ * prochain appel. Chaque travail a une priorité :
+ * - TIMER_PRIO_HIGH : toujours exécuté (file des annonces BLE, état de santé),
+ * - TIMER_PRIO_NORMAL, TIMER_PRIO_LOW : exécutés dans l'ordre des priorités tant que le passage
+ *   dans timerRun() n'a pas consommé TIMER_LOOP_BUDGET_MS, sinon reportés au passage suivant.
+ * Le budget d'un travail est limité à ce qu'il reste du budget du passage. La durée maximale d'un
+ * passage est donc d'environ TIMER_LOOP_BUDGET_MS plus le dépassement du dernier travail, au lieu
+ * de la somme des pires cas de tous les modules.
+ *
+ * Pour chaque travail sont mesurés, et visibles sur /stats :
+ * - le retard au déclenchement (gigue), moyen et maximum,
+ * - la durée d'exécution maximale et son histogramme (puissances de 2 en millisecondes),
+ * - les dépassements : échéances périodiques sautées parce que le travail précédent (ou un autre)
+ *   a duré trop longtemps,
+ * - les dépassements de budget et les reports faute de budget.
+ * La durée des passages dans timerRun() (latence de loop()) a aussi son maximum et son histogramme.
+ *
+ * Fichier \ref MyTimerWheel.h
+ */
+
+#define TIMER_JOBS          24      // Nombre maximum de travaux
+#define TIMER_L0_BITS       8       // Niveau 0 : 256 cases de 1 ms
+#define TIMER_LN_BITS       6       // Niveaux 1 et 2 : 64 cases
+#define TIMER_L0_SIZE       (1 << TIMER_L0_BITS)
+#define TIMER_LN_SIZE       (1 << TIMER_LN_BITS)
+#define TIMER_SPAN          (1UL << (TIMER_L0_BITS + 2 * TIMER_LN_BITS))   // Echéance maximale placée directement
+#define TIMER_IDLE_MAX_MS   50      // Sommeil maximum entre deux passages dans loop()
+#define TIMER_LOOP_BUDGET_MS 50     // Budget d'un passage dans timerRun(), pour les travaux non prioritaires
+#define TIMER_HIST_BUCKETS  8       // Histogrammes : < 1, 2, 4, ... 64 ms, puis au delà
+#define TIMER_NONE          -1
+
+// Priorités
+#define TIMER_PRIO_HIGH     0       // Jamais reporté
+#define TIMER_PRIO_NORMAL   1
+#define TIMER_PRIO_LOW      2
+
+/* Un travail */
+struct TimerJob {
+    const char *name;               // NULL si l'entrée est libre
+    void (*fn)();                   // Travail simple...
+    void (*poll)(uint32_t budgetMs);// ... ou travail à budget
+    uint32_t period;                // 0 : une seule fois
+    uint32_t due;                   // Echéance (millis)
+    uint32_t budgetMs;              // Budget par appel de poll
+    uint8_t priority;
+    int8_t next;                    // Travail suivant dans la même case
+    bool queued;                    // Présent dans la roue
+    bool ready;                     // Echu, en attente d'exécution
+    // Statistiques
+    uint32_t runs;
+    uint32_t lateSumMs;
+    uint32_t lateMaxMs;
+    uint32_t execMaxUs;
+    uint32_t overruns;              // Echéances sautées
+    uint32_t overBudget;            // Exécutions plus longues que le budget
+    uint32_t deferred;              // Reports faute de budget du passage
+    uint32_t hist[TIMER_HIST_BUCKETS];
+};
+
+TimerJob timerJobs[TIMER_JOBS];
+int8_t timerWheel0[TIMER_L0_SIZE];
+int8_t timerWheel1[TIMER_LN_SIZE];
+int8_t timerWheel2[TIMER_LN_SIZE];
+uint32_t timerNow = 0;              // Dernier pas traité
+bool timerStarted = false;
+uint32_t timerIdleMs = 0;           // Temps passé à dormir dans timerIdle()
+int8_t timerReady[TIMER_JOBS];      // Travaux échus, par priorité puis par ordre d'échéance
+uint8_t timerReadyCount = 0;
+// Latence de loop() : durée des passages dans timerRun()
+uint32_t timerLoopMaxUs = 0;
+uint32_t timerLoopHist[TIMER_HIST_BUCKETS];
+
+/**
+ * Case d'histogramme d'une durée : < 1 ms, < 2 ms, < 4 ms ... puis au delà de 64 ms
+ */
+uint8_t timerHistBucket(uint32_t us) {
+    uint32_t ms = us / 1000;
+    uint8_t b = 0;
+    while (ms && b < TIMER_HIST_BUCKETS - 1) {
+        ms >>= 1;
+        b++;
+    }
+    return b;
+}
+
+/**
+ * Placement d'un travail dans la case correspondant à son échéance
+ */
+void timerInsert(int8_t id) {
+    TimerJob &j = timerJobs[id];
+    int32_t delta = (int32_t)(j.due - timerNow);
+    int8_t *slot;
+    if (delta <= 0) {
+        slot = &timerWheel0[(timerNow + 1) & (TIMER_L0_SIZE - 1)];    // En retard : au prochain pas
+    } else if (delta < TIMER_L0_SIZE) {
+        slot = &timerWheel0[j.due & (TIMER_L0_SIZE - 1)];
+    } else if (delta < (1L << (TIMER_L0_BITS + TIMER_LN_BITS))) {
+        slot = &timerWheel1[(j.due >> TIMER_L0_BITS) & (TIMER_LN_SIZE - 1)];
+    } else {
+        uint32_t due = delta < (int32_t)TIMER_SPAN ? j.due : timerNow + TIMER_SPAN - 1;  // Replacé plus tard
+        slot = &timerWheel2[(due >> (TIMER_L0_BITS + TIMER_LN_BITS)) & (TIMER_LN_SIZE - 1)];
+    }
+    j.next = *slot;
+    *slot = id;
+    j.queued = true;
+}
+
+/**
+ * Retrait d'un travail de la roue
+ */
+void timerUnlink(int8_t id) {
+    int8_t *wheels[] = { timerWheel0, timerWheel1, timerWheel2 };
+    int sizes[] = { TIMER_L0_SIZE, TIMER_LN_SIZE, TIMER_LN_SIZE };
+    for (int w = 0; w < 3; w++) {
+        for (int s = 0; s < sizes[w]; s++) {
+            for (int8_t *p = &wheels[w][s]; *p != TIMER_NONE; p = &timerJobs[*p].next) {
+                if (*p == id) {
+                    *p = timerJobs[id].next;
+                    timerJobs[id].queued = false;
+                    return;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Redistribution d'une case d'un niveau supérieur dans les niveaux inférieurs
+ */
+void timerCascade(int8_t *slot) {
+    int8_t id = *slot;
+    *slot = TIMER_NONE;
+    while (id != TIMER_NONE) {
+        int8_t next = timerJobs[id].next;
+        if (timerJobs[id].due == timerNow) {
+            timerJobs[id].next = timerWheel0[timerNow & (TIMER_L0_SIZE - 1)];  // Case en cours, traitée juste après
+            timerWheel0[timerNow & (TIMER_L0_SIZE - 1)] = id;
+        } else {
+            timerInsert(id);
+        }
+        id = next;
+    }
+}
+
+/**
+ * Initialisation de la roue, appelée au premier enregistrement
+ */
+void timerBegin() {
+    memset(timerWheel0, TIMER_NONE, sizeof(timerWheel0));
+    memset(timerWheel1, TIMER_NONE, sizeof(timerWheel1));
+    memset(timerWheel2, TIMER_NONE, sizeof(timerWheel2));
+    timerNow = millis();
+    timerStarted = true;
+}
+
+/**
+ * Enregistrement d'un travail
+ * \param name nom affiché dans les statistiques
+ * \param delayMs délai avant la première exécution
+ * \param periodMs période, 0 pour une seule exécution
+ * \return l'identifiant du travail, TIMER_NONE si la table est pleine
+ */
+int8_t timerAdd(const char *name, uint32_t delayMs, uint32_t periodMs, void (*fn)()) {
+    if (!timerStarted) {
+        timerBegin();
+    }
+    for (int8_t id = 0; id < TIMER_JOBS; id++) {
+        TimerJob &j = timerJobs[id];
+        if (j.name == NULL) {
+            memset(&j, 0, sizeof(j));
+            j.name = name;
+            j.fn = fn;
+            j.period = periodMs;
+            j.budgetMs = TIMER_LOOP_BUDGET_MS;
+            j.priority = TIMER_PRIO_NORMAL;
+            j.due = millis() + delayMs;
+            timerInsert(id);
+            return id;
+        }
+    }
+    MYDEBUG_PRINT("-TIMER : Table pleine, travail ignoré : ");
+    MYDEBUG_PRINTLN(name);
+    return TIMER_NONE;
+}
+
+/**
+ * Travail périodique, première exécution après une période
+ */
+int8_t timerEvery(const char *name, uint32_t periodMs, void (*fn)()) {
+    return timerAdd(name, periodMs, periodMs, fn);
+}
+
+/**
+ * Travail à exécuter une seule fois, dans delayMs millisecondes
+ */
+int8_t timerOnce(const char *name, uint32_t delayMs, void (*fn)()) {
+    return timerAdd(name, delayMs, 0, fn);
+}
+
+/**
+ * Travail périodique à budget
+ * \param budgetMs durée que poll() peut utiliser à chaque appel
+ * \param priority TIMER_PRIO_HIGH, TIMER_PRIO_NORMAL ou TIMER_PRIO_LOW
+ */
+int8_t timerPoll(const char *name, uint32_t periodMs, uint32_t budgetMs, uint8_t priority, void (*poll)(uint32_t budgetMs)) {
+    int8_t id = timerAdd(name, periodMs, periodMs, NULL);
+    if (id != TIMER_NONE) {
+        timerJobs[id].poll = poll;
+        timerJobs[id].budgetMs = budgetMs;
+        timerJobs[id].priority = priority;
+    }
+    return id;
+}
+
+/**
+ * Changement de priorité d'un travail déjà enregistré
+ */
+void timerSetPriority(int8_t id, uint8_t priority) {
+    if (id >= 0 && id < TIMER_JOBS) {
+        timerJobs[id].priority = priority;
+    }
+}
+
+/**
+ * Ajout d'un travail échu dans la liste d'exécution, après ceux de priorité supérieure ou égale
+ */
+void timerReadyAdd(int8_t id) {
+    uint8_t i = timerReadyCount;
+    while (i > 0 && timerJobs[timerReady[i - 1]].priority > timerJobs[id].priority) {
+        timerReady[i] = timerReady[i - 1];
+        i--;
+    }
+    timerReady[i] = id;
+    timerReadyCount++;
+    timerJobs[id].queued = false;
+    timerJobs[id].ready = true;
+}
+
+/**
+ * Retrait d'un travail de la liste d'exécution
+ */
+void timerReadyRemove(uint8_t i) {
+    timerJobs[timerReady[i]].ready = false;
+    timerReadyCount--;
+    for (; i < timerReadyCount; i++) {
+        timerReady[i] = timerReady[i + 1];
+    }
+}
+
+/**
+ * Annulation d'un travail
+ */
+void timerCancel(int8_t id) {
+    if (id < 0 || id >= TIMER_JOBS || timerJobs[id].name == NULL) {
+        return;
+    }
+    if (timerJobs[id].queued) {
+        timerUnlink(id);
+    }
+    for (uint8_t i = 0; i < timerReadyCount; i++) {
+        if (timerReady[i] == id) {
+            timerReadyRemove(i);
+            break;
+        }
+    }
+    timerJobs[id].name = NULL;
+}
+
+/**
+ * Exécution d'un travail arrivé à échéance, puis replacement s'il est périodique
+ * \param budgetMs budget accordé, pour un travail à budget
+ */
+void timerFire(int8_t id, uint32_t budgetMs) {
+    TimerJob &j = timerJobs[id];
+    uint32_t late = millis() - j.due;
+    uint32_t start = micros();
+    if (j.poll) {
+        j.poll(budgetMs);
+    } else {
+        j.fn();
+    }
+    uint32_t exec = micros() - start;
+    if (j.name == NULL) {
+        return;                     // Annulé par lui-même
+    }
+    j.runs++;
+    j.lateSumMs += late;
+    if (late > j.lateMaxMs) j.lateMaxMs = late;
+    if (exec > j.execMaxUs) j.execMaxUs = exec;
+    if (j.poll && exec > budgetMs * 1000) j.overBudget++;
+    j.hist[timerHistBucket(exec)]++;
+    if (j.period == 0) {
+        j.name = NULL;
+        return;
+    }
+    // Prochaine échéance en gardant la phase, les échéances déjà dépassées sont sautées
+    j.due += j.period;
+    uint32_t now = millis();
+    while ((int32_t)(j.due - now) <= 0) {
+        j.due += j.period;
+        j.overruns++;
+    }
+    timerInsert(id);
+}
+
+/**
+ * Avance de la roue jusqu'à l'heure courante et exécution des travaux arrivés à échéance, par
+ * priorité, dans la limite de TIMER_LOOP_BUDGET_MS pour les travaux non prioritaires
+ */
+void timerRun() {
+    if (!timerStarted) {
+        return;
+    }
+    uint32_t loopStart = micros();
+    uint32_t now = millis();
+    while ((int32_t)(now - timerNow) > 0) {
+        timerNow++;
+        uint32_t i0 = timerNow & (TIMER_L0_SIZE - 1);
+        if (i0 == 0) {
+            uint32_t i1 = (timerNow >> TIMER_L0_BITS) & (TIMER_LN_SIZE - 1);
+            if (i1 == 0) {
+                timerCascade(&timerWheel2[(timerNow >> (TIMER_L0_BITS + TIMER_LN_BITS)) & (TIMER_LN_SIZE - 1)]);
+            }
+            timerCascade(&timerWheel1[i1]);
+        }
+        int8_t id = timerWheel0[i0];
+        timerWheel0[i0] = TIMER_NONE;
+        while (id != TIMER_NONE) {
+            int8_t next = timerJobs[id].next;
+            timerReadyAdd(id);
+            id = next;
+        }
+    }
+    while (timerReadyCount > 0) {
+        int8_t id = timerReady[0];
+        TimerJob &j = timerJobs[id];
+        uint32_t usedMs = (micros() - loopStart) / 1000;
+        uint32_t budget = j.budgetMs;
+        if (j.priority != TIMER_PRIO_HIGH) {
+            if (usedMs >= TIMER_LOOP_BUDGET_MS) {
+                for (uint8_t i = 0; i < timerReadyCount; i++) {
+                    if (timerJobs[timerReady[i]].priority != TIMER_PRIO_HIGH) {
+                        timerJobs[timerReady[i]].deferred++;    // Restent échus, au passage suivant
+                    }
+                }
+                break;
+            }
+            if (budget > TIMER_LOOP_BUDGET_MS - usedMs) budget = TIMER_LOOP_BUDGET_MS - usedMs;
+        }
+        timerReadyRemove(0);
+        timerFire(id, budget);
+    }
+    uint32_t loopUs = micros() - loopStart;
+    if (loopUs > timerLoopMaxUs) timerLoopMaxUs = loopUs;
+    timerLoopHist[timerHistBucket(loopUs)]++;
+}
+
+/**
+ * Sommeil jusqu'à la prochaine échéance, au plus TIMER_IDLE_MAX_MS
+ */
+void timerIdle() {
+    if (timerReadyCount > 0) {
+        return;                     // Travaux reportés, pas de sommeil
+    }
+    uint32_t now = millis();
+    int32_t wait = TIMER_IDLE_MAX_MS;
+    for (int8_t id = 0; id < TIMER_JOBS; id++) {
+        if (timerJobs[id].name && (int32_t)(timerJobs[id].due - now) < wait) {
+            wait = (int32_t)(timerJobs[id].due - now);
+        }
+    }
+    if (wait > 0) {
+        delay(wait);
+        timerIdleMs += wait;
+    }
+}
+
+/**
+ * Histogramme sous forme de liste de compteurs séparés par des virgules
+ */
+String timerHistString(const uint32_t *hist) {
+    String out = "";
+    for (int b = 0; b < TIMER_HIST_BUCKETS; b++) {
+        out += String(hist[b]) + (b < TIMER_HIST_BUCKETS - 1 ? "," : "");
+    }
+    return out;
+}
+
+/**
+ * Statistiques des travaux au format "clé valeur" de /stats, les histogrammes sont des listes de
+ * compteurs pour < 1, 2, 4, 8, 16, 32, 64 ms et au delà
+ */
+String timerStats() {
+    String out = "";
+    out += "timer.idle_ms " + String(timerIdleMs) + "\n";
+    out += "timer.loop_budget_ms " + String(TIMER_LOOP_BUDGET_MS) + "\n";
+    out += "timer.loop_max_us " + String(timerLoopMaxUs) + "\n";
+    out += "timer.loop_hist " + timerHistString(timerLoopHist) + "\n";
+    for (int8_t id = 0; id < TIMER_JOBS; id++) {
+        const TimerJob &j = timerJobs[id];
+        if (j.name == NULL) continue;
+        String key = "timer." + String(j.name) + ".";
+        out += key + "priority " + String(j.priority) + "\n";
+        out += key + "runs " + String(j.runs) + "\n";
+        out += key + "late_avg_ms " + String(j.runs ? (float)j.lateSumMs / j.runs : 0) + "\n";
+        out += key + "late_max_ms " + String(j.lateMaxMs) + "\n";
+        out += key + "exec_max_us " + String(j.execMaxUs) + "\n";
+        out += key + "exec_hist " + timerHistString(j.hist) + "\n";
+        out += key + "overruns " + String(j.overruns) + "\n";
+        if (j.poll) {
+            out += key + "budget_ms " + String(j.budgetMs) + "\n";
+            out += key + "over_budget " + String(j.overBudget) + "\n";
+        }
+        out += key + "deferred " + String(j.deferred) + "\n";
+    }
+    return out;
+}
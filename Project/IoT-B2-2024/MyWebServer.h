@@ -22,8 +22,24 @@
  *   Affiche la liste des réseaux WiFi disponibles
  * - /config avec la fonction handleConfig()
  *   Affiche un formulaire pour configurer la carte
+ * - /stats avec la fonction handleStats()
+ *   Affiche les compteurs internes (synchronisation, publications ...) au format texte "clé valeur"
+ * - /trace avec la fonction handleTrace()
+ *   Enregistre ou rejoue des annonces BLE, cf. \ref bletrace
+ * - /energy avec la fonction handleEnergy()
+ *   Affiche le modèle de courant et le bilan énergétique de chaque jour, cf. \ref energy
  * - ...
  * - et avec handleNotFound() si la route n'est pas connue
+ *
+ * Le serveur est un travail à budget de \ref timerwheel ("web", WEB_BUDGET_MS, priorité basse) :
+ * handleClient() traite au plus une requête, il est rappelé tant que des requêtes arrivent et que le
+ * budget n'est pas épuisé (chaque route passe par webRoute(), qui compte les requêtes traitées).
+ * Les routes longues sont découpées :
+ * - /scan lance un scan WiFi asynchrone et répond tout de suite, la page se recharge jusqu'à ce que
+ *   les résultats soient là (un scan bloquant dure 2 à 3 s),
+ * - /format répond d'abord, le formatage du SPIFFS est fait ensuite par le travail "web.format".
+ * Un client lent peut encore retenir le travail jusqu'aux délais de la librairie WebServer
+ * (HTTP_MAX_DATA_WAIT, HTTP_MAX_SEND_WAIT) : ces passages sont comptés dans over_budget sur /stats.
  * 
  * Fichier \ref MyWebServer.h
  */
@@ -33,8 +49,22 @@
 
 
 
+#define WEB_BUDGET_MS   10                    // Budget du travail "web", plusieurs requêtes s'il reste du temps
+
 // Variables
 WebServer monWebServeur(80);           // Serveur web sur le port 80
+uint32_t webRequests = 0;              // Requêtes traitées, toutes routes confondues
+uint32_t webTxBytes = 0;               // Contenu des réponses envoyées
+
+/**
+ * Envoi d'une réponse, dont le contenu est compté dans le temps d'antenne WiFi (\ref energy) :
+ * les en-têtes HTTP et les requêtes reçues ne sont pas mesurés et ne sont pas comptés
+ */
+void webSend(int code, const char *type, const String &content) {
+  webTxBytes += content.length();
+  energyWifiTx(content.length());
+  monWebServeur.send(code, type, content);
+}
 
 /**
  * Fonction de gestion de la route /
@@ -54,11 +84,12 @@ void handleRoot() {
   out +="<li><a href=\"adafruit\"> Adafruit</a></li>";
   out +="<li><a href=\"format\"> Formatage de la carte</a></li>";
   out +="<li><a href=\"config\"> Configuration de la carte</a></li>";
-  out +="<li><a href=\"contact_tracer\">Dashboard YTC</a></li></ul>";
+  out +="<li><a href=\"contact_tracer\">Dashboard YTC</a></li>";
+  out +="<li><a href=\"stats\">Statistiques</a></li></ul>";
   out += "</body></html>";
 
   // Envoi de la réponse en HTML
-  monWebServeur.send(200, "text/html", out);
+  webSend(200, "text/html", out);
 }
 
 /**
@@ -67,8 +98,11 @@ void handleRoot() {
 void handleScan() {
   MYDEBUG_PRINTLN("-WEBSERVER : requete scan");
 
-  // La carte scanne les réseaux WiFi à proximité
-  int n = WiFi.scanNetworks();
+  // La carte scanne les réseaux WiFi à proximité, sans bloquer : la page se recharge jusqu'aux résultats
+  int n = WiFi.scanComplete();
+  if (n == WIFI_SCAN_FAILED) {
+    WiFi.scanNetworks(true);
+  }
 
   // Construction de la réponse HTML
   String out = "";
@@ -79,7 +113,9 @@ void handleScan() {
   out += "<h1>Page de scan</h1><br>";
 
   // Intégration des réseaux WiFi trouvés dans la page HTML
-  if (n == 0) {
+  if (n < 0) {
+    out += "Scan en cours ...";
+  } else if (n == 0) {
     MYDEBUG_PRINTLN("- AUCUN réseau WiFi trouvé");
   } else {
     out += "<ul>";
@@ -88,12 +124,15 @@ void handleScan() {
     }
     out += "</ul>";
   }
+  if (n >= 0) {
+    WiFi.scanDelete();                  // Le prochain rechargement relance un scan
+  }
 
   // Fin de la réponse HTML
   out += "</body></html>";
 
   // Envoi de la page HTML
-  monWebServeur.send(200, "text/html", out);
+  webSend(200, "text/html", out);
 }
 
 /**
@@ -129,6 +168,12 @@ void handleConfig() {
                 config.minutes_stand_by = argValue.toInt();
             } else if (argName == "days_of_historic") {
                 config.days_of_historic = argValue.toInt();
+            } else if (argName == "tx_power") {
+                config.tx_power = argValue.toInt();
+            } else if (argName == "path_loss") {
+                config.path_loss = argValue.toFloat();
+            } else if (argName == "ntp_interval") {
+                config.ntp_interval = argValue.toInt();
             }
 
             // Print received configuration data
@@ -138,6 +183,11 @@ void handleConfig() {
         }
         // Save the updated config to SPIFFS
         saveConfig(config);
+        // Le modèle de distance est pris en compte immédiatement
+        tx_power = config.tx_power;
+        path_loss = config.path_loss;
+        rssiDistanceTableBuild();
+        ntp_interval = config.ntp_interval; // Pris en compte à la prochaine synchronisation
         MYDEBUG_PRINTLN("Configuration saved.");
         MYDEBUG_PRINTLN();
     }
@@ -166,6 +216,12 @@ void handleConfig() {
     out += "<label for='days'>jours</label>";
     out += "<input type='range' id='days' name='days_of_historic' min='0' max='30' value='" + String(config.days_of_historic) + "' step='1'>";
     out += "<output id='outputDays'>" + String(config.days_of_historic) + "</output>Nombres de jours avant suppression de la liste de contact<br><br>";
+    out += "<label for='tx_power'>RSSI à 1 m (dBm) :</label><br>";
+    out += "<input type='text' id='tx_power' name='tx_power' value='" + String(config.tx_power) + "'><br><br>";
+    out += "<label for='path_loss'>Exposant d'atténuation (2 en champ libre, 2.5 à 4 en intérieur) :</label><br>";
+    out += "<input type='text' id='path_loss' name='path_loss' value='" + String(config.path_loss) + "'><br><br>";
+    out += "<label for='ntp_interval'>Synchronisation de l'heure (minutes) :</label><br>";
+    out += "<input type='text' id='ntp_interval' name='ntp_interval' value='" + String(config.ntp_interval) + "'><br><br>";
     out += "<input type='submit' value='Envoyer'>";
     out += "</form>";
     out += "<script>const secondsInput = document.getElementById('minutes');const daysInput = document.getElementById('days');const outputSeconds = document.getElementById('outputSeconds');const outputDays = document.getElementById('outputDays');secondsInput.addEventListener('input', function() {outputSeconds.textContent = this.value;});daysInput.addEventListener('input', function() {outputDays.textContent = this.value;});</script>";
@@ -173,7 +229,14 @@ void handleConfig() {
 
 
     // Envoi de la réponse HTML
-  monWebServeur.send(200, "text/html", out);
+  webSend(200, "text/html", out);
+}
+
+/**
+ * Travail "web.format" : formatage du SPIFFS, plusieurs secondes, une fois la réponse envoyée
+ */
+void webFormat() {
+  setupSPIFFS(true);
 }
 
 /**
@@ -181,16 +244,16 @@ void handleConfig() {
  */
 void handleFormat() {
   MYDEBUG_PRINTLN("-WEBSERVER : requete format");
-  setupSPIFFS(true);
+  timerSetPriority(timerOnce("web.format", 0, webFormat), TIMER_PRIO_LOW);
   String out = "";
   out += "<html><head><meta http-equiv='refresh' content='30'/>";
   out += "<title>YNOV - Projet IoT B2</title>";
   out += "<style>body { background-color: #cccccc; font-family: Arial, Helvetica, Sans-Serif; Color: #000088; }</style>";
   out += "</head><body>";
-  out += "<h1>Formatage fini</h1><br>";
+  out += "<h1>Formatage lancé</h1><br>";
   out += "<a href=\"/\"> Retour</a>";
   out += "</body></html>";
-  monWebServeur.send(200, "text/html", out);
+  webSend(200, "text/html", out);
 }
 
 /**
@@ -215,7 +278,7 @@ void handleAdafruit() {
   out += "</body></html>";
 
   // Envoi de la réponse HTML 
-  monWebServeur.send(200, "text/html", out);
+  webSend(200, "text/html", out);
 }
 
 /**
@@ -226,7 +289,7 @@ void handleContactTracer() {
     String contactName; // Variable to store the contact name
     String contactDate; // Variable to store the contact date
     String positiveContactName; // Variable to store the positive contact name
-    String etat = getEtatSante(DEVICE_NAME); // Variable to store the health state of the device
+    String etat = yctStateName(); // Etat de santé courant, tenu à jour par la machine à états (cf. \ref yct)
     String nom = DEVICE_NAME;
 
     if (monWebServeur.args() > 0) {
@@ -245,8 +308,9 @@ void handleContactTracer() {
             } else if (monWebServeur.argName(i) == "AddPositiveContact") {
                 // If the argument name is 'AddPositiveContact', store the value in positiveContactName
                 positiveContactName = monWebServeur.arg(i);
-            } else if (monWebServeur.argName(i) == "DeclarePositive" && etat != "Positif") {
+            } else if (monWebServeur.argName(i) == "DeclarePositive" && yctState != YCT_POSITIVE) {
                 // If the argument name is 'DeclarePositive', set the state to positive
+                eventPost(EVENT_DECLARE, EVENT_SRC_HTTP, DEVICE_NAME);
                 etat = "Positif";
             }
         }
@@ -257,15 +321,11 @@ void handleContactTracer() {
             MYDEBUG_PRINTLN(contactName);
             MYDEBUG_PRINTLN(contactDate);
             saveContact(myId, contactName, contactDate);
+            eventPost(EVENT_CONTACT, EVENT_SRC_HTTP, contactName.c_str());
         }
         if (positiveContactName != "") {
             savePositiveContact(positiveContactName);
         }
-        if (etat != "") {
-            if (etat == "Positif") {
-              pubEtatSante(etat, DEVICE_NAME);
-            }
-        }
     }
 
     String out = "";
@@ -380,6 +440,9 @@ void handleContactTracer() {
     out+= "    </div>";
     out+= "<div class='add-contact'>";
     out+= "   <h3>Vous êtes actuellement : "+etat+"</h3>";
+    if (yctUnconfirmed && etat != "Positif") {
+      out+= "   <p>Un de vos contacts a été annoncé positif en Bluetooth, en attente de confirmation</p>";
+    }
     out+= "</div>";
     out+= "<div class='add-contact'>";
     out+= "   <h3>Vous êtes actuellement : "+nom+"</h3>";
@@ -402,10 +465,204 @@ void handleContactTracer() {
     out+= "</body>";
     out+= "</html>";
     MYDEBUG_PRINTLN("- Sending HTML response");
-    monWebServeur.send(200, "text/html", out);
+    webSend(200, "text/html", out);
 }
 
 
+/**
+ * Fonction de gestion de la route /trace, cf. \ref bletrace
+ * - /trace?record=60 : enregistrement de 60 secondes d'annonces BLE
+ * - /trace?replay=100 : rejeu de l'enregistrement 100 fois plus vite (0 : au maximum)
+ * - /trace?crowd=2000&seconds=60&speed=100 : foule synthétique de 2000 appareils
+ * Un rejeu tourne ensuite par étapes dans loop() : la réponse est 202, le rapport est sur /trace
+ * une fois le rejeu terminé
+ */
+void handleTrace() {
+  MYDEBUG_PRINTLN("-WEBSERVER : requete trace");
+  String out = "";
+  int code = 200;
+  if (monWebServeur.hasArg("record")) {
+    out = bleTraceRecord(monWebServeur.arg("record").toInt()) ? "trace.recording 1\n" : "trace.recording 0\n";
+  } else if ((monWebServeur.hasArg("replay") || monWebServeur.hasArg("crowd")) && traceJob != TIMER_NONE) {
+    code = 409;
+    out = "trace.error rejeu en cours\n";
+  } else if (monWebServeur.hasArg("replay")) {
+    if (bleTraceReplay(monWebServeur.arg("replay").toInt())) {
+      code = 202;
+      out = "trace.running 1\n";
+    } else {
+      code = 409;
+      out = "trace.error pas de trace ou mémoire insuffisante\n";
+    }
+  } else if (monWebServeur.hasArg("crowd")) {
+    uint16_t seconds = monWebServeur.hasArg("seconds") ? monWebServeur.arg("seconds").toInt() : 60;
+    uint16_t speed = monWebServeur.hasArg("speed") ? monWebServeur.arg("speed").toInt() : 100;
+    if (bleTraceCrowd(monWebServeur.arg("crowd").toInt(), seconds, speed)) {
+      code = 202;
+      out = "trace.running 1\n";
+    } else {
+      code = 409;
+      out = "trace.error mémoire insuffisante ou nombre d'appareils invalide\n";
+    }
+  } else {
+    out += "trace.recording " + String(bleTraceHook ? 1 : 0) + "\n";
+    out += "trace.records " + String(traceRecords) + "\n";
+    out += "trace.bytes " + String(traceBytes) + "\n";
+    out += "trace.dropped " + String(traceDropped) + "\n";
+    out += "trace.running " + String(traceJob != TIMER_NONE ? 1 : 0) + "\n";
+    out += "trace.handoff_failed " + String(traceHandoffFailed) + "\n";
+    if (traceJob != TIMER_NONE) {
+      out += "trace.progress_adverts " + String(traceReport.adverts) + "\n";
+    } else if (traceReportReady) {
+      out += bleTraceReportText(traceReport, "trace.last.");
+    }
+  }
+  webSend(code, "text/plain", out);
+}
+
+/**
+ * Fonction de gestion de la route /energy : modèle de courant, bilan depuis la mise sous tension
+ * et bilan de chaque jour (/energy.csv)
+ * - /energy?wifi_tx=190&cpu=45 : modification du courant de ces états, en mA, enregistrée dans /energy.json
+ */
+void handleEnergy() {
+  MYDEBUG_PRINTLN("-WEBSERVER : requete energy");
+  String out = "";
+  bool changed = false;
+  for (int i = 0; i < monWebServeur.args(); i++) {
+    if (energySetModel(monWebServeur.argName(i).c_str(), monWebServeur.arg(i).toFloat())) {
+      changed = true;
+    } else {
+      out += "energy.error " + monWebServeur.argName(i) + "\n";
+    }
+  }
+  if (changed) {
+    energyModelSave();
+  }
+  out += energyModel();
+  out += energyStats();
+  out += "date;cpu;ble;wifi;sleep;total\n";
+  File historyFile = SPIFFS.open(strEnergyFile, "r");
+  if (historyFile) {
+    out += historyFile.readString();
+    historyFile.close();
+  }
+  webSend(200, "text/plain", out);
+}
+
+/**
+ * Fonction de gestion de la route /stats
+ * Une ligne "clé valeur" par compteur, facile à lire par un humain comme par un script
+ */
+void handleStats() {
+  MYDEBUG_PRINTLN("-WEBSERVER : requete stats");
+
+  String out = "";
+  out += "sync.version " + String(positiveVersion) + "\n";
+  out += "sync.entries " + String(positiveCount) + "\n";
+  out += "sync.bytes_in " + String(syncBytesIn) + "\n";
+  out += "sync.bytes_out " + String(syncBytesOut) + "\n";
+  out += "sync.gained " + String(syncEntriesGained) + "\n";
+  out += "sync.resent " + String(syncResent) + "\n";
+  out += "sync.suppressed " + String(syncSuppressed) + "\n";
+  out += "sync.evicted " + String(syncEvicted) + "\n";
+  out += "sync.convergence_ms " + String(syncConvergenceMs) + "\n";
+  out += "sync.provisional " + String(positiveProvisionalCount) + "\n";
+  out += "sync.provisional_confirmed " + String(syncProvisionalConfirmed) + "\n";
+  out += "sync.provisional_rejected " + String(syncProvisionalRejected) + "\n";
+  out += "web.requests " + String(webRequests) + "\n";
+  out += "web.tx_bytes " + String(webTxBytes) + "\n";
+  out += "yct.state " + String(yctState) + "\n";
+  out += "yct.transitions " + String(yctTransitions) + "\n";
+  out += "yct.unconfirmed " + String(yctUnconfirmed ? 1 : 0) + "\n";
+  out += "yct.recomputes " + String(yctRecomputes) + "\n";
+  out += "events.posted " + String(eventsPosted) + "\n";
+  out += "events.dropped " + String(eventsDropped) + "\n";
+  out += "events.coalesced " + String(eventsCoalesced) + "\n";
+  out += "events.high_water " + String(eventHighWater) + "\n";
+  out += "exposure.nodes " + String(exposure.nodeCount) + "\n";
+  out += "exposure.contacts " + String(exposure.edgeCount / 2) + "\n";
+  out += "exposure.full " + String(exposure.full) + "\n";
+  out += "exposure.evicted " + String(exposure.evicted) + "\n";
+  out += "exposure.expired " + String(exposure.expired) + "\n";
+  out += "exposure.updates " + String(exposureUpdates) + "\n";
+  out += "exposure.positives_1 " + String(exposure.positives[1]) + "\n";
+  out += "exposure.positives_2 " + String(exposure.positives[2]) + "\n";
+  out += "exposure.degree " + String(exposureDegree(exposure)) + "\n";
+  out += "publish.sent " + String(pubSent) + "\n";
+  out += "publish.failed " + String(pubFailed) + "\n";
+  out += "publish.retried " + String(pubRetried) + "\n";
+  out += "publish.abandoned " + String(pubAbandoned) + "\n";
+  out += "publish.deferred " + String(pubDeferred) + "\n";
+  out += "publish.coalesced " + String(pubCoalesced) + "\n";
+  out += "publish.dropped " + String(pubDropped) + "\n";
+  out += "publish.evicted " + String(pubEvicted) + "\n";
+  out += "publish.pending " + String(publisherPending()) + "\n";
+  out += "publish.max_wait_ms " + String(pubMaxWaitMs) + "\n";
+  out += "mqtt.dispatched " + String(MyAdafruitMqtt.dispatched) + "\n";
+  out += "mqtt.unrouted " + String(MyAdafruitMqtt.unrouted) + "\n";
+  out += "ble.heap_used " + String(bleHeapUsed) + "\n";
+  out += "ble.heap_released " + String(bleHeapReleased) + "\n";
+  out += "ble.init_ms " + String(bleInitMs) + "\n";
+  out += "ble.adv_received " + String(bleAdvReceived) + "\n";
+  out += "ble.adv_dropped " + String(bleAdvDropped) + "\n";
+  out += "ble.ring_high_water " + String(bleRingHighWater) + "\n";
+  out += "ble.names_evicted " + String(bleNameEvicted) + "\n";
+  out += "ble.names_collisions " + String(bleNameCollisions) + "\n";
+  out += "ble.names_full " + String(bleNameFull) + "\n";
+  out += "ble.filter_accepted " + String(bleFilterAccepted) + "\n";
+  out += "ble.filter_rejected " + String(bleFilterRejected) + "\n";
+  out += "ble.reject_cycles_avg " + String(bleFilterRejected ? (uint32_t)(bleFilterRejectCycles / bleFilterRejected) : 0) + "\n";
+  out += "ble.reject_cycles_max " + String(bleFilterRejectMax) + "\n";
+  PipeCaptureStats capture;         // Ecrit par le core 0, cf. \ref core0
+  pipeStatsSnapshot(capture);
+  const ScanMode &mode = scanModes[capture.scanMode];
+  out += "ble.scan_mode " + String(mode.name) + "\n";
+  out += "ble.scan_mode_changes " + String(capture.scanModeChanges) + "\n";
+  out += "ble.scan_radio_on_ms " + String((uint32_t)(capture.scanRadioOnUs / 1000)) + "\n";
+  out += "ble.scan_duty_pct " + String(100.0 * mode.window / mode.interval) + "\n";
+  out += "ble.sighting_gap_avg_ms " + String(capture.scanGapCount ? capture.scanGapSumMs / capture.scanGapCount : 0) + "\n";
+  out += "ble.sighting_gap_max_ms " + String(capture.scanGapMaxMs) + "\n";
+  out += "blesync.sessions " + String(bleSyncSessions) + "\n";
+  out += "blesync.up_to_date " + String(bleSyncUpToDate) + "\n";
+  out += "blesync.failed " + String(bleSyncFailed) + "\n";
+  out += "blesync.hints " + String(bleSyncHints) + "\n";
+  out += "blesync.catchups " + String(bleSyncCatchups) + "\n";
+  out += "blesync.served " + String(bleSyncServed) + "\n";
+  out += "blesync.bytes_rx " + String(bleSyncBytesRx) + "\n";
+  out += "blesync.bytes_tx " + String(bleSyncBytesTx) + "\n";
+  out += "blesync.last_mtu " + String(bleSyncLastMtu) + "\n";
+  out += "blesync.last_connect_ms " + String(bleSyncLastConnectMs) + "\n";
+  out += "blesync.last_transfer_ms " + String(bleSyncLastTransferMs) + "\n";
+  out += "blesync.last_bytes_per_s " + String(bleSyncLastBps) + "\n";
+  out += "encounter.active " + String(capture.encounterActive) + "\n";
+  out += "encounter.promoted " + String(capture.encounterPromoted) + "\n";
+  out += "encounter.sightings " + String(capture.encounterSightings) + "\n";
+  out += "encounter.full " + String(capture.encounterFull) + "\n";
+  out += "encounter.name_misses " + String(capture.encounterNameMisses) + "\n";
+  out += "tls.full " + String(tlsFullHandshakes) + "\n";
+  out += "tls.resumed " + String(tlsResumedHandshakes) + "\n";
+  out += "tls.failed " + String(tlsFailedHandshakes) + "\n";
+  out += "tls.rtc_session_bytes " + String(tlsRtcSessionLen) + "/" + String(TLS_RTC_SESSION_MAX) + "\n";
+  out += "tls.rtc_save_failed " + String(tlsRtcSaveFailed) + "\n";
+  // Durées moyennes des poignées de main, totale et CPU, en millisecondes
+  out += "tls.full_ms " + String(tlsFullHandshakes ? tlsFullUs / 1000.0 / tlsFullHandshakes : 0) + "\n";
+  out += "tls.full_cpu_ms " + String(tlsFullHandshakes ? tlsFullCpuUs / 1000.0 / tlsFullHandshakes : 0) + "\n";
+  out += "tls.resumed_ms " + String(tlsResumedHandshakes ? tlsResumedUs / 1000.0 / tlsResumedHandshakes : 0) + "\n";
+  out += "tls.resumed_cpu_ms " + String(tlsResumedHandshakes ? tlsResumedCpuUs / 1000.0 / tlsResumedHandshakes : 0) + "\n";
+  out += wifiStats();
+  out += bootStats();
+  out += ntpStats();
+  out += logStats();
+  out += remoteLogStats();
+  out += energyStats();
+  out += timerStats();
+  out += pipeStats();
+  out += lowPowerStats();
+
+  webSend(200, "text/plain", out);
+}
+
 /**
  * En cas d'erreur de route, renvoi d'un message d'erreur 404
  */
@@ -426,35 +683,61 @@ void handleNotFound() {
   }
 
   // Envoi de la réponse HTML
-  monWebServeur.send(404, "text/plain", message);
+  webSend(404, "text/plain", message);
+}
+
+/**
+ * Association d'une route à sa fonction, en comptant les requêtes traitées
+ */
+void webRoute(const char *uri, void (*handler)()) {
+  monWebServeur.on(uri, [handler]() {
+    webRequests++;
+    handler();
+  });
+}
+
+/**
+ * Toutes les 10 ms, le serveur web traite les requêtes reçues, une par appel à handleClient(),
+ * tant qu'il en arrive et que le budget n'est pas épuisé
+ */
+void pollWebServer(uint32_t budgetMs) {
+  unsigned long start = millis();
+  uint32_t first = webRequests;
+  uint32_t before;
+  do {
+    before = webRequests;
+    monWebServeur.handleClient();
+  } while (webRequests != before && millis() - start < budgetMs);
+  if (webRequests != first) {           // Requêtes traitées, le scan BLE laisse l'antenne au WiFi
+    scanSchedulerWifiActivity();
+  }
 }
 
 /**
  * Initialisation du serveur web
  */
 void setupWebServer(){
-  // On a besoin d'une connexion WiFi !
-  // Test de la connexion WiFi. Si elle n'est pas active alors on démarre le WiFi
-  if (WiFi.status() != WL_CONNECTED){setupWiFi();}  // Connexion WiFi
+  // Le serveur répond sur le point d'accès dès setupWiFi(), et en mode Station une fois connecté
   MYDEBUG_PRINTLN("-WEBSERVER : Démarrage");
 
   // Configuration de mon serveur web en définissant plusieurs routes
   // A chaque route est associée une fonction
-  monWebServeur.on("/", handleRoot);
-  monWebServeur.on("/scan", handleScan);
-  monWebServeur.on("/config", handleConfig);
-  monWebServeur.on("/adafruit", handleAdafruit);
-  monWebServeur.on("/contact_tracer", handleContactTracer);
-  monWebServeur.onNotFound(handleNotFound);
-  monWebServeur.on("/format", handleFormat);            // A ajouter quand le SPIFFFS est activé
-
+  webRoute("/", handleRoot);
+  webRoute("/scan", handleScan);
+  webRoute("/config", handleConfig);
+  webRoute("/adafruit", handleAdafruit);
+  webRoute("/contact_tracer", handleContactTracer);
+  webRoute("/stats", handleStats);
+  webRoute("/energy", handleEnergy);
+  webRoute("/trace", handleTrace);
+  monWebServeur.onNotFound([]() {
+    webRequests++;
+    handleNotFound();
+  });
+  webRoute("/format", handleFormat);            // A ajouter quand le SPIFFFS est activé
+
+  monWebServeur.enableDelay(false);                       // Pas de delay(1) à chaque appel sans client
   monWebServeur.begin();                                  // Démarrage du serveur
+  timerPoll("web", 10, WEB_BUDGET_MS, TIMER_PRIO_LOW, pollWebServer);
   MYDEBUG_PRINTLN("-WEBSERVER : Serveur Web démarré");
 }
-
-/**
- * Loop pour le serveur web afin qu'il regarde s'il a reçu des requêtes afin de les traiter
- */
-void loopWebServer(void) {
-  monWebServeur.handleClient();
-}
@@ -79,6 +79,30 @@
  * - Station pour se connecter à un Access Point pour accéder au réseau externe (internet).
  * 
  * Je peux ajouter un serveur DNS pour réaliser un portail captif ...
+ *
+ * \subsection fastWiFi Reconnexion rapide
+ * Une connexion complète (recherche du réseau sur tous les canaux, association, DHCP) prend
+ * plusieurs secondes, et l'ancienne boucle d'attente bloquait le démarrage indéfiniment si le
+ * réseau était absent. Après chaque connexion réussie, le canal, le BSSID et le bail DHCP (adresse,
+ * passerelle, masque, DNS) sont conservés en mémoire RTC, qui survit au sommeil profond
+ * (cf. \ref deepsleep) et aux redémarrages logiciels. La connexion suivante :
+ * -# tente d'abord une reconnexion directe : canal et BSSID imposés, adresse du bail réutilisée,
+ *    au plus WIFI_FAST_TIMEOUT_MS. Le bail n'est réutilisé que s'il a moins de WIFI_LEASE_MAX_S
+ *    (horloge système, qui continue pendant le sommeil profond) : au delà, le serveur DHCP a pu
+ *    donner l'adresse à une autre carte. Dès l'association, le client DHCP est relancé : la carte
+ *    redemande son bail au serveur au lieu de garder une adresse fixe qu'il ne connaît plus, et la
+ *    connexion n'est annoncée (adresse IP, cf. \ref boot) qu'une fois le bail obtenu,
+ * -# sinon repasse en DHCP et fait une connexion complète, au plus WIFI_CONNECT_TIMEOUT_MS,
+ * -# sinon abandonne, et retente une connexion complète plus tard, avec un délai qui double
+ *    à chaque échec (de WIFI_BACKOFF_MIN_MS à WIFI_BACKOFF_MAX_MS).
+ * setupWiFi() ne fait que lancer la connexion : ces étapes sont suivies en tâche de fond par le
+ * travail "wifi" de \ref timerwheel, toutes les WIFI_MONITOR_MS, et le démarrage continue pendant
+ * l'association.
+ * Le temps jusqu'à la connexion, par type (directe ou complète), et les échecs sont visibles sur
+ * /stats (wifi.*), cumulés depuis la mise sous tension. La première connexion de chaque démarrage
+ * est aussi comptée selon esp_reset_reason() : démarrage à chaud (réveil du sommeil profond,
+ * redémarrage logiciel), où le cache en mémoire RTC est disponible, ou à froid (mise sous tension,
+ * chien de garde, chute de tension ...), avec le temps depuis le démarrage (wifi.warm_*, wifi.cold_*).
 */
 
 // Librairies nécessaires
@@ -98,6 +122,245 @@ String aap_ssid;
 String aap_password;
 int minutes_stand_by;
 int days_of_historic;
+int tx_power = -69;          // RSSI mesuré à 1 m, cf. \ref rssi
+float path_loss = 2.0;       // Exposant d'atténuation, cf. \ref rssi
+int ntp_interval = 60;       // Minutes entre deux synchronisations NTP, cf. \ref ntp
+
+#define WIFI_FAST_TIMEOUT_MS    1500    // Reconnexion directe avec le canal, le BSSID et le bail en cache
+#define WIFI_CONNECT_TIMEOUT_MS 10000   // Connexion complète avec recherche du réseau et DHCP
+#define WIFI_BACKOFF_MIN_MS     5000    // Délai avant la première nouvelle tentative en tâche de fond
+#define WIFI_BACKOFF_MAX_MS     300000  // Délai maximum entre deux tentatives
+#define WIFI_MONITOR_MS         100     // Suivi de la connexion en cours
+#define WIFI_LEASE_MAX_S        1800    // Age maximum du bail en cache pour la reconnexion directe
+#define WIFI_CACHE_MAGIC        0x57494649
+
+// Tentatives de connexion
+#define WIFI_ATTEMPT_NONE       0
+#define WIFI_ATTEMPT_FAST       1       // Reconnexion directe
+#define WIFI_ATTEMPT_FULL       2       // Connexion complète
+
+/* Dernière connexion réussie, conservée en mémoire RTC */
+struct WifiCache {
+  uint32_t magic;
+  char ssid[33];
+  uint8_t bssid[6];
+  int32_t channel;
+  uint32_t ip, gateway, mask, dns;
+  time_t leasedAt;                      // Obtention du bail, horloge système
+};
+
+RTC_DATA_ATTR WifiCache wifiCache;
+// Statistiques, cumulées depuis la mise sous tension
+RTC_DATA_ATTR uint32_t wifiFastConnects = 0;
+RTC_DATA_ATTR uint32_t wifiFastMsSum = 0;
+RTC_DATA_ATTR uint32_t wifiFastFailed = 0;
+RTC_DATA_ATTR uint32_t wifiFullConnects = 0;
+RTC_DATA_ATTR uint32_t wifiFullMsSum = 0;
+RTC_DATA_ATTR uint32_t wifiFailed = 0;
+RTC_DATA_ATTR uint32_t wifiWarmConnects = 0;  // Premières connexions après un démarrage à chaud
+RTC_DATA_ATTR uint32_t wifiWarmMsSum = 0;
+RTC_DATA_ATTR uint32_t wifiColdConnects = 0;  // ... à froid
+RTC_DATA_ATTR uint32_t wifiColdMsSum = 0;
+bool wifiBootCounted = false;           // Première connexion du démarrage déjà comptée
+bool wifiLeasePending = false;          // Client DHCP relancé après une reconnexion directe
+uint32_t wifiLastMs = 0;                // Temps jusqu'à la dernière connexion
+bool wifiStarted = false;
+uint32_t wifiBackoffMs = WIFI_BACKOFF_MIN_MS;
+uint32_t wifiNextAttempt = 0;
+uint8_t wifiAttempt = WIFI_ATTEMPT_NONE;   // Tentative en cours
+uint32_t wifiAttemptStart = 0;
+bool wifiWasConnected = false;
+
+/**
+ * Mémorisation du canal, du BSSID et du bail de la connexion courante
+ */
+void wifiCacheStore() {
+  wifiCache.magic = WIFI_CACHE_MAGIC;
+  strncpy(wifiCache.ssid, sstation_ssid.c_str(), sizeof(wifiCache.ssid) - 1);
+  wifiCache.ssid[sizeof(wifiCache.ssid) - 1] = '\0';
+  memcpy(wifiCache.bssid, WiFi.BSSID(), 6);
+  wifiCache.channel = WiFi.channel();
+  wifiCache.ip = (uint32_t)WiFi.localIP();
+  wifiCache.gateway = (uint32_t)WiFi.gatewayIP();
+  wifiCache.mask = (uint32_t)WiFi.subnetMask();
+  wifiCache.dns = (uint32_t)WiFi.dnsIP();
+  wifiCache.leasedAt = time(NULL);
+}
+
+/**
+ * Le bail en cache peut-il encore être utilisé ? L'horloge peut reculer ou sauter lors de la
+ * mise à l'heure NTP : le bail est alors considéré comme expiré
+ */
+bool wifiLeaseValid() {
+  time_t now = time(NULL);
+  return now >= wifiCache.leasedAt && now - wifiCache.leasedAt < WIFI_LEASE_MAX_S;
+}
+
+/**
+ * Démarrage à chaud : réveil du sommeil profond ou redémarrage logiciel, la mémoire RTC est conservée
+ */
+bool wifiWarmBoot() {
+  esp_reset_reason_t reason = esp_reset_reason();
+  return reason == ESP_RST_DEEPSLEEP || reason == ESP_RST_SW;
+}
+
+/**
+ * Lancement d'une connexion complète (recherche du réseau et DHCP), sans attendre
+ */
+void wifiBeginFull() {
+  MYDEBUG_PRINT("-WIFI : Connexion au réseau : ");
+  MYDEBUG_PRINTLN(sstation_ssid);
+  WiFi.begin(sstation_ssid.c_str(), sstation_password.c_str());
+  wifiAttempt = WIFI_ATTEMPT_FULL;
+}
+
+/**
+ * Lancement de la connexion en mode Station, sans attendre : reconnexion directe si le cache
+ * correspond au réseau configuré, sinon connexion complète. La suite est gérée par wifiMonitor().
+ */
+void wifiConnect() {
+  wifiAttemptStart = millis();
+  if (wifiCache.magic == WIFI_CACHE_MAGIC && sstation_ssid == wifiCache.ssid && wifiLeaseValid()) {
+    MYDEBUG_PRINT("-WIFI : Reconnexion directe, canal ");
+    MYDEBUG_PRINTLN(wifiCache.channel);
+    WiFi.config(IPAddress(wifiCache.ip), IPAddress(wifiCache.gateway), IPAddress(wifiCache.mask), IPAddress(wifiCache.dns));
+    WiFi.begin(sstation_ssid.c_str(), sstation_password.c_str(), wifiCache.channel, wifiCache.bssid);
+    wifiAttempt = WIFI_ATTEMPT_FAST;
+    return;
+  }
+  wifiBeginFull();
+}
+
+/**
+ * Surveillance de la connexion, toutes les WIFI_MONITOR_MS : repli de la reconnexion directe
+ * vers une connexion complète, abandon d'une tentative trop longue, nouvelle tentative en tâche
+ * de fond après une perte ou un échec, avec un délai qui double à chaque échec
+ */
+void wifiMonitor() {
+  uint32_t now = millis();
+  if (WiFi.status() == WL_CONNECTED) {
+    if (wifiAttempt == WIFI_ATTEMPT_FAST) {
+      // Associé avec l'adresse du cache : le client DHCP redemande le bail, la connexion sera
+      // annoncée une fois l'adresse obtenue
+      WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+      wifiLeasePending = true;
+      wifiAttempt = WIFI_ATTEMPT_NONE;      // Après la relance : cf. bootWiFiEvent()
+      return;
+    }
+    if (wifiLeasePending) {
+      if (WiFi.localIP() == INADDR_NONE) {
+        if (now - wifiAttemptStart < WIFI_CONNECT_TIMEOUT_MS) {
+          return;
+        }
+        MYDEBUG_PRINTLN("-WIFI : Pas de bail DHCP, connexion complète");
+        wifiLeasePending = false;
+        wifiFastFailed++;
+        wifiCache.magic = 0;
+        WiFi.disconnect();
+        wifiAttemptStart = now;
+        wifiBeginFull();
+        return;
+      }
+      wifiLeasePending = false;
+      wifiLastMs = now - wifiAttemptStart;
+      wifiFastConnects++;
+      wifiFastMsSum += wifiLastMs;
+    }
+    if (!wifiWasConnected) {
+      if (wifiAttempt != WIFI_ATTEMPT_NONE) {
+        wifiLastMs = now - wifiAttemptStart;
+        wifiFullConnects++;
+        wifiFullMsSum += wifiLastMs;
+        wifiAttempt = WIFI_ATTEMPT_NONE;
+      }
+      if (!wifiBootCounted) {
+        wifiBootCounted = true;
+        if (wifiWarmBoot()) {
+          wifiWarmConnects++;
+          wifiWarmMsSum += now;
+        } else {
+          wifiColdConnects++;
+          wifiColdMsSum += now;
+        }
+      }
+      MYDEBUG_PRINT("-WIFI : connecté en mode Station en ");
+      MYDEBUG_PRINT(wifiLastMs);
+      MYDEBUG_PRINT(" ms avec l'adresse IP : ");
+      MYDEBUG_PRINTLN(WiFi.localIP());
+      wifiCacheStore();
+      wifiBackoffMs = WIFI_BACKOFF_MIN_MS;
+      wifiWasConnected = true;
+    }
+    return;
+  }
+  if (wifiLeasePending) {                 // Association perdue avant l'obtention du bail
+    wifiLeasePending = false;
+    wifiFastFailed++;
+    wifiCache.magic = 0;
+    wifiAttemptStart = now;
+    wifiBeginFull();
+    return;
+  }
+  if (wifiWasConnected) {
+    MYDEBUG_PRINTLN("-WIFI : Connexion perdue");
+    wifiWasConnected = false;
+    wifiNextAttempt = now + wifiBackoffMs;
+    return;
+  }
+  uint32_t elapsed = now - wifiAttemptStart;
+  if (wifiAttempt == WIFI_ATTEMPT_FAST) {
+    if (elapsed < WIFI_FAST_TIMEOUT_MS) {
+      return;
+    }
+    wifiFastFailed++;
+    wifiCache.magic = 0;                  // Point d'accès changé ou bail perdu
+    WiFi.disconnect();
+    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);   // Retour au DHCP
+    wifiBeginFull();
+    return;
+  }
+  if (wifiAttempt == WIFI_ATTEMPT_FULL) {
+    if (elapsed < WIFI_CONNECT_TIMEOUT_MS) {
+      return;
+    }
+    wifiFailed++;
+    wifiAttempt = WIFI_ATTEMPT_NONE;
+    MYDEBUG_PRINT("-WIFI : Réseau injoignable, nouvelle tentative dans ");
+    MYDEBUG_PRINT(wifiBackoffMs / 1000);
+    MYDEBUG_PRINTLN(" s");
+    wifiNextAttempt = now + wifiBackoffMs;
+    wifiBackoffMs = wifiBackoffMs * 2 > WIFI_BACKOFF_MAX_MS ? WIFI_BACKOFF_MAX_MS : wifiBackoffMs * 2;
+    return;
+  }
+  if ((int32_t)(now - wifiNextAttempt) < 0) {
+    return;
+  }
+  MYDEBUG_PRINTLN("-WIFI : Nouvelle tentative de connexion");
+  WiFi.disconnect();
+  wifiAttemptStart = now;
+  wifiBeginFull();
+}
+
+/**
+ * Statistiques de connexion au format "clé valeur" de /stats
+ */
+String wifiStats() {
+  String out = "";
+  out += "wifi.connected " + String(WiFi.status() == WL_CONNECTED) + "\n";
+  out += "wifi.fast_connects " + String(wifiFastConnects) + "\n";
+  out += "wifi.fast_ms_avg " + String(wifiFastConnects ? wifiFastMsSum / wifiFastConnects : 0) + "\n";
+  out += "wifi.fast_failed " + String(wifiFastFailed) + "\n";
+  out += "wifi.full_connects " + String(wifiFullConnects) + "\n";
+  out += "wifi.full_ms_avg " + String(wifiFullConnects ? wifiFullMsSum / wifiFullConnects : 0) + "\n";
+  out += "wifi.failed " + String(wifiFailed) + "\n";
+  out += "wifi.warm_connects " + String(wifiWarmConnects) + "\n";
+  out += "wifi.warm_ms_avg " + String(wifiWarmConnects ? wifiWarmMsSum / wifiWarmConnects : 0) + "\n";
+  out += "wifi.cold_connects " + String(wifiColdConnects) + "\n";
+  out += "wifi.cold_ms_avg " + String(wifiColdConnects ? wifiColdMsSum / wifiColdConnects : 0) + "\n";
+  out += "wifi.last_ms " + String(wifiLastMs) + "\n";
+  out += "wifi.rssi " + String(WiFi.RSSI()) + "\n";
+  return out;
+}
 
 // ------------------------------------------------------------------------------------------------
 // CONFIGURATION DU WIFI
@@ -108,8 +371,16 @@ int days_of_historic;
  * La mode WIFI_AP_STA est utilisé afin de pouvoir à la fois :
  * - Se connecter à un point d'accès réseau en tant que station
  * - Proposer une connexion à l'utilisateur pour accéder à mon serveur web
+ *
+ * Elle ne bloque pas : le point d'accès est disponible au retour, la connexion en mode Station
+ * se poursuit en tâche de fond (cf. \ref boot pour le démarrage des modules qui en ont besoin).
+ * Les appels suivants ne font rien, les reconnexions sont gérées par wifiMonitor().
  */
 void setupWiFi(){
+  if (wifiStarted) {
+    return;
+  }
+  wifiStarted = true;
   MYDEBUG_PRINTLN();
   MYDEBUG_PRINT("-WIFI : Configuration");
 
@@ -123,17 +394,7 @@ void setupWiFi(){
   MYDEBUG_PRINT("-WIFI : Access Point mis à disposition : ");
   MYDEBUG_PRINTLN(WiFi.softAPIP());
 
-  // Démarrage du mode Station
-  WiFi.begin(sstation_ssid, sstation_password);
-  
-  MYDEBUG_PRINT("-WIFI : Connexion au réseau : ");
-  MYDEBUG_PRINTLN(sstation_ssid);
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(500);
-    MYDEBUG_PRINT(".");
-  }
-  MYDEBUG_PRINTLN("");
-  // J'affiche l'adresse IP de ma carte
-  MYDEBUG_PRINT("-WIFI : connecté en mode Station avec l'adresse IP : ");
-  MYDEBUG_PRINTLN(WiFi.localIP());
+  // Démarrage du mode Station, suivi ensuite en tâche de fond
+  wifiConnect();
+  timerEvery("wifi", WIFI_MONITOR_MS, wifiMonitor);
 }
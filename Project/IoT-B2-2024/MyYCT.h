@@ -1,39 +1,179 @@
-// Variables to use :
-// set up your variables (for exemple the parameters from Adafruit or the contact/positive list)
+/**
+ * \file MyYCT.h
+ * \page yct Machine à états de l'état de santé
+ * \brief Un seul endroit qui décide si l'on est négatif, cas contact ou positif
+ *
+ * L'état de santé (YCT_NEGATIVE, YCT_CONTACT, YCT_POSITIVE) n'est recalculé que lorsqu'un événement
+ * pertinent arrive dans la file \ref events :
+ * - EVENT_CONTACT (BLE ou HTTP) : onGetContact() ajoute le contact au graphe \ref exposure,
+ * - EVENT_POSITIVE (MQTT ou BLE) et EVENT_DECLARE (HTTP) : onUpdateState() prend en compte les
+ *   nouveaux positifs,
+ * - EVENT_CONTACT_LIST (MQTT) : updateContacts() ajoute au graphe un contact entre deux autres cartes.
+ * updateState() déduit ensuite l'état du graphe : positif si nous sommes dans la liste des positifs,
+ * cas contact si un contact direct l'est. Un contact de cas contact reste négatif mais est signalé
+ * (yctExposure). Un contact direct annoncé positif en BLE seulement, sans confirmation par MQTT
+ * (positif provisoire, cf. \ref positivesync), laisse l'état négatif mais signale une exposition non
+ * confirmée (yctUnconfirmed), qui disparaît quand MQTT confirme ou infirme.
+ *
+ * Chaque transition n'est traitée qu'une fois : le passage à positif est publié sur Adafruit IO,
+ * la page /contact-tracer se contente d'afficher l'état courant.
+ *
+ * Fichier \ref MyYCT.h
+ */
 
-// ------------------------------------------------------------------------------------------------
-// Main Functions for our application
-// ------------------------------------------------------------------------------------------------
+#define YCT_NEGATIVE        0
+#define YCT_CONTACT         1
+#define YCT_POSITIVE        2
 
-// Variables
+const char * const yctStateNames[] = { "négatif", "cas contact", "Positif" };
 
+uint8_t yctState = YCT_NEGATIVE;
+uint8_t yctExposure = EXPOSURE_FAR;     // Dernier degré d'exposition connu
+bool yctUnconfirmed = false;            // Contact direct positif d'après le BLE seulement
+uint32_t yctTransitions = 0;
+uint32_t yctRecomputes = 0;             // Recalculs de l'état (uniquement sur événement)
 
+/**
+ * Nom de l'état courant, tel qu'affiché par le serveur web
+ */
+const char *yctStateName() {
+  return yctStateNames[yctState];
+}
+
+/**
+ * Nouveau contact enregistré (rencontre BLE promue ou ajout manuel)
+ */
+void onGetContact(const Event &e){
+  exposureLocalContact(e.data);
+}
+
+/**
+ * Contact direct devenu positif, mémorisé dans la liste des contacts positifs affichée par le serveur web
+ */
+void onDirectPositive(const char *id){
+  savePositiveContact(id);
+}
+
+/**
+ * Nouveaux positifs : le graphe rattrape la liste des positifs, tous ceux apparus depuis le
+ * dernier événement (les EVENT_POSITIVE d'une rafale sont fusionnés, cf. \ref events)
+ */
+void onUpdateState(const Event &e){
+  loopExposure(onDirectPositive);
+}
+
+/**
+ * Table des positifs pleine : les entrées pas encore prises en compte le sont avant que la plus
+ * ancienne soit écrasée ; l'EVENT_POSITIVE en attente mettra l'état à jour
+ */
+void catchUpPositives(){
+  loopExposure(onDirectPositive);
+}
+
+/**
+ * Contact entre deux autres cartes, publié sur data.contactlist
+ */
+void updateContacts(const Event &e){
+  exposureOnContactList(e.data);
+}
+
+/**
+ * Un de nos contacts directs est-il parmi les positifs provisoires ?
+ */
+bool yctProvisionalContact(){
+  for (int i = 0; i < positiveProvisionalCount; i++) {
+    int n = exposureNode(exposure, positiveProvisional[i].hash, false);
+    if (n >= 0 && exposure.nodes[n].level == 1) {
+      return true;
+    }
+  }
+  return false;
+}
 
-void onGetContact(){
-  // TODO : Implementing the function that saves the informations of nearby cards (with the right format)
-  // WARNING : this function should call the serialize json function and update a contact as
-  // a contact to follow after a certain time
-  // This function should be in the bluetooth loop and be called when a card is found
+/**
+ * Déduction de l'état à partir du graphe d'exposition, et traitement de la transition éventuelle
+ * \param publish publication du passage à positif (pas au démarrage : il l'a déjà été)
+ */
+void updateState(bool publish = true){
+  yctRecomputes++;
+  uint8_t degree = exposureDegree(exposure);
+  uint8_t state = degree == 0 ? YCT_POSITIVE : (degree == 1 ? YCT_CONTACT : YCT_NEGATIVE);
+  if (degree != yctExposure) {
+    yctExposure = degree;
+    if (degree == 2) {
+      LOG_I("-YCT : Un de nos contacts a été en contact avec un positif");
+    }
+  }
+  bool unconfirmed = state == YCT_NEGATIVE && yctProvisionalContact();
+  if (unconfirmed != yctUnconfirmed) {
+    yctUnconfirmed = unconfirmed;
+    LOG_I(unconfirmed ? "-YCT : Exposition non confirmée (positif annoncé en BLE)" : "-YCT : Fin de l'exposition non confirmée");
+  }
+  if (state == yctState) {
+    return;
+  }
+  LOG_I("-YCT : Etat %s -> %s", yctStateNames[yctState], yctStateNames[state]);
+  yctState = state;
+  yctTransitions++;
+  if (state == YCT_POSITIVE && publish) {
+    pubEtatSante("Positif", DEVICE_NAME);
+  }
 }
 
-void onUpdateState(){
-  // TODO : Implementing the function that Updates your state from Adafruit and your contacts
-  // You should use the deserialize function
-  // This function should be called in the adafruit loop when the state is changed in the app
+/**
+ * Traitement des événements en attente pendant au plus budgetMs, les suivants attendront l'appel
+ * suivant ; l'état n'est recalculé que si l'un d'eux le concerne
+ */
+void pollYCT(uint32_t budgetMs){
+  Event e;
+  bool changed = false;
+  unsigned long start = millis();
+  while (millis() - start < budgetMs && eventPop(e)) {
+    switch (e.type) {
+      case EVENT_CONTACT:
+        onGetContact(e);
+        changed = true;
+        break;
+      case EVENT_POSITIVE:
+        onUpdateState(e);
+        changed = true;
+        break;
+      case EVENT_DECLARE:
+        positiveSyncDeclare(e.data);
+        onUpdateState(e);
+        changed = true;
+        break;
+      case EVENT_CONTACT_LIST:
+        updateContacts(e);
+        changed = true;
+        break;
+      default:
+        break;
+    }
+  }
+  if (changed) {
+    updateState();
+  }
 }
 
-void updateState(){
-  // TODO : Implementing the function that Updates your state from your contacts
-  // if one of your contact to follow is sick, you should be changed to contact case
-  // So you should verify if you have the same person in the contact list and positive list
-  // You should use the deserialize function
-  // This function should be called in the adafruit loop
+/**
+ * Retrait des contacts de plus de days_of_historic jours, qui peut faire baisser l'exposition
+ */
+void ageContacts(){
+  if (exposureAge(exposure, exposureToday(), days_of_historic) > 0) {
+    updateState();
+  }
 }
 
-void updateContacts(){
-  // TODO : Implementing the function that Updates your contacts
-  // the goal of this function is to update the informations of yours contacts to follow
-  // This function should be called in the wifi loop
+/**
+ * Etat initial, d'après la liste des positifs et les contacts chargés au démarrage
+ */
+void setupYCT(){
+  loopExposure();
+  positiveConsumeHook = catchUpPositives;
+  updateState(false);
+  timerPoll("yct", 50, 10, TIMER_PRIO_HIGH, pollYCT);
+  timerSetPriority(timerEvery("exposure.age", EXPOSURE_AGE_MS, ageContacts), TIMER_PRIO_LOW);
 }
 
 // There should be a admin part, where you could setup OTA and Remote Debug,